@@ -113,7 +113,6 @@ Source create_source_from(char* raw_source) {
     new_source._source = raw_source;
     new_source._tokens = create_queue();
     if(!new_source._tokens) {
-        free(raw_source);
         log_fatal(EX_SOFTWARE, "No se ha podido crear la cola de tokens");
     }
     return new_source;
@@ -406,7 +405,6 @@ TokenQueue* tokenize_source(char* raw) {
         parse_token(&source);
     }
     if(source._errors) {
-        free(source._source);
         destroy_all_queue(source._tokens);
         log_fatal(EX_DATAERR, "There where errors during lexing");
     }
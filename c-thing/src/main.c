@@ -13,9 +13,10 @@ void run(char* raw) {
 }
 
 void runFile(char* path) {
-    char* content = read_source(path);
+    size_t mapped_size;
+    char* content = read_source(path, &mapped_size);
     run(content);
-    free(content);
+    release_source(content, mapped_size);
 }
 
 void runPrompt() {
@@ -1,26 +1,43 @@
 #include <stdio.h>
 #include <sysexits.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "source_loader.h"
 #include "logger.h"
 
-char* read_source(char* source_path) {
-    FILE* source_file = fopen(source_path, "r");
-    if(!source_file) {
+char* read_source(char* source_path, size_t* mapped_size) {
+    int fd = open(source_path, O_RDONLY);
+    if(fd < 0) {
         log_fatal(EX_NOINPUT, "Cannot read source file!");
     }
-    fseek(source_file, 0, SEEK_END);
-    long size = ftell(source_file);
-    rewind(source_file);
-    if(size <= 0) {
+    struct stat info;
+    if(fstat(fd, &info) < 0 || !S_ISREG(info.st_mode) || info.st_size <= 0) {
+        close(fd);
         log_fatal(EX_SOFTWARE, "Something strange happened while reading file...");
     }
-    char* buffer = (char*) malloc(size);
-    if(!buffer) {
+    size_t size = (size_t) info.st_size;
+    // The lexer stops at a '\0'. Reserve one zeroed byte past the file
+    // and map the file over the front of the reservation, so the
+    // sentinel exists even when the file fills its last page.
+    *mapped_size = size + 1;
+    char* region = mmap(NULL, *mapped_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(region == MAP_FAILED) {
+        close(fd);
         log_fatal(1, "Cannot assign memory to file buffer");
     }
-    fread(buffer, 1, size, source_file);
-    fclose(source_file);
-    return buffer;
+    if(mmap(region, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(region, *mapped_size);
+        close(fd);
+        log_fatal(EX_IOERR, "Cannot map source file!");
+    }
+    close(fd);
+    return region;
+}
+
+void release_source(char* source, size_t mapped_size) {
+    munmap(source, mapped_size);
 }
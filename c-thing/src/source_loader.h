@@ -1,12 +1,20 @@
 #ifndef SOURCE_LOADER_H
 #define SOURCE_LOADER_H
 
+#include <stddef.h>
+
+/**
+ * Maps Lox source file from source_path.
+ * The returned source is read only and always
+ * ends with a '\0'. If something bad happens,
+ * logs error and stop execution. Release it with
+ * release_source, passing mapped_size back.
+ */
+char* read_source(char* source_path, size_t* mapped_size);
+
 /**
- * Reads Lox source file from source_path.
- * If something bad happens, logs error and
- * stop execution. Always returns assigned
- * memory.
+ * Unmaps a source returned by read_source.
  */
-char* read_source(char* source_path);
+void release_source(char* source, size_t mapped_size);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,146 @@
+// Calls one Lox function from C through the embedding API, compiled once,
+// and compares with recompiling the source for every call. Build and run
+// with 'make bench'.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../clox.h"
+#include "../vm.h"
+#include "../timing.h"
+
+#define CALLS 1000000
+#define RECOMPILED_CALLS 20000
+
+static const char script[] =
+	"var rates = {\"eur\": 1.1, \"gbp\": 1.3};\n"
+	"fun convert(amount, currency) {\n"
+	"  var rate = rates[currency];\n"
+	"  if (rate == nil) return nil.missing;\n"
+	"  return amount * rate;\n"
+	"}\n";
+
+// Closures made before a limit error keep their own variables.
+static const char limited_script[] =
+	"var g;\n"
+	"fun make() { var x = 42; fun get() { return x; } g = get; while (true) {} }\n"
+	"fun reuse() { var x = 99; fun other() { return x; } return g(); }\n";
+
+// Leaves the heap over the limit after the error.
+static const char heap_script[] =
+	"var keep = [];\n"
+	"fun grow() { for (var i = 0; i < 100000; i = i + 1) keep.push([i]); }\n"
+	"fun size() { return keep.length(); }\n";
+
+static void fail(const char* what, CloxVM* vm) {
+	fprintf(stderr, "%s failed: %s\n", what, vm == NULL ? "" : clox_error(vm));
+	exit(1);
+}
+
+static double compiled_once(void) {
+	char error[256];
+	CloxScript* script_handle = clox_compile(script, sizeof(script) - 1, error, sizeof(error));
+	if (script_handle == NULL) {
+		fprintf(stderr, "%s", error);
+		exit(1);
+	}
+	CloxVM* vm = clox_new_vm(script_handle);
+	clox_free_script(script_handle);
+	if (clox_run(vm) != CLOX_OK) fail("run", vm);
+	int convert = clox_global(vm, "convert");
+	if (convert < 0) fail("lookup", vm);
+
+	uint64_t start = monotonic_ns();
+	CloxValue args[2] = { clox_number(0), clox_string("eur", 3) };
+	CloxValue result;
+	for (int i = 0; i < CALLS; i++) {
+		args[0] = clox_number(i);
+		if (clox_call(vm, convert, 2, args, &result) != CLOX_OK) fail("call", vm);
+		if (result.type != CLOX_NUMBER || result.as.number != i * 1.1) fail("result", vm);
+	}
+	double ns = (double)(monotonic_ns() - start) / CALLS;
+
+	args[1] = clox_string("yen", 3);
+	if (clox_call(vm, convert, 2, args, &result) != CLOX_RUNTIME_ERROR
+		|| strstr(clox_error(vm), "Only instances have properties.") == NULL) {
+		fail("error", vm);
+	}
+	args[1] = clox_string("gbp", 3);
+	if (clox_call(vm, convert, 2, args, &result) != CLOX_OK || clox_error(vm)[0] != '\0') {
+		fail("call after error", vm);
+	}
+	clox_free_vm(vm);
+	return ns;
+}
+
+static void check_limit_error(void) {
+	char error[256];
+	CloxScript* script_handle = clox_compile(limited_script, sizeof(limited_script) - 1, error, sizeof(error));
+	if (script_handle == NULL) {
+		fprintf(stderr, "%s", error);
+		exit(1);
+	}
+	CloxVM* vm = clox_new_vm(script_handle);
+	clox_free_script(script_handle);
+	if (clox_run(vm) != CLOX_OK) fail("run", vm);
+	clox_set_limits(vm, 100000, 0, 0);
+	CloxValue result;
+	if (clox_call(vm, clox_global(vm, "make"), 0, NULL, &result) != CLOX_RUNTIME_ERROR) fail("limit", vm);
+	if (clox_call(vm, clox_global(vm, "reuse"), 0, NULL, &result) != CLOX_OK) fail("call after limit", vm);
+	if (result.type != CLOX_NUMBER || result.as.number != 42) fail("captured value after limit", vm);
+	clox_free_vm(vm);
+}
+
+// Every run after a heap limit error starts over the limit, until the
+// host raises it.
+static void check_heap_limit_error(void) {
+	char error[256];
+	CloxScript* script_handle = clox_compile(heap_script, sizeof(heap_script) - 1, error, sizeof(error));
+	if (script_handle == NULL) {
+		fprintf(stderr, "%s", error);
+		exit(1);
+	}
+	CloxVM* vm = clox_new_vm(script_handle);
+	clox_free_script(script_handle);
+	if (clox_run(vm) != CLOX_OK) fail("run", vm);
+	clox_set_limits(vm, 0, 0, 1024 * 1024);
+	CloxValue result;
+	if (clox_call(vm, clox_global(vm, "grow"), 0, NULL, &result) != CLOX_RUNTIME_ERROR) fail("heap limit", vm);
+	if (clox_run(vm) != CLOX_RUNTIME_ERROR || strstr(clox_error(vm), "Heap limit") == NULL) {
+		fail("run over the heap limit", vm);
+	}
+	clox_set_limits(vm, 0, 0, 0);
+	if (clox_run(vm) != CLOX_OK) fail("run after heap limit", vm);
+	clox_set_limits(vm, 0, 0, 1024 * 1024);
+	if (clox_call(vm, clox_global(vm, "size"), 0, NULL, &result) != CLOX_OK
+		|| result.type != CLOX_NUMBER || result.as.number != 0) {
+		fail("call after heap limit", vm);
+	}
+	clox_free_vm(vm);
+}
+
+// What hosts did before: build the source of each call and interpret it.
+static double recompiled(void) {
+	VM* vm = malloc(sizeof(VM));
+	init_vm(vm);
+	char source[sizeof(script) + 64];
+	uint64_t start = monotonic_ns();
+	for (int i = 0; i < RECOMPILED_CALLS; i++) {
+		int length = snprintf(source, sizeof(source), "%sconvert(%d, \"eur\");\n", script, i);
+		if (interpret(vm, source, length) != INTERPRET_OK) fail("interpret", NULL);
+	}
+	double ns = (double)(monotonic_ns() - start) / RECOMPILED_CALLS;
+	free_vm(vm);
+	free(vm);
+	return ns;
+}
+
+int main(void) {
+	check_limit_error();
+	check_heap_limit_error();
+	double once = compiled_once();
+	double again = recompiled();
+	printf("%-22s %10s\n", "calls", "ns/call");
+	printf("%-22s %10.1f\n", "compiled once", once);
+	printf("%-22s %10.1f\n", "recompiled each call", again);
+	return 0;
+}
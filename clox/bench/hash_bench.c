@@ -0,0 +1,71 @@
+// Throughput of hash_string against the FNV-1a hash it replaced, and how
+// evenly both spread similar keys over power-of-two buckets.
+// Build and run with 'make bench'.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../hash.h"
+#include "../timing.h"
+
+static uint32_t fnv1a(const char* chars, int length) {
+	uint32_t hash = 2166136261u;
+	for (int i = 0; i < length; i++) {
+		hash ^= chars[i];
+		hash *= 16777619;
+	}
+	return hash;
+}
+
+typedef uint32_t (*HashFn)(const char* chars, int length);
+
+#define BYTES_PER_RUN (256 * 1024 * 1024)
+
+static double throughput(HashFn hash, const char* data, int length) {
+	long iterations = BYTES_PER_RUN / length;
+	uint32_t sink = 0;
+	uint64_t start = monotonic_ns();
+	for (long i = 0; i < iterations; i++) {
+		// Vary the start so the calls do not fold into one.
+		sink += hash(data + (i & 7), length);
+	}
+	uint64_t elapsed = monotonic_ns() - start;
+	if (sink == 1) printf(" ");
+	return (double)iterations * length / elapsed; // Bytes per ns, GB/s
+}
+
+// Fraction of empty buckets after hashing as many keys as buckets.
+// Uniform hashing leaves 1/e (0.368) of them empty.
+static double empty_buckets(HashFn hash, int bits) {
+	int buckets = 1 << bits;
+	char* used = calloc(buckets, 1);
+	char key[32];
+	for (int i = 0; i < buckets; i++) {
+		int length = snprintf(key, sizeof(key), "key%d", i);
+		used[hash(key, length) & (buckets - 1)] = 1;
+	}
+	int empty = 0;
+	for (int i = 0; i < buckets; i++) empty += !used[i];
+	free(used);
+	return (double)empty / buckets;
+}
+
+int main(void) {
+	static const int lengths[] = {3, 8, 16, 32, 64, 256, 1024, 65536};
+	int max_length = 65536 + 8;
+	char* data = malloc(max_length);
+	for (int i = 0; i < max_length; i++) data[i] = (char)('a' + i % 26);
+
+	printf("%8s %14s %14s\n", "length", "wyhash GB/s", "fnv1a GB/s");
+	for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+		printf("%8d %14.2f %14.2f\n", lengths[i],
+			throughput(hash_string, data, lengths[i]),
+			throughput(fnv1a, data, lengths[i]));
+	}
+
+	printf("empty buckets, 2^16 keys \"key<n>\": wyhash %.3f fnv1a %.3f (ideal 0.368)\n",
+		empty_buckets(hash_string, 16), empty_buckets(fnv1a, 16));
+	printf("empty buckets, 2^20 keys \"key<n>\": wyhash %.3f fnv1a %.3f (ideal 0.368)\n",
+		empty_buckets(hash_string, 20), empty_buckets(fnv1a, 20));
+	free(data);
+	return 0;
+}
@@ -0,0 +1,144 @@
+// Checks format_number and parse_number against the C library over a
+// random corpus, then compares their speed. Build and run with 'make bench'.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "../number.h"
+#include "../timing.h"
+
+#define CORPUS 1000000
+
+static uint64_t state = 0x9E3779B97F4A7C15ull;
+
+static uint64_t next_random() {
+	// xorshift64*
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+	return state * 0x2545F4914F6CDD1Dull;
+}
+
+// Any finite double, uniformly over bit patterns, half of them from a
+// narrower range closer to what scripts print.
+static double random_double(int i) {
+	double value;
+	if (i % 2 == 0) {
+		uint64_t bits = next_random();
+		memcpy(&value, &bits, sizeof(value));
+		if (!isfinite(value)) value = (double)(bits >> 11);
+	} else {
+		value = (double)(next_random() % 2000000) / (1 + next_random() % 1000);
+	}
+	return value;
+}
+
+// Digits in the shortest %.*e output that reads back as the same value.
+static int shortest_digits(double value) {
+	char buffer[64];
+	for (int precision = 0; precision < 17; precision++) {
+		snprintf(buffer, sizeof(buffer), "%.*e", precision, value);
+		if (strtod(buffer, NULL) == value) return precision + 1;
+	}
+	return 17;
+}
+
+static int significant_digits(const char* chars, int length) {
+	int count = 0, first = -1, last = -1;
+	for (int i = 0; i < length && chars[i] != 'e'; i++) {
+		if (chars[i] >= '1' && chars[i] <= '9') {
+			if (first < 0) first = i;
+			last = i;
+		}
+	}
+	if (first < 0) return 1;
+	for (int i = first; i <= last; i++) count += chars[i] >= '0' && chars[i] <= '9';
+	return count;
+}
+
+static void random_literal(char* buffer) {
+	int length = 0;
+	int integral = 1 + (int)(next_random() % 20);
+	for (int i = 0; i < integral; i++) buffer[length++] = (char)('0' + next_random() % 10);
+	if (next_random() % 2) {
+		buffer[length++] = '.';
+		int fraction = 1 + (int)(next_random() % 20);
+		for (int i = 0; i < fraction; i++) buffer[length++] = (char)('0' + next_random() % 10);
+	}
+	if (next_random() % 4 == 0) {
+		length += sprintf(buffer + length, "e%d", (int)(next_random() % 700) - 350);
+	}
+	buffer[length] = '\0';
+}
+
+static bool same_bits(double a, double b) {
+	return memcmp(&a, &b, sizeof(double)) == 0;
+}
+
+int main(void) {
+	char buffer[NUMBER_BUFFER_SIZE + 1];
+	char expected[64];
+	double* values = malloc(sizeof(double) * CORPUS);
+	for (int i = 0; i < CORPUS; i++) values[i] = random_double(i);
+
+	int round_trip_failures = 0, longer = 0;
+	for (int i = 0; i < CORPUS; i++) {
+		int length = format_number(values[i], buffer);
+		buffer[length] = '\0';
+		double back = strtod(buffer, NULL);
+		if (!same_bits(back, values[i])) {
+			if (round_trip_failures++ < 5) printf("round trip: %.17g -> %s\n", values[i], buffer);
+		}
+		if (significant_digits(buffer, length) > shortest_digits(values[i])) longer++;
+	}
+	printf("format: %d values, %d round trip failures, %d not shortest\n",
+		CORPUS, round_trip_failures, longer);
+
+	int parse_failures = 0;
+	for (int i = 0; i < CORPUS; i++) {
+		random_literal(expected);
+		double parsed;
+		if (!parse_number(expected, (int)strlen(expected), &parsed) ||
+			!same_bits(parsed, strtod(expected, NULL))) {
+			if (parse_failures++ < 5) printf("parse: %s\n", expected);
+		}
+	}
+	printf("parse: %d literals, %d differ from strtod\n", CORPUS, parse_failures);
+
+	// Speed, over the same values.
+	uint64_t start = monotonic_ns();
+	size_t sink = 0;
+	for (int i = 0; i < CORPUS; i++) sink += format_number(values[i], buffer);
+	double ours = (double)(monotonic_ns() - start) / CORPUS;
+	start = monotonic_ns();
+	for (int i = 0; i < CORPUS; i++) sink += snprintf(expected, sizeof(expected), "%.17g", values[i]);
+	double libc17 = (double)(monotonic_ns() - start) / CORPUS;
+	start = monotonic_ns();
+	for (int i = 0; i < CORPUS; i++) sink += snprintf(expected, sizeof(expected), "%g", values[i]);
+	double libc6 = (double)(monotonic_ns() - start) / CORPUS;
+	printf("format ns/value: format_number %.1f, %%.17g %.1f, %%g %.1f\n", ours, libc17, libc6);
+
+	// Literals the way scripts write them: short decimals.
+	char (*literals)[NUMBER_BUFFER_SIZE + 1] = malloc(sizeof(*literals) * CORPUS);
+	for (int i = 0; i < CORPUS; i++) {
+		int length = format_number((double)(next_random() % 100000) / 100, literals[i]);
+		literals[i][length] = '\0';
+	}
+	double total = 0;
+	start = monotonic_ns();
+	for (int i = 0; i < CORPUS; i++) {
+		double parsed;
+		parse_number(literals[i], (int)strlen(literals[i]), &parsed);
+		total += parsed;
+	}
+	ours = (double)(monotonic_ns() - start) / CORPUS;
+	start = monotonic_ns();
+	for (int i = 0; i < CORPUS; i++) total += strtod(literals[i], NULL);
+	double libc = (double)(monotonic_ns() - start) / CORPUS;
+	printf("parse ns/literal: parse_number %.1f, strtod %.1f\n", ours, libc);
+
+	if (sink == 1 || total == 1) printf(" ");
+	free(literals);
+	free(values);
+	return round_trip_failures > 0 || parse_failures > 0;
+}
@@ -0,0 +1,102 @@
+// Compacts a heap that sits on top of a large permanent generation, as a
+// prefork worker does with --gc-compact. The permanent pages are made
+// read-only first, so the run fails if a collection writes to them. Build
+// and run with 'make bench'.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "../vm.h"
+#include "../memory.h"
+#include "../timing.h"
+
+#define COMPACTIONS 50
+
+static const char tenured_script[] =
+	"class Point { init(x, y) { this.x = x; this.y = y; } }\n"
+	"var points = [];\n"
+	"var names = {};\n"
+	"for (var i = 0; i < 50000; i = i + 1) { points.push(Point(i, -i)); names[i] = [i]; }\n"
+	"var keep = [];\n"
+	"var last = Point(0, 0);\n"
+	"var lookup = {\"a\": 1};\n";
+
+// Permanent objects end up pointing to new ones.
+static const char young_script[] =
+	"var young = [];\n"
+	"for (var i = 0; i < 5000; i = i + 1) young.push([points[i], i]);\n"
+	"keep.push(young);\n"
+	"last.x = young;\n"
+	"lookup[\"a\"] = young;\n";
+
+static const char garbage_script[] =
+	"for (var i = 0; i < 5000; i = i + 1) { var t = [i, Point(i, i)]; }\n"
+	"var result = keep[0][5][1] + last.x[7][1] + lookup[\"a\"][9][1] + young.length() + points[49999].x;\n";
+
+static void written(int signal) {
+	(void)signal;
+	const char message[] = "A collection wrote to a permanent page\n";
+	write(STDERR_FILENO, message, sizeof(message) - 1);
+	_exit(1);
+}
+
+static void run(VM* vm, const char* source) {
+	if (interpret(vm, source, strlen(source)) != INTERPRET_OK) {
+		fprintf(stderr, "Script failed\n");
+		exit(1);
+	}
+}
+
+// Whole pages inside each region, which only hold permanent objects.
+static size_t protect_permanent(VM* vm, int protection) {
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	size_t protected_bytes = 0;
+	for (Region* region = vm->permanent_regions; region != NULL; region = region->next) {
+		uintptr_t start = ((uintptr_t)region->data + page - 1) & ~(page - 1);
+		uintptr_t end = ((uintptr_t)region->data + region->size) & ~(page - 1);
+		if (end <= start) continue;
+		if (mprotect((void*)start, end - start, protection) != 0) {
+			perror("mprotect");
+			exit(1);
+		}
+		protected_bytes += end - start;
+	}
+	return protected_bytes;
+}
+
+int main(void) {
+	VM* vm = malloc(sizeof(VM));
+	init_vm(vm);
+	run(vm, tenured_script);
+	compact_heap(vm); // Puts every survivor in one region
+	tenure_heap(vm);
+
+	signal(SIGSEGV, written);
+	signal(SIGBUS, written);
+	size_t protected_bytes = protect_permanent(vm, PROT_READ);
+	run(vm, young_script);
+	uint64_t total = 0;
+	for (int i = 0; i < COMPACTIONS; i++) {
+		run(vm, garbage_script);
+		uint64_t start = monotonic_ns();
+		compact_heap(vm);
+		total += monotonic_ns() - start;
+	}
+	run(vm, garbage_script);
+	protect_permanent(vm, PROT_READ | PROT_WRITE);
+
+	Value result;
+	if (!table_get(&vm->globals, copy_string(vm, "result", 6), &result)
+		|| !IS_NUMBER(result) || AS_NUMBER(result) != 5 + 7 + 9 + 5000 + 49999) {
+		fprintf(stderr, "Wrong result after compaction\n");
+		exit(1);
+	}
+	printf("%d permanent objects, %zu KB read-only, %d rewritten by compaction\n",
+		vm->permanent_count, protected_bytes / 1024, vm->remembered_count);
+	printf("%-22s %10.2f\n", "ms per compaction", (double)total / COMPACTIONS / 1e6);
+	free_vm(vm);
+	free(vm);
+	return 0;
+}
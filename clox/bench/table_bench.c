@@ -0,0 +1,287 @@
+// Compares the SwissTable in table.c against the linear probing table it
+// replaced, on the access patterns the VM produces.
+// Build and run with 'make bench'.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../vm.h"
+#include "../table.h"
+#include "../object.h"
+#include "../gc_stats.h"
+#include "../timing.h"
+
+// Previous implementation: 32 byte entries probed one by one.
+typedef struct {
+	ObjString* label;
+	Value value;
+} LinearEntry;
+
+typedef struct {
+	int count;
+	int capacity;
+	LinearEntry* entries;
+} LinearTable;
+
+#define LINEAR_MAX_LOAD 0.75
+
+static VM vm;
+
+static void init_linear(LinearTable* table) {
+	table->count = 0;
+	table->capacity = 0;
+	table->entries = NULL;
+}
+
+static void free_linear(LinearTable* table) {
+	free(table->entries);
+	init_linear(table);
+}
+
+static LinearEntry* linear_find(LinearEntry* entries, int capacity, ObjString* key) {
+	uint32_t index = key->hash & (capacity - 1);
+	LinearEntry* tombstone = NULL;
+	for(;;) {
+		LinearEntry* entry = &entries[index];
+		if(entry->label == NULL) {
+			if(IS_NIL(entry->value)) {
+				return tombstone != NULL ? tombstone : entry;
+			}
+			if(tombstone == NULL) tombstone = entry;
+		} else if(entry->label == key) {
+			return entry;
+		}
+		index = (index + 1) & (capacity - 1);
+	}
+}
+
+static void linear_adjust(LinearTable* table, int capacity) {
+	LinearEntry* entries = malloc(sizeof(LinearEntry) * capacity);
+	for(int i = 0; i < capacity; i++) {
+		entries[i].label = NULL;
+		entries[i].value = NIL_VALUE();
+	}
+	table->count = 0;
+	for(int i = 0; i < table->capacity; i++) {
+		LinearEntry* old = &table->entries[i];
+		if(old->label == NULL) continue;
+		LinearEntry* dest = linear_find(entries, capacity, old->label);
+		*dest = *old;
+		table->count++;
+	}
+	free(table->entries);
+	table->entries = entries;
+	table->capacity = capacity;
+}
+
+__attribute__((noinline)) static void linear_set(LinearTable* table, ObjString* key, Value value) {
+	if(table->count + 1 > table->capacity * LINEAR_MAX_LOAD) {
+		linear_adjust(table, table->capacity < 8 ? 8 : table->capacity * 2);
+	}
+	LinearEntry* entry = linear_find(table->entries, table->capacity, key);
+	if(entry->label == NULL && IS_NIL(entry->value)) table->count++;
+	entry->label = key;
+	entry->value = value;
+}
+
+__attribute__((noinline)) static bool linear_get(LinearTable* table, ObjString* key, Value* value) {
+	if(table->count == 0) return false;
+	LinearEntry* entry = linear_find(table->entries, table->capacity, key);
+	if(entry->label == NULL) return false;
+	*value = entry->value;
+	return true;
+}
+
+static ObjString** make_keys(const char* prefix, int count) {
+	ObjString** keys = malloc(sizeof(ObjString*) * count);
+	char buffer[64];
+	for(int i = 0; i < count; i++) {
+		int length = snprintf(buffer, sizeof(buffer), "%s%d", prefix, i);
+		keys[i] = copy_string(&vm, buffer, length);
+	}
+	return keys;
+}
+
+static double elapsed_ms(uint64_t start) {
+	return (monotonic_ns() - start) / 1e6;
+}
+
+static void report(const char* name, double swiss, double linear, double sink) {
+	printf("%-34s swiss %8.2f ms   linear %8.2f ms   x%.2f  (%g)\n",
+		name, swiss, linear, linear / swiss, sink);
+}
+
+// Many small tables (instance fields) read by a handful of names.
+static void bench_fields() {
+#define INSTANCES 20000
+#define FIELDS 6
+#define ROUNDS 200
+	ObjString** names = make_keys("field", FIELDS);
+	Table* swiss = malloc(sizeof(Table) * INSTANCES);
+	LinearTable* linear = malloc(sizeof(LinearTable) * INSTANCES);
+	for(int i = 0; i < INSTANCES; i++) {
+		init_table(&swiss[i]);
+		init_linear(&linear[i]);
+		for(int f = 0; f < FIELDS; f++) {
+			table_set(&vm, &swiss[i], names[f], NUMBER_VALUE(f));
+			linear_set(&linear[i], names[f], NUMBER_VALUE(f));
+		}
+	}
+
+	double sum = 0;
+	Value value;
+	uint64_t start = monotonic_ns();
+	for(int r = 0; r < ROUNDS; r++) {
+		for(int i = 0; i < INSTANCES; i++) {
+			for(int f = 0; f < FIELDS; f++) {
+				if(table_get(&swiss[i], names[f], &value)) sum += AS_NUMBER(value);
+			}
+		}
+	}
+	double swiss_ms = elapsed_ms(start);
+
+	start = monotonic_ns();
+	for(int r = 0; r < ROUNDS; r++) {
+		for(int i = 0; i < INSTANCES; i++) {
+			for(int f = 0; f < FIELDS; f++) {
+				if(linear_get(&linear[i], names[f], &value)) sum += AS_NUMBER(value);
+			}
+		}
+	}
+	report("instance fields (6 keys x 20k)", swiss_ms, elapsed_ms(start), sum);
+
+	for(int i = 0; i < INSTANCES; i++) {
+		free_table(&vm, &swiss[i]);
+		free_linear(&linear[i]);
+	}
+	free(swiss);
+	free(linear);
+	free(names);
+#undef INSTANCES
+#undef FIELDS
+#undef ROUNDS
+}
+
+// One medium table read in a tight loop (globals).
+static void bench_globals() {
+#define GLOBALS 300
+#define LOOKUPS 20000000
+	ObjString** names = make_keys("global", GLOBALS);
+	Table swiss;
+	LinearTable linear;
+	init_table(&swiss);
+	init_linear(&linear);
+	for(int i = 0; i < GLOBALS; i++) {
+		table_set(&vm, &swiss, names[i], NUMBER_VALUE(i));
+		linear_set(&linear, names[i], NUMBER_VALUE(i));
+	}
+
+	double sum = 0;
+	Value value;
+	uint32_t seed = 1;
+	uint64_t start = monotonic_ns();
+	for(int i = 0; i < LOOKUPS; i++) {
+		seed = seed * 1103515245 + 12345;
+		if(table_get(&swiss, names[(seed >> 8) % GLOBALS], &value)) sum += AS_NUMBER(value);
+	}
+	double swiss_ms = elapsed_ms(start);
+
+	seed = 1;
+	start = monotonic_ns();
+	for(int i = 0; i < LOOKUPS; i++) {
+		seed = seed * 1103515245 + 12345;
+		if(linear_get(&linear, names[(seed >> 8) % GLOBALS], &value)) sum += AS_NUMBER(value);
+	}
+	report("globals (300 keys, 20M lookups)", swiss_ms, elapsed_ms(start), sum);
+
+	free_table(&vm, &swiss);
+	free_linear(&linear);
+	free(names);
+#undef GLOBALS
+#undef LOOKUPS
+}
+
+// Large table, inserts followed by half hits and half misses (interning).
+static void bench_interning() {
+#define KEYS 200000
+	ObjString** present = make_keys("present", KEYS);
+	ObjString** missing = make_keys("missing", KEYS);
+	Table swiss;
+	LinearTable linear;
+	init_table(&swiss);
+	init_linear(&linear);
+
+	double sum = 0;
+	Value value;
+	uint64_t start = monotonic_ns();
+	for(int i = 0; i < KEYS; i++) table_set(&vm, &swiss, present[i], NIL_VALUE());
+	for(int i = 0; i < KEYS; i++) {
+		sum += table_get(&swiss, present[i], &value);
+		sum += table_get(&swiss, missing[i], &value);
+	}
+	double swiss_ms = elapsed_ms(start);
+
+	start = monotonic_ns();
+	for(int i = 0; i < KEYS; i++) linear_set(&linear, present[i], NIL_VALUE());
+	for(int i = 0; i < KEYS; i++) {
+		sum += linear_get(&linear, present[i], &value);
+		sum += linear_get(&linear, missing[i], &value);
+	}
+	report("interning (200k set, hit + miss)", swiss_ms, elapsed_ms(start), sum);
+
+	free_table(&vm, &swiss);
+	free_linear(&linear);
+	free(present);
+	free(missing);
+#undef KEYS
+}
+
+static void print_stats(const char* name, TableStats* stats) {
+	printf("  %-22s count %6d  tombstones %6d  capacity %6d  load %.2f  mean probe %.2f  max %d\n",
+		name, stats->count, stats->tombstones, stats->capacity,
+		stats->load_factor, stats->mean_probe, stats->max_probe);
+}
+
+// Keys come and go: tombstones are reclaimed and the table shrinks back.
+static void bench_churn() {
+#define KEYS 100000
+#define LIVE 1000
+	ObjString** keys = make_keys("churn", KEYS);
+	Table table;
+	TableStats stats;
+	init_table(&table);
+
+	uint64_t start = monotonic_ns();
+	for(int i = 0; i < KEYS; i++) {
+		table_set(&vm, &table, keys[i], NUMBER_VALUE(i));
+		if(i >= LIVE) table_delete(&vm, &table, keys[i - LIVE]);
+	}
+	printf("churn (100k keys, 1k live)          %8.2f ms\n", elapsed_ms(start));
+	table_stats(&table, &stats);
+	print_stats("while churning", &stats);
+
+	for(int i = KEYS - LIVE; i < KEYS - 10; i++) table_delete(&vm, &table, keys[i]);
+	table_stats(&table, &stats);
+	print_stats("after deleting most", &stats);
+
+	free_table(&vm, &table);
+	free(keys);
+#undef KEYS
+#undef LIVE
+}
+
+int main(void) {
+	init_vm(&vm);
+	// Keys only live in C arrays: keep the collector away.
+	GcConfig config;
+	init_gc_config(&config);
+	config.initial_heap = (size_t)-1;
+	configure_gc(&vm, &config);
+
+	bench_fields();
+	bench_globals();
+	bench_interning();
+	bench_churn();
+
+	free_vm(&vm);
+	return 0;
+}
@@ -0,0 +1,95 @@
+// Runs loop kernels interpreted and with hot loops traced into machine
+// code, function compilation off in both, and checks they agree. Build
+// and run with 'make bench'.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../vm.h"
+#include "../timing.h"
+#include "../trace.h"
+
+typedef struct {
+	const char* name;
+	const char* source; // Leaves its answer in 'result'
+} Kernel;
+
+static const Kernel kernels[] = {
+	{ "local sum",
+		"fun sum(n) { var s = 0; for (var i = 0; i < n; i = i + 1) s = s + i * 0.5; return s; }\n"
+		"var result = sum(20000000);\n" },
+	{ "globals",
+		"var result = 0;\n"
+		"var i = 0;\n"
+		"while (i < 10000000) { result = result + i; i = i + 1; }\n" },
+	{ "fields",
+		"class Point { init() { this.x = 0; this.y = 0; } }\n"
+		"fun walk(p, n) { for (var i = 0; i < n; i = i + 1) { p.x = p.x + 1; p.y = p.y - p.x; } }\n"
+		"var p = Point();\n"
+		"walk(p, 10000000);\n"
+		"var result = p.x + p.y;\n" },
+	{ "float math",
+		"fun area(n) {\n"
+		"  var sum = 0; var x = 0; var step = 1 / n;\n"
+		"  for (var i = 0; i < n; i = i + 1) { x = (i + 0.5) * step; sum = sum + 4 / (1 + x * x); }\n"
+		"  return sum * step;\n"
+		"}\n"
+		"var result = area(10000000);\n" },
+	{ "branchy",
+		"fun collatz(limit) {\n"
+		"  var steps = 0;\n"
+		"  for (var n = 1; n < limit; n = n + 1) {\n"
+		"    var k = n;\n"
+		"    while (k != 1) { if (k % 2 == 0) k = k / 2; else k = 3 * k + 1; steps = steps + 1; }\n"
+		"  }\n"
+		"  return steps;\n"
+		"}\n"
+		"var result = collatz(100000);\n" },
+	{ "primes",
+		"fun primes(limit) {\n"
+		"  var count = 0;\n"
+		"  for (var n = 2; n < limit; n = n + 1) {\n"
+		"    var prime = true;\n"
+		"    for (var d = 2; d * d <= n and prime; d = d + 1) if (n % d == 0) prime = false;\n"
+		"    if (prime) count = count + 1;\n"
+		"  }\n"
+		"  return count;\n"
+		"}\n"
+		"var result = primes(300000);\n" },
+};
+
+static double run_kernel(const Kernel* kernel, uint16_t trace_threshold, double* result) {
+	VM* vm = malloc(sizeof(VM));
+	init_vm(vm);
+	configure_jit(vm, 0);
+	configure_traces(vm, trace_threshold);
+	uint64_t start = monotonic_ns();
+	if (interpret(vm, kernel->source, strlen(kernel->source)) != INTERPRET_OK) {
+		fprintf(stderr, "%s failed\n", kernel->name);
+		exit(1);
+	}
+	double ms = (double)(monotonic_ns() - start) / 1e6;
+	Value value;
+	if (!table_get(&vm->globals, copy_string(vm, "result", 6), &value) || !IS_NUMBER(value)) {
+		fprintf(stderr, "%s left no result\n", kernel->name);
+		exit(1);
+	}
+	*result = AS_NUMBER(value);
+	free_vm(vm);
+	free(vm);
+	return ms;
+}
+
+int main(void) {
+	printf("%-12s %14s %10s %8s\n", "kernel", "interpreter ms", "traces ms", "speedup");
+	for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+		double interpreted, traced;
+		double interpreter_ms = run_kernel(&kernels[i], 0, &interpreted);
+		double trace_ms = run_kernel(&kernels[i], TRACE_DEFAULT_THRESHOLD, &traced);
+		if (interpreted != traced) {
+			fprintf(stderr, "%s: %.17g interpreted, %.17g traced\n", kernels[i].name, interpreted, traced);
+			exit(1);
+		}
+		printf("%-12s %14.1f %10.1f %7.1fx\n", kernels[i].name, interpreter_ms, trace_ms, interpreter_ms / trace_ms);
+	}
+	return 0;
+}
@@ -0,0 +1,98 @@
+// Float64Array kernels against the plain loops a scalar build would run,
+// and the radix sort against qsort. Build and run with 'make bench'.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../vector.h"
+#include "../timing.h"
+
+#define LENGTH (1 << 14) // 128 KB per array, stays in cache
+#define ROUNDS 20000
+
+static double scalar_sum(const double* data, int length) {
+	double sum = 0;
+	for (int i = 0; i < length; i++) sum += data[i];
+	return sum;
+}
+
+static double scalar_dot(const double* a, const double* b, int length) {
+	double sum = 0;
+	for (int i = 0; i < length; i++) sum += a[i] * b[i];
+	return sum;
+}
+
+static double scalar_min(const double* data, int length) {
+	double result = data[0];
+	for (int i = 1; i < length; i++) {
+		if (data[i] < result) result = data[i];
+	}
+	return result;
+}
+
+static void scalar_prefix_sum(double* data, int length) {
+	for (int i = 1; i < length; i++) data[i] += data[i - 1];
+}
+
+static int compare_doubles(const void* a, const void* b) {
+	double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+static double* random_data(unsigned seed) {
+	double* data = malloc(sizeof(double) * LENGTH);
+	srand(seed);
+	for (int i = 0; i < LENGTH; i++) data[i] = (double)rand() / RAND_MAX - 0.5;
+	return data;
+}
+
+// Nanoseconds per element.
+#define TIME(result, sink, expr) do { \
+	uint64_t start = monotonic_ns(); \
+	for (int round = 0; round < ROUNDS; round++) sink += (expr); \
+	result = (double)(monotonic_ns() - start) / ((double)ROUNDS * LENGTH); \
+} while (0)
+
+static void report(const char* name, double simd, double scalar) {
+	printf("%-10s %10.3f %10.3f %8.2fx\n", name, simd, scalar, scalar / simd);
+}
+
+int main(void) {
+	double* a = random_data(1);
+	double* b = random_data(2);
+	double sink = 0, simd, scalar;
+
+	printf("%-10s %10s %10s %9s\n", "kernel", "ns/elem", "scalar", "speedup");
+	TIME(simd, sink, vec_sum(a, LENGTH));
+	TIME(scalar, sink, scalar_sum(a, LENGTH));
+	report("sum", simd, scalar);
+
+	TIME(simd, sink, vec_dot(a, b, LENGTH));
+	TIME(scalar, sink, scalar_dot(a, b, LENGTH));
+	report("dot", simd, scalar);
+
+	TIME(simd, sink, vec_min(a, LENGTH));
+	TIME(scalar, sink, scalar_min(a, LENGTH));
+	report("min", simd, scalar);
+
+	// Prefix sums grow the data, so every round starts from a fresh copy.
+	double* work = malloc(sizeof(double) * LENGTH);
+	TIME(simd, sink, (memcpy(work, a, sizeof(double) * LENGTH), vec_prefix_sum(work, LENGTH), work[LENGTH - 1]));
+	TIME(scalar, sink, (memcpy(work, a, sizeof(double) * LENGTH), scalar_prefix_sum(work, LENGTH), work[LENGTH - 1]));
+	report("prefixSum", simd, scalar);
+
+	uint64_t start = monotonic_ns();
+	memcpy(work, a, sizeof(double) * LENGTH);
+	vec_sort(work, LENGTH);
+	simd = (double)(monotonic_ns() - start) / LENGTH;
+	start = monotonic_ns();
+	memcpy(work, a, sizeof(double) * LENGTH);
+	qsort(work, LENGTH, sizeof(double), compare_doubles);
+	scalar = (double)(monotonic_ns() - start) / LENGTH;
+	report("sort", simd, scalar);
+
+	if (sink == 1) printf(" ");
+	free(work);
+	free(a);
+	free(b);
+	return 0;
+}
@@ -0,0 +1,94 @@
+// Runs the same script in one VM per thread, for 1 up to the number of
+// CPUs. Every VM does the same work, so the time stays flat while threads
+// do not outnumber cores. Each count runs once with every VM compiling
+// its own copy and once with all of them sharing frozen code; the code's
+// heap cost per VM comes last. Build and run with 'make bench'.
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "../vm.h"
+#include "../timing.h"
+#include "../shared.h"
+#include "../compiler.h"
+
+#define THREADS_MAX 64
+
+static const char script[] =
+	"fun fib(n) { if (n < 2) return n; return fib(n - 1) + fib(n - 2); }\n"
+	"var list = [];\n"
+	"for (var i = 0; i < 20000; i = i + 1) list.push([i, \"item\"]);\n"
+	"var total = fib(24) + list.length();\n";
+
+static SharedCode* shared_script; // NULL to compile in every VM
+
+static void* run_vm(void* result) {
+	VM* vm = malloc(sizeof(VM));
+	if (shared_script == NULL) {
+		init_vm(vm);
+		*(InterpretResult*)result = interpret(vm, script, sizeof(script) - 1);
+	} else {
+		init_vm_shared(vm, &shared_script, 1);
+		*(InterpretResult*)result = interpret_shared(vm, shared_script);
+	}
+	free_vm(vm);
+	free(vm);
+	return NULL;
+}
+
+static double run_threads(int count, SharedCode* code) {
+	pthread_t threads[THREADS_MAX];
+	InterpretResult results[THREADS_MAX];
+	shared_script = code;
+	uint64_t start = monotonic_ns();
+	for (int i = 0; i < count; i++) {
+		pthread_create(&threads[i], NULL, run_vm, &results[i]);
+	}
+	for (int i = 0; i < count; i++) {
+		pthread_join(threads[i], NULL);
+		if (results[i] != INTERPRET_OK) {
+			fprintf(stderr, "VM %d failed\n", i);
+			exit(1);
+		}
+	}
+	return (monotonic_ns() - start) / 1e6;
+}
+
+// Heap bytes the compiled script costs a VM, on top of a fresh one.
+// Negative when the VM's own names, like 'push', come from the region.
+static long code_bytes(SharedCode* code) {
+	VM* vm = malloc(sizeof(VM));
+	init_vm(vm);
+	size_t fresh = vm->bytes_allocated;
+	free_vm(vm);
+	if (code == NULL) {
+		init_vm(vm);
+		ObjFunction* function = compile(vm, script, sizeof(script) - 1);
+		stack_push(vm, OBJ_VALUE(function));
+	} else {
+		init_vm_shared(vm, &code, 1);
+	}
+	long bytes = (long)vm->bytes_allocated - (long)fresh;
+	free_vm(vm);
+	free(vm);
+	return bytes;
+}
+
+int main(void) {
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1) cpus = 1;
+	if (cpus > THREADS_MAX) cpus = THREADS_MAX;
+
+	SharedCode* code = compile_shared(script, sizeof(script) - 1, stderr);
+	run_threads(1, NULL); // Warm up
+	double single = run_threads(1, NULL);
+	printf("%-10s %10s %10s %10s\n", "vms", "ms", "slowdown", "shared ms");
+	for (int count = 1; count <= cpus; count *= 2) {
+		double ms = count == 1 ? single : run_threads(count, NULL);
+		printf("%-10d %10.1f %9.2fx %10.1f\n", count, ms, ms / single, run_threads(count, code));
+	}
+	printf("code heap per VM: %ld bytes compiled, %ld bytes shared (region of %zu bytes)\n",
+		code_bytes(NULL), code_bytes(code), code->size);
+	release_shared(code);
+	return 0;
+}
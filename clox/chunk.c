@@ -13,15 +13,17 @@ void init_chunk(Chunk* chunk) {
 	init_valuearray(&chunk->constants);
 }
 
-void write_chunk(Chunk* chunk, uint8_t bytecode, int line) {
+void write_chunk(VM* vm, Chunk* chunk, uint8_t bytecode, int line) {
 	if (chunk->capacity < chunk->size + 1) {
 		int new_capacity = GROW_CAPACITY(chunk->capacity);
 		chunk->code = GROW_ARRAY(
+			vm,
 			chunk->code,
 			uint8_t,
 			chunk->capacity,
 			new_capacity);
 		chunk->lines = GROW_ARRAY(
+			vm,
 			chunk->lines,
 			int,
 			chunk->capacity,
@@ -33,16 +35,16 @@ void write_chunk(Chunk* chunk, uint8_t bytecode, int line) {
 	chunk->size++;
 }
 
-void free_chunk(Chunk* chunk) {
-	FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-	FREE_ARRAY(int, chunk->lines, chunk->capacity);
-	free_valuearray(&chunk->constants);
+void free_chunk(VM* vm, Chunk* chunk) {
+	FREE_ARRAY(vm, uint8_t, chunk->code, chunk->capacity);
+	FREE_ARRAY(vm, int, chunk->lines, chunk->capacity);
+	free_valuearray(vm, &chunk->constants);
 	init_chunk(chunk);
 }
 
-int add_constant(Chunk* chunk, Value value) {
-	stack_push(value); // Save value not to be killed by GC mark
-	write_valuearray(&chunk->constants, value);
-	stack_pop(); // Now it's safe
+int add_constant(VM* vm, Chunk* chunk, Value value) {
+	stack_push(vm, value); // Save value not to be killed by GC mark
+	write_valuearray(vm, &chunk->constants, value);
+	stack_pop(vm); // Now it's safe
 	return chunk->constants.size - 1; //index of stored constant
 }
\ No newline at end of file
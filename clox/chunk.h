@@ -43,6 +43,10 @@ typedef enum {
 	OP_INHERIT,
 	OP_GET_SUPER,
 	OP_SUPER_INVOKE,
+	OP_BUILD_LIST,
+	OP_BUILD_MAP,
+	OP_GET_INDEX,
+	OP_SET_INDEX,
 } OpCodes;
 
 typedef struct {
@@ -54,8 +58,8 @@ typedef struct {
 } Chunk;
 
 void init_chunk(Chunk* chunk);
-void write_chunk(Chunk* chunk, uint8_t bytecode, int line);
-void free_chunk(Chunk* chunk);
-int add_constant(Chunk* chunk, Value value);
+void write_chunk(VM* vm, Chunk* chunk, uint8_t bytecode, int line);
+void free_chunk(VM* vm, Chunk* chunk);
+int add_constant(VM* vm, Chunk* chunk, Value value);
 
 #endif
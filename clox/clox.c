@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "clox.h"
+#include "vm.h"
+#include "shared.h"
+
+struct sCloxVM {
+	VM vm;
+	CloxScript* script;
+	FILE* errors; // Memory stream behind vm.errors
+	char* error_text;
+	size_t error_length;
+	bool failed; // The stream holds an error to clear before the next run
+};
+
+static void* allocate_or_exit(size_t size) {
+	void* memory = malloc(size);
+	if (memory == NULL) {
+		fprintf(stderr, "Not enough memory for the VM\n");
+		exit(1);
+	}
+	return memory;
+}
+
+static void open_errors(CloxVM* vm) {
+	vm->error_text = NULL;
+	vm->error_length = 0;
+	vm->errors = open_memstream(&vm->error_text, &vm->error_length);
+	if (vm->errors == NULL) {
+		fprintf(stderr, "Not enough memory for the VM\n");
+		exit(1);
+	}
+	vm->vm.errors = vm->errors;
+	vm->failed = false;
+}
+
+static void close_errors(CloxVM* vm) {
+	fclose(vm->errors);
+	free(vm->error_text);
+}
+
+// Errors are rare: the stream is only replaced after one.
+static void clear_error(CloxVM* vm) {
+	if (!vm->failed) return;
+	close_errors(vm);
+	open_errors(vm);
+}
+
+static CloxResult finish(CloxVM* vm, InterpretResult result) {
+	output_flush(&vm->vm.output);
+	if (result == INTERPRET_OK) return CLOX_OK;
+	vm->failed = true;
+	return result == INTERPRET_COMPILE_ERROR ? CLOX_COMPILE_ERROR : CLOX_RUNTIME_ERROR;
+}
+
+CloxScript* clox_compile(const char* source, size_t length, char* error, size_t error_size) {
+	char* text = NULL;
+	size_t text_length = 0;
+	FILE* errors = open_memstream(&text, &text_length);
+	if (errors == NULL) {
+		fprintf(stderr, "Not enough memory to compile\n");
+		exit(1);
+	}
+	CloxScript* script = compile_shared(source, length, errors);
+	fclose(errors);
+	if (error != NULL && error_size > 0) snprintf(error, error_size, "%s", text);
+	free(text);
+	return script;
+}
+
+void clox_free_script(CloxScript* script) {
+	release_shared(script);
+}
+
+CloxVM* clox_new_vm(CloxScript* script) {
+	CloxVM* vm = allocate_or_exit(sizeof(CloxVM));
+	init_vm_shared(&vm->vm, &script, 1);
+	vm->script = script;
+	open_errors(vm);
+	return vm;
+}
+
+void clox_free_vm(CloxVM* vm) {
+	free_vm(&vm->vm);
+	close_errors(vm);
+	free(vm);
+}
+
+CloxResult clox_run(CloxVM* vm) {
+	clear_error(vm);
+	return finish(vm, interpret_shared(&vm->vm, vm->script));
+}
+
+void clox_set_limits(CloxVM* vm, uint64_t ticks, uint64_t time_ms, size_t heap_bytes) {
+	Limits limits = { .ticks = ticks, .time_ms = time_ms, .heap = heap_bytes };
+	configure_limits(&vm->vm, &limits);
+}
+
+int clox_global(CloxVM* vm, const char* name) {
+	Value value;
+	if (!table_get(&vm->vm.globals, copy_string(&vm->vm, name, (int)strlen(name)), &value)) {
+		return -1;
+	}
+	ValueArray* values = &vm->vm.host_values;
+	for (int i = 0; i < values->size; i++) {
+		if (values_equal(values->values[i], value)) return i;
+	}
+	write_valuearray(&vm->vm, values, value);
+	return values->size - 1;
+}
+
+static Value to_value(VM* vm, const CloxValue* value) {
+	switch (value->type) {
+	case CLOX_BOOL: return BOOL_VALUE(value->as.boolean);
+	case CLOX_NUMBER: return NUMBER_VALUE(value->as.number);
+	case CLOX_STRING:
+		return OBJ_VALUE(copy_string(vm, value->as.string.chars, value->as.string.length));
+	default: return NIL_VALUE();
+	}
+}
+
+// The value must still be on the stack: flattening a rope allocates.
+static CloxValue from_value(VM* vm, Value value) {
+	switch (value.type) {
+	case VAL_NIL: return clox_nil();
+	case VAL_BOOL: return clox_bool(AS_BOOL(value));
+	case VAL_NUMBER: return clox_number(AS_NUMBER(value));
+	case VAL_OBJ: break;
+	}
+	if (IS_ROPE(value)) value = OBJ_VALUE(flatten_rope(vm, AS_ROPE(value)));
+	if (IS_STRING(value)) return clox_string(AS_STRING(value)->chars, AS_STRING(value)->length);
+	CloxValue object = { .type = CLOX_OBJECT };
+	return object;
+}
+
+CloxResult clox_call(CloxVM* vm, int function, int arg_count, const CloxValue* args, CloxValue* result) {
+	clear_error(vm);
+	VM* lox = &vm->vm;
+	if (function < 0 || function >= lox->host_values.size) {
+		fprintf(vm->errors, "No global behind handle %d.\n", function);
+		vm->failed = true;
+		return CLOX_RUNTIME_ERROR;
+	}
+	if (arg_count < 0 || arg_count >= UINT8_COUNT) {
+		fprintf(vm->errors, "Can't call with %d arguments.\n", arg_count);
+		vm->failed = true;
+		return CLOX_RUNTIME_ERROR;
+	}
+
+	stack_push(lox, lox->host_values.values[function]);
+	for (int i = 0; i < arg_count; i++) {
+		stack_push(lox, to_value(lox, &args[i]));
+	}
+	CloxResult status = finish(vm, interpret_call(lox, arg_count));
+	if (status == CLOX_OK) {
+		*result = from_value(lox, lox->stack_top[-1]);
+		stack_pop(lox);
+	}
+	return status;
+}
+
+const char* clox_error(CloxVM* vm) {
+	fflush(vm->errors);
+	return vm->error_text == NULL ? "" : vm->error_text;
+}
@@ -0,0 +1,96 @@
+#ifndef clox_h
+#define clox_h
+
+// Embedding API, built into build/libclox.a and build/libclox.so by
+// 'make lib'. Compile a script once, start any number of VMs on it, then
+// call its functions from C as often as needed. Nothing here prints:
+// errors come back as results and clox_error() describes them. 'print'
+// still writes to stdout.
+//
+// A script can be shared by VMs on any thread. A VM must only be used by
+// one thread at a time.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct sSharedCode CloxScript;
+typedef struct sCloxVM CloxVM;
+
+typedef enum {
+	CLOX_OK,
+	CLOX_COMPILE_ERROR,
+	CLOX_RUNTIME_ERROR,
+} CloxResult;
+
+typedef enum {
+	CLOX_NIL,
+	CLOX_BOOL,
+	CLOX_NUMBER,
+	CLOX_STRING,
+	CLOX_OBJECT, // Any other Lox value. Only returned, never passed in.
+} CloxType;
+
+typedef struct {
+	CloxType type;
+	union {
+		bool boolean;
+		double number;
+		struct {
+			const char* chars; // Not NUL terminated when passed in
+			int length;
+		} string;
+	} as;
+} CloxValue;
+
+static inline CloxValue clox_nil(void) {
+	CloxValue value = { .type = CLOX_NIL };
+	return value;
+}
+
+static inline CloxValue clox_bool(bool boolean) {
+	CloxValue value = { .type = CLOX_BOOL, .as.boolean = boolean };
+	return value;
+}
+
+static inline CloxValue clox_number(double number) {
+	CloxValue value = { .type = CLOX_NUMBER, .as.number = number };
+	return value;
+}
+
+static inline CloxValue clox_string(const char* chars, int length) {
+	CloxValue value = { .type = CLOX_STRING, .as.string = { chars, length } };
+	return value;
+}
+
+// NULL on compile errors. Their description, truncated to error_size
+// bytes, goes to 'error' when it is not NULL.
+CloxScript* clox_compile(const char* source, size_t length, char* error, size_t error_size);
+// VMs started on the script keep it alive, it can be freed any time.
+void clox_free_script(CloxScript* script);
+
+CloxVM* clox_new_vm(CloxScript* script);
+void clox_free_vm(CloxVM* vm);
+
+// Runs the script's top level, which defines its globals. Once per VM,
+// before looking up functions.
+CloxResult clox_run(CloxVM* vm);
+
+// Limits for each later run or call, zero for none: loop iterations plus
+// calls, milliseconds, and bytes of live heap. A run that passes one stops
+// with CLOX_RUNTIME_ERROR and the VM can be used again.
+void clox_set_limits(CloxVM* vm, uint64_t ticks, uint64_t time_ms, size_t heap_bytes);
+
+// Handle for the global with that name, or -1 when there is none. The
+// value stays alive, and the handle valid, as long as the VM.
+int clox_global(CloxVM* vm, const char* name);
+
+// Calls the global behind the handle. On CLOX_OK the return value goes to
+// 'result'; strings in it stay valid until the next call into the VM.
+CloxResult clox_call(CloxVM* vm, int function, int arg_count, const CloxValue* args, CloxValue* result);
+
+// Description of the last error, with the Lox stack trace. Empty when the
+// last run or call succeeded.
+const char* clox_error(CloxVM* vm);
+
+#endif
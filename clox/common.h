@@ -9,8 +9,17 @@
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 
+// Hot functions are compiled to machine code on x86-64, see jit.h. Build
+// with -DCLOX_NO_JIT for an interpreter only binary.
+#if defined(__x86_64__) && !defined(CLOX_NO_JIT)
+#define CLOX_JIT
+#endif
+
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
+// Every entry point takes the interpreter it works on. See vm.h
+typedef struct sVM VM;
+
 #endif
@@ -5,6 +5,8 @@
 #include "scanner.h"
 #include "object.h"
 #include "memory.h"
+#include "number.h"
+#include "vm.h"
 
 #if defined(DEBUG_PRINT_CODE) || defined(DEBUG_PRINT_SCAN)
 #include "debug.h"
@@ -18,6 +20,7 @@ typedef enum {
 } FunctionType;
 
 typedef struct {
+	VM* vm; // Owns the objects the compiler allocates.
 	Token current;
 	Token previous;
 	bool had_error;
@@ -119,6 +122,9 @@ static void grouping(bool can_assign);
 static void binary(bool can_assign);
 static void unary(bool can_assign);
 static void dot(bool can_assign);
+static void list(bool can_assign);
+static void subscript(bool can_assign);
+static void map(bool can_assign);
 static void number(bool can_assign);
 static void literal(bool can_assign);
 static void string(bool can_assign);
@@ -144,8 +150,10 @@ static void end_scope();
 ParseRule rules[] = {
 	{ grouping, call,    PREC_CALL },       // TOKEN_LEFT_PAREN
 	{ NULL,     NULL,    PREC_NONE },       // TOKEN_RIGHT_PAREN
-	{ NULL,     NULL,    PREC_NONE },       // TOKEN_LEFT_BRACE
+	{ map,      NULL,    PREC_NONE },       // TOKEN_LEFT_BRACE
 	{ NULL,     NULL,    PREC_NONE },       // TOKEN_RIGHT_BRACE
+	{ list,     subscript, PREC_CALL },     // TOKEN_LEFT_BRACKET
+	{ NULL,     NULL,    PREC_NONE },       // TOKEN_RIGHT_BRACKET
 	{ NULL,     NULL,    PREC_NONE },       // TOKEN_COMMA
 	{ NULL,     dot,     PREC_CALL },       // TOKEN_DOT
 	{ unary,    binary,  PREC_TERM },       // TOKEN_MINUS
@@ -154,6 +162,7 @@ ParseRule rules[] = {
 	{ NULL,     binary,  PREC_FACTOR },     // TOKEN_SLASH
 	{ NULL,     binary,  PREC_FACTOR },     // TOKEN_STAR
 	{ NULL,     binary,  PREC_FACTOR },     // TOKEN_PERCENT
+	{ NULL,     NULL,    PREC_NONE },       // TOKEN_COLON
 	{ unary,    NULL,    PREC_NONE },       // TOKEN_BANG
 	{ NULL,     binary,  PREC_EQUALITY },   // TOKEN_BANG_EQUAL
 	{ NULL,     NULL,    PREC_NONE },       // TOKEN_EQUAL
@@ -191,13 +200,15 @@ static ParseRule* get_rule(TokenType type) {
 	return &rules[type];
 }
 
-Parser parser;
+// Compiler state is per thread, so VMs on different threads can compile
+// at the same time.
+static _Thread_local Parser parser;
 
-Compiler* current = NULL;
+static _Thread_local Compiler* current = NULL;
 
-ClassCompiler* current_class = NULL;
+static _Thread_local ClassCompiler* current_class = NULL;
 
-LoopMetadata loop_metadata;
+static _Thread_local LoopMetadata loop_metadata;
 
 static void add_local(Token name) {
 	if(current->local_count == UINT8_COUNT) {
@@ -216,7 +227,7 @@ static void init_compiler(Compiler* compiler, FunctionType type) {
 	compiler->local_count = 0;
 	compiler->scope_depth = 0;
 	compiler->type = type;
-	compiler->func = new_function();
+	compiler->func = new_function(parser.vm);
 	current = compiler;
 
 	Local* local = &current->locals[current->local_count++];
@@ -243,7 +254,7 @@ static Chunk* current_chunk() {
 }
 
 static void emit_byte(uint8_t byte) {
-	write_chunk(current_chunk(), byte, parser.previous.line);
+	write_chunk(parser.vm, current_chunk(), byte, parser.previous.line);
 }
 
 static void emit_bytes(uint8_t byte1, uint8_t byte2) {
@@ -254,17 +265,17 @@ static void emit_bytes(uint8_t byte1, uint8_t byte2) {
 static void error_at(Token* token, const char* message) {
 	if (parser.panic_mode) return;
 	parser.panic_mode = true;
-	fprintf(stderr, "[line %d] Error", token->line);
+	fprintf(parser.vm->errors, "[line %d] Error", token->line);
 	if (token->type == TOKEN_EOF) {
-		fprintf(stderr, " at end");
+		fprintf(parser.vm->errors, " at end");
 	}
 	else if (token->type == TOKEN_ERROR) {
 		// Nothing.
 	}
 	else {
-		fprintf(stderr, " at '%.*s'", token->length, token->start);
+		fprintf(parser.vm->errors, " at '%.*s'", token->length, token->start);
 	}
-	fprintf(stderr, ": %s\n", message);
+	fprintf(parser.vm->errors, ": %s\n", message);
 	parser.had_error = true;
 }
 
@@ -336,7 +347,7 @@ static void emit_return() {
 }
 
 static uint8_t make_constant(Value value) {
-	int constant_index = add_constant(current_chunk(), value);
+	int constant_index = add_constant(parser.vm, current_chunk(), value);
 	if (constant_index > UINT8_MAX) {
 		error("Too many constants in one chunk.");
 		return 0;
@@ -466,7 +477,7 @@ static void function(FunctionType type) {
 	begin_scope();
 
 	if(type != TYPE_SCRIPT) {
-		current->func->name = copy_string(parser.previous.start, parser.previous.length);
+		current->func->name = copy_string(parser.vm, parser.previous.start, parser.previous.length);
 	}
 
 	// Compile the parameter list.
@@ -517,7 +528,7 @@ static uint8_t parse_variable(const char* error_msg) {
 }
 
 static uint8_t identifier_constant(Token* identifier) {
-	return make_constant(OBJ_VALUE(copy_string(identifier->start, identifier->length)));
+	return make_constant(OBJ_VALUE(copy_string(parser.vm, identifier->start, identifier->length)));
 }
 
 static void declare_variable() {
@@ -779,7 +790,8 @@ static void expression() {
 }
 
 static void number(bool can_assign) {
-	double value = strtod(parser.previous.start, NULL);
+	double value;
+	parse_number(parser.previous.start, parser.previous.length, &value);
 	emit_constant(NUMBER_VALUE(value));
 }
 
@@ -865,7 +877,7 @@ static void this_(bool can_assign) {
 }
 
 static void string(bool can_assign) {
-	emit_constant(OBJ_VALUE(copy_string(parser.previous.start + 1, parser.previous.length - 2)));
+	emit_constant(OBJ_VALUE(copy_string(parser.vm, parser.previous.start + 1, parser.previous.length - 2)));
 }
 
 static void variable(bool can_assign) {
@@ -893,6 +905,54 @@ static void dot(bool can_assign) {
 	}
 }
 
+// [a, b, c] builds a list from the values left on the stack.
+static void list(bool can_assign) {
+	int count = 0;
+	if(!check(TOKEN_RIGHT_BRACKET)) {
+		do {
+			if(check(TOKEN_RIGHT_BRACKET)) break; // Trailing comma
+			expression();
+			if(count == 255) {
+				error("Cannot have more than 255 elements in a list literal");
+			}
+			count++;
+		} while(match(TOKEN_COMMA));
+	}
+	consume(TOKEN_RIGHT_BRACKET, "Expected ] after list elements");
+	emit_bytes(OP_BUILD_LIST, (uint8_t)count);
+}
+
+// {key: value, ...} in expression position. Keys are any expression.
+static void map(bool can_assign) {
+	int count = 0;
+	if(!check(TOKEN_RIGHT_BRACE)) {
+		do {
+			if(check(TOKEN_RIGHT_BRACE)) break; // Trailing comma
+			expression();
+			consume(TOKEN_COLON, "Expected : after map key");
+			expression();
+			if(count == 255) {
+				error("Cannot have more than 255 entries in a map literal");
+			}
+			count++;
+		} while(match(TOKEN_COMMA));
+	}
+	consume(TOKEN_RIGHT_BRACE, "Expected } after map entries");
+	emit_bytes(OP_BUILD_MAP, (uint8_t)count);
+}
+
+static void subscript(bool can_assign) {
+	expression();
+	consume(TOKEN_RIGHT_BRACKET, "Expected ] after index");
+
+	if(can_assign && match(TOKEN_EQUAL)) {
+		expression();
+		emit_byte(OP_SET_INDEX);
+	} else {
+		emit_byte(OP_GET_INDEX);
+	}
+}
+
 static void super_(bool can_assign) {
 	if (current_class == NULL) {
 		error("Cannot use 'super' outside of a class.");
@@ -996,8 +1056,9 @@ static int add_upvalue(Compiler* compiler, uint8_t index, bool is_local) {
 	return compiler->func->upvalue_count++;
 }
 
-ObjFunction* compile(const char* source) {
-	init_scanner(source);
+ObjFunction* compile(VM* vm, const char* source, size_t length) {
+	parser.vm = vm;
+	init_scanner(source, length);
 	init_loop_metadata();
 	Compiler compiler;
 	init_compiler(&compiler, TYPE_SCRIPT);
@@ -1011,10 +1072,11 @@ ObjFunction* compile(const char* source) {
 	return parser.had_error ? NULL : func;
 }
 
-void mark_compiler_roots() {
+void mark_compiler_roots(VM* vm) {
+	if (parser.vm != vm) return; // This thread is compiling for another VM
 	Compiler* compiler = current;
 	while (compiler != NULL) {
-		mark_object((Obj*)compiler->func);
+		mark_object(vm, (Obj*)compiler->func);
 		compiler = compiler->enclosing;
 	}
 }
@@ -5,7 +5,7 @@
 #include "chunk.h"
 #include "object.h"
 
-ObjFunction* compile(const char* source);
-void mark_compiler_roots();
+ObjFunction* compile(VM* vm, const char* source, size_t length);
+void mark_compiler_roots(VM* vm);
 
 #endif
\ No newline at end of file
@@ -14,8 +14,10 @@ static int invoke_instruction(const char* name, Chunk* chunk, int offset);
 char* tokens_names[] = {
 	"TOKEN_LEFT_PAREN", "TOKEN_RIGHT_PAREN",
 	"TOKEN_LEFT_BRACE", "TOKEN_RIGHT_BRACE",
+	"TOKEN_LEFT_BRACKET", "TOKEN_RIGHT_BRACKET",
 	"TOKEN_COMMA", "TOKEN_DOT", "TOKEN_MINUS", "TOKEN_PLUS",
 	"TOKEN_SEMICOLON", "TOKEN_SLASH", "TOKEN_STAR", "TOKEN_PERCENT",
+	"TOKEN_COLON",
 
 	// One or two character tokens.
 	"TOKEN_BANG", "TOKEN_BANG_EQUAL",
@@ -45,6 +47,15 @@ char* obj_names[] = {
     "OBJ_UPVALUE",
 	"OBJ_CLASS",
 	"OBJ_INSTANCE",
+	"OBJ_BOUND_METHOD",
+	"OBJ_ROPE",
+	"OBJ_LIST",
+	"OBJ_MAP",
+	"OBJ_FLOAT_ARRAY",
+	"OBJ_LINE_READER",
+	"OBJ_CHANNEL",
+	"OBJ_ISOLATE",
+	"OBJ_FIBER",
 };
 
 char* get_obj_str(int obj_type) {
@@ -153,6 +164,14 @@ int disassemble_instruction(Chunk* chunk, int position) {
 		return constant_instruction("OP_GET_SUPER", chunk, position);
 	case OP_SUPER_INVOKE:
 		return invoke_instruction("OP_SUPER_INVOKE", chunk, position);
+	case OP_BUILD_LIST:
+		return byte_instruction("OP_BUILD_LIST", chunk, position);
+	case OP_BUILD_MAP:
+		return byte_instruction("OP_BUILD_MAP", chunk, position);
+	case OP_GET_INDEX:
+		return simple_instruction("OP_GET_INDEX", position);
+	case OP_SET_INDEX:
+		return simple_instruction("OP_SET_INDEX", position);
 	default: {
 		printf("ERROR: UNDEFINED OPCODE: %d\n", opcode);
 		return position + 1;
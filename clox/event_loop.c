@@ -0,0 +1,385 @@
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "event_loop.h"
+#include "memory.h"
+#include "timing.h"
+#include "vm.h"
+
+#define READ_FD_CHUNK 65536
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#define EVENTS_MAX 64
+#endif
+
+void init_event_loop(EventLoop* loop) {
+	loop->poll_fd = -1;
+	loop->ready = NULL;
+	loop->ready_head = 0;
+	loop->ready_count = 0;
+	loop->ready_capacity = 0;
+	loop->timers = NULL;
+	loop->timer_count = 0;
+	loop->timer_capacity = 0;
+	loop->timer_order = 0;
+	loop->waits = NULL;
+	loop->wait_capacity = 0;
+	loop->waiting = 0;
+	loop->running = NULL;
+	loop->parked = false;
+}
+
+void free_event_loop(VM* vm, EventLoop* loop) {
+	if (loop->poll_fd != -1) close(loop->poll_fd);
+	FREE_ARRAY(vm, ReadyFiber, loop->ready, loop->ready_capacity);
+	FREE_ARRAY(vm, Timer, loop->timers, loop->timer_capacity);
+	FREE_ARRAY(vm, IoWait, loop->waits, loop->wait_capacity);
+	init_event_loop(loop);
+}
+
+void mark_event_loop(VM* vm, EventLoop* loop) {
+	for (int i = 0; i < loop->ready_count; i++) {
+		ReadyFiber* ready = &loop->ready[(loop->ready_head + i) % loop->ready_capacity];
+		mark_object(vm, (Obj*)ready->fiber);
+		mark_value(vm, ready->value);
+	}
+	for (int i = 0; i < loop->timer_count; i++) {
+		mark_object(vm, (Obj*)loop->timers[i].fiber);
+	}
+	for (int fd = 0; fd < loop->wait_capacity; fd++) {
+		mark_object(vm, (Obj*)loop->waits[fd].fiber);
+		mark_object(vm, (Obj*)loop->waits[fd].text);
+	}
+	mark_object(vm, (Obj*)loop->running);
+}
+
+void relocate_event_loop(EventLoop* loop) {
+	for (int i = 0; i < loop->ready_count; i++) {
+		ReadyFiber* ready = &loop->ready[(loop->ready_head + i) % loop->ready_capacity];
+		relocate_object((Obj**)&ready->fiber);
+		relocate_value(&ready->value);
+	}
+	for (int i = 0; i < loop->timer_count; i++) {
+		relocate_object((Obj**)&loop->timers[i].fiber);
+	}
+	for (int fd = 0; fd < loop->wait_capacity; fd++) {
+		relocate_object((Obj**)&loop->waits[fd].fiber);
+		relocate_object((Obj**)&loop->waits[fd].text);
+	}
+	relocate_object((Obj**)&loop->running);
+}
+
+// The fiber and the value stay on the stack while the queue grows.
+void event_loop_ready(VM* vm, EventLoop* loop, ObjFiber* fiber, Value value) {
+	if (loop->ready_count == loop->ready_capacity) {
+		stack_push(vm, OBJ_VALUE(fiber));
+		stack_push(vm, value);
+		int capacity = GROW_CAPACITY(loop->ready_capacity);
+		ReadyFiber* ready = ALLOCATE(vm, ReadyFiber, capacity);
+		for (int i = 0; i < loop->ready_count; i++) {
+			ready[i] = loop->ready[(loop->ready_head + i) % loop->ready_capacity];
+		}
+		FREE_ARRAY(vm, ReadyFiber, loop->ready, loop->ready_capacity);
+		loop->ready = ready;
+		loop->ready_head = 0;
+		loop->ready_capacity = capacity;
+		stack_pop(vm);
+		stack_pop(vm);
+	}
+	ReadyFiber* slot = &loop->ready[(loop->ready_head + loop->ready_count) % loop->ready_capacity];
+	slot->fiber = fiber;
+	slot->value = value;
+	loop->ready_count++;
+	if (fiber->state == FIBER_PARKED) fiber->state = FIBER_SUSPENDED;
+}
+
+bool event_loop_next(EventLoop* loop, ReadyFiber* next) {
+	if (loop->ready_count == 0) return false;
+	*next = loop->ready[loop->ready_head];
+	loop->ready_head = (loop->ready_head + 1) % loop->ready_capacity;
+	loop->ready_count--;
+	return true;
+}
+
+bool event_loop_pending(EventLoop* loop) {
+	return loop->timer_count > 0 || loop->waiting > 0;
+}
+
+static bool timer_before(Timer* a, Timer* b) {
+	return a->deadline < b->deadline || (a->deadline == b->deadline && a->order < b->order);
+}
+
+void event_loop_sleep(VM* vm, EventLoop* loop, ObjFiber* fiber, uint64_t deadline) {
+	if (loop->timer_count == loop->timer_capacity) {
+		int old_capacity = loop->timer_capacity;
+		int capacity = GROW_CAPACITY(old_capacity);
+		loop->timers = GROW_ARRAY(vm, loop->timers, Timer, old_capacity, capacity);
+		loop->timer_capacity = capacity;
+	}
+	Timer timer = {deadline, loop->timer_order++, fiber};
+	int index = loop->timer_count++;
+	while (index > 0) {
+		int parent = (index - 1) / 2;
+		if (!timer_before(&timer, &loop->timers[parent])) break;
+		loop->timers[index] = loop->timers[parent];
+		index = parent;
+	}
+	loop->timers[index] = timer;
+}
+
+static ObjFiber* pop_timer(EventLoop* loop) {
+	ObjFiber* fiber = loop->timers[0].fiber;
+	Timer last = loop->timers[--loop->timer_count];
+	int index = 0;
+	for (;;) {
+		int child = index * 2 + 1;
+		if (child >= loop->timer_count) break;
+		if (child + 1 < loop->timer_count &&
+			timer_before(&loop->timers[child + 1], &loop->timers[child])) {
+			child++;
+		}
+		if (!timer_before(&loop->timers[child], &last)) break;
+		loop->timers[index] = loop->timers[child];
+		index = child;
+	}
+	loop->timers[index] = last;
+	return fiber;
+}
+
+// Watches fd once for the next read or write readiness.
+static bool arm(EventLoop* loop, int fd, bool writing) {
+#ifdef __linux__
+	if (loop->poll_fd == -1) {
+		loop->poll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (loop->poll_fd == -1) return false;
+	}
+	struct epoll_event event;
+	event.events = (writing ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT;
+	event.data.fd = fd;
+	IoWait* wait = &loop->waits[fd];
+	int op = wait->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+	if (epoll_ctl(loop->poll_fd, op, fd, &event) == -1) {
+		// The descriptor was closed or reused behind the loop's back.
+		if (errno != ENOENT && errno != EEXIST) return false;
+		op = op == EPOLL_CTL_MOD ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+		if (epoll_ctl(loop->poll_fd, op, fd, &event) == -1) return false;
+	}
+	wait->registered = true;
+#endif
+	return true;
+}
+
+static IoWait* wait_slot(VM* vm, EventLoop* loop, int fd) {
+	if (fd < 0) {
+		errno = EBADF;
+		return NULL;
+	}
+	if (fd >= loop->wait_capacity) {
+		int old_capacity = loop->wait_capacity;
+		int capacity = GROW_CAPACITY(old_capacity);
+		while (capacity <= fd) capacity *= 2;
+		loop->waits = GROW_ARRAY(vm, loop->waits, IoWait, old_capacity, capacity);
+		for (int i = old_capacity; i < capacity; i++) {
+			loop->waits[i] = (IoWait){NULL, false, false, 0, NULL, 0};
+		}
+		loop->wait_capacity = capacity;
+	}
+	if (loop->waits[fd].fiber != NULL) {
+		errno = EBUSY; // One fiber per descriptor
+		return NULL;
+	}
+	return &loop->waits[fd];
+}
+
+static bool wait_on(EventLoop* loop, IoWait* wait, int fd, ObjFiber* fiber) {
+	if (!arm(loop, fd, wait->writing)) return false;
+	wait->fiber = fiber;
+	loop->waiting++;
+	return true;
+}
+
+bool event_loop_read(VM* vm, EventLoop* loop, ObjFiber* fiber, int fd, int max) {
+	IoWait* wait = wait_slot(vm, loop, fd);
+	if (wait == NULL) return false;
+	wait->writing = false;
+	wait->max = max;
+	wait->text = NULL;
+	return wait_on(loop, wait, fd, fiber);
+}
+
+bool event_loop_write(VM* vm, EventLoop* loop, ObjFiber* fiber, int fd, ObjString* text, int written) {
+	IoWait* wait = wait_slot(vm, loop, fd);
+	if (wait == NULL) return false;
+	wait->writing = true;
+	wait->text = text;
+	wait->written = written;
+	return wait_on(loop, wait, fd, fiber);
+}
+
+static void finish_wait(VM* vm, EventLoop* loop, int fd, Value result) {
+	IoWait* wait = &loop->waits[fd];
+	ObjFiber* fiber = wait->fiber;
+	wait->fiber = NULL;
+	wait->text = NULL;
+	loop->waiting--;
+	event_loop_ready(vm, loop, fiber, result);
+}
+
+// The descriptor is ready: do the operation the fiber is waiting for.
+static void complete(VM* vm, EventLoop* loop, int fd) {
+	IoWait* wait = &loop->waits[fd];
+	if (wait->fiber == NULL) return;
+	Value result;
+	int done;
+	if (wait->writing) {
+		done = write_fd(fd, wait->text, &wait->written);
+		result = NUMBER_VALUE(wait->written);
+	} else {
+		done = read_fd(vm, fd, wait->max, &result);
+		if (done == -1) result = NIL_VALUE();
+	}
+	if (done == 0 && arm(loop, fd, wait->writing)) return;
+	finish_wait(vm, loop, fd, result);
+}
+
+void event_loop_forget(VM* vm, EventLoop* loop, int fd) {
+	if (fd < 0 || fd >= loop->wait_capacity) return;
+	IoWait* wait = &loop->waits[fd];
+	if (wait->fiber != NULL) {
+		finish_wait(vm, loop, fd, wait->writing ? NUMBER_VALUE(wait->written) : NIL_VALUE());
+	}
+#ifdef __linux__
+	if (wait->registered) epoll_ctl(loop->poll_fd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+	wait->registered = false;
+}
+
+static int poll_timeout(EventLoop* loop) {
+	if (loop->timer_count == 0) return -1;
+	uint64_t now = monotonic_ns();
+	uint64_t deadline = loop->timers[0].deadline;
+	if (deadline <= now) return 0;
+	uint64_t ms = (deadline - now + 999999) / 1000000;
+	return ms > INT_MAX ? INT_MAX : (int)ms;
+}
+
+bool event_loop_poll(VM* vm, EventLoop* loop) {
+	int timeout = poll_timeout(loop);
+#ifdef __linux__
+	if (loop->poll_fd == -1) {
+		loop->poll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (loop->poll_fd == -1) return false;
+	}
+	struct epoll_event events[EVENTS_MAX];
+	int count = epoll_wait(loop->poll_fd, events, EVENTS_MAX, timeout);
+	if (count == -1 && errno != EINTR) return false;
+	for (int i = 0; i < count; i++) {
+		complete(vm, loop, events[i].data.fd);
+	}
+#else
+	// Without epoll, poll() every waiting descriptor.
+	struct pollfd* fds = malloc(sizeof(struct pollfd) * (loop->waiting + 1));
+	if (fds == NULL) return false;
+	int nfds = 0;
+	for (int fd = 0; fd < loop->wait_capacity; fd++) {
+		if (loop->waits[fd].fiber == NULL) continue;
+		fds[nfds].fd = fd;
+		fds[nfds].events = loop->waits[fd].writing ? POLLOUT : POLLIN;
+		nfds++;
+	}
+	int count = poll(fds, nfds, timeout);
+	if (count == -1 && errno != EINTR) {
+		free(fds);
+		return false;
+	}
+	for (int i = 0; i < nfds && count > 0; i++) {
+		if (fds[i].revents != 0) complete(vm, loop, fds[i].fd);
+	}
+	free(fds);
+#endif
+
+	uint64_t now = monotonic_ns();
+	while (loop->timer_count > 0 && loop->timers[0].deadline <= now) {
+		event_loop_ready(vm, loop, pop_timer(loop), NIL_VALUE());
+	}
+	return true;
+}
+
+// Reads at most a chunk at a time, so a large max only costs memory for
+// data that actually arrived. Later chunks are read only while more data
+// is waiting, which keeps blocking descriptors from blocking.
+int read_fd(VM* vm, int fd, int max, Value* result) {
+	char* buffer = NULL;
+	int length = 0;
+	for (;;) {
+		int chunk = max - length < READ_FD_CHUNK ? max - length : READ_FD_CHUNK;
+		char* grown = realloc(buffer, length + chunk);
+		if (grown == NULL) {
+			free(buffer);
+			errno = ENOMEM;
+			return -1;
+		}
+		buffer = grown;
+		ssize_t count;
+		do {
+			count = read(fd, buffer + length, chunk);
+		} while (count == -1 && errno == EINTR);
+		if (count == -1 && length == 0) {
+			free(buffer);
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		}
+		if (count > 0) length += (int)count;
+		if (count != chunk || length == max) break;
+		struct pollfd more = {fd, POLLIN, 0};
+		if (poll(&more, 1, 0) != 1 || !(more.revents & POLLIN)) break;
+	}
+	*result = length == 0 ? NIL_VALUE() : OBJ_VALUE(copy_string(vm, buffer, length));
+	free(buffer);
+	return 1;
+}
+
+// write() that fails with EPIPE instead of raising SIGPIPE, without
+// touching the signal handlers, which belong to the host process.
+// Sockets have a flag for it; for pipes the signal is blocked on this
+// thread and taken back if the write raised it.
+static ssize_t write_no_sigpipe(int fd, const char* data, size_t length) {
+	ssize_t count;
+#ifdef MSG_NOSIGNAL
+	count = send(fd, data, length, MSG_NOSIGNAL);
+	if (count != -1 || errno != ENOTSOCK) return count;
+#endif
+	sigset_t pipe_signal, old_mask, pending;
+	sigemptyset(&pipe_signal);
+	sigaddset(&pipe_signal, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &pipe_signal, &old_mask);
+	sigpending(&pending);
+	bool was_pending = sigismember(&pending, SIGPIPE);
+	count = write(fd, data, length);
+	if (count == -1 && errno == EPIPE && !was_pending) {
+		int error = errno;
+		struct timespec no_wait = {0, 0};
+		sigtimedwait(&pipe_signal, NULL, &no_wait);
+		errno = error;
+	}
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+	return count;
+}
+
+int write_fd(int fd, ObjString* text, int* written) {
+	while (*written < text->length) {
+		ssize_t count = write_no_sigpipe(fd, text->chars + *written, text->length - *written);
+		if (count == -1) {
+			if (errno == EINTR) continue;
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		}
+		*written += (int)count;
+	}
+	return 1;
+}
@@ -0,0 +1,76 @@
+#ifndef clox_event_loop_h
+#define clox_event_loop_h
+
+#include "common.h"
+#include "values.h"
+#include "object.h"
+
+// Fibers run by runEvents() park themselves here while they sleep or wait
+// on a descriptor. The loop does the read or write once the descriptor is
+// ready and queues the fiber again with the result.
+typedef struct {
+	ObjFiber* fiber;
+	Value value; // Passed to resume()
+} ReadyFiber;
+
+typedef struct {
+	uint64_t deadline; // monotonic_ns()
+	uint64_t order; // Keeps timers with the same deadline in FIFO order
+	ObjFiber* fiber;
+} Timer;
+
+typedef struct {
+	ObjFiber* fiber; // NULL while nobody waits on the descriptor
+	bool writing;
+	bool registered; // Known to epoll
+	int max; // Bytes to read
+	ObjString* text; // To write
+	int written;
+} IoWait;
+
+typedef struct {
+	int poll_fd; // epoll instance, -1 until the first wait
+	ReadyFiber* ready; // Ring buffer
+	int ready_head;
+	int ready_count;
+	int ready_capacity;
+	Timer* timers; // Binary min heap on (deadline, order)
+	int timer_count;
+	int timer_capacity;
+	uint64_t timer_order;
+	IoWait* waits; // Indexed by descriptor
+	int wait_capacity;
+	int waiting; // Descriptors with a fiber parked on them
+	ObjFiber* running; // Fiber the loop is running, NULL outside runEvents()
+	bool parked; // Set by natives that park the running fiber
+} EventLoop;
+
+void init_event_loop(EventLoop* loop);
+void free_event_loop(VM* vm, EventLoop* loop);
+void mark_event_loop(VM* vm, EventLoop* loop);
+void relocate_event_loop(EventLoop* loop);
+
+void event_loop_ready(VM* vm, EventLoop* loop, ObjFiber* fiber, Value value);
+bool event_loop_next(EventLoop* loop, ReadyFiber* next);
+// True while fibers sleep or wait on descriptors.
+bool event_loop_pending(EventLoop* loop);
+
+void event_loop_sleep(VM* vm, EventLoop* loop, ObjFiber* fiber, uint64_t deadline);
+// Return false with errno set when the descriptor can't be watched.
+bool event_loop_read(VM* vm, EventLoop* loop, ObjFiber* fiber, int fd, int max);
+bool event_loop_write(VM* vm, EventLoop* loop, ObjFiber* fiber, int fd, ObjString* text, int written);
+// Before closing fd. A fiber waiting on it gets what it would at the end
+// of the stream.
+void event_loop_forget(VM* vm, EventLoop* loop, int fd);
+
+// Waits until a timer expires or a descriptor is ready, then queues the
+// fibers whose wait is over. False with errno set on failure.
+bool event_loop_poll(VM* vm, EventLoop* loop);
+
+// Non-blocking I/O shared by the natives and the loop. Return 1 when done,
+// 0 when the call would block and -1 on errors. Reads give nil at the end
+// of the stream.
+int read_fd(VM* vm, int fd, int max, Value* result);
+int write_fd(int fd, ObjString* text, int* written);
+
+#endif
@@ -0,0 +1,206 @@
+#include <stdlib.h>
+#include <string.h>
+#include "gc_stats.h"
+
+// Also used as gcStats() field names, so they must be valid identifiers.
+static const char* obj_type_names[] = {
+	"strings",
+	"functions",
+	"natives",
+	"closures",
+	"upvalues",
+	"classes",
+	"instances",
+	"boundMethods",
+	"ropes",
+	"lists",
+	"maps",
+	"floatArrays",
+	"lineReaders",
+	"channels",
+	"isolates",
+	"fibers",
+};
+
+const char* obj_type_name(ObjType type) {
+	return obj_type_names[type];
+}
+
+void init_gc_config(GcConfig* config) {
+	config->grow_factor = GC_DEFAULT_GROW_FACTOR;
+	config->initial_heap = GC_DEFAULT_INITIAL_HEAP;
+	config->compact = false;
+	config->report = GC_REPORT_NONE;
+}
+
+// Accepts plain bytes or K, M and G suffixes.
+bool parse_size(const char* text, size_t* size) {
+	char* end;
+	double value = strtod(text, &end);
+	if (end == text || !(value >= 0)) return false;
+	switch (*end) {
+	case 'k': case 'K': value *= 1024; end++; break;
+	case 'm': case 'M': value *= 1024 * 1024; end++; break;
+	case 'g': case 'G': value *= 1024 * 1024 * 1024; end++; break;
+	}
+	// Also rules out infinity, which the cast can't convert.
+	if (*end != '\0' || value >= (double)SIZE_MAX) return false;
+	*size = (size_t)value;
+	return true;
+}
+
+static bool parse_factor(const char* text, double* factor) {
+	char* end;
+	double value = strtod(text, &end);
+	// NaN fails the range check too.
+	if (end == text || *end != '\0' || !(value >= 1 && value <= GC_MAX_GROW_FACTOR)) return false;
+	*factor = value;
+	return true;
+}
+
+static bool parse_report(const char* text, GcReport* report) {
+	if (strcmp(text, "summary") == 0 || strcmp(text, "1") == 0) {
+		*report = GC_REPORT_SUMMARY;
+	} else if (strcmp(text, "json") == 0) {
+		*report = GC_REPORT_JSON;
+	} else if (strcmp(text, "none") == 0 || strcmp(text, "0") == 0) {
+		*report = GC_REPORT_NONE;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+void gc_config_from_env(GcConfig* config) {
+	const char* value;
+	if ((value = getenv("CLOX_GC_GROW_FACTOR")) != NULL &&
+		!parse_factor(value, &config->grow_factor)) {
+		fprintf(stderr, "Ignoring invalid CLOX_GC_GROW_FACTOR: %s\n", value);
+	}
+	if ((value = getenv("CLOX_GC_INITIAL_HEAP")) != NULL &&
+		!parse_size(value, &config->initial_heap)) {
+		fprintf(stderr, "Ignoring invalid CLOX_GC_INITIAL_HEAP: %s\n", value);
+	}
+	if ((value = getenv("CLOX_GC_COMPACT")) != NULL) {
+		config->compact = strcmp(value, "0") != 0;
+	}
+	if ((value = getenv("CLOX_GC_STATS")) != NULL &&
+		!parse_report(value, &config->report)) {
+		fprintf(stderr, "Ignoring invalid CLOX_GC_STATS: %s\n", value);
+	}
+}
+
+// Parses a command line flag. Returns false for unknown or malformed flags.
+bool gc_config_set(GcConfig* config, const char* option) {
+#define OPTION_VALUE(name) \
+	(strncmp(option, name "=", sizeof(name)) == 0 ? option + sizeof(name) : NULL)
+	const char* value;
+	if (strcmp(option, "--gc-compact") == 0) {
+		config->compact = true;
+		return true;
+	}
+	if (strcmp(option, "--gc-stats") == 0) {
+		config->report = GC_REPORT_SUMMARY;
+		return true;
+	}
+	if ((value = OPTION_VALUE("--gc-stats")) != NULL) {
+		return parse_report(value, &config->report);
+	}
+	if ((value = OPTION_VALUE("--gc-grow-factor")) != NULL) {
+		return parse_factor(value, &config->grow_factor);
+	}
+	if ((value = OPTION_VALUE("--gc-initial-heap")) != NULL) {
+		return parse_size(value, &config->initial_heap);
+	}
+	return false;
+#undef OPTION_VALUE
+}
+
+void init_gc_stats(GcStats* stats) {
+	stats->collections = 0;
+	stats->allocations = 0;
+	stats->bytes_requested = 0;
+	stats->peak_heap = 0;
+	stats->total_freed = 0;
+	stats->total_pause_ns = 0;
+	stats->max_pause_ns = 0;
+	stats->records_count = 0;
+	stats->records_next = 0;
+}
+
+void free_gc_stats(GcStats* stats) {
+	init_gc_stats(stats);
+}
+
+// The oldest record is overwritten once the ring is full.
+void gc_stats_record(GcStats* stats, GcRecord* record) {
+	stats->records[stats->records_next] = *record;
+	stats->records_next = (stats->records_next + 1) % GC_RECORDS;
+	if (stats->records_count < GC_RECORDS) stats->records_count++;
+	stats->collections++;
+	stats->total_pause_ns += record->pause_ns;
+	if (record->pause_ns > stats->max_pause_ns) {
+		stats->max_pause_ns = record->pause_ns;
+	}
+	if (record->heap_before > record->heap_after) {
+		stats->total_freed += record->heap_before - record->heap_after;
+	}
+}
+
+GcRecord* gc_stats_last(GcStats* stats) {
+	if (stats->records_count == 0) return NULL;
+	return &stats->records[(stats->records_next + GC_RECORDS - 1) % GC_RECORDS];
+}
+
+static void report_summary(GcStats* stats, FILE* out) {
+	fprintf(out, "== gc stats ==\n");
+	fprintf(out, "collections:     %d\n", stats->collections);
+	fprintf(out, "allocations:     %zu (%zu bytes)\n", stats->allocations, stats->bytes_requested);
+	fprintf(out, "peak heap:       %zu bytes\n", stats->peak_heap);
+	fprintf(out, "freed:           %zu bytes\n", stats->total_freed);
+	fprintf(out, "total pause:     %.3f ms\n", stats->total_pause_ns / 1e6);
+	fprintf(out, "max pause:       %.3f ms\n", stats->max_pause_ns / 1e6);
+	if (stats->collections > 0) {
+		fprintf(out, "mean pause:      %.3f ms\n",
+			stats->total_pause_ns / 1e6 / stats->collections);
+	}
+	GcRecord* last = gc_stats_last(stats);
+	if (last != NULL) {
+		fprintf(out, "last collection: %zu -> %zu bytes\n", last->heap_before, last->heap_after);
+		for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+			fprintf(out, "  %-14s %d\n", obj_type_name(i), last->objects[i]);
+		}
+	}
+}
+
+static void report_json(GcStats* stats, FILE* out) {
+	fprintf(out, "{\"collections\":%d,\"allocations\":%zu,\"bytes_requested\":%zu,"
+		"\"peak_heap\":%zu,\"total_freed\":%zu,\"total_pause_ns\":%llu,\"max_pause_ns\":%llu,"
+		"\"records\":[",
+		stats->collections, stats->allocations, stats->bytes_requested,
+		stats->peak_heap, stats->total_freed,
+		(unsigned long long)stats->total_pause_ns,
+		(unsigned long long)stats->max_pause_ns);
+	// Oldest first.
+	int first = (stats->records_next + GC_RECORDS - stats->records_count) % GC_RECORDS;
+	for (int i = 0; i < stats->records_count; i++) {
+		GcRecord* record = &stats->records[(first + i) % GC_RECORDS];
+		fprintf(out, "%s{\"pause_ns\":%llu,\"heap_before\":%zu,\"heap_after\":%zu,\"objects\":{",
+			i == 0 ? "" : ",",
+			(unsigned long long)record->pause_ns, record->heap_before, record->heap_after);
+		for (int type = 0; type < OBJ_TYPE_COUNT; type++) {
+			fprintf(out, "%s\"%s\":%d", type == 0 ? "" : ",",
+				obj_type_name(type), record->objects[type]);
+		}
+		fprintf(out, "}}");
+	}
+	fprintf(out, "]}\n");
+}
+
+void gc_stats_report(GcStats* stats, GcReport report, FILE* out) {
+	switch (report) {
+	case GC_REPORT_NONE: break;
+	case GC_REPORT_SUMMARY: report_summary(stats, out); break;
+	case GC_REPORT_JSON: report_json(stats, out); break;
+	}
+}
@@ -0,0 +1,63 @@
+#ifndef clox_gc_stats_h
+#define clox_gc_stats_h
+
+#include <stdio.h>
+#include "common.h"
+#include "object.h"
+
+#define GC_DEFAULT_GROW_FACTOR 2
+#define GC_MAX_GROW_FACTOR 1e6
+#define GC_DEFAULT_INITIAL_HEAP (1024 * 1024)
+#define GC_RECORDS 64 // Collections kept in detail, the most recent ones
+
+typedef enum {
+	GC_REPORT_NONE,
+	GC_REPORT_SUMMARY,
+	GC_REPORT_JSON,
+} GcReport;
+
+// Runtime tuning. Filled from environment variables and command line flags.
+typedef struct {
+	double grow_factor; // next_gc = live bytes * grow_factor
+	size_t initial_heap; // First collection threshold in bytes
+	bool compact; // Compact automatically when the heap gets fragmented.
+	GcReport report; // What to print to stderr at exit.
+} GcConfig;
+
+typedef struct {
+	uint64_t pause_ns;
+	size_t heap_before;
+	size_t heap_after;
+	int objects[OBJ_TYPE_COUNT]; // Survivors by type
+} GcRecord;
+
+typedef struct {
+	int collections;
+	size_t allocations; // Number of blocks requested to the allocator.
+	size_t bytes_requested;
+	size_t peak_heap;
+	size_t total_freed;
+	uint64_t total_pause_ns;
+	uint64_t max_pause_ns;
+
+	// Ring of the last GC_RECORDS collections. The totals above cover all
+	// of them.
+	int records_count;
+	int records_next;
+	GcRecord records[GC_RECORDS];
+} GcStats;
+
+void init_gc_config(GcConfig* config);
+void gc_config_from_env(GcConfig* config);
+bool gc_config_set(GcConfig* config, const char* option);
+bool parse_size(const char* text, size_t* size);
+
+void init_gc_stats(GcStats* stats);
+void free_gc_stats(GcStats* stats);
+void gc_stats_record(GcStats* stats, GcRecord* record);
+GcRecord* gc_stats_last(GcStats* stats);
+void gc_stats_report(GcStats* stats, GcReport report, FILE* out);
+
+const char* obj_type_name(ObjType type);
+
+#endif
@@ -0,0 +1,100 @@
+#include <string.h>
+#include "hash.h"
+
+// wyhash: reads 8 bytes at a time and mixes them with 64x64->128 bit
+// multiplications. The result is folded to 32 bits, and its low bits are
+// as well mixed as the high ones, which power-of-two masking relies on.
+
+static const uint64_t secret[4] = {
+    0xa0761d6478bd642full,
+    0xe7037ed1a0b428dbull,
+    0x8ebc6af09c88c6e3ull,
+    0x589965cc75374cc3ull,
+};
+
+static inline void multiply(uint64_t* a, uint64_t* b) {
+#ifdef __SIZEOF_INT128__
+    __uint128_t result = (__uint128_t)*a * *b;
+    *a = (uint64_t)result;
+    *b = (uint64_t)(result >> 64);
+#else
+    uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32);
+    uint64_t carry = t < rl;
+    uint64_t lo = t + (rm1 << 32);
+    carry += lo < t;
+    *a = lo;
+    *b = rh + (rm0 >> 32) + (rm1 >> 32) + carry;
+#endif
+}
+
+static inline uint64_t mix(uint64_t a, uint64_t b) {
+    multiply(&a, &b);
+    return a ^ b;
+}
+
+// Unaligned little endian reads.
+static inline uint64_t read64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// Up to 3 bytes: first, middle and last.
+static inline uint64_t read_small(const uint8_t* p, size_t length) {
+    return ((uint64_t)p[0] << 16) | ((uint64_t)p[length >> 1] << 8) | p[length - 1];
+}
+
+uint32_t hash_string(const char* chars, int length) {
+    const uint8_t* p = (const uint8_t*)chars;
+    size_t remaining = (size_t)length;
+    uint64_t seed = mix(secret[0], secret[1]);
+    uint64_t a, b;
+
+    if(remaining <= 16) {
+        if(remaining >= 4) {
+            size_t middle = (remaining >> 3) << 2;
+            a = (read32(p) << 32) | read32(p + middle);
+            b = (read32(p + remaining - 4) << 32) | read32(p + remaining - 4 - middle);
+        } else if(remaining > 0) {
+            a = read_small(p, remaining);
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        if(remaining > 48) {
+            // Three independent lanes keep the multipliers busy.
+            uint64_t lane1 = seed, lane2 = seed;
+            do {
+                seed = mix(read64(p) ^ secret[1], read64(p + 8) ^ seed);
+                lane1 = mix(read64(p + 16) ^ secret[2], read64(p + 24) ^ lane1);
+                lane2 = mix(read64(p + 32) ^ secret[3], read64(p + 40) ^ lane2);
+                p += 48;
+                remaining -= 48;
+            } while(remaining > 48);
+            seed ^= lane1 ^ lane2;
+        }
+        while(remaining > 16) {
+            seed = mix(read64(p) ^ secret[1], read64(p + 8) ^ seed);
+            p += 16;
+            remaining -= 16;
+        }
+        // The last 16 bytes, overlapping what was already mixed.
+        a = read64(p + remaining - 16);
+        b = read64(p + remaining - 8);
+    }
+
+    a ^= secret[1];
+    b ^= seed;
+    multiply(&a, &b);
+    uint64_t hash = mix(a ^ secret[0] ^ (uint64_t)length, b ^ secret[1]);
+    return (uint32_t)(hash ^ (hash >> 32));
+}
@@ -0,0 +1,8 @@
+#ifndef clox_hash_h
+#define clox_hash_h
+
+#include "common.h"
+
+uint32_t hash_string(const char* chars, int length);
+
+#endif
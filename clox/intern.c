@@ -0,0 +1,158 @@
+#include <string.h>
+#include "intern.h"
+#include "memory.h"
+#include "object.h"
+
+#define INTERN_MAX_LOAD 0.75
+#define INTERN_MIN_CAPACITY 8
+
+// Hashes 0 and 1 mark free slots, so string hashes below 2 are stored
+// shifted. Both still land in the same probe sequence.
+#define SLOT_EMPTY 0
+#define SLOT_TOMBSTONE 1
+#define SLOT_HASH(hash) ((hash) < 2 ? (hash) + 2 : (hash))
+
+static void resize(VM* vm, InternSet* set, int capacity);
+
+// Smallest capacity that holds count strings at half the maximum load.
+static int fit_capacity(int count) {
+    int capacity = INTERN_MIN_CAPACITY;
+    while(count > capacity * INTERN_MAX_LOAD / 2) capacity *= 2;
+    return capacity;
+}
+
+void init_intern_set(InternSet* set) {
+    set->count = 0;
+    set->tombstones = 0;
+    set->capacity = 0;
+    set->hashes = NULL;
+    set->strings = NULL;
+}
+
+void free_intern_set(VM* vm, InternSet* set) {
+    FREE_ARRAY(vm, uint32_t, set->hashes, set->capacity);
+    FREE_ARRAY(vm, ObjString*, set->strings, set->capacity);
+    init_intern_set(set);
+}
+
+ObjString* intern_set_find(InternSet* set, const char* chars, int length, uint32_t hash) {
+    if(set->count == 0) return NULL;
+
+    uint32_t mask = set->capacity - 1;
+    uint32_t slot_hash = SLOT_HASH(hash);
+    for(uint32_t index = hash & mask; ; index = (index + 1) & mask) {
+        uint32_t current = set->hashes[index];
+        if(current == SLOT_EMPTY) return NULL;
+        if(current == slot_hash) {
+            ObjString* string = set->strings[index];
+            if(string->length == length && memcmp(string->chars, chars, length) == 0) {
+                return string;
+            }
+        }
+    }
+}
+
+// The string must not be in the set already.
+void intern_set_add(VM* vm, InternSet* set, ObjString* string) {
+    if(set->count + set->tombstones + 1 > set->capacity * INTERN_MAX_LOAD) {
+        // When tombstones take most of the used slots, rehashing at a
+        // fitting size is enough to make room.
+        int capacity = set->tombstones >= set->count
+            ? fit_capacity(set->count + 1)
+            : GROW_CAPACITY(set->capacity);
+        resize(vm, set, capacity);
+    }
+
+    uint32_t mask = set->capacity - 1;
+    uint32_t index = string->hash & mask;
+    while(set->hashes[index] > SLOT_TOMBSTONE) {
+        index = (index + 1) & mask;
+    }
+    if(set->hashes[index] == SLOT_TOMBSTONE) set->tombstones--;
+    set->hashes[index] = SLOT_HASH(string->hash);
+    set->strings[index] = string;
+    set->count++;
+}
+
+// Called by the collector for every dead string, so clearing the weak
+// references costs as much as the strings that died instead of a full scan.
+void intern_set_remove(InternSet* set, ObjString* string) {
+    if(set->count == 0) return;
+
+    uint32_t mask = set->capacity - 1;
+    uint32_t slot_hash = SLOT_HASH(string->hash);
+    for(uint32_t index = string->hash & mask; ; index = (index + 1) & mask) {
+        uint32_t current = set->hashes[index];
+        if(current == SLOT_EMPTY) return;
+        if(current == slot_hash && set->strings[index] == string) {
+            set->hashes[index] = SLOT_TOMBSTONE;
+            set->strings[index] = NULL;
+            set->count--;
+            set->tombstones++;
+            return;
+        }
+    }
+}
+
+// Called after the collector removed the dead strings: shrinks the set
+// when most of it died, or clears the tombstones when they dominate.
+void intern_set_shrink(VM* vm, InternSet* set) {
+    if(set->capacity > INTERN_MIN_CAPACITY && set->count < set->capacity / 8) {
+        resize(vm, set, fit_capacity(set->count));
+    } else if(set->tombstones > set->count && set->tombstones > set->capacity / 4) {
+        resize(vm, set, set->capacity);
+    }
+}
+
+static void resize(VM* vm, InternSet* set, int capacity) {
+    // Allocate before touching the set: a collection here may still
+    // remove dead strings from the current arrays.
+    uint32_t* hashes = ALLOCATE(vm, uint32_t, capacity);
+    ObjString** strings = ALLOCATE(vm, ObjString*, capacity);
+    memset(hashes, 0, sizeof(uint32_t) * capacity);
+
+    uint32_t mask = capacity - 1;
+    for(int i = 0; i < set->capacity; i++) {
+        if(set->hashes[i] <= SLOT_TOMBSTONE) continue;
+        ObjString* string = set->strings[i];
+        uint32_t index = string->hash & mask;
+        while(hashes[index] != SLOT_EMPTY) {
+            index = (index + 1) & mask;
+        }
+        hashes[index] = set->hashes[i];
+        strings[index] = string;
+    }
+
+    FREE_ARRAY(vm, uint32_t, set->hashes, set->capacity);
+    FREE_ARRAY(vm, ObjString*, set->strings, set->capacity);
+    set->hashes = hashes;
+    set->strings = strings;
+    set->capacity = capacity;
+    set->tombstones = 0;
+}
+
+void relocate_intern_set(InternSet* set) {
+    for(int i = 0; i < set->capacity; i++) {
+        if(set->hashes[i] <= SLOT_TOMBSTONE) continue;
+        relocate_object((Obj**)&set->strings[i]);
+    }
+}
+
+void intern_set_stats(InternSet* set, TableStats* stats) {
+    memset(stats, 0, sizeof(TableStats));
+    stats->count = set->count;
+    stats->tombstones = set->tombstones;
+    stats->capacity = set->capacity;
+    if(set->capacity == 0) return;
+
+    stats->load_factor = (double)(set->count + set->tombstones) / set->capacity;
+    uint32_t mask = set->capacity - 1;
+    long total = 0;
+    for(uint32_t i = 0; i < (uint32_t)set->capacity; i++) {
+        if(set->hashes[i] <= SLOT_TOMBSTONE) continue;
+        int probes = ((i - set->strings[i]->hash) & mask) + 1;
+        table_stats_add_probe(stats, probes);
+        total += probes;
+    }
+    if(set->count > 0) stats->mean_probe = (double)total / set->count;
+}
@@ -0,0 +1,28 @@
+#ifndef clox_intern_h
+#define clox_intern_h
+
+#include "common.h"
+#include "values.h"
+#include "table.h"
+
+// Set of every live string, used for interning. Only pointers are stored.
+// Probing walks the cached hashes (16 per cache line) and only touches a
+// string when the full hash matches.
+typedef struct {
+    int count;
+    int tombstones;
+    int capacity;
+    uint32_t* hashes; // Slot state and cached hash. See intern.c
+    ObjString** strings;
+} InternSet;
+
+void init_intern_set(InternSet* set);
+void free_intern_set(VM* vm, InternSet* set);
+ObjString* intern_set_find(InternSet* set, const char* chars, int length, uint32_t hash);
+void intern_set_add(VM* vm, InternSet* set, ObjString* string);
+void intern_set_remove(InternSet* set, ObjString* string);
+void intern_set_shrink(VM* vm, InternSet* set);
+void relocate_intern_set(InternSet* set);
+void intern_set_stats(InternSet* set, TableStats* stats);
+
+#endif
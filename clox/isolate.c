@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "isolate.h"
+#include "vm.h"
+
+static void* allocate_or_exit(size_t size) {
+	void* memory = malloc(size);
+	if (memory == NULL) {
+		fprintf(stderr, "Not enough memory to start an isolate\n");
+		exit(1);
+	}
+	return memory;
+}
+
+Channel* create_channel(int capacity) {
+	Channel* channel = allocate_or_exit(sizeof(Channel));
+	pthread_mutex_init(&channel->lock, NULL);
+	pthread_cond_init(&channel->not_empty, NULL);
+	pthread_cond_init(&channel->not_full, NULL);
+	channel->slots = allocate_or_exit(sizeof(Message) * capacity);
+	channel->capacity = capacity;
+	channel->head = 0;
+	channel->count = 0;
+	channel->closed = false;
+	atomic_init(&channel->references, 1);
+	return channel;
+}
+
+void retain_channel(Channel* channel) {
+	atomic_fetch_add(&channel->references, 1);
+}
+
+void release_channel(Channel* channel) {
+	if (atomic_fetch_sub(&channel->references, 1) != 1) return;
+	for (int i = 0; i < channel->count; i++) {
+		free_message(&channel->slots[(channel->head + i) % channel->capacity]);
+	}
+	free(channel->slots);
+	pthread_mutex_destroy(&channel->lock);
+	pthread_cond_destroy(&channel->not_empty);
+	pthread_cond_destroy(&channel->not_full);
+	free(channel);
+}
+
+bool channel_send(Channel* channel, Message* message) {
+	pthread_mutex_lock(&channel->lock);
+	while (channel->count == channel->capacity && !channel->closed) {
+		pthread_cond_wait(&channel->not_full, &channel->lock);
+	}
+	bool sent = !channel->closed;
+	if (sent) {
+		channel->slots[(channel->head + channel->count) % channel->capacity] = *message;
+		channel->count++;
+		init_message(message);
+		pthread_cond_signal(&channel->not_empty);
+	}
+	pthread_mutex_unlock(&channel->lock);
+	return sent;
+}
+
+bool channel_receive(Channel* channel, Message* message) {
+	pthread_mutex_lock(&channel->lock);
+	while (channel->count == 0 && !channel->closed) {
+		pthread_cond_wait(&channel->not_empty, &channel->lock);
+	}
+	bool received = channel->count > 0;
+	if (received) {
+		*message = channel->slots[channel->head];
+		channel->head = (channel->head + 1) % channel->capacity;
+		channel->count--;
+		pthread_cond_signal(&channel->not_full);
+	}
+	pthread_mutex_unlock(&channel->lock);
+	return received;
+}
+
+// Wakes every blocked sender and receiver. Messages already queued can
+// still be received.
+void channel_close(Channel* channel) {
+	pthread_mutex_lock(&channel->lock);
+	channel->closed = true;
+	pthread_cond_broadcast(&channel->not_empty);
+	pthread_cond_broadcast(&channel->not_full);
+	pthread_mutex_unlock(&channel->lock);
+}
+
+static void free_isolate(Isolate* isolate) {
+	free_message(&isolate->input);
+	free_message(&isolate->result);
+	free(isolate);
+}
+
+static void drop_isolate(Isolate* isolate) {
+	if (atomic_fetch_sub(&isolate->references, 1) == 1) free_isolate(isolate);
+}
+
+// Rebuilds the globals and the function in a new VM and calls it. The
+// result goes back through isolate->result.
+static void* run_isolate(void* argument) {
+	Isolate* isolate = argument;
+	VM* vm = allocate_or_exit(sizeof(VM));
+	init_vm_shared(vm, isolate->input.codes, isolate->input.code_count);
+	configure_gc(vm, &isolate->gc_config);
+	configure_output(vm, isolate->output_size);
+	configure_limits(vm, &isolate->limits);
+	configure_jit(vm, isolate->jit_threshold);
+	configure_traces(vm, isolate->trace_threshold);
+
+	ObjList* input = read_message(vm, &isolate->input);
+	stack_push(vm, OBJ_VALUE(input));
+	free_message(&isolate->input);
+	Value* values = input->items.values;
+	for (int i = isolate->arg_count + 1; i < input->items.size; i += 2) {
+		table_set(vm, &vm->globals, AS_STRING(values[i + 1]), values[i]);
+	}
+	for (int i = 0; i <= isolate->arg_count; i++) {
+		stack_push(vm, input->items.values[i]);
+	}
+
+	if (interpret_call(vm, isolate->arg_count) != INTERPRET_OK) {
+		isolate->error = "Spawned function failed.";
+	} else {
+		isolate->error = write_message(vm, &isolate->result, vm->stack_top[-1]);
+		seal_message(&isolate->result);
+	}
+	free_vm(vm);
+	free(vm);
+	drop_isolate(isolate);
+	return NULL;
+}
+
+Isolate* start_isolate(Message* input, int arg_count, VM* parent) {
+	Isolate* isolate = allocate_or_exit(sizeof(Isolate));
+	isolate->input = *input;
+	init_message(input);
+	isolate->arg_count = arg_count;
+	init_message(&isolate->result);
+	isolate->error = NULL;
+	isolate->gc_config = parent->gc_config;
+	isolate->output_size = parent->output.capacity;
+	isolate->limits = parent->limits;
+	isolate->jit_threshold = parent->jit_threshold;
+	isolate->trace_threshold = parent->trace_threshold;
+	atomic_init(&isolate->references, 2); // The thread and the ObjIsolate
+	if (pthread_create(&isolate->thread, NULL, run_isolate, isolate) != 0) {
+		free_isolate(isolate);
+		return NULL;
+	}
+	return isolate;
+}
+
+void join_isolate(Isolate* isolate) {
+	pthread_join(isolate->thread, NULL);
+}
+
+void release_isolate(Isolate* isolate, bool joined) {
+	if (!joined) pthread_detach(isolate->thread);
+	drop_isolate(isolate);
+}
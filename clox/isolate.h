@@ -0,0 +1,60 @@
+#ifndef clox_isolate_h
+#define clox_isolate_h
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include "common.h"
+#include "message.h"
+#include "gc_stats.h"
+#include "vm.h"
+
+// Bounded queue of messages shared by any number of VMs. Every ObjChannel
+// and every message that carries the channel holds a reference.
+typedef struct sChannel {
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	Message* slots; // Ring buffer
+	int capacity;
+	int head;
+	int count;
+	bool closed;
+	atomic_int references;
+} Channel;
+
+Channel* create_channel(int capacity);
+void retain_channel(Channel* channel);
+void release_channel(Channel* channel);
+// Blocks while the channel is full. Takes the message, unless the
+// channel is closed and false is returned.
+bool channel_send(Channel* channel, Message* message);
+// Blocks while the channel is empty. False once it is closed and drained.
+bool channel_receive(Channel* channel, Message* message);
+void channel_close(Channel* channel);
+
+// A function running in a VM of its own, on its own thread. Shared by the
+// thread and the ObjIsolate that started it; the last one frees it.
+typedef struct sIsolate {
+	pthread_t thread;
+	Message input; // Function, arguments, then (value, name) global pairs
+	int arg_count;
+	Message result;
+	const char* error; // Set when the function failed
+	GcConfig gc_config;
+	size_t output_size;
+	Limits limits;
+	uint32_t jit_threshold;
+	uint16_t trace_threshold;
+	atomic_int references;
+} Isolate;
+
+// Takes the input message. Returns NULL when no thread can be started.
+// The new VM takes the collector settings, print buffer size, limits
+// and JIT and trace thresholds of its parent.
+Isolate* start_isolate(Message* input, int arg_count, VM* parent);
+// Waits for the function to finish. Call once.
+void join_isolate(Isolate* isolate);
+// Detaches the thread if it was never joined.
+void release_isolate(Isolate* isolate, bool joined);
+
+#endif
@@ -0,0 +1,603 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/mman.h>
+#include "jit.h"
+
+#ifdef CLOX_JIT
+
+#include "vm.h"
+#include "chunk.h"
+#include "x64.h"
+#include "trace.h"
+
+// Kept across helper calls, set up by the entry code.
+#define VM_REG RBX
+#define SLOTS_REG R12 // frame->slots, so stack heights are fixed offsets
+#define FRAME_REG R13
+
+#define SLOT(height) ((int32_t)((height) * sizeof(Value)))
+#define PAYLOAD(height) (SLOT(height) + (int32_t)offsetof(Value, as))
+
+typedef int (*JitEntry)(VM* vm, CallFrame* frame, void* address);
+
+typedef enum {
+	STUB_SLOW_OP, // jit_slow_op(), then back to 'resume'
+	STUB_LOOP, // jit_loop_check(), then on to the loop target
+} StubKind;
+
+// Out of line slow path, emitted after the body.
+typedef struct {
+	StubKind kind;
+	int offset; // Of the instruction
+	int height; // Before it
+	int resume; // Code offset, or bytecode target for loops
+	int patches[3]; // rel32 of the jumps that lead here, -1 for none
+} Stub;
+
+// rel32 to point at a bytecode offset once its code is placed.
+typedef struct {
+	int at;
+	int target;
+} Jump;
+
+typedef struct {
+	ObjFunction* function;
+	Chunk* chunk;
+	int* heights; // Stack height before each instruction, -1 when unreachable
+	int32_t* entries;
+	CodeBuffer code;
+	int epilogue; // Code offsets of the exits shared by the function
+	int error_exit;
+	Jump* jumps;
+	int jump_count;
+	int jump_capacity;
+	Stub* stubs;
+	int stub_count;
+	int stub_capacity;
+} Compiler;
+
+static void* grow(void* array, int* capacity, size_t size) {
+	*capacity = *capacity < 16 ? 16 : *capacity * 2;
+	array = realloc(array, size * *capacity);
+	if (array == NULL) {
+		fprintf(stderr, "Not enough memory to compile\n");
+		exit(1);
+	}
+	return array;
+}
+
+// A Value as two quadwords: stores of the type and the payload made just
+// before are forwarded to these loads, not to a 16 byte one.
+static void copy_value(CodeBuffer* code, int to_base, int32_t to, int from_base, int32_t from) {
+	x64_load(code, RCX, from_base, from);
+	x64_load(code, RDX, from_base, from + 8);
+	x64_store(code, to_base, to, RCX);
+	x64_store(code, to_base, to + 8, RDX);
+}
+
+// The type is stored as a quadword too, padding included.
+static void store_type(CodeBuffer* code, int height, ValueType type) {
+	x64_mem(code, 0, true, 0xc7, 0, SLOTS_REG, SLOT(height));
+	x64_int32(code, type);
+}
+
+static void store_payload_imm(CodeBuffer* code, int height, int32_t value) {
+	x64_mem(code, 0, true, 0xc7, 0, SLOTS_REG, PAYLOAD(height));
+	x64_int32(code, value);
+}
+
+static void compare_type(CodeBuffer* code, int height, ValueType type) {
+	x64_mem(code, 0, false, 0x83, 7, SLOTS_REG, SLOT(height));
+	x64_byte(code, type);
+}
+
+static void call_helper(CodeBuffer* code, void* function) {
+	x64_byte(code, 0x48); // mov rdi, rbx
+	x64_byte(code, 0x89);
+	x64_byte(code, 0xdf);
+	x64_call(code, function);
+}
+
+// bool result in al, the result Value goes to 'height'.
+static void store_bool_al(CodeBuffer* code, int height) {
+	x64_byte(code, 0x0f); // movzx eax, al
+	x64_byte(code, 0xb6);
+	x64_byte(code, 0xc0);
+	store_type(code, height, VAL_BOOL);
+	x64_store(code, SLOTS_REG, PAYLOAD(height), RAX);
+}
+
+static void add_jump(Compiler* compiler, int at, int target) {
+	if (compiler->jump_count == compiler->jump_capacity) {
+		compiler->jumps = grow(compiler->jumps, &compiler->jump_capacity, sizeof(Jump));
+	}
+	compiler->jumps[compiler->jump_count++] = (Jump){ at, target };
+}
+
+static Stub* add_stub(Compiler* compiler, StubKind kind, int offset, int height) {
+	if (compiler->stub_count == compiler->stub_capacity) {
+		compiler->stubs = grow(compiler->stubs, &compiler->stub_capacity, sizeof(Stub));
+	}
+	Stub* stub = &compiler->stubs[compiler->stub_count++];
+	*stub = (Stub){ kind, offset, height, -1, { -1, -1, -1 } };
+	return stub;
+}
+
+// Leaves the pc and the stack where run() expects them.
+static void sync_frame(Compiler* compiler, int offset, int height) {
+	CodeBuffer* code = &compiler->code;
+	x64_mov_imm64(code, RAX, (uint64_t)(uintptr_t)(compiler->chunk->code + offset));
+	x64_store(code, FRAME_REG, offsetof(CallFrame, pc), RAX);
+	x64_lea(code, RAX, SLOTS_REG, SLOT(height));
+	x64_store(code, VM_REG, offsetof(VM, stack_top), RAX);
+}
+
+static void slow_op(Compiler* compiler, int offset, int height) {
+	CodeBuffer* code = &compiler->code;
+	sync_frame(compiler, offset, height);
+	call_helper(code, jit_slow_op);
+	x64_byte(code, 0x84); // test al, al
+	x64_byte(code, 0xc0);
+	x64_patch_rel32(code, x64_jump_if(code, CC_E), compiler->error_exit);
+}
+
+static void exit_to_interpreter(Compiler* compiler, int offset, int height) {
+	CodeBuffer* code = &compiler->code;
+	sync_frame(compiler, offset, height);
+	x64_byte(code, 0xb8); // mov eax, 1
+	x64_int32(code, 1);
+	x64_jump_to(code, compiler->epilogue);
+}
+
+// Jumps to 'falsy' patches for nil and false, falls through otherwise.
+static void test_falsy(CodeBuffer* code, int height, int falsy[2]) {
+	compare_type(code, height, VAL_NIL);
+	falsy[0] = x64_jump_if(code, CC_E);
+	compare_type(code, height, VAL_BOOL);
+	int truthy = x64_jump_if(code, CC_NE);
+	x64_mem(code, 0, false, 0x80, 7, SLOTS_REG, PAYLOAD(height)); // cmp byte, 0
+	x64_byte(code, 0);
+	falsy[1] = x64_jump_if(code, CC_E);
+	x64_patch_rel32(code, truthy, code->size);
+}
+
+// Both operands numbers, or on to the slow path. Returns the stub.
+static Stub* check_numbers(Compiler* compiler, int offset, int height, int operands) {
+	CodeBuffer* code = &compiler->code;
+	Stub* stub = add_stub(compiler, STUB_SLOW_OP, offset, height);
+	for (int i = 0; i < operands; i++) {
+		compare_type(code, height - 1 - i, VAL_NUMBER);
+		stub->patches[i] = x64_jump_if(code, CC_NE);
+	}
+	return stub;
+}
+
+static void upvalue_location(CodeBuffer* code, int index) {
+	x64_load(code, RAX, FRAME_REG, offsetof(CallFrame, closure));
+	x64_load(code, RAX, RAX, offsetof(ObjClosure, upvalues));
+	x64_load(code, RAX, RAX, index * sizeof(ObjUpvalue*));
+	x64_load(code, RAX, RAX, offsetof(ObjUpvalue, location));
+}
+
+static int instruction_length(Chunk* chunk, int offset) {
+	switch (chunk->code[offset]) {
+	case OP_CONSTANT:
+	case OP_DEFINE_GLOBAL:
+	case OP_GET_GLOBAL:
+	case OP_SET_GLOBAL:
+	case OP_GET_LOCAL:
+	case OP_SET_LOCAL:
+	case OP_GET_UPVALUE:
+	case OP_SET_UPVALUE:
+	case OP_CALL:
+	case OP_CLASS:
+	case OP_GET_PROPERTY:
+	case OP_SET_PROPERTY:
+	case OP_METHOD:
+	case OP_GET_SUPER:
+	case OP_BUILD_LIST:
+	case OP_BUILD_MAP:
+		return 2;
+	case OP_JUMP:
+	case OP_JUMP_IF_FALSE:
+	case OP_LOOP:
+	case OP_INVOKE:
+	case OP_SUPER_INVOKE:
+		return 3;
+	case OP_CLOSURE: {
+		ObjFunction* function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+		return 2 + function->upvalue_count * 2;
+	}
+	default:
+		return 1;
+	}
+}
+
+// Values pushed minus values popped.
+static int stack_effect(Chunk* chunk, int offset) {
+	uint8_t operand = offset + 1 < chunk->size ? chunk->code[offset + 1] : 0;
+	switch (chunk->code[offset]) {
+	case OP_CONSTANT:
+	case OP_NIL:
+	case OP_TRUE:
+	case OP_FALSE:
+	case OP_GET_LOCAL:
+	case OP_GET_GLOBAL:
+	case OP_GET_UPVALUE:
+	case OP_CLOSURE:
+	case OP_CLASS:
+		return 1;
+	case OP_CALL: return -operand;
+	case OP_INVOKE: return -chunk->code[offset + 2];
+	case OP_SUPER_INVOKE: return -chunk->code[offset + 2] - 1;
+	case OP_BUILD_LIST: return 1 - operand;
+	case OP_BUILD_MAP: return 1 - operand * 2;
+	case OP_SET_INDEX: return -2;
+	case OP_NOT:
+	case OP_NEGATE:
+	case OP_SET_LOCAL:
+	case OP_SET_GLOBAL:
+	case OP_SET_UPVALUE:
+	case OP_GET_PROPERTY:
+	case OP_JUMP:
+	case OP_JUMP_IF_FALSE:
+	case OP_LOOP:
+	case OP_RETURN:
+		return 0;
+	default: // Binary operators, pops, definitions
+		return -1;
+	}
+}
+
+static bool reach(int* heights, int* work, int* work_count, int size, int offset, int height) {
+	if (offset < 0 || offset >= size || height < 0) return false;
+	if (heights[offset] == -1) {
+		heights[offset] = height;
+		work[(*work_count)++] = offset;
+		return true;
+	}
+	return heights[offset] == height;
+}
+
+// Follows every path from the start. False on instructions the compiler
+// doesn't handle, or when paths meet with different stack heights.
+static bool measure_heights(Compiler* compiler) {
+	Chunk* chunk = compiler->chunk;
+	int* work = malloc(sizeof(int) * chunk->size);
+	if (work == NULL) {
+		fprintf(stderr, "Not enough memory to compile\n");
+		exit(1);
+	}
+	int work_count = 0;
+	for (int i = 0; i < chunk->size; i++) compiler->heights[i] = -1;
+	bool ok = reach(compiler->heights, work, &work_count, chunk->size, 0, compiler->function->arity + 1);
+
+	while (ok && work_count > 0) {
+		int offset = work[--work_count];
+		uint8_t op = chunk->code[offset];
+		if (op == OP_CLASS || op == OP_METHOD || op == OP_INHERIT || op == OP_GET_SUPER) {
+			ok = false;
+			break;
+		}
+		int length = instruction_length(chunk, offset);
+		if (offset + length > chunk->size) {
+			ok = false;
+			break;
+		}
+		int height = compiler->heights[offset] + stack_effect(chunk, offset);
+		int next = offset + length;
+		uint16_t distance = length == 3 ? (chunk->code[offset + 1] << 8) | chunk->code[offset + 2] : 0;
+		switch (op) {
+		case OP_RETURN: break;
+		case OP_JUMP:
+			ok = reach(compiler->heights, work, &work_count, chunk->size, next + distance, height);
+			break;
+		case OP_LOOP:
+			ok = reach(compiler->heights, work, &work_count, chunk->size, next - distance, height);
+			break;
+		case OP_JUMP_IF_FALSE:
+			ok = reach(compiler->heights, work, &work_count, chunk->size, next + distance, height);
+			// Fall through to the next instruction too.
+		default:
+			ok = ok && reach(compiler->heights, work, &work_count, chunk->size, next, height);
+			break;
+		}
+	}
+	free(work);
+	return ok;
+}
+
+static void compile_instruction(Compiler* compiler, int offset) {
+	CodeBuffer* code = &compiler->code;
+	Chunk* chunk = compiler->chunk;
+	int height = compiler->heights[offset];
+	uint8_t operand = offset + 1 < chunk->size ? chunk->code[offset + 1] : 0;
+	uint16_t distance = 0;
+	if (instruction_length(chunk, offset) == 3) {
+		distance = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+	}
+
+	switch (chunk->code[offset]) {
+	case OP_CONSTANT: {
+		Value* constant = &chunk->constants.values[operand];
+		if (IS_NUMBER(*constant)) {
+			store_type(code, height, VAL_NUMBER);
+			uint64_t bits;
+			memcpy(&bits, &constant->as.number, sizeof(bits));
+			x64_mov_imm64(code, RAX, bits);
+			x64_store(code, SLOTS_REG, PAYLOAD(height), RAX);
+		} else {
+			// The constants never move, what they point to may.
+			x64_mov_imm64(code, RAX, (uint64_t)(uintptr_t)constant);
+			copy_value(code, SLOTS_REG, SLOT(height), RAX, 0);
+		}
+		break;
+	}
+	case OP_NIL:
+		store_type(code, height, VAL_NIL);
+		store_payload_imm(code, height, 0);
+		break;
+	case OP_TRUE:
+	case OP_FALSE:
+		store_type(code, height, VAL_BOOL);
+		store_payload_imm(code, height, chunk->code[offset] == OP_TRUE);
+		break;
+	case OP_POP: break;
+	case OP_GET_LOCAL:
+		copy_value(code, SLOTS_REG, SLOT(height), SLOTS_REG, SLOT(operand));
+		break;
+	case OP_SET_LOCAL:
+		copy_value(code, SLOTS_REG, SLOT(operand), SLOTS_REG, SLOT(height - 1));
+		break;
+	case OP_GET_UPVALUE:
+		upvalue_location(code, operand);
+		copy_value(code, SLOTS_REG, SLOT(height), RAX, 0);
+		break;
+	case OP_SET_UPVALUE:
+		upvalue_location(code, operand);
+		copy_value(code, RAX, 0, SLOTS_REG, SLOT(height - 1));
+		break;
+	case OP_NOT: {
+		int falsy[2];
+		test_falsy(code, height - 1, falsy);
+		x64_byte(code, 0x31); // xor eax, eax
+		x64_byte(code, 0xc0);
+		int done = x64_jump(code);
+		x64_patch_rel32(code, falsy[0], code->size);
+		x64_patch_rel32(code, falsy[1], code->size);
+		x64_byte(code, 0xb8); // mov eax, 1
+		x64_int32(code, 1);
+		x64_patch_rel32(code, done, code->size);
+		store_bool_al(code, height - 1);
+		break;
+	}
+	case OP_NEGATE: {
+		Stub* stub = check_numbers(compiler, offset, height, 1);
+		x64_mov_imm64(code, RCX, 0x8000000000000000ull);
+		x64_mem(code, 0, true, 0x31, RCX, SLOTS_REG, PAYLOAD(height - 1)); // xor sign bit
+		stub->resume = code->size;
+		break;
+	}
+	case OP_ADD:
+	case OP_SUBSTRACT:
+	case OP_MULTIPLY:
+	case OP_DIVIDE: {
+		static const uint16_t opcodes[] = {
+			[OP_ADD] = 0x0f58, [OP_SUBSTRACT] = 0x0f5c, [OP_MULTIPLY] = 0x0f59, [OP_DIVIDE] = 0x0f5e,
+		};
+		Stub* stub = check_numbers(compiler, offset, height, 2);
+		x64_mem(code, 0xf2, false, 0x0f10, XMM0, SLOTS_REG, PAYLOAD(height - 2)); // movsd
+		x64_mem(code, 0xf2, false, opcodes[chunk->code[offset]], XMM0, SLOTS_REG, PAYLOAD(height - 1));
+		x64_mem(code, 0xf2, false, 0x0f11, XMM0, SLOTS_REG, PAYLOAD(height - 2));
+		stub->resume = code->size;
+		break;
+	}
+	case OP_MODULE: {
+		Stub* stub = check_numbers(compiler, offset, height, 2);
+		x64_mem(code, 0xf2, false, 0x0f10, XMM0, SLOTS_REG, PAYLOAD(height - 2));
+		x64_mem(code, 0xf2, false, 0x0f10, XMM1, SLOTS_REG, PAYLOAD(height - 1));
+		x64_call(code, fmod);
+		x64_mem(code, 0xf2, false, 0x0f11, XMM0, SLOTS_REG, PAYLOAD(height - 2));
+		stub->resume = code->size;
+		break;
+	}
+	case OP_LESS:
+	case OP_GREATER:
+	case OP_EQUAL: {
+		uint8_t op = chunk->code[offset];
+		Stub* stub = check_numbers(compiler, offset, height, 2);
+		// a < b is b above a. Unordered (NaN) sets the carry, so is false.
+		int left = op == OP_LESS ? height - 1 : height - 2;
+		int right = op == OP_LESS ? height - 2 : height - 1;
+		x64_mem(code, 0xf2, false, 0x0f10, XMM0, SLOTS_REG, PAYLOAD(left));
+		x64_mem(code, 0x66, false, 0x0f2e, XMM0, SLOTS_REG, PAYLOAD(right)); // ucomisd
+		if (op == OP_EQUAL) {
+			x64_setcc(code, CC_E);
+			x64_byte(code, 0x0f); // setnp cl
+			x64_byte(code, 0x90 | CC_NP);
+			x64_byte(code, 0xc1);
+			x64_byte(code, 0x20); // and al, cl
+			x64_byte(code, 0xc8);
+		} else {
+			x64_setcc(code, CC_A);
+		}
+		store_bool_al(code, height - 2);
+		stub->resume = code->size;
+		break;
+	}
+	case OP_JUMP:
+		add_jump(compiler, x64_jump(code), offset + 3 + distance);
+		break;
+	case OP_JUMP_IF_FALSE: {
+		int falsy[2];
+		test_falsy(code, height - 1, falsy);
+		add_jump(compiler, falsy[0], offset + 3 + distance);
+		add_jump(compiler, falsy[1], offset + 3 + distance);
+		break;
+	}
+	case OP_LOOP: {
+		// --vm->budget < 0 as in run()
+		x64_mem(code, 0, false, 0x83, 5, VM_REG, offsetof(VM, budget));
+		x64_byte(code, 1);
+		Stub* stub = add_stub(compiler, STUB_LOOP, offset, height);
+		stub->patches[0] = x64_jump_if(code, CC_S);
+		stub->resume = offset + 3 - distance;
+		add_jump(compiler, x64_jump(code), stub->resume);
+		break;
+	}
+	case OP_CALL:
+	case OP_INVOKE:
+	case OP_SUPER_INVOKE:
+	case OP_RETURN:
+		exit_to_interpreter(compiler, offset, height);
+		break;
+	default:
+		slow_op(compiler, offset, height);
+		break;
+	}
+}
+
+static void compile_stub(Compiler* compiler, Stub* stub) {
+	CodeBuffer* code = &compiler->code;
+	for (int i = 0; i < 3; i++) {
+		if (stub->patches[i] >= 0) x64_patch_rel32(code, stub->patches[i], code->size);
+	}
+	if (stub->kind == STUB_SLOW_OP) {
+		slow_op(compiler, stub->offset, stub->height);
+		x64_jump_to(code, stub->resume);
+		return;
+	}
+	// The pc is past the loop, where run() checks its limits.
+	sync_frame(compiler, stub->offset + 3, stub->height);
+	call_helper(code, jit_loop_check);
+	x64_byte(code, 0x84); // test al, al
+	x64_byte(code, 0xc0);
+	x64_patch_rel32(code, x64_jump_if(code, CC_E), compiler->error_exit);
+	x64_jump_to(code, compiler->entries[stub->resume]);
+}
+
+// int entry(VM* vm, CallFrame* frame, void* address) returns 1 when run()
+// takes over at the frame's pc and 0 after a runtime error.
+static void compile_entry(Compiler* compiler) {
+	CodeBuffer* code = &compiler->code;
+	static const uint8_t entry[] = {
+		0x53, // push rbx
+		0x41, 0x54, // push r12
+		0x41, 0x55, // push r13: the stack is 16 byte aligned for calls
+		0x48, 0x89, 0xfb, // mov rbx, rdi
+		0x49, 0x89, 0xf5, // mov r13, rsi
+	};
+	for (size_t i = 0; i < sizeof(entry); i++) x64_byte(code, entry[i]);
+	x64_load(code, SLOTS_REG, FRAME_REG, offsetof(CallFrame, slots));
+	x64_byte(code, 0xff); // jmp rdx
+	x64_byte(code, 0xe2);
+
+	static const uint8_t exits[] = {
+		0x41, 0x5d, // pop r13
+		0x41, 0x5c, // pop r12
+		0x5b, // pop rbx
+		0xc3, // ret
+		0x31, 0xc0, // xor eax, eax
+	};
+	compiler->epilogue = code->size;
+	compiler->error_exit = code->size + 6;
+	for (size_t i = 0; i < sizeof(exits); i++) x64_byte(code, exits[i]);
+	x64_jump_to(code, compiler->epilogue);
+}
+
+static bool compile_function(Compiler* compiler) {
+	if (!measure_heights(compiler)) return false;
+	CodeBuffer* code = &compiler->code;
+	compile_entry(compiler);
+
+	Chunk* chunk = compiler->chunk;
+	for (int offset = 0; offset < chunk->size; offset += instruction_length(chunk, offset)) {
+		if (compiler->heights[offset] < 0) continue; // Unreachable
+		compiler->entries[offset] = code->size;
+		compile_instruction(compiler, offset);
+	}
+	for (int i = 0; i < compiler->stub_count; i++) {
+		compile_stub(compiler, &compiler->stubs[i]);
+	}
+	for (int i = 0; i < compiler->jump_count; i++) {
+		Jump* jump = &compiler->jumps[i];
+		x64_patch_rel32(code, jump->at, compiler->entries[jump->target]);
+	}
+	return true;
+}
+
+static bool install(JitFunction* jit, Compiler* compiler) {
+	jit->code = x64_install(&compiler->code);
+	if (jit->code == NULL) return false;
+	jit->size = compiler->code.size;
+	jit->entries = compiler->entries;
+	compiler->entries = NULL;
+	return true;
+}
+
+void jit_compile(ObjFunction* function) {
+	JitFunction* jit = function->jit;
+	int cold = JIT_COLD;
+	if (!atomic_compare_exchange_strong(&jit->state, &cold, JIT_COMPILING)) return;
+
+	Chunk* chunk = &function->chunk;
+	Compiler compiler = { .function = function, .chunk = chunk };
+	compiler.heights = malloc(sizeof(int) * (chunk->size + 1));
+	compiler.entries = malloc(sizeof(int32_t) * (chunk->size + 1));
+	if (compiler.heights == NULL || compiler.entries == NULL) {
+		fprintf(stderr, "Not enough memory to compile\n");
+		exit(1);
+	}
+	for (int i = 0; i < chunk->size; i++) compiler.entries[i] = -1;
+
+	bool compiled = compile_function(&compiler) && install(jit, &compiler);
+	free(compiler.heights);
+	free(compiler.entries);
+	free(compiler.code.bytes);
+	free(compiler.jumps);
+	free(compiler.stubs);
+	atomic_store_explicit(&jit->state, compiled ? JIT_READY : JIT_FAILED, memory_order_release);
+}
+
+bool jit_run(VM* vm, CallFrame* frame) {
+	ObjFunction* function = frame->closure->function;
+	JitFunction* jit = function->jit;
+	int32_t entry = jit->entries[frame->pc - function->chunk.code];
+	if (entry < 0) return true; // Not an instruction the code can start at
+	return ((JitEntry)jit->code)(vm, frame, (uint8_t*)jit->code + entry) != 0;
+}
+
+void init_jit_function(JitFunction* jit) {
+	atomic_init(&jit->calls, 0);
+	atomic_init(&jit->state, JIT_COLD);
+	jit->code = NULL;
+	jit->size = 0;
+	jit->entries = NULL;
+	atomic_init(&jit->traces, NULL);
+}
+
+JitFunction* new_jit_function(void) {
+	JitFunction* jit = malloc(sizeof(JitFunction));
+	if (jit == NULL) {
+		fprintf(stderr, "Not enough memory for a function\n");
+		exit(1);
+	}
+	init_jit_function(jit);
+	return jit;
+}
+
+void free_jit_code(JitFunction* jit) {
+	if (jit->code != NULL) munmap(jit->code, jit->size);
+	free(jit->entries);
+	free_traces(atomic_load(&jit->traces));
+	init_jit_function(jit);
+}
+
+void free_jit_function(JitFunction* jit) {
+	free_jit_code(jit);
+	free(jit);
+}
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "common.h"
+#include "object.h"
+
+#define JIT_DEFAULT_THRESHOLD 100
+
+#ifdef CLOX_JIT
+
+#include <stdatomic.h>
+
+// Baseline template compiler for x86-64. A function called
+// 'vm->jit_threshold' times is translated instruction by instruction into
+// machine code. Stack heights are known at every instruction, so the
+// operand stack becomes fixed slots of the frame and values never leave
+// the VM stack, where the collector sees them. Numbers are handled inline;
+// other instructions call jit_slow_op(), which runs them as run() does.
+//
+// Compiled code hands the frame back to run() at calls and returns, and
+// run() enters it again on the next frame that has code. Functions that
+// declare classes are not compiled and always interpreted.
+//
+// The code only refers to the function's own bytecode and constants, so
+// VMs on any thread can run it. Kept outside ObjFunction: frozen
+// functions are read-only but still count their calls.
+typedef enum {
+	JIT_COLD,
+	JIT_COMPILING,
+	JIT_READY,
+	JIT_FAILED, // Unsupported instructions, never compiled
+} JitState;
+
+typedef struct sJitFunction {
+	atomic_uint calls; // Stops counting at the threshold
+	atomic_int state;
+	void* code; // mmap()ed, executable once READY
+	size_t size;
+	int32_t* entries; // Code offset of the instruction at each bytecode offset, -1 inside one
+	_Atomic(struct sTrace*) traces; // Of the function's loops, see trace.h
+} JitFunction;
+
+JitFunction* new_jit_function(void);
+void init_jit_function(JitFunction* jit);
+void free_jit_code(JitFunction* jit);
+void free_jit_function(JitFunction* jit);
+
+// Compiles the function, once, whichever thread gets here first.
+void jit_compile(ObjFunction* function);
+// Runs the frame's code from its pc until the next call or return, left
+// for run(). False after a runtime error.
+bool jit_run(VM* vm, CallFrame* frame);
+
+static inline void jit_count_call(ObjFunction* function, uint32_t threshold) {
+	// Racing threads may lose counts, that only delays compilation.
+	uint32_t calls = atomic_load_explicit(&function->jit->calls, memory_order_relaxed);
+	if (calls > threshold) return;
+	atomic_store_explicit(&function->jit->calls, calls + 1, memory_order_relaxed);
+	if (calls == threshold) jit_compile(function);
+}
+
+static inline bool jit_ready(ObjFunction* function) {
+	return atomic_load_explicit(&function->jit->state, memory_order_acquire) == JIT_READY;
+}
+
+// Defined in vm.c for compiled code. jit_slow_op() runs the instruction
+// at the frame's pc and jit_loop_check() is the slow path of OP_LOOP's
+// budget. Both return false after a runtime error.
+bool jit_slow_op(VM* vm);
+bool jit_loop_check(VM* vm);
+
+#endif
+
+#endif
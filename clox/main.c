@@ -1,73 +1,198 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include "vm.h"
+#include "shared.h"
+#include "prefork.h"
+#include "mapped_file.h"
 #include "sysexits.h"
+#include "jit.h"
+#include "trace.h"
 
-void repl();
-void run_file(const char* file_name);
-char* read_source_file(const char* file_anme);
+void repl(VM* vm);
+SharedCode* compile_file(const char* file_name);
+int run_file(VM* vm, SharedCode* code);
+
+void usage_error(const char* message, const char* arg);
+int parse_workers(const char* text);
+bool parse_count(const char* text, uint64_t* count);
 
 int main(int argc, char** argv) {
-	init_vm();
-	if (argc == 1) {
-		repl();
-	} else if (argc == 2) {
-		run_file(argv[1]);
+	GcConfig gc_config;
+	init_gc_config(&gc_config);
+	gc_config_from_env(&gc_config);
+
+	size_t output_size = OUTPUT_DEFAULT_SIZE;
+	const char* env_output = getenv("CLOX_OUTPUT_BUFFER");
+	if (env_output != NULL && !parse_size(env_output, &output_size)) {
+		fprintf(stderr, "Ignoring invalid CLOX_OUTPUT_BUFFER: %s\n", env_output);
+	}
+
+	uint64_t jit_threshold = JIT_DEFAULT_THRESHOLD;
+	const char* env_jit = getenv("CLOX_JIT_THRESHOLD");
+	if (env_jit != NULL && (!parse_count(env_jit, &jit_threshold) || jit_threshold > UINT32_MAX)) {
+		fprintf(stderr, "Ignoring invalid CLOX_JIT_THRESHOLD: %s\n", env_jit);
+		jit_threshold = JIT_DEFAULT_THRESHOLD;
+	}
+	uint64_t trace_threshold = TRACE_DEFAULT_THRESHOLD;
+	const char* env_trace = getenv("CLOX_TRACE_THRESHOLD");
+	if (env_trace != NULL && (!parse_count(env_trace, &trace_threshold) || trace_threshold > UINT16_MAX)) {
+		fprintf(stderr, "Ignoring invalid CLOX_TRACE_THRESHOLD: %s\n", env_trace);
+		trace_threshold = TRACE_DEFAULT_THRESHOLD;
+	}
+
+	const char* file_name = NULL;
+	int workers = 0;
+	const char* listen_path = NULL;
+	Limits limits = {0};
+	for (int i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "--gc-", 5) == 0) {
+			if (!gc_config_set(&gc_config, argv[i])) {
+				usage_error("Invalid GC option", argv[i]);
+			}
+		} else if (strncmp(argv[i], "--output-buffer=", 16) == 0) {
+			if (!parse_size(argv[i] + 16, &output_size)) {
+				usage_error("Invalid output buffer size", argv[i]);
+			}
+		} else if (strncmp(argv[i], "--limit-ticks=", 14) == 0) {
+			if (!parse_count(argv[i] + 14, &limits.ticks)) {
+				usage_error("Invalid tick limit", argv[i]);
+			}
+		} else if (strncmp(argv[i], "--limit-time=", 13) == 0) {
+			if (!parse_count(argv[i] + 13, &limits.time_ms)) {
+				usage_error("Invalid time limit", argv[i]);
+			}
+		} else if (strncmp(argv[i], "--limit-heap=", 13) == 0) {
+			if (!parse_size(argv[i] + 13, &limits.heap)) {
+				usage_error("Invalid heap limit", argv[i]);
+			}
+		} else if (strncmp(argv[i], "--jit-threshold=", 16) == 0) {
+			if (!parse_count(argv[i] + 16, &jit_threshold) || jit_threshold > UINT32_MAX) {
+				usage_error("Invalid JIT threshold", argv[i]);
+			}
+		} else if (strncmp(argv[i], "--trace-threshold=", 18) == 0) {
+			if (!parse_count(argv[i] + 18, &trace_threshold) || trace_threshold > UINT16_MAX) {
+				usage_error("Invalid trace threshold", argv[i]);
+			}
+		} else if (strncmp(argv[i], "--prefork=", 10) == 0) {
+			workers = parse_workers(argv[i] + 10);
+		} else if (strcmp(argv[i], "--prefork") == 0 && i + 1 < argc) {
+			workers = parse_workers(argv[++i]);
+		} else if (strncmp(argv[i], "--listen=", 9) == 0) {
+			listen_path = argv[i] + 9;
+		} else if (argv[i][0] == '-') {
+			usage_error("Unknown option", argv[i]);
+		} else if (file_name == NULL) {
+			file_name = argv[i];
+		} else {
+			usage_error("Unexpected parameter", argv[i]);
+		}
+	}
+	if (workers > 0 && file_name == NULL) usage_error("Prefork needs a script", "--prefork");
+	if (listen_path != NULL && workers == 0) usage_error("Listening needs prefork workers", listen_path);
+
+	// Files are compiled into frozen code before the VM starts, so isolates
+	// spawned by the script share it instead of copying it.
+	SharedCode* code = file_name == NULL ? NULL : compile_file(file_name);
+	VM* vm = malloc(sizeof(VM));
+	if (vm == NULL) {
+		fprintf(stderr, "Not enough memory for the VM\n");
+		exit(EX_OSERR);
+	}
+	init_vm_shared(vm, &code, code == NULL ? 0 : 1);
+	configure_gc(vm, &gc_config);
+	configure_output(vm, output_size);
+	configure_limits(vm, &limits);
+	configure_jit(vm, (uint32_t)jit_threshold);
+	configure_traces(vm, (uint16_t)trace_threshold);
+
+	int status = 0;
+	if (file_name == NULL) {
+		repl(vm);
+	} else if (code == NULL) {
+		status = EX_DATAERR;
 	} else {
-		fprintf(stderr, "Wrong number of parameters: %d\n", argc);
-		fprintf(stderr, "Usage: clox [path] to run a file or clox to run REPL\n");
-		free_vm();
-		exit(EX_USAGE);
+		status = run_file(vm, code);
+		if (status == 0 && workers > 0) status = run_prefork(vm, workers, listen_path);
 	}
-	free_vm();
-    return 0;
+	output_flush(&vm->output);
+	gc_stats_report(&vm->gc_stats, vm->gc_config.report, stderr);
+	free_vm(vm);
+	free(vm);
+	if (code != NULL) release_shared(code);
+    return status;
+}
+
+void usage_error(const char* message, const char* arg) {
+	fprintf(stderr, "%s: %s\n", message, arg);
+	fprintf(stderr, "Usage: clox [options] [path] to run a file or clox to run REPL\n");
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "  --gc-compact              Compact the heap when it gets fragmented\n");
+	fprintf(stderr, "  --gc-grow-factor=N        Next collection at live bytes * N, 1 to 1000000 (default 2)\n");
+	fprintf(stderr, "  --gc-initial-heap=BYTES   First collection threshold. Accepts K, M, G (default 1M)\n");
+	fprintf(stderr, "  --gc-stats[=summary|json] Print collector statistics to stderr at exit\n");
+	fprintf(stderr, "  --output-buffer=BYTES     Buffer for print, 0 to write each line. Accepts K, M, G (default 64K)\n");
+	fprintf(stderr, "  --limit-ticks=N           Stop each run after N loop iterations plus calls\n");
+	fprintf(stderr, "  --limit-time=MS           Stop each run after MS milliseconds\n");
+	fprintf(stderr, "  --limit-heap=BYTES        Stop each run once the live heap passes BYTES. Accepts K, M, G\n");
+	fprintf(stderr, "  --jit-threshold=N         Compile functions to machine code after N calls, 0 never (default 100)\n");
+	fprintf(stderr, "  --trace-threshold=N       Compile loops to machine code after N iterations, 0 never, at most 65535 (default 50)\n");
+	fprintf(stderr, "  --prefork=N               After the script, fork N workers that answer stdin lines with handle(line)\n");
+	fprintf(stderr, "  --listen=PATH             With --prefork, workers answer connections to a Unix socket instead\n");
+	fprintf(stderr, "Environment: CLOX_GC_COMPACT, CLOX_GC_GROW_FACTOR, CLOX_GC_INITIAL_HEAP, CLOX_GC_STATS, CLOX_OUTPUT_BUFFER,\n"
+		"             CLOX_JIT_THRESHOLD, CLOX_TRACE_THRESHOLD\n");
+	exit(EX_USAGE);
 }
 
-void repl() {
+int parse_workers(const char* text) {
+	char* end;
+	long workers = strtol(text, &end, 10);
+	if (*text == '\0' || *end != '\0' || workers < 1 || workers > 1024) {
+		usage_error("Invalid number of workers", text);
+	}
+	return (int)workers;
+}
+
+bool parse_count(const char* text, uint64_t* count) {
+	char* end;
+	errno = 0;
+	unsigned long long value = strtoull(text, &end, 10);
+	if (*text < '0' || *text > '9' || *end != '\0' || errno != 0) return false;
+	*count = value;
+	return true;
+}
+
+void repl(VM* vm) {
 #define BUFFER_SIZE 1024
 	char line_buffer[BUFFER_SIZE];
 	for (;;) {
+		output_flush(&vm->output);
 		printf("(lox) ~> ");
+		fflush(stdout);
 		if (!fgets(line_buffer, BUFFER_SIZE, stdin)) {
 			fprintf(stderr, "Error while reading from stdin!\n");
 			exit(EX_IOERR);
 		}
-		interpret(line_buffer);
+		interpret(vm, line_buffer, strlen(line_buffer));
 	}
 #undef BUFFER_SIZE
 }
 
-void run_file(const char* file_name) {
-	char* source = read_source_file(file_name);
-	InterpretResult result = interpret(source);
-	free(source);
-	if (result == INTERPRET_COMPILE_ERROR) exit(EX_DATAERR);
-	if (result == INTERPRET_RUNTIME_ERROR) exit(EX_SOFTWARE);
-}
-
-char* read_source_file(const char* file_name) {
-	FILE* file = fopen(file_name, "rb");
-	if (!file) {
-		fprintf(stderr, "Cannot open file: %s\n", file_name);
+// NULL on compile errors.
+SharedCode* compile_file(const char* file_name) {
+	MappedFile source;
+	if (!map_file(file_name, &source)) {
+		fprintf(stderr, "Cannot read file %s: %s\n", file_name, strerror(errno));
 		exit(EX_IOERR);
 	}
-	fseek(file, 0L, SEEK_END);
-	size_t file_size = ftell(file);
-	rewind(file);
-	char* read_buffer = (char*)malloc(file_size + 1);
-	if (!read_buffer) {
-		fprintf(stderr, "Cannot assign memory.\n");
-		exit(EX_IOERR);
-	}
-	size_t bytes_read = fread(read_buffer, sizeof(char), file_size, file);
-	if (bytes_read < file_size) {
-		fprintf(stderr, "Cannot read file %s", file_name);
-		fclose(file);
-		free(read_buffer);
-		exit(EX_IOERR);
-	}
-	read_buffer[bytes_read] = '\0';
-	fclose(file);
-	return read_buffer;
+	SharedCode* code = compile_shared(source.data, source.length, stderr);
+	unmap_file(&source);
+	return code;
+}
+
+int run_file(VM* vm, SharedCode* code) {
+	InterpretResult result = interpret_shared(vm, code);
+	if (result == INTERPRET_RUNTIME_ERROR) return EX_SOFTWARE;
+	return 0;
 }
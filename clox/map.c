@@ -0,0 +1,171 @@
+#include <string.h>
+#include "map.h"
+#include "memory.h"
+
+// Linear probing over key/value entries. Free slots have a nil key: empty
+// ones hold a nil value and tombstones hold true.
+#define MAP_MAX_LOAD 0.75
+
+static void adjust_capacity(VM* vm, ObjMap* map, int capacity);
+
+void init_map(ObjMap* map) {
+    map->count = 0;
+    map->tombstones = 0;
+    map->capacity = 0;
+    map->stale = false;
+    map->entries = NULL;
+}
+
+void free_map(VM* vm, ObjMap* map) {
+    FREE_ARRAY(vm, MapEntry, map->entries, map->capacity);
+    init_map(map);
+}
+
+static inline uint32_t hash_bits(uint64_t bits) {
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdull;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
+}
+
+static uint32_t hash_value(Value value) {
+    switch(value.type) {
+    case VAL_BOOL: return AS_BOOL(value) ? 3 : 5;
+    case VAL_NIL: return 7;
+    case VAL_NUMBER: {
+        double number = AS_NUMBER(value);
+        if(number == 0) number = 0; // -0 and 0 are equal keys
+        uint64_t bits;
+        memcpy(&bits, &number, sizeof(bits));
+        return hash_bits(bits);
+    }
+    case VAL_OBJ:
+        if(IS_STRING(value)) return AS_STRING(value)->hash;
+        return hash_bits((uint64_t)(uintptr_t)AS_OBJ(value));
+    }
+    return 0;
+}
+
+static MapEntry* find_entry(MapEntry* entries, int capacity, Value key) {
+    uint32_t mask = capacity - 1;
+    MapEntry* tombstone = NULL;
+    for(uint32_t index = hash_value(key) & mask; ; index = (index + 1) & mask) {
+        MapEntry* entry = &entries[index];
+        if(IS_NIL(entry->key)) {
+            if(IS_NIL(entry->value)) return tombstone != NULL ? tombstone : entry;
+            if(tombstone == NULL) tombstone = entry;
+        } else if(values_equal(entry->key, key)) {
+            return entry;
+        }
+    }
+}
+
+// Compaction moves objects, which changes their hash. Entries are put back
+// in place on the first access after that.
+static void refresh(VM* vm, ObjMap* map) {
+    if(map->stale) {
+        map->stale = false;
+        adjust_capacity(vm, map, map->capacity);
+    }
+}
+
+bool map_get(VM* vm, ObjMap* map, Value key, Value* value) {
+    if(map->count == 0) return false;
+    refresh(vm, map);
+
+    MapEntry* entry = find_entry(map->entries, map->capacity, key);
+    if(IS_NIL(entry->key)) return false;
+    *value = entry->value;
+    return true;
+}
+
+// Returns true when the key is new.
+bool map_set(VM* vm, ObjMap* map, Value key, Value value) {
+    refresh(vm, map);
+    // Overwriting a key never grows the map.
+    if(map->count > 0) {
+        MapEntry* entry = find_entry(map->entries, map->capacity, key);
+        if(!IS_NIL(entry->key)) {
+            entry->value = value;
+            return false;
+        }
+    }
+    if(map->count + map->tombstones + 1 > map->capacity * MAP_MAX_LOAD) {
+        // Rehashing at the same size is enough when tombstones dominate.
+        int capacity = map->capacity < 8 ? 8
+            : map->tombstones >= map->count ? map->capacity
+            : map->capacity * 2;
+        adjust_capacity(vm, map, capacity);
+    }
+
+    MapEntry* entry = find_entry(map->entries, map->capacity, key);
+    bool is_new = IS_NIL(entry->key);
+    if(is_new) {
+        map->count++;
+        if(!IS_NIL(entry->value)) map->tombstones--; // Reused tombstone
+    }
+    entry->key = key;
+    entry->value = value;
+    return is_new;
+}
+
+bool map_delete(VM* vm, ObjMap* map, Value key) {
+    if(map->count == 0) return false;
+    refresh(vm, map);
+
+    MapEntry* entry = find_entry(map->entries, map->capacity, key);
+    if(IS_NIL(entry->key)) return false;
+
+    entry->key = NIL_VALUE();
+    entry->value = BOOL_VALUE(true); // Tombstone
+    map->count--;
+    map->tombstones++;
+    return true;
+}
+
+void map_add_all(VM* vm, ObjMap* from, ObjMap* to) {
+    for(int i = 0; i < from->capacity; i++) {
+        MapEntry* entry = &from->entries[i];
+        if(!IS_NIL(entry->key)) map_set(vm, to, entry->key, entry->value);
+    }
+}
+
+static void adjust_capacity(VM* vm, ObjMap* map, int capacity) {
+    // Allocate first: a collection here still sees the old entries.
+    MapEntry* entries = ALLOCATE(vm, MapEntry, capacity);
+    for(int i = 0; i < capacity; i++) {
+        entries[i].key = NIL_VALUE();
+        entries[i].value = NIL_VALUE();
+    }
+
+    for(int i = 0; i < map->capacity; i++) {
+        MapEntry* entry = &map->entries[i];
+        if(IS_NIL(entry->key)) continue;
+        MapEntry* dest = find_entry(entries, capacity, entry->key);
+        *dest = *entry;
+    }
+
+    FREE_ARRAY(vm, MapEntry, map->entries, map->capacity);
+    map->entries = entries;
+    map->capacity = capacity;
+    map->tombstones = 0;
+}
+
+void mark_map(VM* vm, ObjMap* map) {
+    for(int i = 0; i < map->capacity; i++) {
+        MapEntry* entry = &map->entries[i];
+        mark_value(vm, entry->key);
+        mark_value(vm, entry->value);
+    }
+}
+
+void relocate_map(ObjMap* map) {
+    for(int i = 0; i < map->capacity; i++) {
+        MapEntry* entry = &map->entries[i];
+        Value key = entry->key;
+        relocate_value(&entry->key);
+        relocate_value(&entry->value);
+        // Left alone unless a key moved: the map may be permanent.
+        if(IS_OBJ(key) && AS_OBJ(key) != AS_OBJ(entry->key)) map->stale = true;
+    }
+}
@@ -0,0 +1,16 @@
+#ifndef clox_map_h
+#define clox_map_h
+
+#include "common.h"
+#include "object.h"
+
+void init_map(ObjMap* map);
+void free_map(VM* vm, ObjMap* map);
+bool map_get(VM* vm, ObjMap* map, Value key, Value* value);
+bool map_set(VM* vm, ObjMap* map, Value key, Value value);
+bool map_delete(VM* vm, ObjMap* map, Value key);
+void map_add_all(VM* vm, ObjMap* from, ObjMap* to);
+void mark_map(VM* vm, ObjMap* map);
+void relocate_map(ObjMap* map);
+
+#endif
@@ -0,0 +1,87 @@
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mapped_file.h"
+
+static bool read_stream(int fd, MappedFile* file) {
+	size_t capacity = 64 * 1024;
+	size_t length = 0;
+	char* data = malloc(capacity);
+	for (;;) {
+		if (data == NULL) {
+			errno = ENOMEM;
+			return false;
+		}
+		ssize_t bytes = read(fd, data + length, capacity - length);
+		if (bytes < 0) {
+			if (errno == EINTR) continue;
+			free(data);
+			return false;
+		}
+		if (bytes == 0) break;
+		length += bytes;
+		if (length == capacity) {
+			capacity *= 2;
+			char* grown = realloc(data, capacity);
+			if (grown == NULL) free(data);
+			data = grown;
+		}
+	}
+	if (length == 0) {
+		free(data); // Empty files own no buffer, see unmap_file()
+		data = "";
+	}
+	file->data = data;
+	file->length = length;
+	file->mapped = 0;
+	return true;
+}
+
+bool map_file(const char* path, MappedFile* file) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return false;
+
+	struct stat info;
+	if (fstat(fd, &info) < 0) {
+		int error = errno;
+		close(fd);
+		errno = error;
+		return false;
+	}
+
+	bool ok = true;
+	if (!S_ISREG(info.st_mode) || info.st_size == 0) {
+		// Pipes, and /proc files that report no size. mmap also rejects
+		// empty lengths.
+		ok = read_stream(fd, file);
+	} else {
+		void* data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			ok = read_stream(fd, file);
+		} else {
+			// Scanned front to back, once.
+			madvise(data, info.st_size, MADV_SEQUENTIAL);
+			file->data = data;
+			file->length = info.st_size;
+			file->mapped = info.st_size;
+		}
+	}
+	int error = errno;
+	close(fd); // The mapping stays valid
+	errno = error;
+	return ok;
+}
+
+void unmap_file(MappedFile* file) {
+	if (file->mapped > 0) {
+		munmap((void*)file->data, file->mapped);
+	} else if (file->length > 0) {
+		free((void*)file->data);
+	}
+	file->data = NULL;
+	file->length = 0;
+	file->mapped = 0;
+}
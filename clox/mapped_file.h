@@ -0,0 +1,19 @@
+#ifndef clox_mapped_file_h
+#define clox_mapped_file_h
+
+#include "common.h"
+
+// A whole file in memory. Regular files are mapped read only, so their
+// pages come straight from the page cache without a private copy. Pipes
+// and other streams are read into a heap buffer instead.
+typedef struct {
+	const char* data; // Not NUL terminated
+	size_t length;
+	size_t mapped; // Bytes to unmap, 0 when data is a heap buffer.
+} MappedFile;
+
+// Returns false and sets errno when the file cannot be opened or read.
+bool map_file(const char* path, MappedFile* file);
+void unmap_file(MappedFile* file);
+
+#endif
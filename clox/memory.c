@@ -1,24 +1,48 @@
+#include <string.h>
+#include <stdio.h>
+#include <sys/mman.h>
 #include "memory.h"
 #include "chunk.h"
 #include "vm.h"
 #include "compiler.h"
+#include "map.h"
+#include "isolate.h"
+#include "jit.h"
+#include "timing.h"
 
 #ifdef DEBUG_LOG_GC
 #include <stdio.h>
 #include "debug.h"
 #endif
 
-#define GC_HEAP_GROW_FACTOR 2
+#define GC_COMPACT_THRESHOLD 0.5 // Compact when half of the heap is scattered.
+
+#define REGION_ALIGN(size) (((size) + 7) & ~(size_t)7)
+#define FREE_OBJ(vm, type, pointer) free_header(vm, (Obj*)(pointer), sizeof(type))
+#define RELOCATE(field) relocate_object((Obj**)&(field))
 
-void* reallocate(void* oldptr, size_t old_count, size_t count) {
-	vm.bytes_allocated += count - old_count;
+void* reallocate(VM* vm, void* oldptr, size_t old_count, size_t count) {
+	vm->bytes_allocated += count - old_count;
 
 	if(count > old_count) {
+		if(oldptr == NULL) {
+			vm->gc_stats.allocations++;
+		}
+		vm->gc_stats.bytes_requested += count - old_count;
+		if(vm->bytes_allocated > vm->gc_stats.peak_heap) {
+			vm->gc_stats.peak_heap = vm->bytes_allocated;
+		}
 #ifdef DEBUG_STRESS_GC
-		collect_garbage();
+		collect_garbage(vm);
 #endif
-		if(vm.bytes_allocated > vm.next_gc) {
-			collect_garbage();
+		if(vm->bytes_allocated > vm->next_gc) {
+			collect_garbage(vm);
+		}
+		// Raised as a runtime error at the next loop iteration or call,
+		// if a collection doesn't bring the heap back under the limit.
+		if (vm->limits.heap > 0 && vm->bytes_allocated > vm->limits.heap && !vm->heap_exceeded) {
+			vm->heap_exceeded = true;
+			interrupt_run(vm);
 		}
 	}
 
@@ -29,107 +53,250 @@ void* reallocate(void* oldptr, size_t old_count, size_t count) {
 	return realloc(oldptr, count);
 }
 
-void free_object(Obj* object) {
+// Fiber stacks are reserved whole, STACK_MAX values, so they never move
+// and open upvalues can point into them. Pages only take memory once used.
+Value* reserve_stack(void) {
+	void* stack = mmap(NULL, sizeof(Value) * STACK_MAX, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (stack == MAP_FAILED) {
+		fprintf(stderr, "Not enough memory for a fiber stack\n");
+		exit(1);
+	}
+	return stack;
+}
+
+// Called once a fiber is done. Its upvalues must be closed already.
+void free_fiber_stack(VM* vm, ObjFiber* fiber) {
+	if (fiber->stack == NULL) return;
+	munmap(fiber->stack, sizeof(Value) * STACK_MAX);
+	FREE_ARRAY(vm, CallFrame, fiber->frames, FRAMES_MAX);
+	fiber->stack = NULL;
+	fiber->stack_top = NULL;
+	fiber->frames = NULL;
+	fiber->frames_count = 0;
+	fiber->open_upvalues = NULL;
+}
+
+static size_t object_size(Obj* object) {
+	switch (object->type) {
+	case OBJ_STRING: return STRING_SIZE(((ObjString*)object)->length);
+	case OBJ_FUNCTION: return sizeof(ObjFunction);
+	case OBJ_NATIVE: return sizeof(ObjNative);
+	case OBJ_CLOSURE: return sizeof(ObjClosure);
+	case OBJ_UPVALUE: return sizeof(ObjUpvalue);
+	case OBJ_CLASS: return sizeof(ObjClass);
+	case OBJ_INSTANCE: return sizeof(ObjInstance);
+	case OBJ_BOUND_METHOD: return sizeof(ObjBoundMethod);
+	case OBJ_ROPE: return sizeof(ObjRope);
+	case OBJ_LIST: return sizeof(ObjList);
+	case OBJ_MAP: return sizeof(ObjMap);
+	case OBJ_FLOAT_ARRAY: return sizeof(ObjFloatArray);
+	case OBJ_LINE_READER: return sizeof(ObjLineReader);
+	case OBJ_CHANNEL: return sizeof(ObjChannel);
+	case OBJ_ISOLATE: return sizeof(ObjIsolate);
+	case OBJ_FIBER: return sizeof(ObjFiber);
+	}
+	return 0;
+}
+
+static void free_header(VM* vm, Obj* object, size_t size) {
+	if (object->in_region) {
+		// Memory goes back to the system when the region is released.
+		vm->bytes_allocated -= size;
+		vm->region_dead_bytes += size;
+		return;
+	}
+	reallocate(vm, object, size, 0);
+}
+
+void free_object(VM* vm, Obj* object) {
 #ifdef DEBUG_LOG_GC
 	printf("%p free type %s\n", (void*)object, get_obj_str(object->type));
 #endif
 	switch (object->type) {
 	case OBJ_FUNCTION: {
 		ObjFunction* func = (ObjFunction*)object;
-		free_chunk(&func->chunk);
-		FREE(ObjFunction, object);
+		free_chunk(vm, &func->chunk);
+#ifdef CLOX_JIT
+		free_jit_function(func->jit);
+#endif
+		FREE_OBJ(vm, ObjFunction, object);
 		break;
 	}
     case OBJ_STRING: {
-		ObjString* string = (ObjString*)object;
-		FREE_ARRAY(char, string->chars, string->length + 1);
-		FREE(ObjString, object);
+		free_header(vm, object, STRING_SIZE(((ObjString*)object)->length));
 		break;
     }
     case OBJ_NATIVE: {
-    	FREE(ObjNative, object);
+    	FREE_OBJ(vm, ObjNative, object);
     	break;
     }
     case OBJ_CLOSURE: {
     	ObjClosure* closure = (ObjClosure*)object;
-    	FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalue_count);
-    	FREE(ObjClosure, object);
+    	FREE_ARRAY(vm, ObjUpvalue*, closure->upvalues, closure->upvalue_count);
+    	FREE_OBJ(vm, ObjClosure, object);
     	break;
     }
     case OBJ_UPVALUE: {
-    	FREE(ObjUpvalue, object);
+    	FREE_OBJ(vm, ObjUpvalue, object);
     	break;
     }
 	case OBJ_CLASS: {
 		ObjClass* klass = (ObjClass*)object;
-		free_table(&klass->methods);
-		FREE(ObjClass, object);
+		free_table(vm, &klass->methods);
+		FREE_OBJ(vm, ObjClass, object);
 		break;
 	}
 	case OBJ_INSTANCE: {
 		ObjInstance* instance = (ObjInstance*)object;
-		free_table(&instance->fields);
-		FREE(ObjInstance, object);
+		free_table(vm, &instance->fields);
+		FREE_OBJ(vm, ObjInstance, object);
 		break;
 	}
 	case OBJ_BOUND_METHOD: {
-		FREE(ObjBoundMethod, object);
+		FREE_OBJ(vm, ObjBoundMethod, object);
       	break;
 	}
+	case OBJ_ROPE: {
+		FREE_OBJ(vm, ObjRope, object);
+		break;
+	}
+	case OBJ_LIST: {
+		free_valuearray(vm, &((ObjList*)object)->items);
+		FREE_OBJ(vm, ObjList, object);
+		break;
+	}
+	case OBJ_MAP: {
+		free_map(vm, (ObjMap*)object);
+		FREE_OBJ(vm, ObjMap, object);
+		break;
+	}
+	case OBJ_FLOAT_ARRAY: {
+		ObjFloatArray* array = (ObjFloatArray*)object;
+		FREE_ARRAY(vm, double, array->data, array->length);
+		FREE_OBJ(vm, ObjFloatArray, object);
+		break;
+	}
+	case OBJ_LINE_READER: {
+		unmap_file(&((ObjLineReader*)object)->file);
+		FREE_OBJ(vm, ObjLineReader, object);
+		break;
+	}
+	case OBJ_CHANNEL: {
+		release_channel(((ObjChannel*)object)->channel);
+		FREE_OBJ(vm, ObjChannel, object);
+		break;
+	}
+	case OBJ_ISOLATE: {
+		ObjIsolate* handle = (ObjIsolate*)object;
+		release_isolate(handle->isolate, handle->joined);
+		FREE_OBJ(vm, ObjIsolate, object);
+		break;
+	}
+	case OBJ_FIBER: {
+		free_fiber_stack(vm, (ObjFiber*)object);
+		FREE_OBJ(vm, ObjFiber, object);
+		break;
+	}
   }
 }
 
-void mark_object(Obj* object) {
+void mark_object(VM* vm, Obj* object) {
 	if(object == NULL) return;
-	if(object->is_marked) return;
+	if(object->next != object) vm->heap_referenced = true; // Not shared nor permanent
+	if(object->is_marked) return; // Shared objects are always marked
 #ifdef DEBUG_LOG_GC
 	printf("%p mark ", (void*)object);
 	print_value(OBJ_VALUE(object));
 	printf("\n");
 #endif
 	object->is_marked = true;
-	if (vm.gray_capacity < vm.gray_count + 1) {
-		vm.gray_capacity = GROW_CAPACITY(vm.gray_capacity);
-		vm.gray_stack = realloc(vm.gray_stack, sizeof(Obj*) * vm.gray_capacity);
+	if (vm->gray_capacity < vm->gray_count + 1) {
+		vm->gray_capacity = GROW_CAPACITY(vm->gray_capacity);
+		vm->gray_stack = realloc(vm->gray_stack, sizeof(Obj*) * vm->gray_capacity);
 	}
-	vm.gray_stack[vm.gray_count++] = object;
+	vm->gray_stack[vm->gray_count++] = object;
 }
 
-void mark_value(Value value) {
+void mark_value(VM* vm, Value value) {
 	if(!IS_OBJ(value)) return;
-	mark_object(AS_OBJ(value));
+	mark_object(vm, AS_OBJ(value));
 }
 
-static void mark_roots() {
+static void mark_stack(VM* vm, Value* stack, Value* stack_top,
+	CallFrame* frames, int frames_count, ObjUpvalue* open_upvalues) {
 	// Stack
-	for(Value* slot = vm.stack; slot < vm.stack_top; slot++) {
-		mark_value(*slot);
+	for(Value* slot = stack; slot < stack_top; slot++) {
+		mark_value(vm, *slot);
 	}
 
 	// Closures
-	for (int i = 0; i < vm.frames_count; i++) {
-    	mark_object((Obj*)vm.frames[i].closure);
+	for (int i = 0; i < frames_count; i++) {
+    	mark_object(vm, (Obj*)frames[i].closure);
 	}
 
 	// Upvalues
-	for (ObjUpvalue* upvalue = vm.open_upvalues;
+	for (ObjUpvalue* upvalue = open_upvalues;
 		upvalue != NULL;
 		upvalue = upvalue->next) {
-		mark_object((Obj*)upvalue);
+		mark_object(vm, (Obj*)upvalue);
+	}
+}
+
+static void blacken_object(VM* vm, Obj* obj);
+static void remember(VM* vm, Obj* object);
+
+static void mark_roots(VM* vm) {
+	// The running fiber lives in the VM registers. Fibers waiting on it
+	// are reached through their callers.
+	mark_stack(vm, vm->stack, vm->stack_top, vm->frames, vm->frames_count, vm->open_upvalues);
+	mark_object(vm, (Obj*)vm->fiber);
+	mark_object(vm, (Obj*)vm->main_fiber);
+
+	mark_table(vm, &vm->globals);
+	mark_table(vm, &vm->list_methods);
+	mark_table(vm, &vm->map_methods);
+	mark_table(vm, &vm->float_array_methods);
+	mark_table(vm, &vm->line_reader_methods);
+	mark_table(vm, &vm->channel_methods);
+	mark_table(vm, &vm->isolate_methods);
+	mark_table(vm, &vm->fiber_methods);
+	mark_event_loop(vm, &vm->events);
+	mark_compiler_roots(vm);
+	mark_object(vm, (Obj*)vm->init_string);
+	for (int i = 0; i < vm->host_values.size; i++) {
+		mark_value(vm, vm->host_values.values[i]);
 	}
 
-	mark_table(&vm.globals);
-	mark_compiler_roots();
-	mark_object((Obj*)vm.init_string);
+	// Permanent objects are always marked, so they are only traced here.
+	// Those pointing into the heap are the only ones compaction rewrites.
+	vm->remembered_count = 0;
+	for (int i = 0; i < vm->permanent_count; i++) {
+		vm->heap_referenced = false;
+		blacken_object(vm, vm->permanent[i]);
+		if (vm->heap_referenced) remember(vm, vm->permanent[i]);
+	}
+}
+
+static void remember(VM* vm, Obj* object) {
+	if (vm->remembered_capacity < vm->remembered_count + 1) {
+		vm->remembered_capacity = GROW_CAPACITY(vm->remembered_capacity);
+		vm->remembered = realloc(vm->remembered, sizeof(Obj*) * vm->remembered_capacity);
+		if (vm->remembered == NULL) {
+			fprintf(stderr, "Not enough memory for the permanent generation\n");
+			exit(1);
+		}
+	}
+	vm->remembered[vm->remembered_count++] = object;
 }
 
-static void mark_array(ValueArray* array) {
+static void mark_array(VM* vm, ValueArray* array) {
 	for (int i = 0; i < array->size; i++) {
-		mark_value(array->values[i]);
+		mark_value(vm, array->values[i]);
 	}
 }
 
-static void blacken_object(Obj* obj) {
+static void blacken_object(VM* vm, Obj* obj) {
 #ifdef DEBUG_LOG_GC
 	printf("%p blacken ", (void*)obj);
 	print_value(OBJ_VALUE(obj));
@@ -138,55 +305,88 @@ static void blacken_object(Obj* obj) {
 	switch(obj->type) {
 	case OBJ_CLOSURE: {
 		ObjClosure* closure = (ObjClosure*)obj;
-		mark_object((Obj*)closure->function);
+		mark_object(vm, (Obj*)closure->function);
 		for (int i = 0; i < closure->upvalue_count; i++) {
-			mark_object((Obj*)closure->upvalues[i]);
+			mark_object(vm, (Obj*)closure->upvalues[i]);
 		}
 		break;
     }
 	case OBJ_FUNCTION: {
 		ObjFunction* function = (ObjFunction*)obj;
-		mark_object((Obj*)function->name);
-		mark_array(&function->chunk.constants);
+		mark_object(vm, (Obj*)function->name);
+		mark_array(vm, &function->chunk.constants);
 		break;
 	}
 	case OBJ_UPVALUE:
-		mark_value(((ObjUpvalue*)obj)->closed);
+		mark_value(vm, ((ObjUpvalue*)obj)->closed);
 		break;
 	case OBJ_CLASS: {
 		ObjClass* klass = (ObjClass*)obj;
-		mark_table(&klass->methods);
-		mark_object((Obj*)klass->name);
+		mark_table(vm, &klass->methods);
+		mark_object(vm, (Obj*)klass->name);
 		break;
 	}
 	case OBJ_INSTANCE: {
 		ObjInstance* instance = (ObjInstance*)obj;
-		mark_object((Obj*)instance->klass);
-		mark_table(&instance->fields);
+		mark_object(vm, (Obj*)instance->klass);
+		mark_table(vm, &instance->fields);
 		break;
 	}
 	case OBJ_BOUND_METHOD: {
 		ObjBoundMethod* bound = (ObjBoundMethod*)obj;
-		mark_value(bound->receiver);
-		mark_object((Obj*)bound->method);
+		mark_value(vm, bound->receiver);
+		mark_object(vm, (Obj*)bound->method);
 		break;
 	}
+	case OBJ_ROPE: {
+		ObjRope* rope = (ObjRope*)obj;
+		mark_object(vm, rope->left);
+		mark_object(vm, rope->right);
+		mark_object(vm, (Obj*)rope->flat);
+		break;
+	}
+	case OBJ_LIST:
+		mark_array(vm, &((ObjList*)obj)->items);
+		break;
+	case OBJ_MAP:
+		mark_map(vm, (ObjMap*)obj);
+		break;
+	case OBJ_FIBER: {
+		ObjFiber* fiber = (ObjFiber*)obj;
+		mark_object(vm, (Obj*)fiber->closure);
+		mark_object(vm, (Obj*)fiber->caller);
+		if (fiber->state != FIBER_RUNNING) {
+			mark_stack(vm, fiber->stack, fiber->stack_top,
+				fiber->frames, fiber->frames_count, fiber->open_upvalues);
+		}
+		break;
+	}
+	case OBJ_FLOAT_ARRAY:
+	case OBJ_LINE_READER:
+	case OBJ_CHANNEL:
+	case OBJ_ISOLATE:
 	case OBJ_NATIVE:
 	case OBJ_STRING:
 		break; // These object havent childs
 	};
 }
 
-static void trace_references() {
-	while(vm.gray_count > 0) {
-		Obj* obj = vm.gray_stack[--vm.gray_count];
-		blacken_object(obj);
+static void trace_references(VM* vm) {
+	while(vm->gray_count > 0) {
+		Obj* obj = vm->gray_stack[--vm->gray_count];
+		blacken_object(vm, obj);
 	}
 }
 
-static void sweep() {
+typedef struct {
+	size_t live;
+	size_t region_live;
+	int objects[OBJ_TYPE_COUNT];
+} SweepResult;
+
+static void sweep(VM* vm, SweepResult* result) {
 	Obj* previous = NULL;
-	Obj* object = vm.objects;
+	Obj* object = vm->objects;
 	while (object != NULL) {
 #ifdef DEBUG_LOG_GC
 		printf("%p sweep for object: [%s]\n", (void*)object, get_obj_str(object->type));
@@ -196,6 +396,9 @@ static void sweep() {
 			printf("%p sweep object is marked. It'll survive: [%s]\n", (void*)object, get_obj_str(object->type));
 #endif
 			object->is_marked = false;
+			result->live += object_size(object);
+			if (object->in_region) result->region_live += object_size(object);
+			result->objects[object->type]++;
 			previous = object;
 			object = object->next;
 		} else {
@@ -203,37 +406,330 @@ static void sweep() {
 			printf("%p sweep: object is going to die [%s]\n", (void*)object, get_obj_str(object->type));
 #endif
 			Obj* unreached = object;
+			if (unreached->type == OBJ_STRING) {
+				// Interned strings are weak references.
+				intern_set_remove(&vm->strings, (ObjString*)unreached);
+			}
 
 			object = object->next;
 			if (previous != NULL) {
 				previous->next = object;
 			} else {
-				vm.objects = object;
+				vm->objects = object;
 			}
 
-			free_object(unreached);
+			free_object(vm, unreached);
 		}
 	}
 }
 
-void collect_garbage() {
+void collect_garbage(VM* vm) {
+	if (vm->collecting) return;
+	vm->collecting = true;
 #ifdef DEBUG_LOG_GC
 	printf("-- gc begin\n");
-	size_t before = vm.bytes_allocated;
 #endif
-	mark_roots();
-	trace_references();
-	table_remove_white(&vm.strings);
-	sweep();
+	uint64_t start = monotonic_ns();
+	size_t before = vm->bytes_allocated;
 
-	vm.next_gc = vm.bytes_allocated * GC_HEAP_GROW_FACTOR;
+	mark_roots(vm);
+	trace_references(vm);
+	SweepResult result = {0};
+	sweep(vm, &result);
+	intern_set_shrink(vm, &vm->strings);
+
+	double next_gc = vm->bytes_allocated * vm->gc_config.grow_factor;
+	vm->next_gc = next_gc < (double)SIZE_MAX ? (size_t)next_gc : SIZE_MAX;
+
+	// Fragmentation is the part of the heap that is not packed inside a
+	// region: objects allocated one by one plus the holes left by dead
+	// objects that were once compacted.
+	size_t total = result.live + vm->region_dead_bytes;
+	vm->fragmentation = total == 0
+		? 0
+		: (double)(result.live - result.region_live + vm->region_dead_bytes) / total;
+	if (vm->gc_config.compact && vm->fragmentation > GC_COMPACT_THRESHOLD) {
+		vm->compaction_pending = true;
+		interrupt_run(vm);
+	}
+
+	GcRecord record;
+	record.pause_ns = monotonic_ns() - start;
+	record.heap_before = before;
+	record.heap_after = vm->bytes_allocated;
+	memcpy(record.objects, result.objects, sizeof(record.objects));
+	gc_stats_record(&vm->gc_stats, &record);
 
 #ifdef DEBUG_LOG_GC
 	printf("COLLECTED: %ld bytes (from %ld to %ld) next at %ld\n",
-		before - vm.bytes_allocated,
+		before - vm->bytes_allocated,
 		before,
-		vm.bytes_allocated,
-		vm.next_gc);
+		vm->bytes_allocated,
+		vm->next_gc);
+	printf("FRAGMENTATION: %.2f\n", vm->fragmentation);
 	printf("-- gc end\n");
 #endif
-}
\ No newline at end of file
+	vm->collecting = false;
+}
+
+// During compaction the 'next' field of every old object holds the address
+// of its copy. The object list itself is rebuilt from the copies.
+// Shared and permanent objects point to themselves, so they never move.
+static Obj* forward(Obj* object) {
+	return object == NULL ? NULL : object->next;
+}
+
+// Only what moved is stored. Permanent objects are rewritten in place,
+// and storing the same pointer would still copy a page shared after fork().
+void relocate_object(Obj** object) {
+	Obj* moved = forward(*object);
+	if (moved != *object) *object = moved;
+}
+
+void relocate_value(Value* value) {
+	if (!IS_OBJ(*value)) return;
+	Obj* moved = forward(AS_OBJ(*value));
+	if (moved != AS_OBJ(*value)) value->as.obj = moved;
+}
+
+static void relocate_array(ValueArray* array) {
+	for (int i = 0; i < array->size; i++) {
+		relocate_value(&array->values[i]);
+	}
+}
+
+static void relocate_stack(Value* stack, Value* stack_top,
+	CallFrame* frames, int frames_count, ObjUpvalue** open_upvalues) {
+	for (Value* slot = stack; slot < stack_top; slot++) {
+		relocate_value(slot);
+	}
+	for (int i = 0; i < frames_count; i++) {
+		RELOCATE(frames[i].closure);
+	}
+	RELOCATE(*open_upvalues);
+}
+
+static void relocate_references(Obj* copy, Obj* old) {
+	RELOCATE(copy->next);
+	switch (copy->type) {
+	case OBJ_CLOSURE: {
+		ObjClosure* closure = (ObjClosure*)copy;
+		RELOCATE(closure->function);
+		for (int i = 0; i < closure->upvalue_count; i++) {
+			RELOCATE(closure->upvalues[i]);
+		}
+		break;
+	}
+	case OBJ_FUNCTION: {
+		ObjFunction* function = (ObjFunction*)copy;
+		RELOCATE(function->name);
+		relocate_array(&function->chunk.constants);
+		break;
+	}
+	case OBJ_UPVALUE: {
+		ObjUpvalue* upvalue = (ObjUpvalue*)copy;
+		// Closed upvalues point to themselves. Open ones point into
+		// the stack, which never moves.
+		if (copy != old && upvalue->location == &((ObjUpvalue*)old)->closed) {
+			upvalue->location = &upvalue->closed;
+		}
+		relocate_value(&upvalue->closed);
+		RELOCATE(upvalue->next);
+		break;
+	}
+	case OBJ_CLASS: {
+		ObjClass* klass = (ObjClass*)copy;
+		RELOCATE(klass->name);
+		relocate_table(&klass->methods);
+		break;
+	}
+	case OBJ_INSTANCE: {
+		ObjInstance* instance = (ObjInstance*)copy;
+		RELOCATE(instance->klass);
+		relocate_table(&instance->fields);
+		break;
+	}
+	case OBJ_BOUND_METHOD: {
+		ObjBoundMethod* bound = (ObjBoundMethod*)copy;
+		relocate_value(&bound->receiver);
+		RELOCATE(bound->method);
+		break;
+	}
+	case OBJ_ROPE: {
+		ObjRope* rope = (ObjRope*)copy;
+		RELOCATE(rope->left);
+		RELOCATE(rope->right);
+		RELOCATE(rope->flat);
+		break;
+	}
+	case OBJ_LIST:
+		relocate_array(&((ObjList*)copy)->items);
+		break;
+	case OBJ_MAP:
+		relocate_map((ObjMap*)copy);
+		break;
+	case OBJ_FIBER: {
+		ObjFiber* fiber = (ObjFiber*)copy;
+		RELOCATE(fiber->closure);
+		RELOCATE(fiber->caller);
+		if (fiber->state != FIBER_RUNNING) {
+			relocate_stack(fiber->stack, fiber->stack_top,
+				fiber->frames, fiber->frames_count, &fiber->open_upvalues);
+		}
+		break;
+	}
+	case OBJ_FLOAT_ARRAY:
+	case OBJ_LINE_READER:
+	case OBJ_CHANNEL:
+	case OBJ_ISOLATE:
+	case OBJ_NATIVE:
+	case OBJ_STRING:
+		break; // These object havent childs
+	}
+}
+
+static void relocate_roots(VM* vm) {
+	relocate_stack(vm->stack, vm->stack_top, vm->frames, vm->frames_count, &vm->open_upvalues);
+	RELOCATE(vm->fiber);
+	RELOCATE(vm->main_fiber);
+	relocate_table(&vm->globals);
+	relocate_table(&vm->list_methods);
+	relocate_table(&vm->map_methods);
+	relocate_table(&vm->float_array_methods);
+	relocate_table(&vm->line_reader_methods);
+	relocate_table(&vm->channel_methods);
+	relocate_table(&vm->isolate_methods);
+	relocate_table(&vm->fiber_methods);
+	relocate_event_loop(&vm->events);
+	relocate_intern_set(&vm->strings);
+	RELOCATE(vm->init_string);
+	relocate_array(&vm->host_values);
+	RELOCATE(vm->objects);
+}
+
+// Moves every live object into a single new region, in object list order,
+// and rewrites every reference to point to the new addresses. Must only be
+// called from a safe point of the interpreter (no C local holding object
+// pointers and no compiler running).
+void compact_heap(VM* vm) {
+	collect_garbage(vm); // Only survivors remain in vm->objects
+
+	size_t total = 0;
+	int count = 0;
+	for (Obj* object = vm->objects; object != NULL; object = object->next) {
+		total += REGION_ALIGN(object_size(object));
+		count++;
+	}
+
+	// Regions and the temporal array are not accounted: objects just
+	// move from one place to another.
+	Region* region = malloc(sizeof(Region) + total);
+	Obj** moved_from = malloc(sizeof(Obj*) * count);
+	if (region == NULL || moved_from == NULL) {
+		free(region);
+		free(moved_from);
+		return; // Not being able to compact is not an error.
+	}
+	region->size = total;
+
+	char* cursor = region->data;
+	int index = 0;
+	Obj* object = vm->objects;
+	while (object != NULL) {
+		Obj* next = object->next;
+		size_t size = object_size(object);
+		Obj* copy = (Obj*)cursor;
+		memcpy(copy, object, size);
+		copy->in_region = true;
+		object->next = copy; // Forwarding pointer
+		moved_from[index++] = object;
+		cursor += REGION_ALIGN(size);
+		object = next;
+	}
+
+	for (int i = 0; i < count; i++) {
+		relocate_references(moved_from[i]->next, moved_from[i]);
+	}
+	// The rest of the permanent generation only points to itself.
+	for (int i = 0; i < vm->remembered_count; i++) {
+		relocate_references(vm->remembered[i], vm->remembered[i]);
+	}
+	relocate_roots(vm);
+
+	for (int i = 0; i < count; i++) {
+		if (!moved_from[i]->in_region) free(moved_from[i]);
+	}
+	free(moved_from);
+	free_regions(vm);
+
+	region->next = NULL;
+	vm->regions = region;
+	vm->fragmentation = 0;
+	vm->compaction_pending = false;
+
+#ifdef DEBUG_LOG_GC
+	printf("COMPACTED: %d objects (%ld bytes) into %p\n", count, total, (void*)region);
+#endif
+}
+
+void free_regions(VM* vm) {
+	Region* region = vm->regions;
+	while (region != NULL) {
+		Region* next = region->next;
+		free(region);
+		region = next;
+	}
+	vm->regions = NULL;
+	vm->region_dead_bytes = 0;
+}
+
+void tenure_heap(VM* vm) {
+	collect_garbage(vm);
+	int count = vm->permanent_count;
+	for (Obj* object = vm->objects; object != NULL; object = object->next) count++;
+	vm->permanent = realloc(vm->permanent, sizeof(Obj*) * count);
+	if (vm->permanent == NULL) {
+		fprintf(stderr, "Not enough memory for the permanent generation\n");
+		exit(1);
+	}
+
+	Obj* object = vm->objects;
+	while (object != NULL) {
+		Obj* next = object->next;
+		object->is_marked = true;
+		object->next = object;
+		vm->permanent[vm->permanent_count++] = object;
+		object = next;
+	}
+	vm->objects = NULL;
+
+	// Compaction frees every region it knows about.
+	Region* region = vm->regions;
+	while (region != NULL) {
+		Region* next = region->next;
+		region->next = vm->permanent_regions;
+		vm->permanent_regions = region;
+		region = next;
+	}
+	vm->regions = NULL;
+	vm->region_dead_bytes = 0;
+}
+
+void free_permanent(VM* vm) {
+	for (int i = 0; i < vm->permanent_count; i++) {
+		free_object(vm, vm->permanent[i]);
+	}
+	free(vm->permanent);
+	vm->permanent = NULL;
+	vm->permanent_count = 0;
+	free(vm->remembered);
+	vm->remembered = NULL;
+	vm->remembered_count = vm->remembered_capacity = 0;
+	Region* region = vm->permanent_regions;
+	while (region != NULL) {
+		Region* next = region->next;
+		free(region);
+		region = next;
+	}
+	vm->permanent_regions = NULL;
+}
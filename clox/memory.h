@@ -4,24 +4,46 @@
 #include <stdlib.h>
 #include "object.h"
 
-#define ALLOCATE(type, count) \
-    (type*)reallocate(NULL, 0, sizeof(type) * (count))
+#define ALLOCATE(vm, type, count) \
+    (type*)reallocate(vm, NULL, 0, sizeof(type) * (count))
 
 #define GROW_CAPACITY(capacity) ((capacity) < 8 ? 8 : (capacity) * 2);
 
-#define GROW_ARRAY(oldptr, type, old_count, count) \
-		(type*) reallocate(oldptr, old_count * sizeof(type), count * sizeof(type))
-
-#define FREE_ARRAY(type, ptr, count) \
-		(type*) reallocate(ptr, count * sizeof(type), 0)
-
-#define FREE(type, pointer) \
-    reallocate(pointer, sizeof(type), 0)
-
-void* reallocate(void* oldptr, size_t old_count, size_t count);
-void collect_garbage();
-void mark_value(Value value);
-void mark_object(Obj* object);
-void free_object(Obj* object);
+#define GROW_ARRAY(vm, oldptr, type, old_count, count) \
+		(type*) reallocate(vm, oldptr, old_count * sizeof(type), count * sizeof(type))
+
+#define FREE_ARRAY(vm, type, ptr, count) \
+		(type*) reallocate(vm, ptr, count * sizeof(type), 0)
+
+#define FREE(vm, type, pointer) \
+    reallocate(vm, pointer, sizeof(type), 0)
+
+// Contiguous block where the compacting collector evacuates live objects.
+// Objects inside a region are never freed one by one: the whole block is
+// released on the next compaction, once every survivor has moved out.
+typedef struct sRegion {
+	struct sRegion* next;
+	size_t size;
+	char data[];
+} Region;
+
+void* reallocate(VM* vm, void* oldptr, size_t old_count, size_t count);
+void collect_garbage(VM* vm);
+void compact_heap(VM* vm);
+void mark_value(VM* vm, Value value);
+void mark_object(VM* vm, Obj* object);
+void relocate_value(Value* value);
+void relocate_object(Obj** object);
+void free_object(VM* vm, Obj* object);
+void free_regions(VM* vm);
+// Collects, then moves every survivor into the permanent generation: they
+// are never freed before free_vm(), and collections trace them as roots
+// without writing to their headers. Pages holding them stay shared with
+// a parent process after fork(). Compaction only rewrites the ones the
+// last collection found pointing into the heap.
+void tenure_heap(VM* vm);
+void free_permanent(VM* vm);
+Value* reserve_stack(void);
+void free_fiber_stack(VM* vm, ObjFiber* fiber);
 
 #endif
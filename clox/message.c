@@ -0,0 +1,517 @@
+#include <stdlib.h>
+#include <string.h>
+#include "message.h"
+#include "isolate.h"
+#include "shared.h"
+#include "memory.h"
+#include "vm.h"
+#include "map.h"
+
+#define MESSAGE_DEPTH_MAX 256
+
+typedef enum {
+	TAG_NIL,
+	TAG_FALSE,
+	TAG_TRUE,
+	TAG_NUMBER,
+	TAG_REFERENCE, // Number of an object written before
+	TAG_STRING,
+	TAG_LIST,
+	TAG_MAP,
+	TAG_FLOAT_ARRAY,
+	TAG_CHANNEL,
+	TAG_FUNCTION,
+	TAG_SHARED_FUNCTION, // Region number and address
+	TAG_CLOSURE,
+	TAG_CLASS,
+	TAG_INSTANCE,
+} Tag;
+
+void init_message(Message* message) {
+	message->data = NULL;
+	message->length = 0;
+	message->capacity = 0;
+	message->count = 0;
+	message->objects = 0;
+	message->channels = NULL;
+	message->channel_count = 0;
+	message->channel_capacity = 0;
+	message->codes = NULL;
+	message->code_count = 0;
+	message->code_capacity = 0;
+	message->seen = NULL;
+	message->seen_numbers = NULL;
+	message->seen_capacity = 0;
+}
+
+void seal_message(Message* message) {
+	free(message->seen);
+	free(message->seen_numbers);
+	message->seen = NULL;
+	message->seen_numbers = NULL;
+	message->seen_capacity = 0;
+}
+
+void free_message(Message* message) {
+	for (int i = 0; i < message->channel_count; i++) {
+		release_channel(message->channels[i]);
+	}
+	for (int i = 0; i < message->code_count; i++) {
+		release_shared(message->codes[i]);
+	}
+	free(message->data);
+	free(message->channels);
+	free(message->codes);
+	seal_message(message);
+	init_message(message);
+}
+
+// Writing. Buffers live outside the VM heap, so nothing here can start a
+// collection except flattening a rope.
+
+static void write_bytes(Message* message, const void* bytes, size_t length) {
+	if (message->length + length > message->capacity) {
+		size_t capacity = message->capacity < 64 ? 64 : message->capacity * 2;
+		while (capacity < message->length + length) capacity *= 2;
+		message->data = realloc(message->data, capacity);
+		if (message->data == NULL) {
+			fprintf(stderr, "Not enough memory for a message\n");
+			exit(1);
+		}
+		message->capacity = capacity;
+	}
+	memcpy(message->data + message->length, bytes, length);
+	message->length += length;
+}
+
+static void write_byte(Message* message, uint8_t byte) {
+	write_bytes(message, &byte, 1);
+}
+
+static void write_int(Message* message, int number) {
+	uint32_t bits = (uint32_t)number;
+	write_bytes(message, &bits, sizeof(bits));
+}
+
+static uint32_t hash_pointer(Obj* object) {
+	uint64_t bits = (uint64_t)(uintptr_t)object;
+	bits ^= bits >> 33;
+	bits *= 0xff51afd7ed558ccdull;
+	bits ^= bits >> 33;
+	return (uint32_t)bits;
+}
+
+// Slot for the object in the seen set, linear probing.
+static int seen_slot(Message* message, Obj* object) {
+	int mask = message->seen_capacity - 1;
+	int index = hash_pointer(object) & mask;
+	while (message->seen[index] != NULL && message->seen[index] != object) {
+		index = (index + 1) & mask;
+	}
+	return index;
+}
+
+static void grow_seen(Message* message) {
+	Obj** old_seen = message->seen;
+	int* old_numbers = message->seen_numbers;
+	int old_capacity = message->seen_capacity;
+	message->seen_capacity = old_capacity == 0 ? 64 : old_capacity * 2;
+	message->seen = calloc(message->seen_capacity, sizeof(Obj*));
+	message->seen_numbers = malloc(sizeof(int) * message->seen_capacity);
+	if (message->seen == NULL || message->seen_numbers == NULL) {
+		fprintf(stderr, "Not enough memory for a message\n");
+		exit(1);
+	}
+	for (int i = 0; i < old_capacity; i++) {
+		if (old_seen[i] == NULL) continue;
+		int slot = seen_slot(message, old_seen[i]);
+		message->seen[slot] = old_seen[i];
+		message->seen_numbers[slot] = old_numbers[i];
+	}
+	free(old_seen);
+	free(old_numbers);
+}
+
+// Writes a back reference and returns true when the object was written
+// before. Otherwise gives it the next number.
+static bool write_seen(Message* message, Obj* object) {
+	if (message->objects + 1 > message->seen_capacity / 2) grow_seen(message);
+	int slot = seen_slot(message, object);
+	if (message->seen[slot] != NULL) {
+		write_byte(message, TAG_REFERENCE);
+		write_int(message, message->seen_numbers[slot]);
+		return true;
+	}
+	message->seen[slot] = object;
+	message->seen_numbers[slot] = message->objects++;
+	return false;
+}
+
+static const char* write_item(VM* vm, Message* message, Value value, int depth);
+
+static const char* write_table(VM* vm, Message* message, Table* table, int depth) {
+	write_int(message, table->count);
+	for (int i = 0; i < table->capacity; i++) {
+		if (table->control[i] < 0) continue;
+		const char* error = write_item(vm, message, OBJ_VALUE(table->slots[i].key), depth);
+		if (error == NULL) error = write_item(vm, message, table->slots[i].value, depth);
+		if (error != NULL) return error;
+	}
+	return NULL;
+}
+
+static const char* write_function(VM* vm, Message* message, ObjFunction* function, int depth) {
+	Chunk* chunk = &function->chunk;
+	write_byte(message, TAG_FUNCTION);
+	write_int(message, function->arity);
+	write_int(message, function->upvalue_count);
+	write_int(message, chunk->size);
+	write_bytes(message, chunk->code, chunk->size);
+	write_bytes(message, chunk->lines, sizeof(int) * chunk->size);
+	const char* error = write_item(vm, message,
+		function->name == NULL ? NIL_VALUE() : OBJ_VALUE(function->name), depth);
+	if (error != NULL) return error;
+	write_int(message, chunk->constants.size);
+	for (int i = 0; i < chunk->constants.size; i++) {
+		error = write_item(vm, message, chunk->constants.values[i], depth);
+		if (error != NULL) return error;
+	}
+	return NULL;
+}
+
+static void write_channel(Message* message, Channel* channel) {
+	if (message->channel_count == message->channel_capacity) {
+		message->channel_capacity = message->channel_capacity < 4 ? 4 : message->channel_capacity * 2;
+		message->channels = realloc(message->channels, sizeof(Channel*) * message->channel_capacity);
+		if (message->channels == NULL) {
+			fprintf(stderr, "Not enough memory for a message\n");
+			exit(1);
+		}
+	}
+	retain_channel(channel);
+	message->channels[message->channel_count++] = channel;
+	write_byte(message, TAG_CHANNEL);
+	write_int(message, message->channel_count - 1);
+}
+
+static void write_shared_function(VM* vm, Message* message, ObjFunction* function) {
+	SharedCode* code = find_shared(vm, (Obj*)function);
+	int index = 0;
+	while (index < message->code_count && message->codes[index] != code) index++;
+	if (index == message->code_count) {
+		if (message->code_count == message->code_capacity) {
+			message->code_capacity = message->code_capacity < 4 ? 4 : message->code_capacity * 2;
+			message->codes = realloc(message->codes, sizeof(SharedCode*) * message->code_capacity);
+			if (message->codes == NULL) {
+				fprintf(stderr, "Not enough memory for a message\n");
+				exit(1);
+			}
+		}
+		retain_shared(code);
+		message->codes[message->code_count++] = code;
+	}
+	write_byte(message, TAG_SHARED_FUNCTION);
+	write_int(message, index);
+	write_bytes(message, &function, sizeof(function));
+}
+
+static const char* write_item(VM* vm, Message* message, Value value, int depth) {
+	switch (value.type) {
+	case VAL_NIL: write_byte(message, TAG_NIL); return NULL;
+	case VAL_BOOL: write_byte(message, AS_BOOL(value) ? TAG_TRUE : TAG_FALSE); return NULL;
+	case VAL_NUMBER: {
+		double number = AS_NUMBER(value);
+		write_byte(message, TAG_NUMBER);
+		write_bytes(message, &number, sizeof(number));
+		return NULL;
+	}
+	case VAL_OBJ: break;
+	}
+
+	if (depth == MESSAGE_DEPTH_MAX) return "Value nested too deeply to send.";
+	depth++;
+	Obj* object = AS_OBJ(value);
+	if (object->type == OBJ_ROPE) object = (Obj*)flatten_rope(vm, (ObjRope*)object);
+	switch (object->type) {
+	case OBJ_NATIVE: return "Cannot send native functions.";
+	case OBJ_BOUND_METHOD: return "Cannot send bound methods.";
+	case OBJ_UPVALUE: return "Cannot send upvalues.";
+	case OBJ_LINE_READER: return "Cannot send line readers.";
+	case OBJ_ISOLATE: return "Cannot send isolates.";
+	case OBJ_FIBER: return "Cannot send fibers.";
+	case OBJ_CLOSURE:
+		if (((ObjClosure*)object)->upvalue_count > 0) {
+			return "Cannot send functions that capture variables.";
+		}
+		break;
+	default: break;
+	}
+	if (write_seen(message, object)) return NULL;
+
+	switch (object->type) {
+	case OBJ_STRING: {
+		ObjString* string = (ObjString*)object;
+		write_byte(message, TAG_STRING);
+		write_int(message, string->length);
+		write_bytes(message, string->chars, string->length);
+		return NULL;
+	}
+	case OBJ_LIST: {
+		ValueArray* items = &((ObjList*)object)->items;
+		write_byte(message, TAG_LIST);
+		write_int(message, items->size);
+		for (int i = 0; i < items->size; i++) {
+			const char* error = write_item(vm, message, items->values[i], depth);
+			if (error != NULL) return error;
+		}
+		return NULL;
+	}
+	case OBJ_MAP: {
+		ObjMap* map = (ObjMap*)object;
+		write_byte(message, TAG_MAP);
+		write_int(message, map->count);
+		for (int i = 0; i < map->capacity; i++) {
+			MapEntry* entry = &map->entries[i];
+			if (IS_NIL(entry->key)) continue;
+			const char* error = write_item(vm, message, entry->key, depth);
+			if (error == NULL) error = write_item(vm, message, entry->value, depth);
+			if (error != NULL) return error;
+		}
+		return NULL;
+	}
+	case OBJ_FLOAT_ARRAY: {
+		ObjFloatArray* array = (ObjFloatArray*)object;
+		write_byte(message, TAG_FLOAT_ARRAY);
+		write_int(message, array->length);
+		write_bytes(message, array->data, sizeof(double) * array->length);
+		return NULL;
+	}
+	case OBJ_CHANNEL:
+		write_channel(message, ((ObjChannel*)object)->channel);
+		return NULL;
+	case OBJ_FUNCTION:
+		if (object->shared) {
+			write_shared_function(vm, message, (ObjFunction*)object);
+			return NULL;
+		}
+		return write_function(vm, message, (ObjFunction*)object, depth);
+	case OBJ_CLOSURE:
+		write_byte(message, TAG_CLOSURE);
+		return write_item(vm, message, OBJ_VALUE(((ObjClosure*)object)->function), depth);
+	case OBJ_CLASS: {
+		ObjClass* klass = (ObjClass*)object;
+		write_byte(message, TAG_CLASS);
+		const char* error = write_item(vm, message, OBJ_VALUE(klass->name), depth);
+		return error != NULL ? error : write_table(vm, message, &klass->methods, depth);
+	}
+	case OBJ_INSTANCE: {
+		ObjInstance* instance = (ObjInstance*)object;
+		write_byte(message, TAG_INSTANCE);
+		const char* error = write_item(vm, message, OBJ_VALUE(instance->klass), depth);
+		return error != NULL ? error : write_table(vm, message, &instance->fields, depth);
+	}
+	default:
+		return "Cannot send this value.";
+	}
+}
+
+const char* write_message(VM* vm, Message* message, Value value) {
+	size_t length = message->length;
+	int objects = message->objects;
+	int channel_count = message->channel_count;
+	int code_count = message->code_count;
+	const char* error = write_item(vm, message, value, 0);
+	if (error != NULL) {
+		// Objects written by this call are forgotten with the whole seen
+		// set. Later values may copy an object again instead of sharing it.
+		seal_message(message);
+		message->length = length;
+		message->objects = objects;
+		while (message->channel_count > channel_count) {
+			release_channel(message->channels[--message->channel_count]);
+		}
+		while (message->code_count > code_count) {
+			release_shared(message->codes[--message->code_count]);
+		}
+		return error;
+	}
+	message->count++;
+	return NULL;
+}
+
+// Reading. Every object is added to 'objects', a list that keeps it
+// reachable and resolves back references. Objects that need their
+// children to be created reserve their number first.
+
+typedef struct {
+	Message* message;
+	size_t position;
+	ObjList* objects;
+} Reader;
+
+static void read_bytes(Reader* reader, void* bytes, size_t length) {
+	memcpy(bytes, reader->message->data + reader->position, length);
+	reader->position += length;
+}
+
+static uint8_t read_byte(Reader* reader) {
+	return reader->message->data[reader->position++];
+}
+
+static int read_int(Reader* reader) {
+	uint32_t bits;
+	read_bytes(reader, &bits, sizeof(bits));
+	return (int)bits;
+}
+
+static int reserve(VM* vm, Reader* reader) {
+	write_valuearray(vm, &reader->objects->items, NIL_VALUE());
+	return reader->objects->items.size - 1;
+}
+
+static Value created(Reader* reader, int number, Obj* object) {
+	reader->objects->items.values[number] = OBJ_VALUE(object);
+	return OBJ_VALUE(object);
+}
+
+static Value read_item(VM* vm, Reader* reader);
+
+static void read_table(VM* vm, Reader* reader, Table* table) {
+	int count = read_int(reader);
+	for (int i = 0; i < count; i++) {
+		Value key = read_item(vm, reader);
+		Value value = read_item(vm, reader);
+		table_set(vm, table, AS_STRING(key), value);
+	}
+}
+
+static Value read_function(VM* vm, Reader* reader) {
+	int number = reserve(vm, reader);
+	ObjFunction* function = new_function(vm);
+	created(reader, number, (Obj*)function);
+	function->arity = read_int(reader);
+	function->upvalue_count = read_int(reader);
+
+	Chunk* chunk = &function->chunk;
+	int size = read_int(reader);
+	if (size > 0) {
+		chunk->code = GROW_ARRAY(vm, NULL, uint8_t, 0, size);
+		chunk->lines = GROW_ARRAY(vm, NULL, int, 0, size);
+		chunk->capacity = size;
+		read_bytes(reader, chunk->code, size);
+		read_bytes(reader, chunk->lines, sizeof(int) * size);
+		chunk->size = size;
+	}
+	Value name = read_item(vm, reader);
+	function->name = IS_NIL(name) ? NULL : AS_STRING(name);
+	int constants = read_int(reader);
+	for (int i = 0; i < constants; i++) {
+		write_valuearray(vm, &chunk->constants, read_item(vm, reader));
+	}
+	return OBJ_VALUE(function);
+}
+
+static Value read_item(VM* vm, Reader* reader) {
+	switch ((Tag)read_byte(reader)) {
+	case TAG_NIL: return NIL_VALUE();
+	case TAG_FALSE: return BOOL_VALUE(false);
+	case TAG_TRUE: return BOOL_VALUE(true);
+	case TAG_NUMBER: {
+		double number;
+		read_bytes(reader, &number, sizeof(number));
+		return NUMBER_VALUE(number);
+	}
+	case TAG_REFERENCE:
+		return reader->objects->items.values[read_int(reader)];
+	case TAG_STRING: {
+		int length = read_int(reader);
+		const char* chars = (const char*)reader->message->data + reader->position;
+		reader->position += length;
+		int number = reserve(vm, reader);
+		return created(reader, number, (Obj*)copy_string(vm, chars, length));
+	}
+	case TAG_LIST: {
+		int number = reserve(vm, reader);
+		ObjList* list = new_list(vm);
+		created(reader, number, (Obj*)list);
+		int count = read_int(reader);
+		for (int i = 0; i < count; i++) {
+			Value item = read_item(vm, reader);
+			write_valuearray(vm, &list->items, item);
+		}
+		return OBJ_VALUE(list);
+	}
+	case TAG_MAP: {
+		int number = reserve(vm, reader);
+		ObjMap* map = new_map(vm);
+		created(reader, number, (Obj*)map);
+		int count = read_int(reader);
+		for (int i = 0; i < count; i++) {
+			Value key = read_item(vm, reader);
+			Value value = read_item(vm, reader);
+			map_set(vm, map, key, value);
+		}
+		return OBJ_VALUE(map);
+	}
+	case TAG_FLOAT_ARRAY: {
+		int number = reserve(vm, reader);
+		int length = read_int(reader);
+		ObjFloatArray* array = new_float_array(vm, length);
+		read_bytes(reader, array->data, sizeof(double) * length);
+		return created(reader, number, (Obj*)array);
+	}
+	case TAG_CHANNEL: {
+		int number = reserve(vm, reader);
+		Channel* channel = reader->message->channels[read_int(reader)];
+		return created(reader, number, (Obj*)new_channel(vm, channel));
+	}
+	case TAG_FUNCTION:
+		return read_function(vm, reader);
+	case TAG_SHARED_FUNCTION: {
+		int number = reserve(vm, reader);
+		SharedCode* code = reader->message->codes[read_int(reader)];
+		ObjFunction* function;
+		read_bytes(reader, &function, sizeof(function));
+		// A VM holding strings of its own with the same characters can't
+		// run the frozen code, it gets a copy.
+		if (!attach_shared(vm, code)) function = thaw_function(vm, function);
+		return created(reader, number, (Obj*)function);
+	}
+	case TAG_CLOSURE: {
+		int number = reserve(vm, reader);
+		Value function = read_item(vm, reader);
+		return created(reader, number, (Obj*)new_closure(vm, AS_FUNCTION(function)));
+	}
+	case TAG_CLASS: {
+		int number = reserve(vm, reader);
+		Value name = read_item(vm, reader);
+		ObjClass* klass = new_class(vm, AS_STRING(name));
+		created(reader, number, (Obj*)klass);
+		read_table(vm, reader, &klass->methods);
+		return OBJ_VALUE(klass);
+	}
+	case TAG_INSTANCE: {
+		int number = reserve(vm, reader);
+		Value klass = read_item(vm, reader);
+		ObjInstance* instance = new_instance(vm, AS_CLASS(klass));
+		created(reader, number, (Obj*)instance);
+		read_table(vm, reader, &instance->fields);
+		return OBJ_VALUE(instance);
+	}
+	}
+	return NIL_VALUE(); // Unreachable
+}
+
+ObjList* read_message(VM* vm, Message* message) {
+	Reader reader = { .message = message, .position = 0, .objects = new_list(vm) };
+	stack_push(vm, OBJ_VALUE(reader.objects));
+	ObjList* values = new_list(vm);
+	stack_push(vm, OBJ_VALUE(values));
+	for (int i = 0; i < message->count; i++) {
+		Value value = read_item(vm, &reader);
+		write_valuearray(vm, &values->items, value);
+	}
+	stack_pop(vm);
+	stack_pop(vm);
+	return values;
+}
@@ -0,0 +1,47 @@
+#ifndef clox_message_h
+#define clox_message_h
+
+#include "common.h"
+#include "values.h"
+#include "object.h"
+
+// Values copied out of one VM's heap so another VM can rebuild them.
+// Every object is written once and later references to it become back
+// references, so shared and cyclic structures keep their shape. Channels
+// and frozen functions are not copied: the message holds a reference to
+// each channel and to each SharedCode region.
+typedef struct {
+	uint8_t* data;
+	size_t length;
+	size_t capacity;
+	int count; // Values in the message
+	int objects; // Objects written so far, the back reference numbers
+	struct sChannel** channels;
+	int channel_count;
+	int channel_capacity;
+	struct sSharedCode** codes;
+	int code_count;
+	int code_capacity;
+	// Writer only: objects already written and their numbers. The keys
+	// are heap addresses, valid until the sender reaches a safe point.
+	Obj** seen;
+	int* seen_numbers;
+	int seen_capacity;
+} Message;
+
+void init_message(Message* message);
+void free_message(Message* message);
+
+// Appends a value. Returns NULL on success, otherwise why the value can't
+// be sent; the message is left as it was before the call.
+const char* write_message(VM* vm, Message* message, Value value);
+
+// Drops the writer's bookkeeping once the last value is written, before
+// the message leaves the sending VM.
+void seal_message(Message* message);
+
+// Rebuilds every value in the message, in order, into a new list. The list
+// is not rooted: push it before allocating anything else.
+ObjList* read_message(VM* vm, Message* message);
+
+#endif
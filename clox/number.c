@@ -0,0 +1,499 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "number.h"
+
+static double decimal_to_double(uint64_t mantissa, int exponent);
+
+// Formatting is Grisu2 (Loitsch, "Printing Floating-Point Numbers Quickly
+// and Accurately with Integers"). The value and its rounding boundaries
+// are scaled by a cached power of ten into 64 bit integers and digits are
+// generated until they fall inside the boundaries. The output always
+// reads back as the same double. Because the boundaries are narrowed to
+// absorb rounding errors, about 1% of round numbers (5e22, 1e23) would
+// come out with 16 or 17 digits. Those are detected and shorten() finds
+// the shorter output with exact checks.
+
+typedef struct {
+    uint64_t f;
+    int e;
+} DiyFp; // f * 2^e
+
+typedef struct {
+    uint64_t f;
+    int e;
+    int k;
+} CachedPower; // f * 2^e ~= 10^k
+
+// Normalized powers 10^k for k = -300, -292, ..., 324.
+static const CachedPower cached_powers[] = {
+    { 0xAB70FE17C79AC6CAULL, -1060, -300 },
+    { 0xFF77B1FCBEBCDC4FULL, -1034, -292 },
+    { 0xBE5691EF416BD60CULL, -1007, -284 },
+    { 0x8DD01FAD907FFC3CULL, -980, -276 },
+    { 0xD3515C2831559A83ULL, -954, -268 },
+    { 0x9D71AC8FADA6C9B5ULL, -927, -260 },
+    { 0xEA9C227723EE8BCBULL, -901, -252 },
+    { 0xAECC49914078536DULL, -874, -244 },
+    { 0x823C12795DB6CE57ULL, -847, -236 },
+    { 0xC21094364DFB5637ULL, -821, -228 },
+    { 0x9096EA6F3848984FULL, -794, -220 },
+    { 0xD77485CB25823AC7ULL, -768, -212 },
+    { 0xA086CFCD97BF97F4ULL, -741, -204 },
+    { 0xEF340A98172AACE5ULL, -715, -196 },
+    { 0xB23867FB2A35B28EULL, -688, -188 },
+    { 0x84C8D4DFD2C63F3BULL, -661, -180 },
+    { 0xC5DD44271AD3CDBAULL, -635, -172 },
+    { 0x936B9FCEBB25C996ULL, -608, -164 },
+    { 0xDBAC6C247D62A584ULL, -582, -156 },
+    { 0xA3AB66580D5FDAF6ULL, -555, -148 },
+    { 0xF3E2F893DEC3F126ULL, -529, -140 },
+    { 0xB5B5ADA8AAFF80B8ULL, -502, -132 },
+    { 0x87625F056C7C4A8BULL, -475, -124 },
+    { 0xC9BCFF6034C13053ULL, -449, -116 },
+    { 0x964E858C91BA2655ULL, -422, -108 },
+    { 0xDFF9772470297EBDULL, -396, -100 },
+    { 0xA6DFBD9FB8E5B88FULL, -369, -92 },
+    { 0xF8A95FCF88747D94ULL, -343, -84 },
+    { 0xB94470938FA89BCFULL, -316, -76 },
+    { 0x8A08F0F8BF0F156BULL, -289, -68 },
+    { 0xCDB02555653131B6ULL, -263, -60 },
+    { 0x993FE2C6D07B7FACULL, -236, -52 },
+    { 0xE45C10C42A2B3B06ULL, -210, -44 },
+    { 0xAA242499697392D3ULL, -183, -36 },
+    { 0xFD87B5F28300CA0EULL, -157, -28 },
+    { 0xBCE5086492111AEBULL, -130, -20 },
+    { 0x8CBCCC096F5088CCULL, -103, -12 },
+    { 0xD1B71758E219652CULL, -77, -4 },
+    { 0x9C40000000000000ULL, -50, 4 },
+    { 0xE8D4A51000000000ULL, -24, 12 },
+    { 0xAD78EBC5AC620000ULL, 3, 20 },
+    { 0x813F3978F8940984ULL, 30, 28 },
+    { 0xC097CE7BC90715B3ULL, 56, 36 },
+    { 0x8F7E32CE7BEA5C70ULL, 83, 44 },
+    { 0xD5D238A4ABE98068ULL, 109, 52 },
+    { 0x9F4F2726179A2245ULL, 136, 60 },
+    { 0xED63A231D4C4FB27ULL, 162, 68 },
+    { 0xB0DE65388CC8ADA8ULL, 189, 76 },
+    { 0x83C7088E1AAB65DBULL, 216, 84 },
+    { 0xC45D1DF942711D9AULL, 242, 92 },
+    { 0x924D692CA61BE758ULL, 269, 100 },
+    { 0xDA01EE641A708DEAULL, 295, 108 },
+    { 0xA26DA3999AEF774AULL, 322, 116 },
+    { 0xF209787BB47D6B85ULL, 348, 124 },
+    { 0xB454E4A179DD1877ULL, 375, 132 },
+    { 0x865B86925B9BC5C2ULL, 402, 140 },
+    { 0xC83553C5C8965D3DULL, 428, 148 },
+    { 0x952AB45CFA97A0B3ULL, 455, 156 },
+    { 0xDE469FBD99A05FE3ULL, 481, 164 },
+    { 0xA59BC234DB398C25ULL, 508, 172 },
+    { 0xF6C69A72A3989F5CULL, 534, 180 },
+    { 0xB7DCBF5354E9BECEULL, 561, 188 },
+    { 0x88FCF317F22241E2ULL, 588, 196 },
+    { 0xCC20CE9BD35C78A5ULL, 614, 204 },
+    { 0x98165AF37B2153DFULL, 641, 212 },
+    { 0xE2A0B5DC971F303AULL, 667, 220 },
+    { 0xA8D9D1535CE3B396ULL, 694, 228 },
+    { 0xFB9B7CD9A4A7443CULL, 720, 236 },
+    { 0xBB764C4CA7A44410ULL, 747, 244 },
+    { 0x8BAB8EEFB6409C1AULL, 774, 252 },
+    { 0xD01FEF10A657842CULL, 800, 260 },
+    { 0x9B10A4E5E9913129ULL, 827, 268 },
+    { 0xE7109BFBA19C0C9DULL, 853, 276 },
+    { 0xAC2820D9623BF429ULL, 880, 284 },
+    { 0x80444B5E7AA7CF85ULL, 907, 292 },
+    { 0xBF21E44003ACDD2DULL, 933, 300 },
+    { 0x8E679C2F5E44FF8FULL, 960, 308 },
+    { 0xD433179D9C8CB841ULL, 986, 316 },
+    { 0x9E19DB92B4E31BA9ULL, 1013, 324 },
+};
+
+#define CACHED_POWERS_MIN_EXP -300
+#define CACHED_POWERS_STEP 8
+
+// The scaled upper boundary lands in [2^ALPHA, 2^GAMMA) so its integer
+// part fits in 32 bits.
+#define ALPHA -60
+#define GAMMA -32
+
+static DiyFp diyfp_multiply(DiyFp x, DiyFp y) {
+#ifdef __SIZEOF_INT128__
+    __uint128_t product = (__uint128_t)x.f * y.f;
+    uint64_t high = (uint64_t)(product >> 64);
+    high += (uint64_t)product >> 63; // Round
+    return (DiyFp){ high, x.e + y.e + 64 };
+#else
+    uint64_t x_lo = (uint32_t)x.f, x_hi = x.f >> 32;
+    uint64_t y_lo = (uint32_t)y.f, y_hi = y.f >> 32;
+    uint64_t lo_lo = x_lo * y_lo, lo_hi = x_lo * y_hi;
+    uint64_t hi_lo = x_hi * y_lo, hi_hi = x_hi * y_hi;
+    uint64_t middle = (lo_lo >> 32) + (uint32_t)lo_hi + (uint32_t)hi_lo;
+    middle += 1u << 31; // Round
+    return (DiyFp){ hi_hi + (lo_hi >> 32) + (hi_lo >> 32) + (middle >> 32), x.e + y.e + 64 };
+#endif
+}
+
+static DiyFp diyfp_normalize(DiyFp x) {
+    while ((x.f >> 63) == 0) {
+        x.f <<= 1;
+        x.e--;
+    }
+    return x;
+}
+
+// The value and the midpoints to its neighbours, all with the exponent of
+// the normalized upper midpoint.
+static void compute_boundaries(double value, DiyFp* w, DiyFp* minus, DiyFp* plus) {
+    const uint64_t hidden_bit = 1ull << 52;
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint64_t fraction = bits & (hidden_bit - 1);
+    int exponent = (int)(bits >> 52);
+
+    DiyFp v = exponent == 0
+        ? (DiyFp){ fraction, 1 - 1075 } // Subnormal
+        : (DiyFp){ fraction + hidden_bit, exponent - 1075 };
+
+    // Powers of two are closer to their lower neighbour.
+    bool lower_closer = fraction == 0 && exponent > 1;
+    DiyFp upper = { 2 * v.f + 1, v.e - 1 };
+    DiyFp lower = lower_closer
+        ? (DiyFp){ 4 * v.f - 1, v.e - 2 }
+        : (DiyFp){ 2 * v.f - 1, v.e - 1 };
+
+    *plus = diyfp_normalize(upper);
+    *minus = (DiyFp){ lower.f << (lower.e - plus->e), plus->e };
+    *w = diyfp_normalize(v);
+}
+
+static CachedPower cached_power_for(int e) {
+    // k = ceil((ALPHA - e - 1) * log10(2)), with log10(2) ~= 78913 / 2^18.
+    int f = ALPHA - e - 1;
+    int k = (f * 78913) / (1 << 18) + (f > 0);
+    int index = (-CACHED_POWERS_MIN_EXP + k + (CACHED_POWERS_STEP - 1)) / CACHED_POWERS_STEP;
+    return cached_powers[index];
+}
+
+static int largest_pow10(uint32_t n, uint32_t* pow10) {
+    static const uint32_t powers[] = {
+        1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000,
+    };
+    int digits = 10;
+    while (digits > 1 && n < powers[digits - 1]) digits--;
+    *pow10 = powers[digits - 1];
+    return digits;
+}
+
+// Moves the last digit down while that brings it closer to the value and
+// stays inside the boundaries.
+static void round_weed(char* buffer, int length, uint64_t distance, uint64_t delta,
+                       uint64_t rest, uint64_t ten_k) {
+    while (rest < distance && delta - rest >= ten_k &&
+           (rest + ten_k < distance || distance - rest > rest + ten_k - distance)) {
+        buffer[length - 1]--;
+        rest += ten_k;
+    }
+}
+
+// Generates the shortest digits between low and high, the ones nearest to
+// mid when there is a choice. All three are scaled by the same power of
+// ten and share the exponent -shift. Returns the number of digits and
+// adds the power of ten of the last one to exponent.
+static int generate_digits(char* buffer, int* exponent,
+                           uint64_t low, uint64_t mid, uint64_t high, int shift) {
+    uint64_t delta = high - low;
+    uint64_t distance = high - mid;
+    uint64_t one = 1ull << shift;
+    uint32_t integral = (uint32_t)(high >> shift);
+    uint64_t fractional = high & (one - 1);
+
+    int length = 0;
+    uint32_t pow10;
+    int n = largest_pow10(integral, &pow10);
+    while (n > 0) {
+        buffer[length++] = (char)('0' + integral / pow10);
+        integral %= pow10;
+        n--;
+        uint64_t rest = ((uint64_t)integral << shift) + fractional;
+        if (rest <= delta) {
+            *exponent += n;
+            round_weed(buffer, length, distance, delta, rest, (uint64_t)pow10 << shift);
+            return length;
+        }
+        pow10 /= 10;
+    }
+
+    for (;;) {
+        fractional *= 10;
+        delta *= 10;
+        distance *= 10;
+        buffer[length++] = (char)('0' + (fractional >> shift));
+        fractional &= one - 1;
+        (*exponent)--;
+        if (fractional <= delta) break;
+    }
+    round_weed(buffer, length, distance, delta, fractional, one);
+    return length;
+}
+
+// Writes the digits of a positive finite value. value = digits * 10^exponent.
+// Sets maybe_longer when a shorter output may exist, see shorten().
+static int grisu2(double value, char* buffer, int* exponent, bool* maybe_longer) {
+    DiyFp v, minus, plus;
+    compute_boundaries(value, &v, &minus, &plus);
+
+    CachedPower cached = cached_power_for(plus.e);
+    DiyFp c = { cached.f, cached.e };
+    DiyFp w = diyfp_multiply(v, c);
+    DiyFp w_minus = diyfp_multiply(minus, c);
+    DiyFp w_plus = diyfp_multiply(plus, c);
+    int shift = -w_plus.e;
+
+    // The products may be off by one unit either way. Digits inside the
+    // narrowed interval are always safe.
+    *exponent = -cached.k;
+    int length = generate_digits(buffer, exponent, w_minus.f + 1, w.f, w_plus.f - 1, shift);
+
+    // Only a long result can have a shorter one that was lost in the
+    // narrowing. Generating over the widened interval tells whether one
+    // could exist at all.
+    *maybe_longer = false;
+    if (length >= 16) {
+        char wide[20];
+        int wide_exponent = -cached.k;
+        *maybe_longer = w_plus.f == UINT64_MAX ||
+            generate_digits(wide, &wide_exponent, w_minus.f - 1, w.f, w_plus.f + 1, shift) < length;
+    }
+    return length;
+}
+
+static int write_digits(uint64_t value, char* digits) {
+    char reversed[20];
+    int count = 0;
+    do {
+        reversed[count++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value > 0);
+    for (int i = 0; i < count; i++) digits[i] = reversed[count - 1 - i];
+    return count;
+}
+
+// The shortest representation with one digit less is the Grisu2 output
+// cut to that length or the next number up, since any number between
+// them is also inside the rounding interval. Keeps cutting while one of
+// them still reads back as the value.
+static int shorten(double value, char* digits, int count, int* exponent) {
+    while (count > 1) {
+        int length = count - 1;
+        uint64_t prefix = 0;
+        for (int i = 0; i < length; i++) prefix = prefix * 10 + (digits[i] - '0');
+        int shorter_exponent = *exponent + 1;
+
+        // Try the one nearer to the Grisu2 output first.
+        bool round_up = digits[length] >= '5';
+        uint64_t nearer = round_up ? prefix + 1 : prefix;
+        uint64_t farther = round_up ? prefix : prefix + 1;
+        uint64_t chosen;
+        if (decimal_to_double(nearer, shorter_exponent) == value) {
+            chosen = nearer;
+        } else if (decimal_to_double(farther, shorter_exponent) == value) {
+            chosen = farther;
+        } else {
+            break;
+        }
+
+        while (chosen % 10 == 0) {
+            chosen /= 10;
+            shorter_exponent++;
+        }
+        count = write_digits(chosen, digits);
+        *exponent = shorter_exponent;
+    }
+    return count;
+}
+
+static int write_exponent(char* buffer, int exponent) {
+    int length = 0;
+    buffer[length++] = 'e';
+    buffer[length++] = exponent < 0 ? '-' : '+';
+    if (exponent < 0) exponent = -exponent;
+    if (exponent >= 100) buffer[length++] = (char)('0' + exponent / 100);
+    if (exponent >= 10) buffer[length++] = (char)('0' + exponent / 10 % 10);
+    buffer[length++] = (char)('0' + exponent % 10);
+    return length;
+}
+
+int format_number(double value, char* buffer) {
+    if (isnan(value)) {
+        memcpy(buffer, "nan", 3);
+        return 3;
+    }
+    int length = 0;
+    if (signbit(value)) {
+        buffer[length++] = '-';
+        value = -value;
+    }
+    if (isinf(value)) {
+        memcpy(buffer + length, "inf", 3);
+        return length + 3;
+    }
+    if (value == 0) {
+        buffer[length++] = '0';
+        return length;
+    }
+
+    char digits[20];
+    int exponent;
+    bool maybe_longer;
+    int count = grisu2(value, digits, &exponent, &maybe_longer);
+    if (maybe_longer) count = shorten(value, digits, count, &exponent);
+    int point = count + exponent; // value = 0.digits * 10^point
+
+    if (count <= point && point <= 21) {
+        // 1234000
+        memcpy(buffer + length, digits, count);
+        memset(buffer + length + count, '0', point - count);
+        return length + point;
+    }
+    if (0 < point && point <= 21) {
+        // 12.34
+        memcpy(buffer + length, digits, point);
+        buffer[length + point] = '.';
+        memcpy(buffer + length + point + 1, digits + point, count - point);
+        return length + count + 1;
+    }
+    if (-6 < point && point <= 0) {
+        // 0.001234
+        buffer[length++] = '0';
+        buffer[length++] = '.';
+        memset(buffer + length, '0', -point);
+        memcpy(buffer + length - point, digits, count);
+        return length - point + count;
+    }
+    // 1.234e+25
+    buffer[length++] = digits[0];
+    if (count > 1) {
+        buffer[length++] = '.';
+        memcpy(buffer + length, digits + 1, count - 1);
+        length += count - 1;
+    }
+    return length + write_exponent(buffer + length, point - 1);
+}
+
+// Parsing takes Clinger's fast path: a mantissa of at most 2^53 and a
+// power of ten up to 10^22 are both exact doubles, so one correctly
+// rounded multiplication or division gives the exact result. That covers
+// almost every literal. Longer mantissas and larger exponents fall back
+// to strtod.
+
+#define MAX_EXACT_MANTISSA (1ull << 53)
+#define MAX_EXACT_POW10 22
+
+static const double exact_powers[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+static bool is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+static double parse_slow(const char* chars, int length) {
+    char small[64];
+    char* copy = length < (int)sizeof(small) ? small : malloc(length + 1);
+    memcpy(copy, chars, length);
+    copy[length] = '\0';
+    double result = strtod(copy, NULL);
+    if (copy != small) free(copy);
+    return result;
+}
+
+// mantissa * 10^exponent, correctly rounded.
+static double decimal_to_double(uint64_t mantissa, int exponent) {
+    if (mantissa <= MAX_EXACT_MANTISSA) {
+        double value = (double)mantissa;
+        if (mantissa == 0 || exponent == 0) return value;
+        if (exponent < 0 && exponent >= -MAX_EXACT_POW10) {
+            return value / exact_powers[-exponent];
+        }
+        if (exponent > 0 && exponent <= MAX_EXACT_POW10) {
+            return value * exact_powers[exponent];
+        }
+        if (exponent > MAX_EXACT_POW10 && exponent <= MAX_EXACT_POW10 + 15) {
+            // 12e30 is 12000000000e22: still exact while the mantissa fits.
+            uint64_t scaled = mantissa;
+            int i = MAX_EXACT_POW10;
+            for (; i < exponent && scaled <= MAX_EXACT_MANTISSA; i++) scaled *= 10;
+            if (i == exponent && scaled <= MAX_EXACT_MANTISSA) {
+                return (double)scaled * exact_powers[MAX_EXACT_POW10];
+            }
+        }
+    }
+    char buffer[48];
+    int length = snprintf(buffer, sizeof(buffer), "%" PRIu64 "e%d", mantissa, exponent);
+    return parse_slow(buffer, length);
+}
+
+bool parse_number(const char* chars, int length, double* result) {
+    const char* current = chars;
+    const char* end = chars + length;
+    bool negative = false;
+    if (current < end && (*current == '-' || *current == '+')) {
+        negative = *current == '-';
+        current++;
+    }
+
+    uint64_t mantissa = 0;
+    int significant = 0; // Digits in the mantissa, leading zeros excluded.
+    int exponent = 0;
+    bool truncated = false;
+    int digits = 0;
+    for (; current < end && is_digit(*current); current++, digits++) {
+        if (significant < 19) {
+            mantissa = mantissa * 10 + (*current - '0');
+            if (mantissa > 0) significant++;
+        } else {
+            exponent++;
+            truncated |= *current != '0';
+        }
+    }
+    if (current < end && *current == '.') {
+        current++;
+        for (; current < end && is_digit(*current); current++, digits++) {
+            if (significant < 19) {
+                mantissa = mantissa * 10 + (*current - '0');
+                if (mantissa > 0) significant++;
+                exponent--;
+            } else {
+                truncated |= *current != '0';
+            }
+        }
+    }
+    if (digits == 0) return false;
+
+    if (current < end && (*current == 'e' || *current == 'E')) {
+        current++;
+        bool negative_exponent = false;
+        if (current < end && (*current == '-' || *current == '+')) {
+            negative_exponent = *current == '-';
+            current++;
+        }
+        if (current == end || !is_digit(*current)) return false;
+        int written = 0;
+        for (; current < end && is_digit(*current); current++) {
+            if (written < 100000) written = written * 10 + (*current - '0');
+        }
+        exponent += negative_exponent ? -written : written;
+    }
+    if (current != end) return false;
+
+    if (truncated) {
+        *result = parse_slow(chars, length);
+        return true;
+    }
+    double value = decimal_to_double(mantissa, exponent);
+    *result = negative ? -value : value;
+    return true;
+}
@@ -0,0 +1,18 @@
+#ifndef clox_number_h
+#define clox_number_h
+
+#include "common.h"
+
+// Enough for "-0.000001" followed by 17 digits or "-1.2345678901234567e-308".
+#define NUMBER_BUFFER_SIZE 32
+
+// Writes the shortest digits that read back as the same double, without a
+// terminating NUL, and returns the length. Uses plain notation between
+// 1e-6 and 1e21 and exponent notation (1e+21, 1.5e-7) outside.
+int format_number(double value, char* buffer);
+
+// Parses [+-]digits[.digits][(e|E)[+-]digits], where either side of the
+// dot may be empty. Returns false when the whole text is not a number.
+bool parse_number(const char* chars, int length, double* result);
+
+#endif
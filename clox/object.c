@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "memory.h"
@@ -7,141 +8,382 @@
 #include "table.h"
 #include "vm.h"
 #include "debug.h"
+#include "hash.h"
+#include "jit.h"
+#include "map.h"
+#include "isolate.h"
 
-#define ALLOCATE_OBJ(type, objectType) \
-    (type*)allocate_object(sizeof(type), objectType)
+#define ALLOCATE_OBJ(vm, type, objectType) \
+    (type*)allocate_object(vm, sizeof(type), objectType)
 
-static ObjString* allocate_string(const char* chars, int length, uint32_t hash);
-static Obj* allocate_object(size_t size, ObjType type);
-static uint32_t hash_string(const char* chars, int length);
-void print_function(ObjFunction* func);
+static ObjString* add_string(VM* vm, ObjString* string);
+static Obj* allocate_object(VM* vm, size_t size, ObjType type);
+static void write_function(Output* out, ObjFunction* func);
+static void write_rope_to(Output* out, ObjRope* rope);
+static void write_list(Output* out, ObjList* list);
+static void write_float_array(Output* out, ObjFloatArray* array);
+static void write_map(Output* out, ObjMap* map);
 
-ObjString* copy_string(const char* chars, int length) {
+ObjString* copy_string(VM* vm, const char* chars, int length) {
     uint32_t hash = hash_string(chars, length);
-    ObjString* interned = table_find_string(&vm.strings, chars, length, hash);
+    ObjString* interned = intern_set_find(&vm->strings, chars, length, hash);
     if(interned != NULL) return interned;
 
-    char* heapChars = ALLOCATE(char, length + 1); // Copy string to heap
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
-    return allocate_string(heapChars, length, hash);
+    ObjString* string = allocate_string(vm, length); // Header and chars in one block
+    memcpy(string->chars, chars, length);
+    string->hash = hash;
+    return add_string(vm, string);
 }
 
-static ObjString* allocate_string(const char* chars, int length, uint32_t hash) {
-    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+// Creates a string with room for length chars that is not interned yet.
+// The caller must fill chars and call intern_string before allocating
+// anything else.
+ObjString* allocate_string(VM* vm, int length) {
+    ObjString* string = (ObjString*)allocate_object(vm, STRING_SIZE(length), OBJ_STRING);
     string->length = length;
-    string->chars = (char *)chars;
-    string->hash = hash;
-    stack_push(OBJ_VALUE(string)); // GC mark needs to discover our object.
-    table_set(&vm.strings, string, NIL_VALUE());
-    stack_pop(); // GC its safe now.
+    string->hash = 0;
+    string->chars[length] = '\0';
+    return string;
+}
+
+ObjString* intern_string(VM* vm, ObjString* string) {
+    string->hash = hash_string(string->chars, string->length);
+    ObjString* interned = intern_set_find(&vm->strings, string->chars, string->length, string->hash);
+    if(interned == NULL) return add_string(vm, string);
+
+    // Nothing was allocated since allocate_string, so the string is still
+    // the head of the object list and can be released right away.
+    vm->objects = string->obj.next;
+    reallocate(vm, string, STRING_SIZE(string->length), 0);
+    return interned;
+}
+
+static ObjString* add_string(VM* vm, ObjString* string) {
+    stack_push(vm, OBJ_VALUE(string)); // GC mark needs to discover our object.
+    intern_set_add(vm, &vm->strings, string);
+    stack_pop(vm); // GC its safe now.
     return string;
 }
 
-static Obj* allocate_object(size_t size, ObjType type) {
-    Obj* object = (Obj*)reallocate(NULL, 0, size);
+static Obj* allocate_object(VM* vm, size_t size, ObjType type) {
+    Obj* object = (Obj*)reallocate(vm, NULL, 0, size);
     object->type = type;
     object->is_marked = false;
-    object->next = vm.objects;
-    vm.objects = object;
+    object->in_region = false;
+    object->shared = false;
+    object->next = vm->objects;
+    vm->objects = object;
 #ifdef DEBUG_LOG_GC
     printf("%p allocate %ld for %s\n", (void*)object, size, get_obj_str(type));
 #endif
     return object;
 }
 
-void print_object(Value value) {
+void write_object(Output* out, Value value) {
     switch(OBJ_TYPE(value)) {
-    case OBJ_FUNCTION: print_function(AS_FUNCTION(value)); break;
-    case OBJ_CLOSURE: print_function(AS_CLOSURE(value)->function); break;
-    case OBJ_STRING: printf("%s", AS_CSTRING(value)); break;
-    case OBJ_NATIVE: printf("<native code>"); break;
-    case OBJ_UPVALUE: printf("upvalue"); break;
-    case OBJ_CLASS: printf("Class %s", AS_CLASS(value)->name->chars); break;
-    case OBJ_INSTANCE: printf("Instance of class %s [%p]", AS_INSTANCE(value)->klass->name->chars, AS_INSTANCE(value)); break;
-    case OBJ_BOUND_METHOD:  print_function(AS_BOUND_METHOD(value)->method->function); break;
+    case OBJ_FUNCTION: write_function(out, AS_FUNCTION(value)); break;
+    case OBJ_CLOSURE: write_function(out, AS_CLOSURE(value)->function); break;
+    case OBJ_STRING: output_bytes(out, AS_CSTRING(value), AS_STRING(value)->length); break;
+    case OBJ_NATIVE: output_cstring(out, "<native code>"); break;
+    case OBJ_UPVALUE: output_cstring(out, "upvalue"); break;
+    case OBJ_CLASS:
+        output_cstring(out, "Class ");
+        output_cstring(out, AS_CLASS(value)->name->chars);
+        break;
+    case OBJ_INSTANCE: {
+        char address[32];
+        snprintf(address, sizeof(address), " [%p]", (void*)AS_INSTANCE(value));
+        output_cstring(out, "Instance of class ");
+        output_cstring(out, AS_INSTANCE(value)->klass->name->chars);
+        output_cstring(out, address);
+        break;
+    }
+    case OBJ_BOUND_METHOD: write_function(out, AS_BOUND_METHOD(value)->method->function); break;
+    case OBJ_ROPE: write_rope_to(out, AS_ROPE(value)); break;
+    case OBJ_LIST: write_list(out, AS_LIST(value)); break;
+    case OBJ_MAP: write_map(out, AS_MAP(value)); break;
+    case OBJ_FLOAT_ARRAY: write_float_array(out, AS_FLOAT_ARRAY(value)); break;
+    case OBJ_LINE_READER: output_cstring(out, "<line reader>"); break;
+    case OBJ_CHANNEL: output_cstring(out, "<channel>"); break;
+    case OBJ_ISOLATE: output_cstring(out, "<isolate>"); break;
+    case OBJ_FIBER: output_cstring(out, "<fiber>"); break;
     }
 }
 
-void print_function(ObjFunction* func) {
+static void write_function(Output* out, ObjFunction* func) {
     if(func->name == NULL) {
-        printf("<GLOBAL>");
+        output_cstring(out, "<GLOBAL>");
         return;
     }
-    printf("<fn %s>", func->name->chars);
+    output_cstring(out, "<fn ");
+    output_cstring(out, func->name->chars);
+    output_char(out, '>');
 }
 
-ObjString* take_string(const char* chars, int length) {
-    uint32_t hash = hash_string(chars, length);
-    ObjString* interned = table_find_string(&vm.strings, chars, length, hash);
-    if(interned != NULL) {
-        FREE_ARRAY(char, (char*)chars, length + 1);
-        return interned;
+// Takes ownership of a heap buffer allocated with ALLOCATE. Strings keep
+// their chars inline, so the buffer is copied and released.
+ObjString* take_string(VM* vm, const char* chars, int length) {
+    ObjString* string = copy_string(vm, chars, length);
+    FREE_ARRAY(vm, char, (char*)chars, length + 1);
+    return string;
+}
+
+static int node_length(Obj* text) {
+    return text->type == OBJ_ROPE ? ((ObjRope*)text)->length : ((ObjString*)text)->length;
+}
+
+ObjRope* new_rope(VM* vm, Obj* left, Obj* right) {
+    ObjRope* rope = ALLOCATE_OBJ(vm, ObjRope, OBJ_ROPE);
+    rope->length = node_length(left) + node_length(right);
+    rope->left = left;
+    rope->right = right;
+    rope->flat = NULL;
+    return rope;
+}
+
+// Copies the rope bytes into dest. Does not allocate on the GC heap.
+// Pieces are written at their final offset, so the order of the walk does
+// not matter: strings are copied as soon as they are found and only ropes
+// are pushed. Ropes built appending (or prepending) in a loop keep the
+// pending list at a single element regardless of their depth.
+static void write_rope(ObjRope* root, char* dest) {
+    typedef struct { ObjRope* rope; int offset; } Pending;
+    int capacity = 8;
+    int count = 0;
+    Pending* pending = malloc(sizeof(Pending) * capacity);
+    pending[count++] = (Pending){ root, 0 };
+
+    while(count > 0) {
+        Pending current = pending[--count];
+        if(current.rope->flat != NULL) {
+            ObjString* flat = current.rope->flat;
+            memcpy(dest + current.offset, flat->chars, flat->length);
+            continue;
+        }
+        Obj* children[2] = { current.rope->left, current.rope->right };
+        int offset = current.offset;
+        for(int i = 0; i < 2; i++) {
+            if(children[i]->type == OBJ_STRING) {
+                ObjString* string = (ObjString*)children[i];
+                memcpy(dest + offset, string->chars, string->length);
+            } else {
+                if(capacity < count + 1) {
+                    capacity *= 2;
+                    pending = realloc(pending, sizeof(Pending) * capacity);
+                }
+                pending[count++] = (Pending){ (ObjRope*)children[i], offset };
+            }
+            offset += node_length(children[i]);
+        }
     }
-    return allocate_string(chars, length, hash);
+    free(pending);
 }
 
-static uint32_t hash_string(const char* chars, int length) {
-    uint32_t hash = 2166136261u;
-    for (int i = 0; i < length; i++) {
-        hash ^= chars[i];
-        hash *= 16777619;
+// The rope must be reachable by the GC (usually it is on the stack).
+ObjString* flatten_rope(VM* vm, ObjRope* rope) {
+    if(rope->flat != NULL) return rope->flat;
+    ObjString* string = allocate_string(vm, rope->length);
+    write_rope(rope, string->chars);
+    rope->flat = intern_string(vm, string);
+    rope->left = NULL; // Let the pieces die.
+    rope->right = NULL;
+    return rope->flat;
+}
+
+static void write_rope_to(Output* out, ObjRope* rope) {
+    if(rope->flat != NULL) {
+        output_bytes(out, rope->flat->chars, rope->flat->length);
+        return;
     }
-    return hash;
+    char* chars = malloc(rope->length);
+    write_rope(rope, chars);
+    output_bytes(out, chars, rope->length);
+    free(chars);
 }
 
-ObjFunction* new_function() {
-    ObjFunction* func = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
+ObjFunction* new_function(VM* vm) {
+    ObjFunction* func = ALLOCATE_OBJ(vm, ObjFunction, OBJ_FUNCTION);
     func->arity = 0;
     func->upvalue_count = 0;
     init_chunk(&func->chunk);
     func->name = NULL;
+#ifdef CLOX_JIT
+    func->jit = new_jit_function();
+#endif
     return func;
 }
 
-ObjNative* new_native(NativeFn function) {
-    ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
+ObjNative* new_native(VM* vm, NativeFn function) {
+    ObjNative* native = ALLOCATE_OBJ(vm, ObjNative, OBJ_NATIVE);
     native->function = function;
     return native;
 }
 
-ObjClosure* new_closure(ObjFunction* function) {
-    ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, function->upvalue_count);
+ObjClosure* new_closure(VM* vm, ObjFunction* function) {
+    ObjUpvalue** upvalues = ALLOCATE(vm, ObjUpvalue*, function->upvalue_count);
     for(int i = 0; i < function->upvalue_count; i++) {
         upvalues[i] = NULL;
     }
-    ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+    ObjClosure* closure = ALLOCATE_OBJ(vm, ObjClosure, OBJ_CLOSURE);
     closure->function = function;
     closure->upvalues = upvalues;
     closure->upvalue_count = function->upvalue_count;
     return closure;
 }
 
-ObjUpvalue* new_upvalue(Value* slot) {
-    ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
+ObjUpvalue* new_upvalue(VM* vm, Value* slot) {
+    ObjUpvalue* upvalue = ALLOCATE_OBJ(vm, ObjUpvalue, OBJ_UPVALUE);
     upvalue->location = slot;
     upvalue->next = NULL;
     upvalue->closed = NIL_VALUE();
     return upvalue;
 }
 
-ObjClass* new_class(ObjString* name) {
-    ObjClass* klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
+ObjClass* new_class(VM* vm, ObjString* name) {
+    ObjClass* klass = ALLOCATE_OBJ(vm, ObjClass, OBJ_CLASS);
     klass->name = name;
     init_table(&klass->methods);
     return klass;
 }
 
-ObjInstance* new_instance(ObjClass* klass) {
-    ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+ObjInstance* new_instance(VM* vm, ObjClass* klass) {
+    ObjInstance* instance = ALLOCATE_OBJ(vm, ObjInstance, OBJ_INSTANCE);
     instance->klass = klass;
     init_table(&instance->fields);
     return instance;
 }
 
-ObjBoundMethod* new_bound_method(Value receiver, ObjClosure* method) {
-    ObjBoundMethod* bound = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
+ObjBoundMethod* new_bound_method(VM* vm, Value receiver, ObjClosure* method) {
+    ObjBoundMethod* bound = ALLOCATE_OBJ(vm, ObjBoundMethod, OBJ_BOUND_METHOD);
     bound->receiver = receiver;
     bound->method = method;
     return bound;
-}
\ No newline at end of file
+}
+
+ObjList* new_list(VM* vm) {
+    ObjList* list = ALLOCATE_OBJ(vm, ObjList, OBJ_LIST);
+    init_valuearray(&list->items);
+    return list;
+}
+
+ObjMap* new_map(VM* vm) {
+    ObjMap* map = ALLOCATE_OBJ(vm, ObjMap, OBJ_MAP);
+    init_map(map);
+    return map;
+}
+
+// Takes ownership of the file.
+ObjLineReader* new_line_reader(VM* vm, MappedFile* file) {
+    ObjLineReader* reader = ALLOCATE_OBJ(vm, ObjLineReader, OBJ_LINE_READER);
+    reader->file = *file;
+    reader->position = 0;
+    return reader;
+}
+
+// Takes a new reference to the channel.
+ObjChannel* new_channel(VM* vm, Channel* channel) {
+    ObjChannel* handle = ALLOCATE_OBJ(vm, ObjChannel, OBJ_CHANNEL);
+    retain_channel(channel);
+    handle->channel = channel;
+    return handle;
+}
+
+// Takes over the caller's reference to the isolate.
+ObjIsolate* new_isolate(VM* vm, Isolate* isolate) {
+    ObjIsolate* handle = ALLOCATE_OBJ(vm, ObjIsolate, OBJ_ISOLATE);
+    handle->isolate = isolate;
+    handle->joined = false;
+    return handle;
+}
+
+// Without a closure the fiber is the main script's, already running. The
+// frames are allocated before the fiber so a collection never sees it half
+// built.
+ObjFiber* new_fiber(VM* vm, ObjClosure* closure) {
+    CallFrame* frames = ALLOCATE(vm, CallFrame, FRAMES_MAX);
+    ObjFiber* fiber = ALLOCATE_OBJ(vm, ObjFiber, OBJ_FIBER);
+    fiber->closure = closure;
+    fiber->state = closure == NULL ? FIBER_RUNNING : FIBER_NEW;
+    fiber->caller = NULL;
+    fiber->resumed_at = 0;
+    fiber->frames = frames;
+    fiber->frames_count = 0;
+    fiber->stack = reserve_stack();
+    fiber->stack_top = fiber->stack;
+    fiber->open_upvalues = NULL;
+    if (closure != NULL) *fiber->stack_top++ = OBJ_VALUE(closure);
+    return fiber;
+}
+
+// Elements start at zero. The data is allocated first so a collection
+// triggered by either allocation never sees a half built array.
+ObjFloatArray* new_float_array(VM* vm, int length) {
+    double* data = NULL;
+    if (length > 0) {
+        data = ALLOCATE(vm, double, length);
+        memset(data, 0, sizeof(double) * length);
+    }
+    ObjFloatArray* array = ALLOCATE_OBJ(vm, ObjFloatArray, OBJ_FLOAT_ARRAY);
+    array->length = length;
+    array->data = data;
+    return array;
+}
+
+// Containers being printed, outermost first. A container that contains
+// itself, directly or not, prints as [...] or {...}. Per thread, like the
+// compiler state, since printing never needs the VM.
+#define PRINT_DEPTH_MAX 64
+static _Thread_local Obj* printing[PRINT_DEPTH_MAX];
+static _Thread_local int printing_count = 0;
+
+static bool start_printing(Obj* container) {
+    if (printing_count == PRINT_DEPTH_MAX) return false;
+    for (int i = 0; i < printing_count; i++) {
+        if (printing[i] == container) return false;
+    }
+    printing[printing_count++] = container;
+    return true;
+}
+
+static void write_list(Output* out, ObjList* list) {
+    if (!start_printing((Obj*)list)) {
+        output_cstring(out, "[...]");
+        return;
+    }
+    output_char(out, '[');
+    for (int i = 0; i < list->items.size; i++) {
+        if (i > 0) output_cstring(out, ", ");
+        write_value(out, list->items.values[i]);
+    }
+    output_char(out, ']');
+    printing_count--;
+}
+
+static void write_map(Output* out, ObjMap* map) {
+    if (!start_printing((Obj*)map)) {
+        output_cstring(out, "{...}");
+        return;
+    }
+    output_char(out, '{');
+    bool first = true;
+    for (int i = 0; i < map->capacity; i++) {
+        MapEntry* entry = &map->entries[i];
+        if (IS_NIL(entry->key)) continue;
+        if (!first) output_cstring(out, ", ");
+        first = false;
+        write_value(out, entry->key);
+        output_cstring(out, ": ");
+        write_value(out, entry->value);
+    }
+    output_char(out, '}');
+    printing_count--;
+}
+
+static void write_float_array(Output* out, ObjFloatArray* array) {
+    output_cstring(out, "Float64Array[");
+    for (int i = 0; i < array->length; i++) {
+        if (i > 0) output_cstring(out, ", ");
+        output_number(out, array->data[i]);
+    }
+    output_char(out, ']');
+}
@@ -5,6 +5,8 @@
 #include "values.h"
 #include "chunk.h"
 #include "table.h"
+#include "output.h"
+#include "mapped_file.h"
 
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
 
@@ -15,6 +17,15 @@
 #define IS_CLASS(value) is_obj_type(value, OBJ_CLASS)
 #define IS_INSTANCE(value) is_obj_type(value, OBJ_INSTANCE)
 #define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
+#define IS_ROPE(value) is_obj_type(value, OBJ_ROPE)
+#define IS_TEXT(value) (IS_STRING(value) || IS_ROPE(value))
+#define IS_LIST(value) is_obj_type(value, OBJ_LIST)
+#define IS_MAP(value) is_obj_type(value, OBJ_MAP)
+#define IS_FLOAT_ARRAY(value) is_obj_type(value, OBJ_FLOAT_ARRAY)
+#define IS_LINE_READER(value) is_obj_type(value, OBJ_LINE_READER)
+#define IS_CHANNEL(value) is_obj_type(value, OBJ_CHANNEL)
+#define IS_ISOLATE(value) is_obj_type(value, OBJ_ISOLATE)
+#define IS_FIBER(value) is_obj_type(value, OBJ_FIBER)
 
 #define AS_STRING(value) ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString*)AS_OBJ(value))->chars)
@@ -24,6 +35,14 @@
 #define AS_CLASS(value) ((ObjClass*)AS_OBJ(value))
 #define AS_INSTANCE(value) ((ObjInstance*)AS_OBJ(value))
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
+#define AS_ROPE(value) ((ObjRope*)AS_OBJ(value))
+#define AS_LIST(value) ((ObjList*)AS_OBJ(value))
+#define AS_MAP(value) ((ObjMap*)AS_OBJ(value))
+#define AS_FLOAT_ARRAY(value) ((ObjFloatArray*)AS_OBJ(value))
+#define AS_LINE_READER(value) ((ObjLineReader*)AS_OBJ(value))
+#define AS_CHANNEL(value) ((ObjChannel*)AS_OBJ(value))
+#define AS_ISOLATE(value) ((ObjIsolate*)AS_OBJ(value))
+#define AS_FIBER(value) ((ObjFiber*)AS_OBJ(value))
 
 typedef enum {
     OBJ_STRING,
@@ -34,25 +53,49 @@ typedef enum {
 	OBJ_CLASS,
 	OBJ_INSTANCE,
 	OBJ_BOUND_METHOD,
+	OBJ_ROPE,
+	OBJ_LIST,
+	OBJ_MAP,
+	OBJ_FLOAT_ARRAY,
+	OBJ_LINE_READER,
+	OBJ_CHANNEL,
+	OBJ_ISOLATE,
+	OBJ_FIBER,
 } ObjType;
 
+#define OBJ_TYPE_COUNT (OBJ_FIBER + 1)
+
 struct sObj {
     ObjType type;
 	bool is_marked;
+	bool in_region; // Lives inside a compaction Region, see memory.h
+	bool shared; // Frozen into a SharedCode region, see shared.h
     struct sObj* next;
 };
 
 struct sObjString {
 	Obj obj;
 	int length;
-	char* chars;
 	uint32_t hash;
+	char chars[]; // Stored inline. Always NUL terminated.
 };
 
+#define STRING_SIZE(length) (sizeof(ObjString) + (length) + 1)
+
+// Lazy concatenation. Flattened into an interned ObjString only when the
+// bytes are needed (comparison, printing, used as key).
+typedef struct {
+	Obj obj;
+	int length;
+	Obj* left; // ObjString or ObjRope. NULL once flattened.
+	Obj* right;
+	ObjString* flat;
+} ObjRope;
+
 typedef struct sUpvalue {
 	Obj obj;
 	Value* location;
-	Value closed;
+	Value closed; // While open, the fiber whose stack holds the variable
 	struct sUpvalue* next;
 } ObjUpvalue;
 
@@ -62,6 +105,9 @@ typedef struct {
 	Chunk chunk;
 	ObjString* name;
 	int upvalue_count;
+#ifdef CLOX_JIT
+	struct sJitFunction* jit; // Call count and machine code, see jit.h
+#endif
 } ObjFunction;
 
 typedef struct {
@@ -71,6 +117,12 @@ typedef struct {
 	int upvalue_count;
 } ObjClosure;
 
+typedef struct {
+	ObjClosure* closure;
+	uint8_t* pc;
+	Value* slots;
+} CallFrame;
+
 typedef struct sObjClass {
 	Obj obj;
 	ObjString* name;
@@ -89,7 +141,86 @@ typedef struct {
 	ObjClosure* method;
 } ObjBoundMethod;
 
-typedef Value (*NativeFn)(int arg_count, Value* args);
+// Elements are stored contiguously and grow like any other ValueArray.
+typedef struct {
+	Obj obj;
+	ValueArray items;
+} ObjList;
+
+typedef struct {
+	Value key; // Nil for free slots. See map.c
+	Value value;
+} MapEntry;
+
+// Hash map keyed by any value except nil. Strings hash by content and
+// other objects by address, so maps are rehashed after a compaction.
+typedef struct {
+	Obj obj;
+	int count;
+	int tombstones;
+	int capacity;
+	bool stale; // Objects moved since the last rehash.
+	MapEntry* entries;
+} ObjMap;
+
+// Fixed length array of raw doubles. Elements are not Values, so bulk
+// natives can run SIMD kernels over them (see vector.h).
+typedef struct {
+	Obj obj;
+	int length;
+	double* data;
+} ObjFloatArray;
+
+// Reads a mapped file one line at a time. Each line is copied once, into
+// its string, and the file is unmapped when the reader is closed or freed.
+typedef struct {
+	Obj obj;
+	MappedFile file;
+	size_t position;
+} ObjLineReader;
+
+// Handle on a channel shared with other VMs, see isolate.h. Each handle
+// holds a reference to the channel.
+typedef struct {
+	Obj obj;
+	struct sChannel* channel;
+} ObjChannel;
+
+// Handle on a function running in another VM, see isolate.h.
+typedef struct {
+	Obj obj;
+	struct sIsolate* isolate;
+	bool joined;
+} ObjIsolate;
+
+typedef enum {
+	FIBER_NEW, // Not resumed yet
+	FIBER_RUNNING,
+	FIBER_WAITING, // Resumed another fiber
+	FIBER_SUSPENDED, // Yielded
+	FIBER_PARKED, // Waiting in the event loop, see event_loop.h
+	FIBER_DONE,
+} FiberState;
+
+// A function with its own value stack and call frames, so it can stop
+// half way and be resumed later. The VM works on the running fiber's
+// stack through its own registers; the fields below are saved copies,
+// valid while the fiber is not running. The stack never moves, so open
+// upvalues into a suspended fiber stay valid.
+typedef struct sObjFiber {
+	Obj obj;
+	ObjClosure* closure; // NULL for the main script
+	FiberState state;
+	struct sObjFiber* caller; // Fiber to return to on yield
+	int resumed_at; // vm->nested_runs when last resumed
+	CallFrame* frames;
+	int frames_count;
+	Value* stack; // NULL once done
+	Value* stack_top;
+	ObjUpvalue* open_upvalues;
+} ObjFiber;
+
+typedef Value (*NativeFn)(VM* vm, int arg_count, Value* args);
 
 typedef struct {
   Obj obj;
@@ -100,16 +231,31 @@ static inline bool is_obj_type(Value value, ObjType type) {
   return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
-ObjString* copy_string(const char* chars, int length);
-void print_object(Value value);
-ObjString* take_string(const char* chars, int length);
-
-ObjFunction* new_function();
-ObjNative* new_native(NativeFn function);
-ObjClosure* new_closure(ObjFunction* function);
-ObjUpvalue* new_upvalue(Value* slot);
-ObjClass* new_class(ObjString* name);
-ObjInstance* new_instance(ObjClass* klass);
-ObjBoundMethod* new_bound_method(Value receiver, ObjClosure* method);
+static inline int text_length(Value text) {
+  return IS_ROPE(text) ? AS_ROPE(text)->length : AS_STRING(text)->length;
+}
+
+ObjString* copy_string(VM* vm, const char* chars, int length);
+void write_object(Output* out, Value value);
+ObjString* take_string(VM* vm, const char* chars, int length);
+ObjString* allocate_string(VM* vm, int length);
+ObjString* intern_string(VM* vm, ObjString* string);
+ObjRope* new_rope(VM* vm, Obj* left, Obj* right);
+ObjString* flatten_rope(VM* vm, ObjRope* rope);
+
+ObjFunction* new_function(VM* vm);
+ObjNative* new_native(VM* vm, NativeFn function);
+ObjClosure* new_closure(VM* vm, ObjFunction* function);
+ObjUpvalue* new_upvalue(VM* vm, Value* slot);
+ObjClass* new_class(VM* vm, ObjString* name);
+ObjInstance* new_instance(VM* vm, ObjClass* klass);
+ObjBoundMethod* new_bound_method(VM* vm, Value receiver, ObjClosure* method);
+ObjList* new_list(VM* vm);
+ObjMap* new_map(VM* vm);
+ObjFloatArray* new_float_array(VM* vm, int length);
+ObjLineReader* new_line_reader(VM* vm, MappedFile* file);
+ObjChannel* new_channel(VM* vm, struct sChannel* channel);
+ObjIsolate* new_isolate(VM* vm, struct sIsolate* isolate);
+ObjFiber* new_fiber(VM* vm, ObjClosure* closure);
 
 #endif
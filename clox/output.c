@@ -0,0 +1,75 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include "output.h"
+#include "number.h"
+
+void init_output(Output* out, FILE* file, size_t capacity) {
+	out->file = file;
+	out->count = 0;
+	out->capacity = capacity;
+	out->data = capacity > 0 ? malloc(capacity) : NULL;
+	if (out->data == NULL) out->capacity = 0; // Fall back to unbuffered
+	out->flush_lines = isatty(fileno(file));
+}
+
+void free_output(Output* out) {
+	output_flush(out);
+	free(out->data);
+	out->data = NULL;
+	out->capacity = 0;
+}
+
+void output_flush(Output* out) {
+	if (out->count > 0) {
+		fwrite(out->data, 1, out->count, out->file);
+		out->count = 0;
+	}
+	fflush(out->file);
+}
+
+void output_bytes(Output* out, const char* bytes, size_t length) {
+	if (length == 0) return;
+	if (out->count + length > out->capacity) {
+		if (out->count > 0) {
+			fwrite(out->data, 1, out->count, out->file);
+			out->count = 0;
+		}
+		if (length >= out->capacity) {
+			fwrite(bytes, 1, length, out->file);
+			return;
+		}
+	}
+	memcpy(out->data + out->count, bytes, length);
+	out->count += length;
+}
+
+void output_cstring(Output* out, const char* chars) {
+	output_bytes(out, chars, strlen(chars));
+}
+
+// Integers that a double holds exactly skip the general formatter.
+void output_number(Output* out, double number) {
+	if (number > -9007199254740992.0 && number < 9007199254740992.0 &&
+		number == (int64_t)number && !(number == 0 && signbit(number))) {
+		char digits[20];
+		int64_t value = (int64_t)number;
+		uint64_t magnitude = value < 0 ? -(uint64_t)value : (uint64_t)value;
+		int start = sizeof(digits);
+		do {
+			digits[--start] = (char)('0' + magnitude % 10);
+			magnitude /= 10;
+		} while (magnitude > 0);
+		if (value < 0) digits[--start] = '-';
+		output_bytes(out, digits + start, sizeof(digits) - start);
+		return;
+	}
+	char buffer[NUMBER_BUFFER_SIZE];
+	output_bytes(out, buffer, format_number(number, buffer));
+}
+
+void output_newline(Output* out) {
+	output_char(out, '\n');
+	if (out->flush_lines || out->capacity == 0) output_flush(out);
+}
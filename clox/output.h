@@ -0,0 +1,36 @@
+#ifndef clox_output_h
+#define clox_output_h
+
+#include <stdio.h>
+#include "common.h"
+
+#define OUTPUT_DEFAULT_SIZE (64 * 1024)
+
+// Buffered writer used by 'print'. Bytes reach the file only when the
+// buffer fills or on output_flush(). With capacity 0 every write goes
+// straight to the file's stdio buffer.
+typedef struct {
+	FILE* file;
+	char* data;
+	size_t count;
+	size_t capacity;
+	bool flush_lines; // Flush after each line, set for terminals.
+} Output;
+
+void init_output(Output* out, FILE* file, size_t capacity);
+void free_output(Output* out);
+void output_flush(Output* out);
+void output_bytes(Output* out, const char* bytes, size_t length);
+void output_cstring(Output* out, const char* chars);
+void output_number(Output* out, double number);
+void output_newline(Output* out);
+
+static inline void output_char(Output* out, char c) {
+	if (out->count < out->capacity) {
+		out->data[out->count++] = c;
+	} else {
+		output_bytes(out, &c, 1);
+	}
+}
+
+#endif
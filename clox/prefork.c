@@ -0,0 +1,226 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "prefork.h"
+#include "vm.h"
+#include "memory.h"
+#include "sysexits.h"
+
+// Calls the handler and writes the printed result and a newline. After a
+// runtime error, reported on stderr, the answer is an empty line.
+static void handle_request(VM* vm, Value handler, const char* line, size_t length, Output* out) {
+	stack_push(vm, handler);
+	stack_push(vm, OBJ_VALUE(copy_string(vm, line, length)));
+	if (interpret_call(vm, 1) == INTERPRET_OK) {
+		write_value(out, stack_pop(vm));
+	}
+	output_newline(out);
+	output_flush(out);
+}
+
+// Answers every line read from fd until the other end closes it.
+static void serve(VM* vm, Value handler, int fd) {
+	FILE* in = fdopen(dup(fd), "r");
+	FILE* answers = fdopen(fd, "w");
+	if (in == NULL || answers == NULL) {
+		fprintf(stderr, "Cannot serve requests: %s\n", strerror(errno));
+		exit(EX_OSERR);
+	}
+	Output out;
+	init_output(&out, answers, OUTPUT_DEFAULT_SIZE);
+	char* line = NULL;
+	size_t capacity = 0;
+	ssize_t length;
+	while ((length = getline(&line, &capacity, in)) > 0) {
+		if (line[length - 1] == '\n') length--;
+		handle_request(vm, handler, line, length, &out);
+	}
+	free(line);
+	free_output(&out);
+	fclose(in);
+	fclose(answers);
+}
+
+// Workers leave without freeing the heap: that would touch, and copy,
+// every shared page.
+static void exit_worker(VM* vm) {
+	output_flush(&vm->output);
+	_exit(0);
+}
+
+static int wait_workers(pid_t* pids, int workers) {
+	int status = 0;
+	for (int i = 0; i < workers; i++) {
+		int worker_status;
+		if (waitpid(pids[i], &worker_status, 0) < 0
+			|| !WIFEXITED(worker_status) || WEXITSTATUS(worker_status) != 0) {
+			status = EX_SOFTWARE;
+		}
+	}
+	return status;
+}
+
+static int fork_failed(pid_t* pids, int started) {
+	fprintf(stderr, "Cannot start a worker: %s\n", strerror(errno));
+	for (int i = 0; i < started; i++) kill(pids[i], SIGTERM);
+	wait_workers(pids, started);
+	return EX_OSERR;
+}
+
+static bool write_all(int fd, const char* bytes, size_t length) {
+	while (length > 0) {
+		ssize_t written = write(fd, bytes, length);
+		if (written < 0) {
+			if (errno == EINTR) continue;
+			return false;
+		}
+		bytes += written;
+		length -= written;
+	}
+	return true;
+}
+
+// Sends each request to a worker through a socket pair of its own. A
+// worker gets a new request only after its last answer is read, so answers
+// keep the order of the requests and neither side blocks the other.
+static int serve_stdin(VM* vm, Value handler, int workers, pid_t* pids) {
+	int* sockets = malloc(sizeof(int) * workers);
+	FILE** answers = malloc(sizeof(FILE*) * workers);
+	if (sockets == NULL || answers == NULL) {
+		fprintf(stderr, "Not enough memory for the workers\n");
+		exit(EX_OSERR);
+	}
+	for (int i = 0; i < workers; i++) {
+		int pair[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) return fork_failed(pids, i);
+		pids[i] = fork();
+		if (pids[i] < 0) return fork_failed(pids, i);
+		if (pids[i] == 0) {
+			for (int j = 0; j < i; j++) {
+				fclose(answers[j]);
+				close(sockets[j]);
+			}
+			close(pair[0]);
+			serve(vm, handler, pair[1]);
+			exit_worker(vm);
+		}
+		close(pair[1]);
+		sockets[i] = pair[0];
+		answers[i] = fdopen(dup(pair[0]), "r");
+	}
+
+	int status = 0;
+	char* request = NULL;
+	size_t request_capacity = 0;
+	char* answer = NULL;
+	size_t answer_capacity = 0;
+	long sent = 0;
+	long received = 0;
+	while (status == 0) {
+		ssize_t length = getline(&request, &request_capacity, stdin);
+		bool more = length > 0;
+		// Wait until the next worker is free, or for every answer at the end.
+		while (received < sent && (!more || sent - received == workers)) {
+			int worker = received % workers;
+			ssize_t answer_length = getline(&answer, &answer_capacity, answers[worker]);
+			if (answer_length <= 0) {
+				fprintf(stderr, "Worker %d stopped answering.\n", worker);
+				status = EX_SOFTWARE;
+				break;
+			}
+			output_bytes(&vm->output, answer, answer_length);
+			received++;
+		}
+		if (!more || status != 0) break;
+
+		int worker = sent % workers;
+		if (!write_all(sockets[worker], request, length)
+			|| (request[length - 1] != '\n' && !write_all(sockets[worker], "\n", 1))) {
+			fprintf(stderr, "Worker %d stopped answering.\n", worker);
+			status = EX_SOFTWARE;
+		}
+		sent++;
+	}
+	free(request);
+	free(answer);
+	for (int i = 0; i < workers; i++) {
+		fclose(answers[i]);
+		close(sockets[i]);
+	}
+	free(sockets);
+	free(answers);
+	if (status != 0) {
+		for (int i = 0; i < workers; i++) kill(pids[i], SIGTERM);
+	}
+	int workers_status = wait_workers(pids, workers);
+	return status != 0 ? status : workers_status;
+}
+
+// Every worker accepts connections on the same listening socket and
+// answers one connection at a time.
+static int serve_socket(VM* vm, Value handler, int workers, pid_t* pids, const char* path) {
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(address.sun_path)) {
+		fprintf(stderr, "Socket path too long: %s\n", path);
+		return EX_USAGE;
+	}
+	strcpy(address.sun_path, path);
+	int server = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(path); // Left over by an earlier server
+	if (server < 0
+		|| bind(server, (struct sockaddr*)&address, sizeof(address)) < 0
+		|| listen(server, SOMAXCONN) < 0) {
+		fprintf(stderr, "Cannot listen on %s: %s\n", path, strerror(errno));
+		if (server >= 0) close(server);
+		return EX_OSERR;
+	}
+
+	for (int i = 0; i < workers; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) return fork_failed(pids, i);
+		if (pids[i] == 0) {
+			for (;;) {
+				int client = accept(server, NULL, NULL);
+				if (client < 0) {
+					if (errno == EINTR || errno == ECONNABORTED) continue;
+					fprintf(stderr, "Cannot accept connections: %s\n", strerror(errno));
+					_exit(EX_OSERR);
+				}
+				serve(vm, handler, client);
+			}
+		}
+	}
+	close(server);
+	return wait_workers(pids, workers);
+}
+
+int run_prefork(VM* vm, int workers, const char* listen_path) {
+	Value handler;
+	if (!table_get(&vm->globals, copy_string(vm, "handle", 6), &handler)) {
+		fprintf(stderr, "Define handle(request) to serve requests.\n");
+		return EX_SOFTWARE;
+	}
+	pid_t* pids = malloc(sizeof(pid_t) * workers);
+	if (pids == NULL) {
+		fprintf(stderr, "Not enough memory for the workers\n");
+		exit(EX_OSERR);
+	}
+	signal(SIGPIPE, SIG_IGN); // Clients that leave early are errors on write
+	output_flush(&vm->output); // Or workers print it again
+	fflush(stdout);
+	tenure_heap(vm);
+
+	int status = listen_path == NULL
+		? serve_stdin(vm, handler, workers, pids)
+		: serve_socket(vm, handler, workers, pids, listen_path);
+	free(pids);
+	return status;
+}
@@ -0,0 +1,18 @@
+#ifndef clox_prefork_h
+#define clox_prefork_h
+
+#include "common.h"
+
+// Serves requests with the 'handle(request)' function the script defined.
+// The heap built so far becomes the permanent generation, then 'workers'
+// processes are forked and share it copy-on-write. Each request is one
+// line and the answer is the printed result, on one line.
+//
+// With a NULL 'listen_path' the lines come from stdin and the answers go
+// to stdout in the same order. Otherwise every worker accepts connections
+// on a Unix socket at that path, until it is killed.
+//
+// Returns the exit status for the process.
+int run_prefork(VM* vm, int workers, const char* listen_path);
+
+#endif
@@ -6,10 +6,11 @@
 typedef struct {
 	const char* start;
 	const char* current;
+	const char* end; // The source needs no NUL terminator
 	int line;
 } Scanner;
 
-Scanner scanner;
+static _Thread_local Scanner scanner;
 
 Token make_token(TokenType type) {
 	Token token;
@@ -30,16 +31,17 @@ Token error_token(const char* error) {
 }
 
 static bool is_at_end() {
-	return *scanner.current == '\0';
+	return scanner.current >= scanner.end;
 }
 
 static char peek() {
+	if (is_at_end()) return '\0';
 	return *scanner.current;
 }
 
 static char peek_next() {
-	if (is_at_end()) return '\0';
-	return *(scanner.current++);
+	if (scanner.current + 1 >= scanner.end) return '\0';
+	return scanner.current[1];
 }
 
 static char advance() {
@@ -56,8 +58,7 @@ static bool match(char expected) {
 }
 
 static bool match_next(char expected) {
-	if(is_at_end()) return false;
-	return *(scanner.current+1) == expected;
+	return peek_next() == expected;
 }
 
 static void skip_whitespace() {
@@ -171,9 +172,10 @@ static Token scan_identifier() {
 	return make_token(identifier_type());
 }
 
-void init_scanner(const char* source) {
+void init_scanner(const char* source, size_t length) {
 	scanner.start = source;
 	scanner.current = source;
+	scanner.end = source + length;
 	scanner.line = 1;
 }
 
@@ -191,6 +193,8 @@ Token scan_token() {
 	case ')': return make_token(TOKEN_RIGHT_PAREN);
 	case '{': return make_token(TOKEN_LEFT_BRACE);
 	case '}': return make_token(TOKEN_RIGHT_BRACE);
+	case '[': return make_token(TOKEN_LEFT_BRACKET);
+	case ']': return make_token(TOKEN_RIGHT_BRACKET);
 	case ';': return make_token(TOKEN_SEMICOLON);
 	case ',': return make_token(TOKEN_COMMA);
 	case '.': return make_token(TOKEN_DOT);
@@ -198,6 +202,7 @@ Token scan_token() {
 	case '+': return make_token(TOKEN_PLUS);
 	case '/': return make_token(TOKEN_SLASH);
 	case '%': return make_token(TOKEN_PERCENT);
+	case ':': return make_token(TOKEN_COLON);
 	case '*': return make_token(TOKEN_STAR);
 	case '!':
 		return make_token(match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
@@ -1,13 +1,16 @@
 #ifndef clox_scanner_h
 #define clox_scanner_h
 
+#include "common.h"
+
 typedef enum {
 	// Single-character tokens.
 	TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN,
 	TOKEN_LEFT_BRACE, TOKEN_RIGHT_BRACE,
+	TOKEN_LEFT_BRACKET, TOKEN_RIGHT_BRACKET,
 	TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS,
 	TOKEN_SEMICOLON, TOKEN_SLASH, TOKEN_STAR,
-	TOKEN_PERCENT,
+	TOKEN_PERCENT, TOKEN_COLON,
 
 	// One or two character tokens.
 	TOKEN_BANG, TOKEN_BANG_EQUAL,
@@ -36,7 +39,7 @@ typedef struct {
 	int line;
 } Token;
 
-void init_scanner(const char* source);
+void init_scanner(const char* source, size_t length);
 Token scan_token();
 
 #endif
\ No newline at end of file
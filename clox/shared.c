@@ -0,0 +1,246 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "shared.h"
+#include "vm.h"
+#include "compiler.h"
+#include "memory.h"
+#include "jit.h"
+
+#define SHARED_ALIGN(size) (((size) + 7) & ~(size_t)7)
+
+// Freezing runs in two passes over the function tree: the first measures
+// the region and collects the distinct strings, the second copies
+// everything into it. 'strings' maps each string of the scratch VM to its
+// copy, nil until it is made.
+typedef struct {
+	VM* vm;
+	Table strings;
+	size_t size;
+	int string_count;
+	int function_count;
+	char* cursor;
+	SharedCode* code;
+} Freezer;
+
+static void measure_string(Freezer* freezer, ObjString* string) {
+	Value copy;
+	if (table_get(&freezer->strings, string, &copy)) return;
+	table_set(freezer->vm, &freezer->strings, string, NIL_VALUE());
+	freezer->size += SHARED_ALIGN(STRING_SIZE(string->length));
+	freezer->string_count++;
+}
+
+static void measure_function(Freezer* freezer, ObjFunction* function) {
+	Chunk* chunk = &function->chunk;
+	freezer->size += SHARED_ALIGN(sizeof(ObjFunction))
+		+ SHARED_ALIGN(chunk->size)
+		+ SHARED_ALIGN(sizeof(int) * chunk->size)
+		+ SHARED_ALIGN(sizeof(Value) * chunk->constants.size);
+	freezer->function_count++;
+	if (function->name != NULL) measure_string(freezer, function->name);
+	for (int i = 0; i < chunk->constants.size; i++) {
+		Value constant = chunk->constants.values[i];
+		if (!IS_OBJ(constant)) continue;
+		if (IS_STRING(constant)) measure_string(freezer, AS_STRING(constant));
+		else if (IS_FUNCTION(constant)) measure_function(freezer, AS_FUNCTION(constant));
+	}
+}
+
+static void* carve(Freezer* freezer, const void* from, size_t size) {
+	void* memory = freezer->cursor;
+	if (size > 0) memcpy(memory, from, size); // Empty chunks have no arrays
+	freezer->cursor += SHARED_ALIGN(size);
+	return memory;
+}
+
+static void freeze_header(Obj* object) {
+	object->is_marked = true;
+	object->in_region = false;
+	object->shared = true;
+	object->next = object;
+}
+
+static ObjString* freeze_string(Freezer* freezer, ObjString* string) {
+	Value copy;
+	table_get(&freezer->strings, string, &copy);
+	if (!IS_NIL(copy)) return AS_STRING(copy);
+	ObjString* frozen = carve(freezer, string, STRING_SIZE(string->length));
+	freeze_header(&frozen->obj);
+	table_set(freezer->vm, &freezer->strings, string, OBJ_VALUE(frozen)); // Key exists, no allocation
+	freezer->code->strings[freezer->code->string_count++] = frozen;
+	return frozen;
+}
+
+static ObjFunction* freeze_function(Freezer* freezer, ObjFunction* function) {
+	Chunk* chunk = &function->chunk;
+	ObjFunction* frozen = carve(freezer, function, sizeof(ObjFunction));
+	freeze_header(&frozen->obj);
+#ifdef CLOX_JIT
+	frozen->jit = &freezer->code->jit[freezer->code->function_count++];
+	init_jit_function(frozen->jit);
+#endif
+	if (function->name != NULL) frozen->name = freeze_string(freezer, function->name);
+
+	Chunk* frozen_chunk = &frozen->chunk;
+	frozen_chunk->capacity = chunk->size;
+	frozen_chunk->code = carve(freezer, chunk->code, chunk->size);
+	frozen_chunk->lines = carve(freezer, chunk->lines, sizeof(int) * chunk->size);
+	ValueArray* constants = &frozen_chunk->constants;
+	constants->capacity = chunk->constants.size;
+	constants->values = carve(freezer, chunk->constants.values, sizeof(Value) * constants->size);
+	for (int i = 0; i < constants->size; i++) {
+		Value constant = constants->values[i];
+		if (!IS_OBJ(constant)) continue;
+		if (IS_STRING(constant)) {
+			constants->values[i] = OBJ_VALUE(freeze_string(freezer, AS_STRING(constant)));
+		} else if (IS_FUNCTION(constant)) {
+			constants->values[i] = OBJ_VALUE(freeze_function(freezer, AS_FUNCTION(constant)));
+		}
+	}
+	return frozen;
+}
+
+// The script must be rooted: measuring allocates in the scratch VM.
+static SharedCode* freeze(VM* vm, ObjFunction* script) {
+	Freezer freezer = { .vm = vm, .size = 0, .string_count = 0, .function_count = 0 };
+	init_table(&freezer.strings);
+	measure_function(&freezer, script);
+	freezer.size += SHARED_ALIGN(sizeof(ObjString*) * freezer.string_count);
+
+	SharedCode* code = malloc(sizeof(SharedCode));
+	void* memory = mmap(NULL, freezer.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (code == NULL || memory == MAP_FAILED) {
+		fprintf(stderr, "Not enough memory to share the code\n");
+		exit(1);
+	}
+	code->memory = memory;
+	code->size = freezer.size;
+	code->strings = memory;
+	code->string_count = 0;
+	atomic_init(&code->references, 1);
+#ifdef CLOX_JIT
+	code->jit = malloc(sizeof(JitFunction) * freezer.function_count);
+	code->function_count = 0;
+	if (code->jit == NULL) {
+		fprintf(stderr, "Not enough memory to share the code\n");
+		exit(1);
+	}
+#endif
+	freezer.code = code;
+	freezer.cursor = (char*)memory + SHARED_ALIGN(sizeof(ObjString*) * freezer.string_count);
+	code->script = freeze_function(&freezer, script);
+
+	mprotect(memory, freezer.size, PROT_READ);
+	free_table(vm, &freezer.strings);
+	return code;
+}
+
+SharedCode* compile_shared(const char* source, size_t length, FILE* errors) {
+	VM* vm = malloc(sizeof(VM));
+	if (vm == NULL) {
+		fprintf(stderr, "Not enough memory for the VM\n");
+		exit(1);
+	}
+	init_vm(vm);
+	vm->errors = errors;
+	SharedCode* code = NULL;
+	ObjFunction* script = compile(vm, source, length);
+	if (script != NULL) {
+		stack_push(vm, OBJ_VALUE(script));
+		code = freeze(vm, script);
+	}
+	free_vm(vm);
+	free(vm);
+	return code;
+}
+
+void retain_shared(SharedCode* code) {
+	atomic_fetch_add(&code->references, 1);
+}
+
+void release_shared(SharedCode* code) {
+	if (atomic_fetch_sub(&code->references, 1) != 1) return;
+	munmap(code->memory, code->size);
+#ifdef CLOX_JIT
+	for (int i = 0; i < code->function_count; i++) free_jit_code(&code->jit[i]);
+	free(code->jit);
+#endif
+	free(code);
+}
+
+bool attach_shared(VM* vm, SharedCode* code) {
+	for (int i = 0; i < vm->shared_count; i++) {
+		if (vm->shared[i] == code) return true;
+	}
+	for (int i = 0; i < code->string_count; i++) {
+		ObjString* string = code->strings[i];
+		ObjString* interned = intern_set_find(&vm->strings, string->chars, string->length, string->hash);
+		if (interned != NULL && interned != string) return false;
+	}
+
+	if (vm->shared_count == vm->shared_capacity) {
+		vm->shared_capacity = vm->shared_capacity < 4 ? 4 : vm->shared_capacity * 2;
+		vm->shared = realloc(vm->shared, sizeof(SharedCode*) * vm->shared_capacity);
+		if (vm->shared == NULL) {
+			fprintf(stderr, "Not enough memory to share the code\n");
+			exit(1);
+		}
+	}
+	retain_shared(code);
+	vm->shared[vm->shared_count++] = code;
+	for (int i = 0; i < code->string_count; i++) {
+		ObjString* string = code->strings[i];
+		if (intern_set_find(&vm->strings, string->chars, string->length, string->hash) == NULL) {
+			intern_set_add(vm, &vm->strings, string);
+		}
+	}
+	return true;
+}
+
+SharedCode* find_shared(VM* vm, Obj* object) {
+	for (int i = 0; i < vm->shared_count; i++) {
+		char* memory = vm->shared[i]->memory;
+		if ((char*)object >= memory && (char*)object < memory + vm->shared[i]->size) {
+			return vm->shared[i];
+		}
+	}
+	return NULL;
+}
+
+ObjFunction* thaw_function(VM* vm, ObjFunction* shared) {
+	ObjFunction* function = new_function(vm);
+	stack_push(vm, OBJ_VALUE(function));
+	function->arity = shared->arity;
+	function->upvalue_count = shared->upvalue_count;
+	if (shared->name != NULL) {
+		function->name = copy_string(vm, shared->name->chars, shared->name->length);
+	}
+
+	Chunk* chunk = &function->chunk;
+	int size = shared->chunk.size;
+	if (size > 0) {
+		chunk->code = GROW_ARRAY(vm, NULL, uint8_t, 0, size);
+		chunk->lines = GROW_ARRAY(vm, NULL, int, 0, size);
+		chunk->capacity = size;
+		memcpy(chunk->code, shared->chunk.code, size);
+		memcpy(chunk->lines, shared->chunk.lines, sizeof(int) * size);
+		chunk->size = size;
+	}
+	ValueArray* constants = &shared->chunk.constants;
+	for (int i = 0; i < constants->size; i++) {
+		Value constant = constants->values[i];
+		if (IS_STRING(constant)) {
+			ObjString* string = AS_STRING(constant);
+			constant = OBJ_VALUE(copy_string(vm, string->chars, string->length));
+		} else if (IS_FUNCTION(constant)) {
+			constant = OBJ_VALUE(thaw_function(vm, AS_FUNCTION(constant)));
+		}
+		stack_push(vm, constant);
+		write_valuearray(vm, &chunk->constants, constant);
+		stack_pop(vm);
+	}
+	stack_pop(vm);
+	return function;
+}
@@ -0,0 +1,43 @@
+#ifndef clox_shared_h
+#define clox_shared_h
+
+#include <stdio.h>
+#include <stdatomic.h>
+#include "common.h"
+#include "object.h"
+
+// A compiled script frozen into read-only memory: its functions, their
+// code and constants, and the strings they use. Any number of VMs, on any
+// thread, run it without a copy. Shared objects are never in a VM's object
+// list; they stay marked and forward to themselves, so collections and
+// compaction never write to them.
+typedef struct sSharedCode {
+	void* memory; // mmap()ed, PROT_READ once frozen
+	size_t size;
+	ObjFunction* script;
+	ObjString** strings; // Every string in the region, for interning
+	int string_count;
+#ifdef CLOX_JIT
+	struct sJitFunction* jit; // One per function, writable
+	int function_count;
+#endif
+	atomic_int references;
+} SharedCode;
+
+// Compiles in a scratch VM and freezes the result. NULL on compile errors,
+// already written to 'errors'.
+SharedCode* compile_shared(const char* source, size_t length, FILE* errors);
+void retain_shared(SharedCode* code);
+void release_shared(SharedCode* code);
+
+// Interns the region's strings and keeps a reference until free_vm().
+// False when the VM already holds a string with the same characters as a
+// shared one: code compares strings by identity, so both can't live in
+// the same VM. Attach before the VM interns anything to avoid that.
+bool attach_shared(VM* vm, SharedCode* code);
+// Region attached to the VM that holds the object, NULL if none.
+SharedCode* find_shared(VM* vm, Obj* object);
+// Copies a shared function, and those nested in it, into the VM's heap.
+ObjFunction* thaw_function(VM* vm, ObjFunction* shared);
+
+#endif
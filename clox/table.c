@@ -3,83 +3,196 @@
 #include "memory.h"
 #include "object.h"
 
-#define TABLE_MAX_LOAD 0.75
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-static Entry* find_entry(Entry* entries, int length, ObjString* key);
-static void adjust_capacity(Table* table, int capacity);
+// Grow when 7 of every 8 slots are used (live keys or tombstones).
+#define TABLE_MAX_LOAD(capacity) ((capacity) - (capacity) / 8)
+
+// Control bytes. Used slots store H2, the top 7 bits of the hash, so they
+// are never negative. The first TABLE_GROUP_WIDTH bytes are mirrored after
+// the end, so a group can be loaded from any slot without wrapping.
+#define CTRL_EMPTY ((int8_t)-128)
+#define CTRL_DELETED ((int8_t)-2)
+#define H1(hash) (hash)
+#define H2(hash) ((int8_t)((hash) >> 25))
+
+typedef uint32_t GroupMask; // Bit i set when slot i of the group matches
+
+static void adjust_capacity(VM* vm, Table* table, int capacity);
+
+// Smallest capacity that holds count keys at half the maximum load, so a
+// rehashed or shrunk table does not have to grow again right away.
+static int fit_capacity(int count) {
+    int capacity = TABLE_MIN_CAPACITY;
+    while(count > TABLE_MAX_LOAD(capacity) / 2) capacity *= 2;
+    return capacity;
+}
+
+#ifdef __SSE2__
+
+static inline GroupMask group_match(const int8_t* group, int8_t h2) {
+    __m128i ctrl = _mm_loadu_si128((const __m128i*)group);
+    return (GroupMask)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(h2)));
+}
+
+static inline GroupMask group_match_empty(const int8_t* group) {
+    return group_match(group, CTRL_EMPTY);
+}
+
+static inline GroupMask group_match_free(const int8_t* group) {
+    // Only EMPTY and DELETED have the sign bit set.
+    __m128i ctrl = _mm_loadu_si128((const __m128i*)group);
+    return (GroupMask)_mm_movemask_epi8(ctrl);
+}
+
+#else
+
+static inline GroupMask group_match(const int8_t* group, int8_t h2) {
+    GroupMask mask = 0;
+    for(int i = 0; i < TABLE_GROUP_WIDTH; i++) {
+        if(group[i] == h2) mask |= 1u << i;
+    }
+    return mask;
+}
+
+static inline GroupMask group_match_empty(const int8_t* group) {
+    return group_match(group, CTRL_EMPTY);
+}
+
+static inline GroupMask group_match_free(const int8_t* group) {
+    GroupMask mask = 0;
+    for(int i = 0; i < TABLE_GROUP_WIDTH; i++) {
+        if(group[i] < 0) mask |= 1u << i;
+    }
+    return mask;
+}
+
+#endif
+
+#define FIRST_MATCH(mask) __builtin_ctz(mask)
 
 void init_table(Table* table) {
-    table->capacity = 0;
     table->count = 0;
-    table->entries = NULL;
+    table->tombstones = 0;
+    table->capacity = 0;
+    table->control = NULL;
+    table->slots = NULL;
 }
 
-void free_table(Table* table) {
-    FREE_ARRAY(Entry, table->entries, table->capacity);
-    init_table(table);
+// Slots and control bytes share one allocation, so a small table (an
+// instance with a few fields) touches as few cache lines as possible.
+static size_t table_bytes(int capacity) {
+    return sizeof(TableSlot) * capacity + capacity + TABLE_GROUP_WIDTH;
 }
 
-bool table_set(Table* table, ObjString* key, Value value) {
-    if(table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-        int capacity = GROW_CAPACITY(table->capacity);
-        adjust_capacity(table, capacity);
+void free_table(VM* vm, Table* table) {
+    if(table->capacity > 0) {
+        reallocate(vm, table->slots, table_bytes(table->capacity), 0);
     }
-    Entry* entry = find_entry(table->entries, table->capacity, key);
-    bool is_new = entry->label == NULL;
-    if(is_new && IS_NIL(entry->value)) table->count++;
-    entry->label = key;
-    entry->value = value;
-    return is_new;
+    init_table(table);
 }
 
-static Entry* find_entry(Entry* entries, int length, ObjString* key) {
-    uint32_t index = key->hash & (length - 1);
-    Entry* tombstone = NULL;
+// Bytes past the end mirror the slot they wrap to. Tables smaller than a
+// group mirror each slot more than once.
+static void set_control(Table* table, int index, int8_t control) {
+    table->control[index] = control;
+    for(int i = index + table->capacity; i < table->capacity + TABLE_GROUP_WIDTH; i += table->capacity) {
+        table->control[i] = control;
+    }
+}
 
-    for(;;) {
-        Entry* entry = &entries[index];
-        if(entry->label == NULL) {
-            if(IS_NIL(entry->value)) {
-                return tombstone != NULL ? tombstone : entry;
-            }
-            if(tombstone != NULL) tombstone = entry;
+// Probes group by group with triangular steps, which visits every group
+// once when the capacity is a power of two.
+static int find_slot(Table* table, ObjString* key) {
+    uint32_t mask = table->capacity - 1;
+    uint32_t position = H1(key->hash) & mask;
+    // Most hits are in the home slot: check it before loading the group.
+    if(table->control[position] >= 0 && table->slots[position].key == key) {
+        return (int)position;
+    }
+    int8_t h2 = H2(key->hash);
+    for(uint32_t step = TABLE_GROUP_WIDTH; ; step += TABLE_GROUP_WIDTH) {
+        const int8_t* group = table->control + position;
+        GroupMask matches = group_match(group, h2);
+        while(matches != 0) {
+            uint32_t index = (position + FIRST_MATCH(matches)) & mask;
+            if(table->slots[index].key == key) return (int)index;
+            matches &= matches - 1;
         }
-        if(entry->label == key) {
-            return entry;
+        if(group_match_empty(group) != 0) return -1;
+        position = (position + step) & mask;
+    }
+}
+
+static int find_free_slot(Table* table, uint32_t hash) {
+    uint32_t mask = table->capacity - 1;
+    uint32_t position = H1(hash) & mask;
+    for(uint32_t step = TABLE_GROUP_WIDTH; ; step += TABLE_GROUP_WIDTH) {
+        GroupMask free_slots = group_match_free(table->control + position);
+        if(free_slots != 0) {
+            return (int)((position + FIRST_MATCH(free_slots)) & mask);
         }
-        index = (index + 1) & (length - 1);
+        position = (position + step) & mask;
     }
 }
 
-static void adjust_capacity(Table* table, int capacity) {
-    Entry* entries = ALLOCATE(Entry, capacity);
+static void insert_new(VM* vm, Table* table, ObjString* key, Value value) {
+    int index = find_free_slot(table, key->hash);
+    if(table->control[index] == CTRL_DELETED) table->tombstones--;
+    set_control(table, index, H2(key->hash));
+    table->slots[index].key = key;
+    table->slots[index].value = value;
+    table->count++;
+}
 
-    for(int i = 0; i < capacity; i++) {
-        entries[i].label = NULL;
-        entries[i].value = NIL_VALUE();
+bool table_set(VM* vm, Table* table, ObjString* key, Value value) {
+    if(table->capacity > 0) {
+        int index = find_slot(table, key);
+        if(index != -1) {
+            table->slots[index].value = value;
+            return false;
+        }
+    }
+    if(table->count + table->tombstones + 1 > TABLE_MAX_LOAD(table->capacity)) {
+        // When tombstones take most of the used slots, rehashing at the
+        // same size is enough to make room.
+        int capacity = table->tombstones >= table->count
+            ? fit_capacity(table->count + 1)
+            : table->capacity * 2;
+        adjust_capacity(vm, table, capacity);
     }
+    insert_new(vm, table, key, value);
+    return true;
+}
 
+static void adjust_capacity(VM* vm, Table* table, int capacity) {
+    TableSlot* slots = reallocate(vm, NULL, 0, table_bytes(capacity));
+    int8_t* control = (int8_t*)(slots + capacity);
+    memset(control, CTRL_EMPTY, capacity + TABLE_GROUP_WIDTH);
+
+    Table old = *table;
     table->count = 0;
+    table->tombstones = 0;
+    table->capacity = capacity;
+    table->control = control;
+    table->slots = slots;
 
-    for(int i = 0; i < table->capacity; i++) {
-        Entry* old_entry = &table->entries[i];
-        if(old_entry->label == NULL) continue;
-        Entry* position = find_entry(entries, capacity, old_entry->label);
-        position->label = old_entry->label;
-        position->value = old_entry->value;
-        table->count++;
+    for(int i = 0; i < old.capacity; i++) {
+        if(old.control[i] < 0) continue;
+        insert_new(vm, table, old.slots[i].key, old.slots[i].value);
     }
 
-    FREE_ARRAY(Entry, table->entries, table->capacity);
-    table->capacity = capacity;
-    table->entries = entries;
+    if(old.capacity > 0) {
+        reallocate(vm, old.slots, table_bytes(old.capacity), 0);
+    }
 }
 
-void table_add_all(Table *from, Table* to) {
+void table_add_all(VM* vm, Table *from, Table* to) {
     for(int i = 0; i < from->capacity; i++) {
-        Entry* entry = &from->entries[i];
-        if(entry->label != NULL) {
-            table_set(to, entry->label, entry->value);
+        if(from->control[i] >= 0) {
+            table_set(vm, to, from->slots[i].key, from->slots[i].value);
         }
     }
 }
@@ -87,55 +200,88 @@ void table_add_all(Table *from, Table* to) {
 bool table_get(Table* table, ObjString* key, Value* value) {
     if(table->count == 0) return false;
 
-    Entry* entry = find_entry(table->entries, table->capacity, key);
-    if(entry->label == NULL) return false;
+    int index = find_slot(table, key);
+    if(index == -1) return false;
 
-    *value = entry->value;
+    *value = table->slots[index].value;
     return true;
 }
 
-bool table_delete(Table* table, ObjString* key) {
+Value* table_find(Table* table, ObjString* key) {
+    if(table->count == 0) return NULL;
+
+    int index = find_slot(table, key);
+    return index == -1 ? NULL : &table->slots[index].value;
+}
+
+bool table_delete(VM* vm, Table* table, ObjString* key) {
     if(table->count == 0) return false;
 
-    Entry* entry = find_entry(table->entries, table->capacity, key);
-    if(entry->label == NULL) return false;
+    int index = find_slot(table, key);
+    if(index == -1) return false;
 
-    entry->label = NULL;
-    entry->value = BOOL_VALUE(true); // Place tombstone
+    set_control(table, index, CTRL_DELETED); // Place tombstone
+    table->slots[index].key = NULL;
+    table->count--;
+    table->tombstones++;
+
+    // Give memory back once the table is mostly empty.
+    if(table->count == 0) {
+        free_table(vm, table);
+    } else if(table->capacity > TABLE_MIN_CAPACITY && table->count < table->capacity / 8) {
+        adjust_capacity(vm, table, fit_capacity(table->count));
+    }
     return true;
 }
 
-ObjString* table_find_string(Table* table, const char* chars, int length, uint32_t hash) {
-    if(table->count == 0) return NULL;
+// Number of groups a lookup of the key in the given slot reads.
+static int probe_length(Table* table, int index) {
+    uint32_t mask = table->capacity - 1;
+    uint32_t position = H1(table->slots[index].key->hash) & mask;
+    int probes = 1;
+    for(uint32_t step = TABLE_GROUP_WIDTH; ; step += TABLE_GROUP_WIDTH) {
+        if(((index - position) & mask) < TABLE_GROUP_WIDTH) return probes;
+        position = (position + step) & mask;
+        probes++;
+    }
+}
 
-    uint32_t index = hash & (table->capacity - 1);
+void table_stats(Table* table, TableStats* stats) {
+    memset(stats, 0, sizeof(TableStats));
+    stats->count = table->count;
+    stats->tombstones = table->tombstones;
+    stats->capacity = table->capacity;
+    if(table->capacity == 0) return;
 
-    for(;;) {
-        Entry* entry = &table->entries[index];
-        if(entry->label == NULL) {
-            if(IS_NIL(entry->value)) return NULL;
-        } else if(entry->label->length == length &&
-            entry->label->hash == hash &&
-            memcmp(entry->label->chars, chars, length) == 0) {
-            return entry->label;
-        }
-        index = (index + 1) & (table->capacity - 1);
+    stats->load_factor = (double)(table->count + table->tombstones) / table->capacity;
+    long total = 0;
+    for(int i = 0; i < table->capacity; i++) {
+        if(table->control[i] < 0) continue;
+        int probes = probe_length(table, i);
+        table_stats_add_probe(stats, probes);
+        total += probes;
     }
+    if(table->count > 0) stats->mean_probe = (double)total / table->count;
 }
 
-void mark_table(Table* table) {
+void table_stats_add_probe(TableStats* stats, int probes) {
+    int bucket = probes < TABLE_PROBE_BUCKETS ? probes - 1 : TABLE_PROBE_BUCKETS - 1;
+    stats->probes[bucket]++;
+    if(probes > stats->max_probe) stats->max_probe = probes;
+}
+
+void mark_table(VM* vm, Table* table) {
     for(int i = 0; i < table->capacity; i++) {
-        Entry* entry = &table->entries[i];
-        mark_object((Obj*)entry->label);
-        mark_value(entry->value);
+        if(table->control[i] < 0) continue;
+        mark_object(vm, (Obj*)table->slots[i].key);
+        mark_value(vm, table->slots[i].value);
     }
 }
 
-void table_remove_white(Table* table) {
+void relocate_table(Table* table) {
     for(int i = 0; i < table->capacity; i++) {
-        Entry* entry = &table->entries[i];
-        if(entry->label != NULL && !entry->label->obj.is_marked) {
-            table_delete(table, entry->label);
-        }
+        if(table->control[i] < 0) continue;
+        relocate_object((Obj**)&table->slots[i].key);
+        relocate_value(&table->slots[i].value);
     }
 }
@@ -3,25 +3,52 @@
 
 #include "values.h"
 
+// SwissTable style hash table. Each slot has a control byte: free slots are
+// negative and used slots keep 7 bits of the key hash. Lookups compare a
+// whole group of control bytes at once and only read the keys whose hash
+// bits match.
 typedef struct {
-    ObjString* label;
+    ObjString* key;
     Value value;
-} Entry;
+} TableSlot;
 
 typedef struct {
     int count;
-    int capacity;
-    Entry* entries;
+    int tombstones;
+    int capacity; // Power of two, zero or at least TABLE_MIN_CAPACITY.
+    TableSlot* slots; // Start of the allocation, control bytes follow
+    int8_t* control; // capacity + TABLE_GROUP_WIDTH bytes. See table.c
 } Table;
 
+#define TABLE_GROUP_WIDTH 16
+#define TABLE_MIN_CAPACITY 8
+#define TABLE_PROBE_BUCKETS 8
+
+// Snapshot of a table's shape, to check how well probing behaves.
+typedef struct {
+    int count;
+    int tombstones;
+    int capacity;
+    double load_factor; // Live keys and tombstones over capacity
+    double mean_probe;
+    int max_probe;
+    // probes[i] counts the keys found with i + 1 probes. The last bucket
+    // also counts longer sequences.
+    int probes[TABLE_PROBE_BUCKETS];
+} TableStats;
+
 void init_table(Table* table);
-void free_table(Table* table);
-bool table_set(Table* table, ObjString* key, Value value);
-void table_add_all(Table* from, Table* to);
+void free_table(VM* vm, Table* table);
+bool table_set(VM* vm, Table* table, ObjString* key, Value value);
+void table_add_all(VM* vm, Table* from, Table* to);
 bool table_get(Table* table, ObjString* key, Value* value);
-bool table_delete(Table* table, ObjString* key);
-void mark_table(Table* table);
-void table_remove_white(Table* table);
-ObjString* table_find_string(Table* table, const char* chars, int length, uint32_t hash);
+// Where the key's value is stored, NULL when it is missing. Valid until
+// the next key is added or deleted.
+Value* table_find(Table* table, ObjString* key);
+bool table_delete(VM* vm, Table* table, ObjString* key);
+void mark_table(VM* vm, Table* table);
+void relocate_table(Table* table);
+void table_stats(Table* table, TableStats* stats);
+void table_stats_add_probe(TableStats* stats, int probes);
 
 #endif
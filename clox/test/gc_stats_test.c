@@ -0,0 +1,55 @@
+#include "common.h"
+#include "../gc_stats.h"
+
+static void should_accept_grow_factors(void **state) {
+  GcConfig config;
+  init_gc_config(&config);
+  assert_true(gc_config_set(&config, "--gc-grow-factor=1"));
+  assert_true(config.grow_factor == 1);
+  assert_true(gc_config_set(&config, "--gc-grow-factor=1.5"));
+  assert_true(config.grow_factor == 1.5);
+  assert_true(gc_config_set(&config, "--gc-grow-factor=1000000"));
+  assert_true(config.grow_factor == 1e6);
+}
+
+static void should_reject_grow_factors_out_of_range(void **state) {
+  GcConfig config;
+  init_gc_config(&config);
+  assert_false(gc_config_set(&config, "--gc-grow-factor=nan"));
+  assert_false(gc_config_set(&config, "--gc-grow-factor=inf"));
+  assert_false(gc_config_set(&config, "--gc-grow-factor=-inf"));
+  assert_false(gc_config_set(&config, "--gc-grow-factor=1e300"));
+  assert_false(gc_config_set(&config, "--gc-grow-factor=1000001"));
+  assert_false(gc_config_set(&config, "--gc-grow-factor=0.5"));
+  assert_false(gc_config_set(&config, "--gc-grow-factor="));
+  assert_true(config.grow_factor == GC_DEFAULT_GROW_FACTOR);
+}
+
+static void should_parse_sizes(void **state) {
+  size_t size;
+  assert_true(parse_size("0", &size));
+  assert_int_equal(size, 0);
+  assert_true(parse_size("64K", &size));
+  assert_int_equal(size, 64 * 1024);
+  assert_true(parse_size("2m", &size));
+  assert_int_equal(size, 2 * 1024 * 1024);
+}
+
+static void should_reject_sizes_out_of_range(void **state) {
+  size_t size;
+  assert_false(parse_size("nan", &size));
+  assert_false(parse_size("inf", &size));
+  assert_false(parse_size("1e300", &size));
+  assert_false(parse_size("-1", &size));
+  assert_false(parse_size("12X", &size));
+}
+
+int main(void) {
+  const struct CMUnitTest tests[] = {
+    cmocka_unit_test(should_accept_grow_factors),
+    cmocka_unit_test(should_reject_grow_factors_out_of_range),
+    cmocka_unit_test(should_parse_sizes),
+    cmocka_unit_test(should_reject_sizes_out_of_range),
+  };
+  return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,90 @@
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include "common.h"
+#include "../number.h"
+
+static void assert_formats(double value, const char* expected) {
+  char buffer[NUMBER_BUFFER_SIZE + 1];
+  int length = format_number(value, buffer);
+  buffer[length] = '\0';
+  assert_string_equal(buffer, expected);
+}
+
+static void assert_parses(const char* text, double expected) {
+  double result;
+  assert_true(parse_number(text, (int)strlen(text), &result));
+  assert_memory_equal(&result, &expected, sizeof(double));
+}
+
+static void should_format_integers(void **state) {
+  assert_formats(0, "0");
+  assert_formats(-0.0, "-0");
+  assert_formats(7, "7");
+  assert_formats(-42, "-42");
+  assert_formats(1000000, "1000000");
+  assert_formats(9007199254740992.0, "9007199254740992");
+  assert_formats(1e21, "1e+21");
+  assert_formats(123e20, "1.23e+22");
+}
+
+static void should_format_shortest_fractions(void **state) {
+  assert_formats(0.1, "0.1");
+  assert_formats(0.1 + 0.2, "0.30000000000000004");
+  assert_formats(1.0 / 3, "0.3333333333333333");
+  assert_formats(-0.125, "-0.125");
+  assert_formats(0.000001, "0.000001");
+  assert_formats(0.0000001, "1e-7");
+  assert_formats(1.5e-10, "1.5e-10");
+}
+
+static void should_format_extremes(void **state) {
+  assert_formats(DBL_MAX, "1.7976931348623157e+308");
+  assert_formats(DBL_MIN, "2.2250738585072014e-308");
+  assert_formats(5e-324, "5e-324");
+  assert_formats(INFINITY, "inf");
+  assert_formats(-INFINITY, "-inf");
+  assert_formats(NAN, "nan");
+}
+
+static void should_parse_literals(void **state) {
+  assert_parses("0", 0);
+  assert_parses("42", 42);
+  assert_parses("-42", -42);
+  assert_parses("0.5", 0.5);
+  assert_parses("3.14159", 3.14159);
+  assert_parses(".5", 0.5);
+  assert_parses("5.", 5);
+  assert_parses("1e3", 1000);
+  assert_parses("12e30", 12e30);
+  assert_parses("2.5E-3", 2.5e-3);
+}
+
+static void should_parse_beyond_the_fast_path(void **state) {
+  assert_parses("123456789012345678901234567890", 123456789012345678901234567890.0);
+  assert_parses("0.30000000000000004", 0.30000000000000004);
+  assert_parses("1e400", INFINITY);
+  assert_parses("1e-400", 0);
+  assert_parses("4.9406564584124654e-324", 5e-324);
+}
+
+static void should_reject_malformed_numbers(void **state) {
+  double result;
+  assert_false(parse_number("", 0, &result));
+  assert_false(parse_number(".", 1, &result));
+  assert_false(parse_number("1e", 2, &result));
+  assert_false(parse_number("1.2.3", 5, &result));
+  assert_false(parse_number("12abc", 5, &result));
+}
+
+int main(void) {
+  const struct CMUnitTest tests[] = {
+    cmocka_unit_test(should_format_integers),
+    cmocka_unit_test(should_format_shortest_fractions),
+    cmocka_unit_test(should_format_extremes),
+    cmocka_unit_test(should_parse_literals),
+    cmocka_unit_test(should_parse_beyond_the_fast_path),
+    cmocka_unit_test(should_reject_malformed_numbers),
+  };
+  return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -1,12 +1,16 @@
+#include <string.h>
 #include "common.h"
 #include "../scanner.h"
 
+#define SCAN(source) init_scanner(source, strlen(source))
 #define ASSERT_TOKEN_TYPE(TOKEN) assert_int_equal(scan_token().type, TOKEN);
 
 static void should_scan_single_character(void **state) {
-  init_scanner("{}(),.-+;/*%");
+  SCAN("{}[](),.-+;/*%:");
   ASSERT_TOKEN_TYPE(TOKEN_LEFT_BRACE);
   ASSERT_TOKEN_TYPE(TOKEN_RIGHT_BRACE);
+  ASSERT_TOKEN_TYPE(TOKEN_LEFT_BRACKET);
+  ASSERT_TOKEN_TYPE(TOKEN_RIGHT_BRACKET);
   ASSERT_TOKEN_TYPE(TOKEN_LEFT_PAREN);
   ASSERT_TOKEN_TYPE(TOKEN_RIGHT_PAREN);
   ASSERT_TOKEN_TYPE(TOKEN_COMMA);
@@ -17,10 +21,11 @@ static void should_scan_single_character(void **state) {
   ASSERT_TOKEN_TYPE(TOKEN_SLASH);
   ASSERT_TOKEN_TYPE(TOKEN_STAR);
   ASSERT_TOKEN_TYPE(TOKEN_PERCENT);
+  ASSERT_TOKEN_TYPE(TOKEN_COLON);
 }
 
 static void should_scan_two_character(void **state) {
-  init_scanner("! != = == > >= < <=");
+  SCAN("! != = == > >= < <=");
   ASSERT_TOKEN_TYPE(TOKEN_BANG);
   ASSERT_TOKEN_TYPE(TOKEN_BANG_EQUAL);
   ASSERT_TOKEN_TYPE(TOKEN_EQUAL);
@@ -32,15 +37,26 @@ static void should_scan_two_character(void **state) {
 }
 
 static void should_scan_literals(void **state) {
-  init_scanner("hola \"hola\" 22 22.11");
+  SCAN("hola \"hola\" 22 22.11");
   ASSERT_TOKEN_TYPE(TOKEN_IDENTIFIER);
   ASSERT_TOKEN_TYPE(TOKEN_STRING);
   ASSERT_TOKEN_TYPE(TOKEN_NUMBER);
   ASSERT_TOKEN_TYPE(TOKEN_NUMBER);
 }
 
+static void should_scan_decimal_numbers(void **state) {
+  SCAN("3.14 7.x");
+  Token token = scan_token();
+  assert_int_equal(token.type, TOKEN_NUMBER);
+  assert_int_equal(token.length, 4);
+  ASSERT_TOKEN_TYPE(TOKEN_NUMBER);
+  ASSERT_TOKEN_TYPE(TOKEN_DOT);
+  ASSERT_TOKEN_TYPE(TOKEN_IDENTIFIER);
+  ASSERT_TOKEN_TYPE(TOKEN_EOF);
+}
+
 static void should_scan_keywords(void **state) {
-  init_scanner("and class else false for fun if nil or print return super this true var while break continue");
+  SCAN("and class else false for fun if nil or print return super this true var while break continue");
   ASSERT_TOKEN_TYPE(TOKEN_AND);
   ASSERT_TOKEN_TYPE(TOKEN_CLASS);
   ASSERT_TOKEN_TYPE(TOKEN_ELSE);
@@ -62,16 +78,16 @@ static void should_scan_keywords(void **state) {
 }
 
 static void should_return_token_error(void **state) {
-  init_scanner("    \"this sting does not terminate   ");
+  SCAN("    \"this sting does not terminate   ");
   ASSERT_TOKEN_TYPE(TOKEN_ERROR);
 }
 
 static void should_return_token_eof(void **state) {
-  init_scanner("");
+  SCAN("");
   ASSERT_TOKEN_TYPE(TOKEN_EOF);
-  init_scanner("       ");
+  SCAN("       ");
   ASSERT_TOKEN_TYPE(TOKEN_EOF);
-  init_scanner("   and    ");
+  SCAN("   and    ");
   ASSERT_TOKEN_TYPE(TOKEN_AND);
   ASSERT_TOKEN_TYPE(TOKEN_EOF);
 }
@@ -81,6 +97,7 @@ int main(void) {
     cmocka_unit_test(should_scan_single_character),
     cmocka_unit_test(should_scan_two_character),
     cmocka_unit_test(should_scan_literals),
+    cmocka_unit_test(should_scan_decimal_numbers),
     cmocka_unit_test(should_scan_keywords),
     cmocka_unit_test(should_return_token_error),
     cmocka_unit_test(should_return_token_eof),
@@ -0,0 +1,11 @@
+#ifndef clox_timing_h
+#define clox_timing_h
+
+#include "common.h"
+
+// Monotonic wall clock, for durations.
+uint64_t monotonic_ns();
+// CPU time stamp counter ticks.
+uint64_t cycle_count();
+
+#endif
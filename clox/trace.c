@@ -0,0 +1,1194 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/mman.h>
+#include "trace.h"
+
+#ifdef CLOX_JIT
+
+#include "jit.h"
+#include "x64.h"
+
+#define MAX_IR 256
+#define MAX_HOMES 32
+#define MAX_DEPTH 32 // Stack slots above the loop's locals
+#define MAX_SNAPSHOTS 64
+#define BUDGET_EXIT 0 // Snapshot of the loop's end, taken when the budget runs out
+#define MAX_ATTEMPTS 3 // Failed recordings before a loop is left alone
+
+// Kept across calls, set up by the entry code.
+#define VM_REG RBX
+#define SLOTS_REG R12
+#define FRAME_REG R13
+#define HOMES_REG R14 // Value* of each home, found on entry
+// Values live in xmm0 to xmm13, the other two are scratch.
+#define REGISTERS 14
+#define SCRATCH XMM15
+#define SCRATCH2 XMM14
+#define SAVE_AREA 120 // xmm0 to xmm13 while calling out, keeps rsp aligned
+
+#define PAYLOAD_OFFSET ((int32_t)offsetof(Value, as))
+#define SLOT(height) ((int32_t)((height) * sizeof(Value)))
+
+typedef void (*TraceEntry)(VM* vm, CallFrame* frame, Value** homes);
+
+// Where a variable of the loop lives between iterations.
+typedef enum {
+	HOME_LOCAL,
+	HOME_GLOBAL,
+	HOME_UPVALUE,
+	HOME_FIELD, // Of the instance in the home 'index', which the loop doesn't assign
+} HomeKind;
+
+typedef struct {
+	HomeKind kind;
+	int index; // Local slot, upvalue, or receiver
+	int constant; // Name of globals and fields, read again on each entry
+	ValueType type; // At the top of the loop
+	bool checked; // The type is checked on entry
+} TraceHome;
+
+struct sTrace {
+	struct sTrace* next;
+	int header; // Bytecode offset of the loop's start
+	atomic_int attempts; // Failed recordings, for entries without code
+	void* code;
+	size_t size;
+	TraceHome* homes;
+	int home_count;
+};
+
+// Linear SSA, one iteration of the loop. Operands come before their users.
+typedef enum {
+	IR_LOAD, // Value of a home at the top of the loop
+	IR_CONST,
+	IR_ADD,
+	IR_SUB,
+	IR_MUL,
+	IR_DIV,
+	IR_MOD,
+	IR_NEG,
+	IR_LESS, // Of numbers
+	IR_GREATER,
+	IR_EQUAL,
+	IR_SAME, // Of booleans
+	IR_NOT,
+	IR_GUARD, // Leaves the loop unless 'a' is 'expect'
+} IrOp;
+
+typedef struct {
+	IrOp op;
+	ValueType type; // Of the result
+	int a;
+	int b;
+	uint64_t bits; // IR_CONST
+	int home; // IR_LOAD
+	int snapshot; // IR_GUARD
+	bool expect; // IR_GUARD
+} Ir;
+
+typedef struct {
+	HomeKind kind;
+	int index;
+	ObjString* name;
+	int constant;
+	ValueType type;
+	int load; // IR_LOAD, -1 until the loop needs it
+	int current; // Value so far in the iteration, -1 before it is assigned
+	bool written;
+} Home;
+
+// What the interpreter needs when a guard fails: the bytecode to go on
+// at and the values of the stack and of the homes at that point.
+typedef struct {
+	int pc;
+	int height;
+	int stack; // First of height - base refs in 'refs'
+	int homes; // First of home_count refs in 'refs'
+	int home_count; // Homes found by then, later ones are untouched
+	int patches[2]; // rel32 of the jumps to its exit
+} Snapshot;
+
+// MOD called fmod() out of line.
+typedef struct {
+	int ir;
+	int patches[5];
+	int resume;
+} SlowMod;
+
+typedef struct {
+	VM* vm;
+	CallFrame* frame;
+	Chunk* chunk;
+	int header;
+	int base; // Stack height at the loop's start
+	int height;
+	int loops; // OP_LOOPs in an iteration
+	int loop_end; // The one back to the start
+	uint8_t* visited;
+
+	int stack[MAX_DEPTH]; // Refs of the slots from 'base' up
+	Ir ir[MAX_IR];
+	int ir_count;
+	Home homes[MAX_HOMES];
+	int home_count;
+	Snapshot snapshots[MAX_SNAPSHOTS];
+	int snapshot_count;
+	int refs[MAX_SNAPSHOTS * (MAX_DEPTH + MAX_HOMES)];
+	int ref_count;
+
+	// Code generation
+	bool live[MAX_IR];
+	int uses[MAX_IR];
+	int user[MAX_IR]; // The last one
+	int last_use[MAX_IR];
+	bool fused[MAX_IR]; // Compares done by the guard using them
+	int reg[MAX_IR];
+	CodeBuffer code;
+	uint64_t pool[MAX_IR + 4];
+	int pool_count;
+	int fixups[MAX_IR * 8][2]; // rel32 and pool index
+	int fixup_count;
+	SlowMod mods[MAX_IR];
+	int mod_count;
+} Recorder;
+
+typedef enum {
+	RECORD_NEXT,
+	RECORD_DONE,
+	RECORD_ABORT,
+} RecordStep;
+
+static bool falsy(Value value) {
+	return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+static uint64_t number_bits(double number) {
+	uint64_t bits;
+	memcpy(&bits, &number, sizeof(bits));
+	return bits;
+}
+
+static double bits_number(uint64_t bits) {
+	double number;
+	memcpy(&number, &bits, sizeof(number));
+	return number;
+}
+
+// Recording
+
+static int emit(Recorder* r, Ir ir) {
+	r->ir[r->ir_count] = ir;
+	return r->ir_count++;
+}
+
+static int constant(Recorder* r, ValueType type, uint64_t bits) {
+	for (int i = 0; i < r->ir_count; i++) {
+		if (r->ir[i].op == IR_CONST && r->ir[i].type == type && r->ir[i].bits == bits) return i;
+	}
+	return emit(r, (Ir){ .op = IR_CONST, .type = type, .bits = bits });
+}
+
+static int number_constant(Recorder* r, double number) {
+	return constant(r, VAL_NUMBER, number_bits(number));
+}
+
+static int bool_constant(Recorder* r, bool boolean) {
+	return constant(r, VAL_BOOL, boolean);
+}
+
+static bool is_constant(Recorder* r, int ref) {
+	return r->ir[ref].op == IR_CONST;
+}
+
+static double folded(IrOp op, double a, double b) {
+	switch (op) {
+	case IR_ADD: return a + b;
+	case IR_SUB: return a - b;
+	case IR_MUL: return a * b;
+	case IR_DIV: return a / b;
+	case IR_MOD: return fmod(a, b);
+	default: return -a;
+	}
+}
+
+// Folds constants and reuses an earlier instruction computing the same.
+static int pure(Recorder* r, IrOp op, ValueType type, int a, int b) {
+	if (is_constant(r, a) && (b < 0 || is_constant(r, b))) {
+		double x = bits_number(r->ir[a].bits);
+		double y = b < 0 ? 0 : bits_number(r->ir[b].bits);
+		switch (op) {
+		case IR_LESS: return bool_constant(r, x < y);
+		case IR_GREATER: return bool_constant(r, x > y);
+		case IR_EQUAL: return bool_constant(r, x == y);
+		case IR_SAME: return bool_constant(r, r->ir[a].bits == r->ir[b].bits);
+		case IR_NOT: return bool_constant(r, !r->ir[a].bits);
+		default: return number_constant(r, folded(op, x, y));
+		}
+	}
+	for (int i = 0; i < r->ir_count; i++) {
+		Ir* ir = &r->ir[i];
+		if (ir->op == op && ir->a == a && ir->b == b) return i;
+	}
+	return emit(r, (Ir){ .op = op, .type = type, .a = a, .b = b });
+}
+
+static int find_home(Recorder* r, HomeKind kind, int index, ObjString* name, int constant) {
+	for (int i = 0; i < r->home_count; i++) {
+		Home* home = &r->homes[i];
+		if (home->kind == kind && home->index == index && home->name == name) return i;
+	}
+	if (r->home_count == MAX_HOMES) return -1;
+	r->homes[r->home_count] = (Home){ kind, index, name, constant, VAL_NIL, -1, -1, false };
+	return r->home_count++;
+}
+
+// 'value' is what the home holds now, its value at the top of the loop
+// unless the iteration assigned it.
+static int read_home(Recorder* r, int index, Value value) {
+	Home* home = &r->homes[index];
+	if (home->current >= 0) return home->current;
+	if (home->load < 0) {
+		home->type = value.type;
+		home->load = emit(r, (Ir){ .op = IR_LOAD, .type = value.type, .home = index });
+	}
+	return home->type == VAL_NIL ? constant(r, VAL_NIL, 0) : home->load;
+}
+
+static void write_home(Recorder* r, int index, int ref) {
+	r->homes[index].current = ref;
+	r->homes[index].written = true;
+}
+
+// The home whose value at the top of the loop 'ref' is.
+static int home_of(Recorder* r, int ref) {
+	for (int i = 0; i < r->home_count; i++) {
+		if (r->homes[i].load == ref && r->homes[i].current < 0) return i;
+	}
+	return -1;
+}
+
+static bool push(Recorder* r, int ref, Value value) {
+	if (ref < 0 || r->height - r->base == MAX_DEPTH) return false;
+	r->stack[r->height++ - r->base] = ref;
+	stack_push(r->vm, value);
+	return true;
+}
+
+static int top(Recorder* r, int distance) {
+	return r->stack[r->height - 1 - distance - r->base];
+}
+
+static Value peek(Recorder* r, int distance) {
+	return r->vm->stack_top[-1 - distance];
+}
+
+static void pop(Recorder* r, int count) {
+	r->height -= count;
+	r->vm->stack_top -= count;
+}
+
+static void take_snapshot(Recorder* r, Snapshot* snapshot, int pc) {
+	*snapshot = (Snapshot){ pc, r->height, r->ref_count, 0, r->home_count, { -1, -1 } };
+	for (int i = r->base; i < r->height; i++) r->refs[r->ref_count++] = r->stack[i - r->base];
+	snapshot->homes = r->ref_count;
+	for (int i = 0; i < r->home_count; i++) r->refs[r->ref_count++] = r->homes[i].current;
+}
+
+// Leaves the trace at 'exit_pc' unless 'ref' is 'expect'.
+static bool guard(Recorder* r, int ref, bool expect, int exit_pc) {
+	if (r->snapshot_count == MAX_SNAPSHOTS) return false;
+	int exit = r->snapshot_count++;
+	Snapshot* snapshot = &r->snapshots[exit];
+	take_snapshot(r, snapshot, exit_pc);
+	// The condition is still on the stack, with the other value.
+	r->refs[snapshot->stack + r->height - 1 - r->base] = bool_constant(r, !expect);
+	while (r->ir[ref].op == IR_NOT) {
+		ref = r->ir[ref].a;
+		expect = !expect;
+	}
+	emit(r, (Ir){ .op = IR_GUARD, .a = ref, .b = -1, .snapshot = exit, .expect = expect });
+	return true;
+}
+
+static bool record_binary(Recorder* r, IrOp op, ValueType type) {
+	if (!IS_NUMBER(peek(r, 0)) || !IS_NUMBER(peek(r, 1))) return false;
+	double b = AS_NUMBER(peek(r, 0));
+	double a = AS_NUMBER(peek(r, 1));
+	int ref = pure(r, op, type, top(r, 1), top(r, 0));
+	pop(r, 2);
+	Value result = type == VAL_BOOL ? BOOL_VALUE(op == IR_LESS ? a < b : op == IR_GREATER ? a > b : a == b)
+		: NUMBER_VALUE(folded(op, a, b));
+	push(r, ref, result);
+	return true;
+}
+
+static bool record_equal(Recorder* r) {
+	Value a = peek(r, 1);
+	Value b = peek(r, 0);
+	int ref;
+	bool equal;
+	if (a.type != b.type) {
+		ref = bool_constant(r, false);
+		equal = false;
+	} else if (IS_NUMBER(a)) {
+		return record_binary(r, IR_EQUAL, VAL_BOOL);
+	} else if (IS_BOOL(a)) {
+		ref = pure(r, IR_SAME, VAL_BOOL, top(r, 1), top(r, 0));
+		equal = AS_BOOL(a) == AS_BOOL(b);
+	} else if (IS_NIL(a)) {
+		ref = bool_constant(r, true);
+		equal = true;
+	} else {
+		return false; // Strings compare by content
+	}
+	pop(r, 2);
+	push(r, ref, BOOL_VALUE(equal));
+	return true;
+}
+
+// The instance under the stack's top 'distance' values, and the home of
+// its field, which must exist. -1 when the trace can't keep it.
+static int field_home(Recorder* r, int distance, ObjString* name, int constant, Value** field) {
+	Value receiver = peek(r, distance);
+	if (!IS_INSTANCE(receiver)) return -1;
+	*field = table_find(&AS_INSTANCE(receiver)->fields, name);
+	int owner = home_of(r, top(r, distance));
+	if (*field == NULL || owner < 0) return -1;
+	return find_home(r, HOME_FIELD, owner, name, constant);
+}
+
+// Runs the instruction at the frame's pc as run() would and notes it.
+// Stops before anything it can't trace, which run() then does itself.
+static RecordStep record_instruction(Recorder* r) {
+	CallFrame* frame = r->frame;
+	uint8_t* pc = frame->pc;
+	int offset = (int)(pc - r->chunk->code);
+	// An inner loop, or a path too long to be worth it.
+	if (r->visited[offset] || r->ir_count > MAX_IR - 8) return RECORD_ABORT;
+	r->visited[offset] = true;
+	ValueArray* constants = &r->chunk->constants;
+	uint16_t distance = (pc[1] << 8) | pc[2];
+
+	switch (*pc) {
+	case OP_CONSTANT: {
+		Value value = constants->values[pc[1]];
+		if (!IS_NUMBER(value)) return RECORD_ABORT;
+		if (!push(r, number_constant(r, AS_NUMBER(value)), value)) return RECORD_ABORT;
+		frame->pc += 2;
+		return RECORD_NEXT;
+	}
+	case OP_NIL:
+		if (!push(r, constant(r, VAL_NIL, 0), NIL_VALUE())) return RECORD_ABORT;
+		break;
+	case OP_TRUE:
+	case OP_FALSE: {
+		bool boolean = *pc == OP_TRUE;
+		if (!push(r, bool_constant(r, boolean), BOOL_VALUE(boolean))) return RECORD_ABORT;
+		break;
+	}
+	case OP_POP:
+		if (r->height == r->base) return RECORD_ABORT;
+		pop(r, 1);
+		break;
+	case OP_GET_LOCAL: {
+		int slot = pc[1];
+		Value value = frame->slots[slot];
+		int ref;
+		if (slot < r->base) {
+			int home = find_home(r, HOME_LOCAL, slot, NULL, 0);
+			if (home < 0) return RECORD_ABORT;
+			ref = read_home(r, home, value);
+		} else {
+			ref = r->stack[slot - r->base];
+		}
+		if (!push(r, ref, value)) return RECORD_ABORT;
+		frame->pc += 2;
+		return RECORD_NEXT;
+	}
+	case OP_SET_LOCAL: {
+		int slot = pc[1];
+		if (slot < r->base) {
+			int home = find_home(r, HOME_LOCAL, slot, NULL, 0);
+			if (home < 0) return RECORD_ABORT;
+			write_home(r, home, top(r, 0));
+		} else {
+			r->stack[slot - r->base] = top(r, 0);
+		}
+		frame->slots[slot] = peek(r, 0);
+		frame->pc += 2;
+		return RECORD_NEXT;
+	}
+	case OP_GET_GLOBAL:
+	case OP_SET_GLOBAL: {
+		ObjString* name = AS_STRING(constants->values[pc[1]]);
+		Value* global = table_find(&r->vm->globals, name);
+		int home = global == NULL ? -1 : find_home(r, HOME_GLOBAL, 0, name, pc[1]);
+		if (home < 0) return RECORD_ABORT;
+		if (*pc == OP_GET_GLOBAL) {
+			if (!push(r, read_home(r, home, *global), *global)) return RECORD_ABORT;
+		} else {
+			write_home(r, home, top(r, 0));
+			*global = peek(r, 0);
+		}
+		frame->pc += 2;
+		return RECORD_NEXT;
+	}
+	case OP_GET_UPVALUE:
+	case OP_SET_UPVALUE: {
+		Value* location = frame->closure->upvalues[pc[1]]->location;
+		int home = find_home(r, HOME_UPVALUE, pc[1], NULL, 0);
+		if (home < 0) return RECORD_ABORT;
+		if (*pc == OP_GET_UPVALUE) {
+			if (!push(r, read_home(r, home, *location), *location)) return RECORD_ABORT;
+		} else {
+			write_home(r, home, top(r, 0));
+			*location = peek(r, 0);
+		}
+		frame->pc += 2;
+		return RECORD_NEXT;
+	}
+	case OP_GET_PROPERTY: {
+		Value* field;
+		int home = field_home(r, 0, AS_STRING(constants->values[pc[1]]), pc[1], &field);
+		if (home < 0) return RECORD_ABORT;
+		int ref = read_home(r, home, *field);
+		pop(r, 1);
+		push(r, ref, *field);
+		frame->pc += 2;
+		return RECORD_NEXT;
+	}
+	case OP_SET_PROPERTY: {
+		Value* field;
+		int home = field_home(r, 1, AS_STRING(constants->values[pc[1]]), pc[1], &field);
+		if (home < 0) return RECORD_ABORT;
+		int ref = top(r, 0);
+		Value value = peek(r, 0);
+		write_home(r, home, ref);
+		*field = value;
+		pop(r, 2);
+		push(r, ref, value);
+		frame->pc += 2;
+		return RECORD_NEXT;
+	}
+	case OP_ADD: if (!record_binary(r, IR_ADD, VAL_NUMBER)) return RECORD_ABORT; break;
+	case OP_SUBSTRACT: if (!record_binary(r, IR_SUB, VAL_NUMBER)) return RECORD_ABORT; break;
+	case OP_MULTIPLY: if (!record_binary(r, IR_MUL, VAL_NUMBER)) return RECORD_ABORT; break;
+	case OP_DIVIDE: if (!record_binary(r, IR_DIV, VAL_NUMBER)) return RECORD_ABORT; break;
+	case OP_MODULE: if (!record_binary(r, IR_MOD, VAL_NUMBER)) return RECORD_ABORT; break;
+	case OP_LESS: if (!record_binary(r, IR_LESS, VAL_BOOL)) return RECORD_ABORT; break;
+	case OP_GREATER: if (!record_binary(r, IR_GREATER, VAL_BOOL)) return RECORD_ABORT; break;
+	case OP_EQUAL: if (!record_equal(r)) return RECORD_ABORT; break;
+	case OP_NEGATE: {
+		if (!IS_NUMBER(peek(r, 0))) return RECORD_ABORT;
+		int ref = pure(r, IR_NEG, VAL_NUMBER, top(r, 0), -1);
+		Value value = NUMBER_VALUE(-AS_NUMBER(peek(r, 0)));
+		pop(r, 1);
+		push(r, ref, value);
+		break;
+	}
+	case OP_NOT: {
+		Value value = peek(r, 0);
+		int ref = IS_BOOL(value) && !is_constant(r, top(r, 0))
+			? pure(r, IR_NOT, VAL_BOOL, top(r, 0), -1)
+			: bool_constant(r, falsy(value));
+		pop(r, 1);
+		push(r, ref, BOOL_VALUE(falsy(value)));
+		break;
+	}
+	case OP_JUMP:
+		frame->pc += 3 + distance;
+		return RECORD_NEXT;
+	case OP_JUMP_IF_FALSE: {
+		bool jumps = falsy(peek(r, 0));
+		int taken = offset + 3 + distance;
+		int ref = top(r, 0);
+		// Other types and constants always go the same way.
+		if (r->ir[ref].type == VAL_BOOL && !is_constant(r, ref)) {
+			if (!guard(r, ref, !jumps, jumps ? offset + 3 : taken)) return RECORD_ABORT;
+			r->stack[r->height - 1 - r->base] = bool_constant(r, !jumps);
+		}
+		frame->pc = r->chunk->code + (jumps ? taken : offset + 3);
+		return RECORD_NEXT;
+	}
+	case OP_LOOP: {
+		int target = offset + 3 - distance;
+		r->loops++;
+		if (target == r->header) {
+			r->loop_end = offset;
+			return RECORD_DONE; // run() does this one
+		}
+		// As run() does, unless the budget is out.
+		if (r->vm->budget <= 0) return RECORD_ABORT;
+		r->vm->budget--;
+		frame->pc = r->chunk->code + target;
+		return RECORD_NEXT;
+	}
+	default:
+		return RECORD_ABORT;
+	}
+	frame->pc++;
+	return RECORD_NEXT;
+}
+
+// Closes the loop: what the homes hold at the end is what the next
+// iteration starts with, so it must have the type checked on entry.
+static bool finish_recording(Recorder* r) {
+	if (r->height != r->base) return false;
+	for (int i = 0; i < r->home_count; i++) {
+		Home* home = &r->homes[i];
+		if (home->kind == HOME_FIELD && r->homes[home->index].written) return false;
+		if (!home->written) continue;
+		ValueType type = r->ir[home->current].type;
+		if (home->load < 0) {
+			home->type = type;
+			home->load = emit(r, (Ir){ .op = IR_LOAD, .type = type, .home = i });
+		} else if (home->type != type) {
+			return false;
+		}
+	}
+	// Out of budget: back to the last OP_LOOP, which checks the limits.
+	take_snapshot(r, &r->snapshots[BUDGET_EXIT], r->loop_end);
+	return true;
+}
+
+// Code generation
+
+static bool has_register(Recorder* r, int ref) {
+	return r->reg[ref] >= 0;
+}
+
+static void use(Recorder* r, int ref, int at) {
+	if (ref < 0) return;
+	r->live[ref] = true;
+	r->uses[ref]++;
+	r->user[ref] = at;
+	if (at > r->last_use[ref]) r->last_use[ref] = at;
+}
+
+static void use_snapshot(Recorder* r, Snapshot* snapshot, int at) {
+	for (int i = 0; i < snapshot->height - r->base; i++) use(r, r->refs[snapshot->stack + i], at);
+	for (int i = 0; i < r->home_count; i++) {
+		if (!r->homes[i].written) continue;
+		int ref = i < snapshot->home_count ? r->refs[snapshot->homes + i] : -1;
+		use(r, ref >= 0 ? ref : r->homes[i].load, at);
+	}
+}
+
+static bool is_compare(IrOp op) {
+	return op == IR_LESS || op == IR_GREATER || op == IR_EQUAL || op == IR_SAME;
+}
+
+// Guards and what the loop carries are live, and so is what they use.
+static void find_live(Recorder* r) {
+	int end = r->ir_count;
+	for (int i = 0; i < r->ir_count; i++) {
+		r->live[i] = r->ir[i].op == IR_GUARD;
+		r->uses[i] = 0;
+		r->last_use[i] = i;
+		r->fused[i] = false;
+	}
+	for (int i = 0; i < r->home_count; i++) {
+		if (!r->homes[i].written) continue;
+		use(r, r->homes[i].current, end);
+		use(r, r->homes[i].load, end);
+	}
+	use_snapshot(r, &r->snapshots[BUDGET_EXIT], end);
+	for (int i = r->ir_count - 1; i >= 0; i--) {
+		Ir* ir = &r->ir[i];
+		if (!r->live[i]) continue;
+		if (ir->op == IR_GUARD) use_snapshot(r, &r->snapshots[ir->snapshot], i);
+		if (ir->op != IR_LOAD && ir->op != IR_CONST) {
+			use(r, ir->a, i);
+			use(r, ir->b, i);
+		}
+	}
+	// A compare only tested by a guard sets the flags right there.
+	for (int i = 0; i < r->ir_count; i++) {
+		Ir* ir = &r->ir[i];
+		if (!r->live[i] || !is_compare(ir->op) || r->uses[i] != 1) continue;
+		int guard = r->user[i];
+		if (r->ir[guard].op != IR_GUARD || r->ir[guard].a != i) continue;
+		r->fused[i] = true;
+		if (r->last_use[ir->a] < guard) r->last_use[ir->a] = guard;
+		if (r->last_use[ir->b] < guard) r->last_use[ir->b] = guard;
+	}
+}
+
+static bool needs_register(Recorder* r, int ref) {
+	Ir* ir = &r->ir[ref];
+	return r->live[ref] && ir->op != IR_CONST && ir->op != IR_GUARD && ir->type != VAL_NIL && !r->fused[ref];
+}
+
+// Linear scan. Loads hold the loop's variables and keep their registers.
+// False when the loop needs more registers than there are.
+static bool allocate_registers(Recorder* r) {
+	bool taken[REGISTERS] = { false };
+	int next = 0;
+	for (int i = 0; i < r->ir_count; i++) {
+		r->reg[i] = -1;
+		if (r->ir[i].op != IR_LOAD || !needs_register(r, i)) continue;
+		if (next == REGISTERS) return false;
+		taken[next] = true;
+		r->reg[i] = next++;
+		r->last_use[i] = r->ir_count;
+	}
+	for (int i = 0; i < r->ir_count; i++) {
+		// Operands used for the last time here can hold the result.
+		for (int j = 0; j < i; j++) {
+			if (r->reg[j] >= 0 && r->ir[j].op != IR_LOAD && r->last_use[j] == i) {
+				taken[r->reg[j]] = false;
+			}
+		}
+		if (r->ir[i].op == IR_LOAD || !needs_register(r, i)) continue;
+		int reg = 0;
+		while (reg < REGISTERS && taken[reg]) reg++;
+		if (reg == REGISTERS) return false;
+		taken[reg] = true;
+		r->reg[i] = reg;
+	}
+	return true;
+}
+
+static int pool_constant(Recorder* r, uint64_t bits) {
+	for (int i = 0; i < r->pool_count; i++) {
+		if (r->pool[i] == bits) return i;
+	}
+	r->pool[r->pool_count] = bits;
+	return r->pool_count++;
+}
+
+static void fixup(Recorder* r, int at, uint64_t bits) {
+	r->fixups[r->fixup_count][0] = at;
+	r->fixups[r->fixup_count][1] = pool_constant(r, bits);
+	r->fixup_count++;
+}
+
+static uint64_t constant_bits(Recorder* r, int ref) {
+	return r->ir[ref].op == IR_CONST ? r->ir[ref].bits : 0;
+}
+
+#define SIGN_BIT 0x8000000000000000ull
+
+// SSE instruction with 'reg' and the value 'ref', from its register or
+// the constant pool.
+static void sse(Recorder* r, uint8_t prefix, bool wide, uint16_t opcode, int reg, int ref) {
+	if (has_register(r, ref)) {
+		x64_reg(&r->code, prefix, wide, opcode, reg, r->reg[ref]);
+	} else {
+		fixup(r, x64_mem(&r->code, prefix, wide, opcode, reg, RIP, 0), constant_bits(r, ref));
+	}
+}
+
+static void sse_constant(Recorder* r, uint8_t prefix, uint16_t opcode, int reg, uint64_t bits) {
+	fixup(r, x64_mem(&r->code, prefix, false, opcode, reg, RIP, 0), bits);
+}
+
+static void move_xmm(Recorder* r, int to, int from) {
+	if (to != from) x64_reg(&r->code, 0x66, false, 0x0f28, to, from); // movapd
+}
+
+static void move_to(Recorder* r, int reg, int ref) {
+	if (has_register(r, ref)) {
+		move_xmm(r, reg, r->reg[ref]);
+	} else {
+		sse(r, 0xf2, false, 0x0f10, reg, ref); // movsd
+	}
+}
+
+// The payload of 'ref' in rax, or rcx.
+static void move_to_gpr(Recorder* r, int gpr, int ref) {
+	if (has_register(r, ref)) {
+		x64_reg(&r->code, 0x66, true, 0x0f7e, r->reg[ref], gpr); // movq
+	} else {
+		x64_mov_imm64(&r->code, gpr, constant_bits(r, ref));
+	}
+}
+
+static void gpr_to_xmm(Recorder* r, int reg, int gpr) {
+	x64_reg(&r->code, 0x66, true, 0x0f6e, reg, gpr); // movq
+}
+
+static void binary(Recorder* r, uint16_t opcode, bool commutative, int result, int a, int b) {
+	int reg = r->reg[result];
+	if (has_register(r, a) && r->reg[a] == reg) {
+		sse(r, 0xf2, false, opcode, reg, b);
+	} else if (commutative && has_register(r, b) && r->reg[b] == reg) {
+		sse(r, 0xf2, false, opcode, reg, a);
+	} else if (has_register(r, b) && r->reg[b] == reg) {
+		move_to(r, SCRATCH, a);
+		sse(r, 0xf2, false, opcode, SCRATCH, b);
+		move_xmm(r, reg, SCRATCH);
+	} else {
+		move_to(r, reg, a);
+		sse(r, 0xf2, false, opcode, reg, b);
+	}
+}
+
+// Sets the flags so that CC_A, or CC_E for equality, means true.
+static void compare(Recorder* r, Ir* ir) {
+	if (ir->op == IR_SAME) {
+		move_to_gpr(r, RAX, ir->a);
+		move_to_gpr(r, RCX, ir->b);
+		x64_reg(&r->code, 0, true, 0x39, RCX, RAX); // cmp rax, rcx
+		return;
+	}
+	// a < b is b above a. Unordered (NaN) sets the carry, so is false.
+	int x = ir->op == IR_LESS ? ir->b : ir->a;
+	int y = ir->op == IR_LESS ? ir->a : ir->b;
+	int reg = SCRATCH;
+	if (has_register(r, x)) {
+		reg = r->reg[x];
+	} else {
+		move_to(r, SCRATCH, x);
+	}
+	sse(r, 0x66, false, 0x0f2e, reg, y); // ucomisd
+}
+
+static void exit_if(Recorder* r, int condition, Snapshot* snapshot) {
+	int at = x64_jump_if(&r->code, condition);
+	snapshot->patches[snapshot->patches[0] < 0 ? 0 : 1] = at;
+}
+
+static void compile_guard(Recorder* r, Ir* guard) {
+	CodeBuffer* code = &r->code;
+	Snapshot* snapshot = &r->snapshots[guard->snapshot];
+	Ir* tested = &r->ir[guard->a];
+	if (!r->fused[guard->a]) {
+		move_to_gpr(r, RAX, guard->a);
+		x64_byte(code, 0x85); // test eax, eax
+		x64_byte(code, 0xc0);
+		exit_if(r, guard->expect ? CC_E : CC_NE, snapshot);
+		return;
+	}
+	compare(r, tested);
+	if (tested->op == IR_LESS || tested->op == IR_GREATER) {
+		exit_if(r, guard->expect ? CC_BE : CC_A, snapshot);
+	} else if (tested->op == IR_SAME) {
+		exit_if(r, guard->expect ? CC_NE : CC_E, snapshot);
+	} else if (guard->expect) {
+		exit_if(r, CC_NE, snapshot);
+		exit_if(r, CC_P, snapshot);
+	} else {
+		int ordered = x64_jump_if(code, CC_P);
+		exit_if(r, CC_E, snapshot);
+		x64_patch_rel32(code, ordered, code->size);
+	}
+}
+
+// Integers in range take idiv; the rest, and division by zero, fmod().
+// Both give the sign of the dividend to the remainder, zero included.
+static void compile_mod(Recorder* r, int index) {
+	CodeBuffer* code = &r->code;
+	Ir* ir = &r->ir[index];
+	SlowMod* mod = &r->mods[r->mod_count++];
+	mod->ir = index;
+	int patch = 0;
+	for (int i = 0; i < 2; i++) {
+		int operand = i == 0 ? ir->a : ir->b;
+		int gpr = i == 0 ? RAX : RCX;
+		sse(r, 0xf2, true, 0x0f2c, gpr, operand); // cvttsd2si
+		x64_reg(code, 0xf2, true, 0x0f2a, SCRATCH, gpr); // cvtsi2sd
+		sse(r, 0x66, false, 0x0f2e, SCRATCH, operand); // ucomisd
+		mod->patches[patch++] = x64_jump_if(code, CC_NE);
+		mod->patches[patch++] = x64_jump_if(code, CC_P);
+	}
+	// rcx is neither 0 nor -1, which would overflow.
+	x64_mem(code, 0, true, 0x8d, RDX, RCX, 1); // lea rdx, [rcx + 1]
+	x64_reg(code, 0, true, 0x83, 7, RDX); // cmp rdx, 1
+	x64_byte(code, 1);
+	mod->patches[patch++] = x64_jump_if(code, CC_BE);
+	x64_byte(code, 0x48); // cqo
+	x64_byte(code, 0x99);
+	x64_reg(code, 0, true, 0xf7, 7, RCX); // idiv rcx
+	x64_reg(code, 0xf2, true, 0x0f2a, SCRATCH, RDX);
+	sse_constant(r, 0x66, 0x0f54, SCRATCH, ~SIGN_BIT); // andpd
+	move_to(r, SCRATCH2, ir->a);
+	sse_constant(r, 0x66, 0x0f54, SCRATCH2, SIGN_BIT);
+	x64_reg(code, 0x66, false, 0x0f56, SCRATCH, SCRATCH2); // orpd
+	move_xmm(r, r->reg[index], SCRATCH);
+	mod->resume = code->size;
+}
+
+static void save_registers(Recorder* r, bool save) {
+	for (int i = 0; i < REGISTERS; i++) {
+		x64_mem(&r->code, 0xf2, false, save ? 0x0f11 : 0x0f10, i, RSP, i * 8);
+	}
+}
+
+static void compile_slow_mod(Recorder* r, SlowMod* mod) {
+	CodeBuffer* code = &r->code;
+	Ir* ir = &r->ir[mod->ir];
+	for (int i = 0; i < 5; i++) x64_patch_rel32(code, mod->patches[i], code->size);
+	save_registers(r, true);
+	for (int i = 0; i < 2; i++) {
+		int operand = i == 0 ? ir->a : ir->b;
+		if (has_register(r, operand)) {
+			x64_mem(code, 0xf2, false, 0x0f10, i, RSP, r->reg[operand] * 8);
+		} else {
+			sse(r, 0xf2, false, 0x0f10, i, operand);
+		}
+	}
+	x64_call(code, fmod);
+	move_xmm(r, SCRATCH, XMM0);
+	save_registers(r, false);
+	move_xmm(r, r->reg[mod->ir], SCRATCH);
+	x64_jump_to(code, mod->resume);
+}
+
+static void compile_instruction(Recorder* r, int index) {
+	CodeBuffer* code = &r->code;
+	Ir* ir = &r->ir[index];
+	int reg = r->reg[index];
+	switch (ir->op) {
+	case IR_ADD: binary(r, 0x0f58, true, index, ir->a, ir->b); break;
+	case IR_SUB: binary(r, 0x0f5c, false, index, ir->a, ir->b); break;
+	case IR_MUL: binary(r, 0x0f59, true, index, ir->a, ir->b); break;
+	case IR_DIV: binary(r, 0x0f5e, false, index, ir->a, ir->b); break;
+	case IR_MOD: compile_mod(r, index); break;
+	case IR_NEG:
+		move_to(r, reg, ir->a);
+		sse_constant(r, 0x66, 0x0f57, reg, SIGN_BIT); // xorpd
+		break;
+	case IR_LESS:
+	case IR_GREATER:
+	case IR_EQUAL:
+	case IR_SAME:
+		compare(r, ir);
+		if (ir->op == IR_EQUAL) {
+			x64_setcc(code, CC_E);
+			x64_byte(code, 0x0f); // setnp cl
+			x64_byte(code, 0x90 | CC_NP);
+			x64_byte(code, 0xc1);
+			x64_byte(code, 0x20); // and al, cl
+			x64_byte(code, 0xc8);
+		} else {
+			x64_setcc(code, ir->op == IR_SAME ? CC_E : CC_A);
+		}
+		x64_byte(code, 0x0f); // movzx eax, al
+		x64_byte(code, 0xb6);
+		x64_byte(code, 0xc0);
+		gpr_to_xmm(r, reg, RAX);
+		break;
+	case IR_NOT:
+		move_to_gpr(r, RAX, ir->a);
+		x64_reg(code, 0, false, 0x83, 6, RAX); // xor eax, 1
+		x64_byte(code, 1);
+		gpr_to_xmm(r, reg, RAX);
+		break;
+	case IR_GUARD: compile_guard(r, ir); break;
+	default: break;
+	}
+}
+
+// [base + disp] = the Value 'ref'.
+static void store_value(Recorder* r, int base, int32_t disp, int ref) {
+	CodeBuffer* code = &r->code;
+	x64_mem(code, 0, true, 0xc7, 0, base, disp); // mov qword, type
+	x64_int32(code, r->ir[ref].type);
+	if (has_register(r, ref)) {
+		x64_mem(code, 0xf2, false, 0x0f11, r->reg[ref], base, disp + PAYLOAD_OFFSET);
+	} else {
+		x64_mov_imm64(code, RCX, constant_bits(r, ref));
+		x64_store(code, base, disp + PAYLOAD_OFFSET, RCX);
+	}
+}
+
+// Writes the values back for the interpreter. Returns where the jump
+// to the epilogue goes.
+static int compile_exit(Recorder* r, Snapshot* snapshot) {
+	CodeBuffer* code = &r->code;
+	for (int i = r->base; i < snapshot->height; i++) {
+		store_value(r, SLOTS_REG, SLOT(i), r->refs[snapshot->stack + i - r->base]);
+	}
+	for (int i = 0; i < r->home_count; i++) {
+		if (!r->homes[i].written) continue;
+		int ref = i < snapshot->home_count ? r->refs[snapshot->homes + i] : -1;
+		x64_load(code, RAX, HOMES_REG, i * sizeof(Value*));
+		store_value(r, RAX, 0, ref >= 0 ? ref : r->homes[i].load);
+	}
+	x64_mov_imm64(code, RAX, (uint64_t)(uintptr_t)(r->chunk->code + snapshot->pc));
+	x64_store(code, FRAME_REG, offsetof(CallFrame, pc), RAX);
+	x64_lea(code, RAX, SLOTS_REG, SLOT(snapshot->height));
+	x64_store(code, VM_REG, offsetof(VM, stack_top), RAX);
+	return x64_jump(code);
+}
+
+// The values carried to the next iteration go to the registers of the
+// loads. A cycle of them goes through the scratch register.
+static void carry_values(Recorder* r) {
+	int from[MAX_HOMES];
+	int to[MAX_HOMES];
+	int count = 0;
+	for (int i = 0; i < r->home_count; i++) {
+		Home* home = &r->homes[i];
+		if (!home->written || !has_register(r, home->load)) continue;
+		if (has_register(r, home->current) && r->reg[home->current] == r->reg[home->load]) continue;
+		from[count] = has_register(r, home->current) ? r->reg[home->current] : -1 - home->current;
+		to[count++] = r->reg[home->load];
+	}
+	while (count > 0) {
+		int ready = -1;
+		for (int i = 0; i < count && ready < 0; i++) {
+			if (from[i] < 0) continue;
+			bool needed = false;
+			for (int j = 0; j < count; j++) needed = needed || (j != i && from[j] == to[i]);
+			if (!needed) ready = i;
+		}
+		if (ready < 0) {
+			// Only constants left, or cycles.
+			int i = 0;
+			while (i < count && from[i] < 0) i++;
+			if (i == count) break;
+			move_xmm(r, SCRATCH, to[i]);
+			for (int j = 0; j < count; j++) {
+				if (from[j] == to[i]) from[j] = SCRATCH;
+			}
+			continue;
+		}
+		move_xmm(r, to[ready], from[ready]);
+		from[ready] = from[--count];
+		to[ready] = to[count];
+	}
+	for (int i = 0; i < count; i++) move_to(r, to[i], -1 - from[i]);
+}
+
+static void compile_trace(Recorder* r) {
+	CodeBuffer* code = &r->code;
+	static const uint8_t entry[] = {
+		0x53, // push rbx
+		0x41, 0x54, // push r12
+		0x41, 0x55, // push r13
+		0x41, 0x56, // push r14
+		0x48, 0x83, 0xec, SAVE_AREA, // sub rsp, SAVE_AREA
+		0x48, 0x89, 0xfb, // mov rbx, rdi
+		0x49, 0x89, 0xf5, // mov r13, rsi
+		0x49, 0x89, 0xd6, // mov r14, rdx
+	};
+	for (size_t i = 0; i < sizeof(entry); i++) x64_byte(code, entry[i]);
+	x64_load(code, SLOTS_REG, FRAME_REG, offsetof(CallFrame, slots));
+
+	// The loop's variables, checked by the caller.
+	for (int i = 0; i < r->ir_count; i++) {
+		Ir* ir = &r->ir[i];
+		if (ir->op != IR_LOAD || !has_register(r, i)) continue;
+		x64_load(code, RAX, HOMES_REG, ir->home * sizeof(Value*));
+		if (ir->type == VAL_BOOL) {
+			// Only the byte is written, the rest may be anything.
+			x64_mem(code, 0, false, 0x0fb6, RAX, RAX, PAYLOAD_OFFSET); // movzx eax, byte
+			gpr_to_xmm(r, r->reg[i], RAX);
+		} else {
+			x64_mem(code, 0xf2, false, 0x0f10, r->reg[i], RAX, PAYLOAD_OFFSET);
+		}
+	}
+
+	int loop = code->size;
+	for (int i = 0; i < r->ir_count; i++) {
+		if (r->live[i] && !r->fused[i]) compile_instruction(r, i);
+	}
+	// Each OP_LOOP takes a tick, as in run().
+	Snapshot* out_of_budget = &r->snapshots[BUDGET_EXIT];
+	x64_mem(code, 0, false, 0x81, 7, VM_REG, offsetof(VM, budget)); // cmp dword
+	x64_int32(code, r->loops);
+	exit_if(r, CC_L, out_of_budget);
+	x64_mem(code, 0, false, 0x81, 5, VM_REG, offsetof(VM, budget)); // sub dword
+	x64_int32(code, r->loops);
+	carry_values(r);
+	x64_jump_to(code, loop);
+
+	int exits[MAX_SNAPSHOTS];
+	for (int i = 0; i < r->snapshot_count; i++) {
+		Snapshot* snapshot = &r->snapshots[i];
+		for (int j = 0; j < 2; j++) {
+			if (snapshot->patches[j] >= 0) x64_patch_rel32(code, snapshot->patches[j], code->size);
+		}
+		if (i == BUDGET_EXIT && r->loops > 1) {
+			// All but the last OP_LOOP, which run() does.
+			x64_mem(code, 0, false, 0x81, 5, VM_REG, offsetof(VM, budget));
+			x64_int32(code, r->loops - 1);
+		}
+		exits[i] = compile_exit(r, snapshot);
+	}
+	for (int i = 0; i < r->mod_count; i++) compile_slow_mod(r, &r->mods[i]);
+
+	int epilogue = code->size;
+	static const uint8_t exit_code[] = {
+		0x48, 0x83, 0xc4, SAVE_AREA, // add rsp, SAVE_AREA
+		0x41, 0x5e, // pop r14
+		0x41, 0x5d, // pop r13
+		0x41, 0x5c, // pop r12
+		0x5b, // pop rbx
+		0xc3, // ret
+	};
+	for (size_t i = 0; i < sizeof(exit_code); i++) x64_byte(code, exit_code[i]);
+	for (int i = 0; i < r->snapshot_count; i++) x64_patch_rel32(code, exits[i], epilogue);
+
+	// Constants, 16 bytes each for andpd and xorpd.
+	while (code->size % 16 != 0) x64_byte(code, 0xcc);
+	int pool = code->size;
+	for (int i = 0; i < r->pool_count; i++) {
+		x64_int64(code, r->pool[i]);
+		x64_int64(code, 0);
+	}
+	for (int i = 0; i < r->fixup_count; i++) {
+		x64_patch_rel32(code, r->fixups[i][0], pool + r->fixups[i][1] * 16);
+	}
+}
+
+static Trace* new_trace(int header) {
+	Trace* trace = malloc(sizeof(Trace));
+	if (trace == NULL) {
+		fprintf(stderr, "Not enough memory to compile\n");
+		exit(1);
+	}
+	trace->next = NULL;
+	trace->header = header;
+	atomic_init(&trace->attempts, 0);
+	trace->code = NULL;
+	trace->size = 0;
+	trace->homes = NULL;
+	trace->home_count = 0;
+	return trace;
+}
+
+static Trace* install(Recorder* r) {
+	void* code = x64_install(&r->code);
+	if (code == NULL) return NULL;
+	Trace* trace = new_trace(r->header);
+	trace->code = code;
+	trace->size = r->code.size;
+	trace->homes = malloc(sizeof(TraceHome) * (r->home_count + 1));
+	if (trace->homes == NULL) {
+		fprintf(stderr, "Not enough memory to compile\n");
+		exit(1);
+	}
+	for (int i = 0; i < r->home_count; i++) {
+		Home* home = &r->homes[i];
+		trace->homes[i] = (TraceHome){
+			home->kind, home->index, home->constant, home->type, home->load >= 0,
+		};
+	}
+	trace->home_count = r->home_count;
+	return trace;
+}
+
+// Records the iteration starting at the frame's pc and compiles it. NULL
+// when that can't be done; the frame is left wherever recording stopped.
+static Trace* record(VM* vm, CallFrame* frame) {
+	Recorder* r = malloc(sizeof(Recorder));
+	Chunk* chunk = &frame->closure->function->chunk;
+	uint8_t* visited = calloc(chunk->size, 1);
+	if (r == NULL || visited == NULL) {
+		fprintf(stderr, "Not enough memory to compile\n");
+		exit(1);
+	}
+	r->vm = vm;
+	r->frame = frame;
+	r->chunk = chunk;
+	r->header = (int)(frame->pc - chunk->code);
+	r->base = r->height = (int)(vm->stack_top - frame->slots);
+	r->loops = 0;
+	r->visited = visited;
+	r->ir_count = r->home_count = r->ref_count = 0;
+	r->snapshot_count = BUDGET_EXIT + 1;
+	r->code = (CodeBuffer){ NULL, 0, 0 };
+	r->pool_count = r->fixup_count = r->mod_count = 0;
+
+	RecordStep step;
+	do {
+		step = record_instruction(r);
+	} while (step == RECORD_NEXT);
+
+	Trace* trace = NULL;
+	if (step == RECORD_DONE && finish_recording(r)) {
+		find_live(r);
+		if (allocate_registers(r)) {
+			compile_trace(r);
+			trace = install(r);
+		}
+	}
+	free(r->code.bytes);
+	free(visited);
+	free(r);
+	return trace;
+}
+
+// Where each home is in this VM and frame. False when the trace can't
+// run: a variable is missing or has another type, or two fields it
+// keeps apart are the same.
+static bool find_homes(VM* vm, CallFrame* frame, Trace* trace, Value** homes) {
+	ValueArray* constants = &frame->closure->function->chunk.constants;
+	for (int i = 0; i < trace->home_count; i++) {
+		TraceHome* home = &trace->homes[i];
+		switch (home->kind) {
+		case HOME_LOCAL: homes[i] = &frame->slots[home->index]; break;
+		case HOME_GLOBAL:
+			homes[i] = table_find(&vm->globals, AS_STRING(constants->values[home->constant]));
+			break;
+		case HOME_UPVALUE: homes[i] = frame->closure->upvalues[home->index]->location; break;
+		case HOME_FIELD: {
+			Value receiver = *homes[home->index];
+			if (!IS_INSTANCE(receiver)) return false;
+			homes[i] = table_find(&AS_INSTANCE(receiver)->fields, AS_STRING(constants->values[home->constant]));
+			for (int j = 0; j < i && homes[i] != NULL; j++) {
+				if (homes[j] == homes[i]) return false;
+			}
+			break;
+		}
+		}
+		if (homes[i] == NULL || (home->checked && homes[i]->type != home->type)) return false;
+	}
+	return true;
+}
+
+static void publish(JitFunction* jit, Trace* trace) {
+	Trace* head = atomic_load_explicit(&jit->traces, memory_order_relaxed);
+	do {
+		trace->next = head;
+	} while (!atomic_compare_exchange_weak_explicit(&jit->traces, &head, trace,
+		memory_order_release, memory_order_relaxed));
+}
+
+void trace_loop(VM* vm, CallFrame* frame) {
+	ObjFunction* function = frame->closure->function;
+	uint16_t* counter = hot_loop_counter(vm, frame->pc);
+	int header = (int)(frame->pc - function->chunk.code);
+	Trace* trace = atomic_load_explicit(&function->jit->traces, memory_order_acquire);
+	while (trace != NULL && trace->header != header) trace = trace->next;
+
+	if (trace != NULL && trace->code != NULL) {
+		*counter = 1; // Entered on each arrival
+		Value* homes[MAX_HOMES];
+		if (find_homes(vm, frame, trace, homes)) ((TraceEntry)trace->code)(vm, frame, homes);
+		return;
+	}
+	if (trace != NULL && atomic_load_explicit(&trace->attempts, memory_order_relaxed) >= MAX_ATTEMPTS) {
+		*counter = UINT16_MAX;
+		return;
+	}
+	*counter = vm->trace_threshold;
+	Trace* recorded = record(vm, frame);
+	if (recorded != NULL) {
+		*counter = 1;
+		publish(function->jit, recorded);
+	} else if (trace != NULL) {
+		atomic_fetch_add_explicit(&trace->attempts, 1, memory_order_relaxed);
+	} else {
+		Trace* failed = new_trace(header);
+		atomic_init(&failed->attempts, 1);
+		publish(function->jit, failed);
+	}
+}
+
+void free_traces(Trace* traces) {
+	while (traces != NULL) {
+		Trace* next = traces->next;
+		if (traces->code != NULL) munmap(traces->code, traces->size);
+		free(traces->homes);
+		free(traces);
+		traces = next;
+	}
+}
+
+#endif
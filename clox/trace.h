@@ -0,0 +1,43 @@
+#ifndef clox_trace_h
+#define clox_trace_h
+
+#include "common.h"
+#include "vm.h"
+
+#define TRACE_DEFAULT_THRESHOLD 50
+
+#ifdef CLOX_JIT
+
+// Tracing compiler for loops the interpreter runs. OP_LOOP counts the
+// arrivals at its target, in counters shared by all loops of the VM.
+// When one runs out, the next iteration is run by a recorder, which notes
+// each instruction and the types it meets until the loop is back at its
+// start. The recorded path becomes a loop of machine code:
+//
+// - Variables the loop uses, locals, globals, upvalues and fields of
+//   instances it doesn't reassign, are looked up and type checked once,
+//   when the trace is entered. Inside the loop they stay in registers,
+//   numbers as raw doubles, and are written back when it exits.
+// - Branches become guards. A guard that fails, like the loop condition
+//   at the end, leaves the loop where the interpreter takes over.
+// - Anything else, calls, strings, allocation, inner loops, stops the
+//   recording, and the loop keeps being interpreted.
+//
+// Traces belong to the function, like compiled code, and can run in any
+// VM: the lookups are made again on each entry.
+typedef struct sTrace Trace;
+
+// Called by OP_LOOP in run() once the counter of the loop's start, where
+// the frame's pc is, runs out. Runs the trace or records one; either way
+// run() goes on at the frame's pc.
+void trace_loop(VM* vm, CallFrame* frame);
+void free_traces(Trace* traces);
+
+static inline uint16_t* hot_loop_counter(VM* vm, uint8_t* pc) {
+	uintptr_t address = (uintptr_t)pc;
+	return &vm->hot_loops[(address ^ (address >> 6)) & (HOT_LOOP_COUNTERS - 1)];
+}
+
+#endif
+
+#endif
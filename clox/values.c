@@ -10,10 +10,11 @@ void init_valuearray(ValueArray* array) {
 	array->size = 0;
 }
 
-void write_valuearray(ValueArray* array, Value value) {
+void write_valuearray(VM* vm, ValueArray* array, Value value) {
 	if (array->capacity < array->size + 1) {
 		int new_capacity = GROW_CAPACITY(array->capacity);
 		array->values = GROW_ARRAY(
+			vm,
 			array->values,
 			Value,
 			array->capacity,
@@ -24,17 +25,24 @@ void write_valuearray(ValueArray* array, Value value) {
 	array->size++;
 }
 
-void free_valuearray(ValueArray* array) {
-	FREE_ARRAY(Value, array->values, array->capacity);
+void free_valuearray(VM* vm, ValueArray* array) {
+	FREE_ARRAY(vm, Value, array->values, array->capacity);
 	init_valuearray(array);
 }
 
+// Unbuffered, for debug output mixed with printf.
 void print_value(Value value) {
+	Output out;
+	init_output(&out, stdout, 0);
+	write_value(&out, value);
+}
+
+void write_value(Output* out, Value value) {
 	switch(value.type) {
-	case VAL_BOOL: printf("%s", AS_BOOL(value) ? "true" : "false"); break;
-	case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
-	case VAL_NIL: printf("nil"); break;
-	case VAL_OBJ: print_object(value); break;
+	case VAL_BOOL: output_cstring(out, AS_BOOL(value) ? "true" : "false"); break;
+	case VAL_NUMBER: output_number(out, AS_NUMBER(value)); break;
+	case VAL_NIL: output_cstring(out, "nil"); break;
+	case VAL_OBJ: write_object(out, value); break;
 	}
 }
 
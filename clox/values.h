@@ -2,6 +2,7 @@
 #define clox_value_h
 
 #include "common.h"
+#include "output.h"
 
 typedef struct sObj Obj;
 typedef struct sObjString ObjString;
@@ -43,9 +44,10 @@ typedef struct {
 } ValueArray;
 
 void init_valuearray(ValueArray* array);
-void write_valuearray(ValueArray* array, Value value);
-void free_valuearray(ValueArray* array);
+void write_valuearray(VM* vm, ValueArray* array, Value value);
+void free_valuearray(VM* vm, ValueArray* array);
 void print_value(Value value);
+void write_value(Output* out, Value value);
 bool values_equal(Value left, Value right);
 bool is_falsy(Value value);
 
@@ -0,0 +1,233 @@
+#include <stdlib.h>
+#include <string.h>
+#include "vector.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef __SSE2__
+
+// Four independent accumulators (8 doubles) hide the latency of the adds.
+double vec_sum(const double* data, int length) {
+    __m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+    __m128d acc2 = _mm_setzero_pd(), acc3 = _mm_setzero_pd();
+    int i = 0;
+    for(; i + 8 <= length; i += 8) {
+        acc0 = _mm_add_pd(acc0, _mm_loadu_pd(data + i));
+        acc1 = _mm_add_pd(acc1, _mm_loadu_pd(data + i + 2));
+        acc2 = _mm_add_pd(acc2, _mm_loadu_pd(data + i + 4));
+        acc3 = _mm_add_pd(acc3, _mm_loadu_pd(data + i + 6));
+    }
+    __m128d acc = _mm_add_pd(_mm_add_pd(acc0, acc1), _mm_add_pd(acc2, acc3));
+    double lanes[2];
+    _mm_storeu_pd(lanes, acc);
+    double sum = lanes[0] + lanes[1];
+    for(; i < length; i++) sum += data[i];
+    return sum;
+}
+
+double vec_dot(const double* a, const double* b, int length) {
+    __m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+    __m128d acc2 = _mm_setzero_pd(), acc3 = _mm_setzero_pd();
+    int i = 0;
+    for(; i + 8 <= length; i += 8) {
+        acc0 = _mm_add_pd(acc0, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+        acc1 = _mm_add_pd(acc1, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+        acc2 = _mm_add_pd(acc2, _mm_mul_pd(_mm_loadu_pd(a + i + 4), _mm_loadu_pd(b + i + 4)));
+        acc3 = _mm_add_pd(acc3, _mm_mul_pd(_mm_loadu_pd(a + i + 6), _mm_loadu_pd(b + i + 6)));
+    }
+    __m128d acc = _mm_add_pd(_mm_add_pd(acc0, acc1), _mm_add_pd(acc2, acc3));
+    double lanes[2];
+    _mm_storeu_pd(lanes, acc);
+    double sum = lanes[0] + lanes[1];
+    for(; i < length; i++) sum += a[i] * b[i];
+    return sum;
+}
+
+void vec_scale(double* data, int length, double factor) {
+    __m128d k = _mm_set1_pd(factor);
+    int i = 0;
+    for(; i + 4 <= length; i += 4) {
+        _mm_storeu_pd(data + i, _mm_mul_pd(_mm_loadu_pd(data + i), k));
+        _mm_storeu_pd(data + i + 2, _mm_mul_pd(_mm_loadu_pd(data + i + 2), k));
+    }
+    for(; i < length; i++) data[i] *= factor;
+}
+
+void vec_add(double* into, const double* other, int length) {
+    int i = 0;
+    for(; i + 4 <= length; i += 4) {
+        _mm_storeu_pd(into + i, _mm_add_pd(_mm_loadu_pd(into + i), _mm_loadu_pd(other + i)));
+        _mm_storeu_pd(into + i + 2, _mm_add_pd(_mm_loadu_pd(into + i + 2), _mm_loadu_pd(other + i + 2)));
+    }
+    for(; i < length; i++) into[i] += other[i];
+}
+
+// Length must be at least 1.
+double vec_min(const double* data, int length) {
+    double result = data[0];
+    int i = 0;
+    if(length >= 4) {
+        __m128d m0 = _mm_loadu_pd(data), m1 = _mm_loadu_pd(data + 2);
+        for(i = 4; i + 4 <= length; i += 4) {
+            m0 = _mm_min_pd(m0, _mm_loadu_pd(data + i));
+            m1 = _mm_min_pd(m1, _mm_loadu_pd(data + i + 2));
+        }
+        double lanes[2];
+        _mm_storeu_pd(lanes, _mm_min_pd(m0, m1));
+        result = lanes[0] < lanes[1] ? lanes[0] : lanes[1];
+    }
+    for(; i < length; i++) {
+        if(data[i] < result) result = data[i];
+    }
+    return result;
+}
+
+double vec_max(const double* data, int length) {
+    double result = data[0];
+    int i = 0;
+    if(length >= 4) {
+        __m128d m0 = _mm_loadu_pd(data), m1 = _mm_loadu_pd(data + 2);
+        for(i = 4; i + 4 <= length; i += 4) {
+            m0 = _mm_max_pd(m0, _mm_loadu_pd(data + i));
+            m1 = _mm_max_pd(m1, _mm_loadu_pd(data + i + 2));
+        }
+        double lanes[2];
+        _mm_storeu_pd(lanes, _mm_max_pd(m0, m1));
+        result = lanes[0] > lanes[1] ? lanes[0] : lanes[1];
+    }
+    for(; i < length; i++) {
+        if(data[i] > result) result = data[i];
+    }
+    return result;
+}
+
+// Scans four elements at a time. Only the final add of the running total
+// is serial, so the dependency chain is one add per four elements.
+static inline __m128d scan_pair(__m128d x) {
+    return _mm_add_pd(x, _mm_castsi128_pd(_mm_slli_si128(_mm_castpd_si128(x), 8)));
+}
+
+void vec_prefix_sum(double* data, int length) {
+    __m128d carry = _mm_setzero_pd();
+    int i = 0;
+    for(; i + 4 <= length; i += 4) {
+        __m128d low = scan_pair(_mm_loadu_pd(data + i));
+        __m128d high = scan_pair(_mm_loadu_pd(data + i + 2));
+        high = _mm_add_pd(high, _mm_unpackhi_pd(low, low));
+        _mm_storeu_pd(data + i, _mm_add_pd(low, carry));
+        high = _mm_add_pd(high, carry);
+        _mm_storeu_pd(data + i + 2, high);
+        carry = _mm_unpackhi_pd(high, high);
+    }
+    double total = _mm_cvtsd_f64(carry);
+    for(; i < length; i++) {
+        total += data[i];
+        data[i] = total;
+    }
+}
+
+#else
+
+double vec_sum(const double* data, int length) {
+    double sum = 0;
+    for(int i = 0; i < length; i++) sum += data[i];
+    return sum;
+}
+
+double vec_dot(const double* a, const double* b, int length) {
+    double sum = 0;
+    for(int i = 0; i < length; i++) sum += a[i] * b[i];
+    return sum;
+}
+
+void vec_scale(double* data, int length, double factor) {
+    for(int i = 0; i < length; i++) data[i] *= factor;
+}
+
+void vec_add(double* into, const double* other, int length) {
+    for(int i = 0; i < length; i++) into[i] += other[i];
+}
+
+double vec_min(const double* data, int length) {
+    double result = data[0];
+    for(int i = 1; i < length; i++) {
+        if(data[i] < result) result = data[i];
+    }
+    return result;
+}
+
+double vec_max(const double* data, int length) {
+    double result = data[0];
+    for(int i = 1; i < length; i++) {
+        if(data[i] > result) result = data[i];
+    }
+    return result;
+}
+
+void vec_prefix_sum(double* data, int length) {
+    for(int i = 1; i < length; i++) data[i] += data[i - 1];
+}
+
+#endif
+
+// Maps a double to an integer with the same order: negative numbers have
+// every bit flipped, positive ones only the sign bit.
+static inline uint64_t sort_key(double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits ^ ((uint64_t)((int64_t)bits >> 63) | 0x8000000000000000ull);
+}
+
+static inline double from_sort_key(uint64_t key) {
+    uint64_t bits = key ^ (((key >> 63) - 1) | 0x8000000000000000ull);
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// LSD radix sort, 8 bits per pass. Passes where every key has the same
+// byte are skipped. Returns false when out of memory.
+bool vec_sort(double* data, int length) {
+    if(length < 2) return true;
+    uint64_t* keys = malloc(sizeof(uint64_t) * length);
+    uint64_t* buffer = malloc(sizeof(uint64_t) * length);
+    if(keys == NULL || buffer == NULL) {
+        free(keys);
+        free(buffer);
+        return false;
+    }
+
+    size_t counts[8][256];
+    memset(counts, 0, sizeof(counts));
+    for(int i = 0; i < length; i++) {
+        keys[i] = sort_key(data[i]);
+        for(int pass = 0; pass < 8; pass++) {
+            counts[pass][(keys[i] >> (pass * 8)) & 0xff]++;
+        }
+    }
+
+    for(int pass = 0; pass < 8; pass++) {
+        size_t* count = counts[pass];
+        if(count[(keys[0] >> (pass * 8)) & 0xff] == (size_t)length) continue;
+
+        size_t offset = 0;
+        for(int byte = 0; byte < 256; byte++) {
+            size_t n = count[byte];
+            count[byte] = offset;
+            offset += n;
+        }
+        for(int i = 0; i < length; i++) {
+            buffer[count[(keys[i] >> (pass * 8)) & 0xff]++] = keys[i];
+        }
+        uint64_t* swap = keys;
+        keys = buffer;
+        buffer = swap;
+    }
+
+    for(int i = 0; i < length; i++) data[i] = from_sort_key(keys[i]);
+    free(keys);
+    free(buffer);
+    return true;
+}
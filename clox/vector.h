@@ -0,0 +1,18 @@
+#ifndef clox_vector_h
+#define clox_vector_h
+
+#include "common.h"
+
+// Kernels over packed doubles, used by Float64Array. They use SSE2 when
+// the compiler targets it and plain loops otherwise. Sums add lanes in a
+// different order than a sequential loop, so the last bits may differ.
+double vec_sum(const double* data, int length);
+double vec_dot(const double* a, const double* b, int length);
+void vec_scale(double* data, int length, double factor);
+void vec_add(double* into, const double* other, int length);
+double vec_min(const double* data, int length);
+double vec_max(const double* data, int length);
+void vec_prefix_sum(double* data, int length);
+bool vec_sort(double* data, int length);
+
+#endif
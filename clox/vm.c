@@ -1,103 +1,1249 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
 #include <time.h>
 #include <math.h>
+#include <limits.h>
 #include "vm.h"
 #include "object.h"
 #include "debug.h"
 #include "compiler.h"
 #include "memory.h"
+#include "map.h"
+#include "vector.h"
+#include "isolate.h"
+#include "shared.h"
+#include "jit.h"
+#include "trace.h"
+#include "timing.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
 
-VM vm;
-
-static InterpretResult run();
-static void stack_reset();
-static Value stack_peek(int distance);
-static void runtime_error(const char* format, ...);
-static void concatenate_str();
-static void free_objects();
-static bool call_value(Value callee, int arg_count);
-static bool call(ObjClosure* closure, int arg_count);
-static void define_native(const char* name, NativeFn native);
-static ObjUpvalue* capture_upvalue(Value* value);
-static void close_upvalues(Value* last);
-static void define_method(ObjString* name);
-static bool bind_method(ObjClass* klass, ObjString* name);
-static bool invoke(ObjString* name, int arg_count);
-static bool invoke_from_class(ObjClass* klass, ObjString* name, int arg_count);
-
-static Value clock_native(int argCount, Value* args) {
+#define CONCAT_BUFFER_SIZE 256
+#define LIMIT_CHECK_TICKS 4096 // Between clock reads under a time limit
+#define SLEEP_MAX_MS 1e10 // About 115 days
+
+static InterpretResult run(VM* vm, Value* exit_stack, int exit_depth);
+static void stack_reset(VM* vm);
+static void load_fiber(VM* vm, ObjFiber* fiber);
+static void save_fiber(VM* vm);
+static Value stack_peek(VM* vm, int distance);
+static void runtime_error(VM* vm, const char* format, ...);
+static void concatenate_str(VM* vm);
+static ObjString* flatten_at(VM* vm, int distance);
+static void free_objects(VM* vm);
+static bool call_value(VM* vm, Value callee, int arg_count);
+static bool call(VM* vm, ObjClosure* closure, int arg_count);
+static bool check_limits(VM* vm, bool safe_point);
+static void compare_equal(VM* vm);
+static void print_top(VM* vm);
+static void define_global(VM* vm, ObjString* name);
+static bool get_global(VM* vm, ObjString* name);
+static bool set_global(VM* vm, ObjString* name);
+static void make_closure(VM* vm, CallFrame* frame);
+static bool get_property(VM* vm, ObjString* name);
+static bool set_property(VM* vm, ObjString* name);
+static void build_list(VM* vm, int count);
+static bool build_map(VM* vm, int count);
+static bool get_index(VM* vm);
+static bool set_index(VM* vm);
+static void define_native(VM* vm, Table* table, const char* name, NativeFn native);
+static bool call_native(VM* vm, NativeFn native, int arg_count);
+static bool call_from_native(VM* vm, int arg_count);
+static Value native_failed(VM* vm);
+static bool to_integer(Value value, int* result);
+static const char* array_index(Value index, int length, int* result);
+static bool valid_key(VM* vm, Value* key);
+static ObjUpvalue* capture_upvalue(VM* vm, Value* value);
+static void close_upvalues(VM* vm, Value* last);
+static void define_method(VM* vm, ObjString* name);
+static bool bind_method(VM* vm, ObjClass* klass, ObjString* name);
+static bool invoke(VM* vm, ObjString* name, int arg_count);
+static bool invoke_from_class(VM* vm, ObjClass* klass, ObjString* name, int arg_count);
+static bool invoke_native(VM* vm, Table* methods, ObjString* name, int arg_count);
+
+static Value clock_native(VM* vm, int argCount, Value* args) {
  	return NUMBER_VALUE((double)clock() / CLOCKS_PER_SEC);
 }
 
-void init_vm() {
-	stack_reset();
-	vm.objects = NULL;
-	vm.open_upvalues = NULL;
-	init_table(&vm.strings);
-	init_table(&vm.globals);
+static Value heap_fragmentation_native(VM* vm, int argCount, Value* args) {
+	return NUMBER_VALUE(vm->fragmentation);
+}
+
+static Value compact_heap_native(VM* vm, int argCount, Value* args) {
+	// Natives are not a safe point. Compact on the next loop iteration.
+	vm->compaction_pending = true;
+	interrupt_run(vm);
+	return NIL_VALUE();
+}
+
+static Value gc_collect_native(VM* vm, int argCount, Value* args) {
+	collect_garbage(vm);
+	return NIL_VALUE();
+}
+
+static void set_stat(VM* vm, ObjInstance* stats, const char* name, double value) {
+	stack_push(vm, OBJ_VALUE(copy_string(vm, name, (int)strlen(name))));
+	table_set(vm, &stats->fields, AS_STRING(stack_peek(vm, 0)), NUMBER_VALUE(value));
+	stack_pop(vm);
+}
+
+static Value gc_stats_native(VM* vm, int argCount, Value* args) {
+	stack_push(vm, OBJ_VALUE(copy_string(vm, "GcStats", 7)));
+	stack_push(vm, OBJ_VALUE(new_class(vm, AS_STRING(stack_peek(vm, 0)))));
+	ObjInstance* stats = new_instance(vm, AS_CLASS(stack_peek(vm, 0)));
+	stack_push(vm, OBJ_VALUE(stats));
+
+	GcStats* gc = &vm->gc_stats;
+	set_stat(vm, stats, "collections", gc->collections);
+	set_stat(vm, stats, "allocations", gc->allocations);
+	set_stat(vm, stats, "bytesAllocated", vm->bytes_allocated);
+	set_stat(vm, stats, "nextGc", vm->next_gc);
+	set_stat(vm, stats, "peakHeap", gc->peak_heap);
+	set_stat(vm, stats, "totalFreed", gc->total_freed);
+	set_stat(vm, stats, "totalPause", gc->total_pause_ns / 1e6);
+	set_stat(vm, stats, "maxPause", gc->max_pause_ns / 1e6);
+	set_stat(vm, stats, "fragmentation", vm->fragmentation);
+	GcRecord* last = gc_stats_last(gc);
+	set_stat(vm, stats, "lastPause", last ? last->pause_ns / 1e6 : 0);
+	set_stat(vm, stats, "lastFreed", last && last->heap_before > last->heap_after
+		? last->heap_before - last->heap_after
+		: 0);
+	for (int type = 0; type < OBJ_TYPE_COUNT; type++) {
+		set_stat(vm, stats, obj_type_name(type), last ? last->objects[type] : 0);
+	}
+
+	stack_pop(vm);
+	stack_pop(vm);
+	stack_pop(vm);
+	return OBJ_VALUE(stats);
+}
+
+// tableStats() describes the interned strings set, tableStats(instance)
+// the fields of the instance.
+static Value table_stats_native(VM* vm, int argCount, Value* args) {
+	TableStats table;
+	if (argCount == 0) {
+		intern_set_stats(&vm->strings, &table);
+	} else if (IS_INSTANCE(args[0])) {
+		table_stats(&AS_INSTANCE(args[0])->fields, &table);
+	} else {
+		return NIL_VALUE();
+	}
 
-	vm.gray_capacity = 0;
-	vm.gray_count = 0;
-	vm.gray_stack = NULL;
+	stack_push(vm, OBJ_VALUE(copy_string(vm, "TableStats", 10)));
+	stack_push(vm, OBJ_VALUE(new_class(vm, AS_STRING(stack_peek(vm, 0)))));
+	ObjInstance* stats = new_instance(vm, AS_CLASS(stack_peek(vm, 0)));
+	stack_push(vm, OBJ_VALUE(stats));
+
+	set_stat(vm, stats, "count", table.count);
+	set_stat(vm, stats, "tombstones", table.tombstones);
+	set_stat(vm, stats, "capacity", table.capacity);
+	set_stat(vm, stats, "load", table.load_factor);
+	set_stat(vm, stats, "meanProbe", table.mean_probe);
+	set_stat(vm, stats, "maxProbe", table.max_probe);
+	for (int i = 0; i < TABLE_PROBE_BUCKETS; i++) {
+		char name[16];
+		snprintf(name, sizeof(name), "probes%d", i + 1);
+		set_stat(vm, stats, name, table.probes[i]);
+	}
 
-	vm.bytes_allocated = 0;
-	vm.next_gc = 1024 * 1024;
+	stack_pop(vm);
+	stack_pop(vm);
+	stack_pop(vm);
+	return OBJ_VALUE(stats);
+}
 
-	vm.init_string = NULL;
-	vm.init_string = copy_string("init", 4);
+static Value clock_ns_native(VM* vm, int argCount, Value* args) {
+	return NUMBER_VALUE((double)monotonic_ns());
+}
 
-	define_native("clock", clock_native);
+static Value cycles_native(VM* vm, int argCount, Value* args) {
+	return NUMBER_VALUE((double)cycle_count());
 }
 
-void free_vm() {
-	free_table(&vm.globals);
-	free_table(&vm.strings);
-	vm.init_string = NULL;
-	free_objects();
-	free(vm.gray_stack);
+static int compare_samples(const void* a, const void* b) {
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
 }
 
-InterpretResult interpret(const char* source) {
-	ObjFunction* func = compile(source);
-	if(func == NULL) {
-		return INTERPRET_COMPILE_ERROR;
+// bench(fn, iterations) calls fn that many times from here and times each
+// call with the monotonic clock. Returns min, median, mean, max and total
+// in nanoseconds.
+static Value bench_native(VM* vm, int arg_count, Value* args) {
+	int iterations;
+	if (arg_count != 2 || !to_integer(args[1], &iterations) || iterations < 1) {
+		return native_error(vm, "bench() expects a function and a positive iteration count.");
+	}
+	uint64_t* samples = malloc(sizeof(uint64_t) * iterations);
+	if (samples == NULL) return native_error(vm, "Not enough memory for %d samples.", iterations);
+
+	uint64_t total = 0;
+	for (int i = 0; i < iterations; i++) {
+		// Read fn from its stack slot every time, a compaction may move it.
+		stack_push(vm, args[0]);
+		uint64_t start = monotonic_ns();
+		if (!call_from_native(vm, 0)) {
+			free(samples);
+			return native_failed(vm);
+		}
+		samples[i] = monotonic_ns() - start;
+		total += samples[i];
+		stack_pop(vm);
+	}
+	qsort(samples, iterations, sizeof(uint64_t), compare_samples);
+
+	stack_push(vm, OBJ_VALUE(copy_string(vm, "BenchStats", 10)));
+	stack_push(vm, OBJ_VALUE(new_class(vm, AS_STRING(stack_peek(vm, 0)))));
+	ObjInstance* stats = new_instance(vm, AS_CLASS(stack_peek(vm, 0)));
+	stack_push(vm, OBJ_VALUE(stats));
+
+	set_stat(vm, stats, "iterations", iterations);
+	set_stat(vm, stats, "min", samples[0]);
+	set_stat(vm, stats, "median", iterations % 2 == 1
+		? samples[iterations / 2]
+		: (samples[iterations / 2 - 1] + samples[iterations / 2]) / 2.0);
+	set_stat(vm, stats, "mean", (double)total / iterations);
+	set_stat(vm, stats, "max", samples[iterations - 1]);
+	set_stat(vm, stats, "total", total);
+	free(samples);
+
+	stack_pop(vm);
+	stack_pop(vm);
+	stack_pop(vm);
+	return OBJ_VALUE(stats);
+}
+
+// List methods. The receiver is in args[-1] and arg_count does not
+// include it.
+static Value list_push_native(VM* vm, int arg_count, Value* args) {
+	ObjList* list = AS_LIST(args[-1]);
+	for (int i = 0; i < arg_count; i++) {
+		write_valuearray(vm, &list->items, args[i]);
+	}
+	return NUMBER_VALUE(list->items.size);
+}
+
+static Value list_pop_native(VM* vm, int arg_count, Value* args) {
+	ObjList* list = AS_LIST(args[-1]);
+	if (arg_count != 0) {
+		return native_error(vm, "Expected 0 arguments but got %d.", arg_count);
+	}
+	if (list->items.size == 0) {
+		return native_error(vm, "Cannot pop from an empty list.");
+	}
+	return list->items.values[--list->items.size];
+}
+
+static Value list_length_native(VM* vm, int arg_count, Value* args) {
+	if (arg_count != 0) {
+		return native_error(vm, "Expected 0 arguments but got %d.", arg_count);
+	}
+	return NUMBER_VALUE(AS_LIST(args[-1])->items.size);
+}
+
+// slice(start, end) copies [start, end). end defaults to the length.
+static Value list_slice_native(VM* vm, int arg_count, Value* args) {
+	ObjList* list = AS_LIST(args[-1]);
+	if (arg_count != 1 && arg_count != 2) {
+		return native_error(vm, "Expected 1 or 2 arguments but got %d.", arg_count);
+	}
+	int size = list->items.size;
+	int start, end = size;
+	if (!to_integer(args[0], &start) || (arg_count == 2 && !to_integer(args[1], &end))) {
+		return native_error(vm, "Slice bounds must be integers.");
+	}
+	if (start < 0 || end > size || start > end) {
+		return native_error(vm, "Slice [%d, %d) out of range (length %d).", start, end, size);
+	}
+
+	ObjList* slice = new_list(vm);
+	stack_push(vm, OBJ_VALUE(slice));
+	int length = end - start;
+	if (length > 0) {
+		slice->items.values = GROW_ARRAY(vm, NULL, Value, 0, length);
+		slice->items.capacity = length;
+		memcpy(slice->items.values, list->items.values + start, sizeof(Value) * length);
+		slice->items.size = length;
+	}
+	stack_pop(vm);
+	return OBJ_VALUE(slice);
+}
+
+// Map methods. Same calling convention as list methods.
+static Value map_size_native(VM* vm, int arg_count, Value* args) {
+	if (arg_count != 0) {
+		return native_error(vm, "Expected 0 arguments but got %d.", arg_count);
+	}
+	return NUMBER_VALUE(AS_MAP(args[-1])->count);
+}
+
+static Value map_has_native(VM* vm, int arg_count, Value* args) {
+	if (arg_count != 1) {
+		return native_error(vm, "Expected 1 argument but got %d.", arg_count);
+	}
+	Value value;
+	if (!valid_key(vm, &args[0])) return BOOL_VALUE(false);
+	return BOOL_VALUE(map_get(vm, AS_MAP(args[-1]), args[0], &value));
+}
+
+// get(key, default) returns default (or nil) for missing keys.
+static Value map_get_native(VM* vm, int arg_count, Value* args) {
+	if (arg_count != 1 && arg_count != 2) {
+		return native_error(vm, "Expected 1 or 2 arguments but got %d.", arg_count);
+	}
+	Value value;
+	if (valid_key(vm, &args[0]) && map_get(vm, AS_MAP(args[-1]), args[0], &value)) {
+		return value;
+	}
+	return arg_count == 2 ? args[1] : NIL_VALUE();
+}
+
+static Value map_remove_native(VM* vm, int arg_count, Value* args) {
+	if (arg_count != 1) {
+		return native_error(vm, "Expected 1 argument but got %d.", arg_count);
+	}
+	if (!valid_key(vm, &args[0])) return BOOL_VALUE(false);
+	return BOOL_VALUE(map_delete(vm, AS_MAP(args[-1]), args[0]));
+}
+
+// Copies keys (or values) into a new list, in slot order.
+static Value map_to_list(VM* vm, ObjMap* map, bool keys) {
+	ObjList* list = new_list(vm);
+	stack_push(vm, OBJ_VALUE(list));
+	if (map->count > 0) {
+		int count = map->count;
+		list->items.values = GROW_ARRAY(vm, NULL, Value, 0, count);
+		list->items.capacity = count;
+		for (int i = 0; i < map->capacity; i++) {
+			MapEntry* entry = &map->entries[i];
+			if (IS_NIL(entry->key)) continue;
+			list->items.values[list->items.size++] = keys ? entry->key : entry->value;
+		}
+	}
+	stack_pop(vm);
+	return OBJ_VALUE(list);
+}
+
+static Value map_keys_native(VM* vm, int arg_count, Value* args) {
+	if (arg_count != 0) {
+		return native_error(vm, "Expected 0 arguments but got %d.", arg_count);
+	}
+	return map_to_list(vm, AS_MAP(args[-1]), true);
+}
+
+static Value map_values_native(VM* vm, int arg_count, Value* args) {
+	if (arg_count != 0) {
+		return native_error(vm, "Expected 0 arguments but got %d.", arg_count);
+	}
+	return map_to_list(vm, AS_MAP(args[-1]), false);
+}
+
+static Value map_put_all_native(VM* vm, int arg_count, Value* args) {
+	if (arg_count != 1 || !IS_MAP(args[0])) {
+		return native_error(vm, "putAll() expects a map.");
+	}
+	map_add_all(vm, AS_MAP(args[0]), AS_MAP(args[-1]));
+	return NIL_VALUE();
+}
+
+static Value map_clear_native(VM* vm, int arg_count, Value* args) {
+	if (arg_count != 0) {
+		return native_error(vm, "Expected 0 arguments but got %d.", arg_count);
+	}
+	free_map(vm, AS_MAP(args[-1]));
+	return NIL_VALUE();
+}
+
+// Float64Array(length) is filled with zeros, Float64Array(list) copies a
+// list of numbers.
+static Value float_array_native(VM* vm, int arg_count, Value* args) {
+	if (arg_count != 1) {
+		return native_error(vm, "Expected 1 argument but got %d.", arg_count);
+	}
+	if (IS_LIST(args[0])) {
+		ObjList* list = AS_LIST(args[0]);
+		ObjFloatArray* array = new_float_array(vm, list->items.size);
+		for (int i = 0; i < array->length; i++) {
+			if (!IS_NUMBER(list->items.values[i])) {
+				return native_error(vm, "Float64Array elements must be numbers.");
+			}
+			array->data[i] = AS_NUMBER(list->items.values[i]);
+		}
+		return OBJ_VALUE(array);
+	}
+	int length;
+	if (!to_integer(args[0], &length) || length < 0) {
+		return native_error(vm, "Float64Array() expects a length or a list.");
+	}
+	return OBJ_VALUE(new_float_array(vm, length));
+}
+
+// Float64Array methods. Same calling convention as list methods. Methods
+// that change the array in place return it, so calls can be chained.
+static Value float_array_length_native(VM* vm, int arg_count, Value* args) {
+	if (arg_count != 0) {
+		return native_error(vm, "Expected 0 arguments but got %d.", arg_count);
+	}
+	return NUMBER_VALUE(AS_FLOAT_ARRAY(args[-1])->length);
+}
+
+static Value float_array_sum_native(VM* vm, int arg_count, Value* args) {
+	if (arg_count != 0) {
+		return native_error(vm, "Expected 0 arguments but got %d.", arg_count);
+	}
+	ObjFloatArray* array = AS_FLOAT_ARRAY(args[-1]);
+	return NUMBER_VALUE(vec_sum(array->data, array->length));
+}
+
+// Returns the other array when it has the receiver's length, else NULL.
+static ObjFloatArray* same_length_operand(VM* vm, int arg_count, Value* args, const char* method) {
+	if (arg_count != 1 || !IS_FLOAT_ARRAY(args[0])) {
+		native_error(vm, "%s() expects a Float64Array.", method);
+		return NULL;
+	}
+	ObjFloatArray* array = AS_FLOAT_ARRAY(args[-1]);
+	ObjFloatArray* other = AS_FLOAT_ARRAY(args[0]);
+	if (other->length != array->length) {
+		native_error(vm, "%s() lengths differ (%d and %d).", method, array->length, other->length);
+		return NULL;
+	}
+	return other;
+}
+
+static Value float_array_dot_native(VM* vm, int arg_count, Value* args) {
+	ObjFloatArray* other = same_length_operand(vm, arg_count, args, "dot");
+	if (other == NULL) return NIL_VALUE();
+	ObjFloatArray* array = AS_FLOAT_ARRAY(args[-1]);
+	return NUMBER_VALUE(vec_dot(array->data, other->data, array->length));
+}
+
+static Value float_array_add_native(VM* vm, int arg_count, Value* args) {
+	ObjFloatArray* other = same_length_operand(vm, arg_count, args, "add");
+	if (other == NULL) return NIL_VALUE();
+	ObjFloatArray* array = AS_FLOAT_ARRAY(args[-1]);
+	vec_add(array->data, other->data, array->length);
+	return args[-1];
+}
+
+static Value float_array_scale_native(VM* vm, int arg_count, Value* args) {
+	if (arg_count != 1 || !IS_NUMBER(args[0])) {
+		return native_error(vm, "scale() expects a number.");
+	}
+	ObjFloatArray* array = AS_FLOAT_ARRAY(args[-1]);
+	vec_scale(array->data, array->length, AS_NUMBER(args[0]));
+	return args[-1];
+}
+
+static Value float_array_min_native(VM* vm, int arg_count, Value* args) {
+	if (arg_count != 0) {
+		return native_error(vm, "Expected 0 arguments but got %d.", arg_count);
+	}
+	ObjFloatArray* array = AS_FLOAT_ARRAY(args[-1]);
+	if (array->length == 0) return native_error(vm, "min() of an empty Float64Array.");
+	return NUMBER_VALUE(vec_min(array->data, array->length));
+}
+
+static Value float_array_max_native(VM* vm, int arg_count, Value* args) {
+	if (arg_count != 0) {
+		return native_error(vm, "Expected 0 arguments but got %d.", arg_count);
+	}
+	ObjFloatArray* array = AS_FLOAT_ARRAY(args[-1]);
+	if (array->length == 0) return native_error(vm, "max() of an empty Float64Array.");
+	return NUMBER_VALUE(vec_max(array->data, array->length));
+}
+
+static Value float_array_prefix_sum_native(VM* vm, int arg_count, Value* args) {
+	if (arg_count != 0) {
+		return native_error(vm, "Expected 0 arguments but got %d.", arg_count);
+	}
+	ObjFloatArray* array = AS_FLOAT_ARRAY(args[-1]);
+	vec_prefix_sum(array->data, array->length);
+	return args[-1];
+}
+
+static Value float_array_sort_native(VM* vm, int arg_count, Value* args) {
+	if (arg_count != 0) {
+		return native_error(vm, "Expected 0 arguments but got %d.", arg_count);
+	}
+	ObjFloatArray* array = AS_FLOAT_ARRAY(args[-1]);
+	if (!vec_sort(array->data, array->length)) {
+		return native_error(vm, "Not enough memory to sort.");
+	}
+	return args[-1];
+}
+
+static Value float_array_to_list_native(VM* vm, int arg_count, Value* args) {
+	if (arg_count != 0) {
+		return native_error(vm, "Expected 0 arguments but got %d.", arg_count);
+	}
+	ObjList* list = new_list(vm);
+	stack_push(vm, OBJ_VALUE(list));
+	int length = AS_FLOAT_ARRAY(args[-1])->length;
+	if (length > 0) {
+		list->items.values = GROW_ARRAY(vm, NULL, Value, 0, length);
+		list->items.capacity = length;
+		double* data = AS_FLOAT_ARRAY(args[-1])->data;
+		for (int i = 0; i < length; i++) {
+			list->items.values[i] = NUMBER_VALUE(data[i]);
+		}
+		list->items.size = length;
+	}
+	stack_pop(vm);
+	return OBJ_VALUE(list);
+}
+
+// LineReader(path) maps the file. next() returns each line without its
+// "\n" or "\r\n", then nil at the end. close() unmaps the file early.
+static Value line_reader_native(VM* vm, int arg_count, Value* args) {
+	if (arg_count != 1 || !IS_TEXT(args[0])) {
+		return native_error(vm, "LineReader() expects a path.");
+	}
+	ObjString* path = flatten_at(vm, 0);
+	MappedFile file;
+	if (!map_file(path->chars, &file)) {
+		return native_error(vm, "Cannot open %s: %s", path->chars, strerror(errno));
+	}
+	return OBJ_VALUE(new_line_reader(vm, &file));
+}
+
+static Value line_reader_next_native(VM* vm, int arg_count, Value* args) {
+	if (arg_count != 0) {
+		return native_error(vm, "Expected 0 arguments but got %d.", arg_count);
+	}
+	ObjLineReader* reader = AS_LINE_READER(args[-1]);
+	MappedFile* file = &reader->file;
+	if (reader->position >= file->length) return NIL_VALUE();
+
+	const char* start = file->data + reader->position;
+	size_t left = file->length - reader->position;
+	const char* newline = memchr(start, '\n', left);
+	size_t length = newline != NULL ? (size_t)(newline - start) : left;
+	reader->position += newline != NULL ? length + 1 : length;
+	if (length > 0 && start[length - 1] == '\r') length--;
+	if (length > INT_MAX) return native_error(vm, "Line longer than %d bytes.", INT_MAX);
+	return OBJ_VALUE(copy_string(vm, start, (int)length));
+}
+
+static Value line_reader_close_native(VM* vm, int arg_count, Value* args) {
+	if (arg_count != 0) {
+		return native_error(vm, "Expected 0 arguments but got %d.", arg_count);
+	}
+	unmap_file(&AS_LINE_READER(args[-1])->file);
+	return NIL_VALUE();
+}
+
+// spawn(fn, args...) calls fn in a new VM on a thread of its own and
+// returns the isolate; join() waits for it and returns fn's result. The
+// function, the arguments and the globals are copied into the new VM.
+// Globals that can't be sent, like natives, are left out.
+static Value spawn_native(VM* vm, int arg_count, Value* args) {
+	if (arg_count < 1 || !IS_CLOSURE(args[0])) {
+		return native_error(vm, "spawn() expects a function.");
+	}
+	Message message;
+	init_message(&message);
+	for (int i = 0; i < arg_count; i++) {
+		const char* error = write_message(vm, &message, args[i]);
+		if (error != NULL) {
+			free_message(&message);
+			return native_error(vm, "%s", error);
+		}
+	}
+	Table* globals = &vm->globals;
+	for (int i = 0; i < globals->capacity; i++) {
+		if (globals->control[i] < 0) continue;
+		if (write_message(vm, &message, globals->slots[i].value) != NULL) continue;
+		write_message(vm, &message, OBJ_VALUE(globals->slots[i].key));
+	}
+	seal_message(&message);
+
+	Isolate* isolate = start_isolate(&message, arg_count - 1, vm);
+	if (isolate == NULL) {
+		free_message(&message);
+		return native_error(vm, "Cannot start a thread.");
+	}
+	return OBJ_VALUE(new_isolate(vm, isolate));
+}
+
+static Value isolate_join_native(VM* vm, int arg_count, Value* args) {
+	if (arg_count != 0) {
+		return native_error(vm, "Expected 0 arguments but got %d.", arg_count);
+	}
+	ObjIsolate* handle = AS_ISOLATE(args[-1]);
+	if (!handle->joined) {
+		join_isolate(handle->isolate);
+		handle->joined = true;
+	}
+	if (handle->isolate->error != NULL) {
+		return native_error(vm, "%s", handle->isolate->error);
+	}
+	return read_message(vm, &handle->isolate->result)->items.values[0];
+}
+
+// Channel(capacity) makes a queue that holds up to capacity values, 1 by
+// default. send(value) copies the value in and blocks while the channel
+// is full. receive() blocks while it is empty and returns nil once it is
+// closed and drained.
+static Value channel_native(VM* vm, int arg_count, Value* args) {
+	int capacity = 1;
+	if (arg_count > 1 || (arg_count == 1 && (!to_integer(args[0], &capacity) || capacity < 1))) {
+		return native_error(vm, "Channel() expects a positive capacity.");
+	}
+	Channel* channel = create_channel(capacity);
+	ObjChannel* handle = new_channel(vm, channel);
+	release_channel(channel);
+	return OBJ_VALUE(handle);
+}
+
+static Value channel_send_native(VM* vm, int arg_count, Value* args) {
+	if (arg_count != 1) {
+		return native_error(vm, "Expected 1 arguments but got %d.", arg_count);
+	}
+	Message message;
+	init_message(&message);
+	const char* error = write_message(vm, &message, args[0]);
+	if (error != NULL) {
+		free_message(&message);
+		return native_error(vm, "%s", error);
+	}
+	seal_message(&message);
+	if (!channel_send(AS_CHANNEL(args[-1])->channel, &message)) {
+		free_message(&message);
+		return native_error(vm, "Send on a closed channel.");
+	}
+	return NIL_VALUE();
+}
+
+static Value channel_receive_native(VM* vm, int arg_count, Value* args) {
+	if (arg_count != 0) {
+		return native_error(vm, "Expected 0 arguments but got %d.", arg_count);
+	}
+	Message message;
+	if (!channel_receive(AS_CHANNEL(args[-1])->channel, &message)) return NIL_VALUE();
+	Value value = read_message(vm, &message)->items.values[0];
+	free_message(&message);
+	return value;
+}
+
+static Value channel_close_native(VM* vm, int arg_count, Value* args) {
+	if (arg_count != 0) {
+		return native_error(vm, "Expected 0 arguments but got %d.", arg_count);
+	}
+	channel_close(AS_CHANNEL(args[-1])->channel);
+	return NIL_VALUE();
+}
+
+// Fiber(fn) wraps a function of at most one argument. resume(value) runs
+// it until it calls yield(value) or returns, and gives back that value.
+// The value passed to resume() is the function's argument the first time
+// and the result of yield() after that. done() tells if fn returned.
+static Value fiber_native(VM* vm, int arg_count, Value* args) {
+	if (arg_count != 1 || !IS_CLOSURE(args[0]) || AS_CLOSURE(args[0])->function->arity > 1) {
+		return native_error(vm, "Fiber() expects a function with at most one parameter.");
+	}
+	return OBJ_VALUE(new_fiber(vm, AS_CLOSURE(args[0])));
+}
+
+static Value fiber_resume_native(VM* vm, int arg_count, Value* args) {
+	if (arg_count > 1) {
+		return native_error(vm, "Expected at most 1 argument but got %d.", arg_count);
+	}
+	ObjFiber* fiber = AS_FIBER(args[-1]);
+	if (fiber->state == FIBER_DONE) return native_error(vm, "Cannot resume a finished fiber.");
+	if (fiber->state == FIBER_PARKED) return native_error(vm, "Cannot resume a fiber waiting for an event.");
+	if (fiber->state != FIBER_NEW && fiber->state != FIBER_SUSPENDED) {
+		return native_error(vm, "Cannot resume a running fiber.");
+	}
+	fiber->caller = vm->fiber;
+	vm->next_fiber = fiber;
+	return arg_count == 1 ? args[0] : NIL_VALUE();
+}
+
+static Value fiber_done_native(VM* vm, int arg_count, Value* args) {
+	if (arg_count != 0) {
+		return native_error(vm, "Expected 0 arguments but got %d.", arg_count);
+	}
+	return BOOL_VALUE(AS_FIBER(args[-1])->state == FIBER_DONE);
+}
+
+// A fiber can only yield from the run() that resumed it: a native in
+// between would be left with a C frame belonging to a suspended fiber.
+static Value yield_native(VM* vm, int arg_count, Value* args) {
+	if (arg_count > 1) {
+		return native_error(vm, "Expected at most 1 argument but got %d.", arg_count);
+	}
+	ObjFiber* fiber = vm->fiber;
+	if (fiber->caller == NULL) return native_error(vm, "Cannot yield from the main script.");
+	if (fiber->resumed_at != vm->nested_runs) {
+		return native_error(vm, "Cannot yield across a native call.");
+	}
+	vm->next_fiber = fiber->caller;
+	return arg_count == 1 ? args[0] : NIL_VALUE();
+}
+
+// Called once resume() or yield() returned and their call was popped. The
+// fiber being left keeps a slot on its stack for the value it will get
+// when it runs again.
+static bool switch_fiber(VM* vm, Value value) {
+	ObjFiber* from = vm->fiber;
+	ObjFiber* to = vm->next_fiber;
+	vm->next_fiber = NULL;
+	stack_push(vm, NIL_VALUE());
+	save_fiber(vm);
+	if (to->caller == from) {
+		from->state = FIBER_WAITING;
+		to->resumed_at = vm->nested_runs;
+	} else {
+		from->state = FIBER_SUSPENDED;
+		from->caller = NULL;
+	}
+
+	FiberState state = to->state;
+	to->state = FIBER_RUNNING;
+	load_fiber(vm, to);
+	if (state == FIBER_NEW) {
+		int arity = to->closure->function->arity;
+		if (arity == 1) stack_push(vm, value);
+		return call(vm, to->closure, arity);
+	}
+	vm->stack_top[-1] = value;
+	return true;
+}
+
+// The fiber's function returned: its result goes to the fiber that
+// resumed it and its stack is released.
+static void finish_fiber(VM* vm, Value result) {
+	ObjFiber* fiber = vm->fiber;
+	ObjFiber* caller = fiber->caller;
+	fiber->state = FIBER_DONE;
+	fiber->caller = NULL;
+	free_fiber_stack(vm, fiber);
+	caller->state = FIBER_RUNNING;
+	load_fiber(vm, caller);
+	vm->stack_top[-1] = result;
+}
+
+// Resumes the fiber on top of the stack from a native and runs it until it
+// yields or returns. What it gave back replaces it on the stack.
+static bool resume_from_native(VM* vm, Value value) {
+	ObjFiber* fiber = AS_FIBER(stack_pop(vm));
+	Value* stack = vm->stack;
+	int depth = vm->frames_count;
+	fiber->caller = vm->fiber;
+	vm->next_fiber = fiber;
+	vm->nested_runs++;
+	bool resumed = switch_fiber(vm, value) && run(vm, stack, depth) == INTERPRET_OK;
+	vm->nested_runs--;
+	return resumed;
+}
+
+// schedule(fn) queues a new fiber running fn, or a fiber that has not
+// finished, for runEvents(). runEvents() runs the queued fibers until
+// every one has finished. Inside them sleep(), readFd() and writeFd()
+// park the fiber instead of blocking, and the loop resumes it once the
+// timer expires or the descriptor is ready. A fiber that yields goes to
+// the back of the queue.
+static Value schedule_native(VM* vm, int arg_count, Value* args) {
+	if (arg_count == 1 && IS_CLOSURE(args[0]) && AS_CLOSURE(args[0])->function->arity == 0) {
+		args[0] = OBJ_VALUE(new_fiber(vm, AS_CLOSURE(args[0])));
+	}
+	if (arg_count != 1 || !IS_FIBER(args[0]) ||
+		(AS_FIBER(args[0])->state != FIBER_NEW && AS_FIBER(args[0])->state != FIBER_SUSPENDED)) {
+		return native_error(vm, "schedule() expects a function without parameters or a suspended fiber.");
+	}
+	event_loop_ready(vm, &vm->events, AS_FIBER(args[0]), NIL_VALUE());
+	return args[0];
+}
+
+static Value run_events_native(VM* vm, int arg_count, Value* args) {
+	if (arg_count != 0) {
+		return native_error(vm, "Expected 0 arguments but got %d.", arg_count);
+	}
+	if (vm->fiber != vm->main_fiber) {
+		return native_error(vm, "runEvents() must be called from the main script.");
+	}
+	EventLoop* loop = &vm->events;
+	for (;;) {
+		ReadyFiber next;
+		while (event_loop_next(loop, &next)) {
+			ObjFiber* fiber = next.fiber;
+			if (fiber->state != FIBER_NEW && fiber->state != FIBER_SUSPENDED) continue;
+			// On the stack, a compaction may move it while it runs.
+			stack_push(vm, OBJ_VALUE(fiber));
+			stack_push(vm, OBJ_VALUE(fiber));
+			loop->running = fiber;
+			loop->parked = false;
+			bool resumed = resume_from_native(vm, next.value);
+			loop->running = NULL;
+			if (!resumed) return native_failed(vm);
+			stack_pop(vm);
+			fiber = AS_FIBER(stack_pop(vm));
+			if (loop->parked) {
+				fiber->state = FIBER_PARKED;
+			} else if (fiber->state == FIBER_SUSPENDED) {
+				event_loop_ready(vm, loop, fiber, NIL_VALUE());
+			}
+		}
+		if (!event_loop_pending(loop)) return NIL_VALUE();
+		if (!event_loop_poll(vm, loop)) {
+			return native_error(vm, "Event loop failed: %s", strerror(errno));
+		}
+	}
+}
+
+// Only the fiber run by runEvents() can park, and not from inside a
+// native call. Everywhere else the natives block the thread.
+static bool can_park(VM* vm) {
+	return vm->fiber == vm->events.running && vm->fiber->resumed_at == vm->nested_runs;
+}
+
+static Value park(VM* vm) {
+	vm->events.parked = true;
+	vm->next_fiber = vm->fiber->caller;
+	return NIL_VALUE();
+}
+
+// sleep(ms) waits at least that many milliseconds.
+static Value sleep_native(VM* vm, int arg_count, Value* args) {
+	// Also rules out NaN, and durations that don't fit in nanoseconds.
+	if (arg_count != 1 || !IS_NUMBER(args[0]) ||
+		!(AS_NUMBER(args[0]) >= 0 && AS_NUMBER(args[0]) <= SLEEP_MAX_MS)) {
+		return native_error(vm, "sleep() expects a number of milliseconds from 0 to 1e10.");
+	}
+	uint64_t ns = (uint64_t)(AS_NUMBER(args[0]) * 1e6);
+	if (can_park(vm)) {
+		event_loop_sleep(vm, &vm->events, vm->fiber, monotonic_ns() + ns);
+		return park(vm);
+	}
+	struct timespec wait = {ns / 1000000000, ns % 1000000000};
+	while (nanosleep(&wait, &wait) == -1 && errno == EINTR);
+	return NIL_VALUE();
+}
+
+// Blocks the thread until fd is ready, for natives that can't park.
+static bool wait_fd(int fd, bool writing) {
+	struct pollfd poll_fd = {fd, writing ? POLLOUT : POLLIN, 0};
+	int count;
+	do {
+		count = poll(&poll_fd, 1, -1);
+	} while (count == -1 && errno == EINTR);
+	return count != -1;
+}
+
+static bool set_non_blocking(int fd) {
+	int flags = fcntl(fd, F_GETFL);
+	return flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1 &&
+		fcntl(fd, F_SETFD, FD_CLOEXEC) != -1;
+}
+
+// Descriptors come in pairs as a [first, second] list. Writes to a closed
+// pipe report an error instead of raising SIGPIPE, see write_fd().
+static Value fd_pair(VM* vm, int fds[2]) {
+	if (!set_non_blocking(fds[0]) || !set_non_blocking(fds[1])) {
+		close(fds[0]);
+		close(fds[1]);
+		return native_error(vm, "Cannot set up descriptors: %s", strerror(errno));
 	}
-	stack_push(OBJ_VALUE(func));
-	ObjClosure* closure = new_closure(func);
-	CallFrame* frame = &vm.frames[vm.frames_count];
+	ObjList* list = new_list(vm);
+	stack_push(vm, OBJ_VALUE(list));
+	write_valuearray(vm, &list->items, NUMBER_VALUE(fds[0]));
+	write_valuearray(vm, &list->items, NUMBER_VALUE(fds[1]));
+	stack_pop(vm);
+	return OBJ_VALUE(list);
+}
+
+// pipe() returns [readEnd, writeEnd].
+static Value pipe_native(VM* vm, int arg_count, Value* args) {
+	if (arg_count != 0) {
+		return native_error(vm, "Expected 0 arguments but got %d.", arg_count);
+	}
+	int fds[2];
+	if (pipe(fds) == -1) return native_error(vm, "Cannot create a pipe: %s", strerror(errno));
+	return fd_pair(vm, fds);
+}
+
+// socketPair() returns two connected local stream sockets.
+static Value socket_pair_native(VM* vm, int arg_count, Value* args) {
+	if (arg_count != 0) {
+		return native_error(vm, "Expected 0 arguments but got %d.", arg_count);
+	}
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+		return native_error(vm, "Cannot create sockets: %s", strerror(errno));
+	}
+	return fd_pair(vm, fds);
+}
+
+// readFd(fd, max) returns up to max bytes, 4096 by default, as soon as
+// any are available. nil at the end of the stream.
+static Value read_fd_native(VM* vm, int arg_count, Value* args) {
+	int fd;
+	int max = 4096;
+	if (arg_count < 1 || arg_count > 2 || !to_integer(args[0], &fd) ||
+		(arg_count == 2 && (!to_integer(args[1], &max) || max < 1))) {
+		return native_error(vm, "readFd() expects a descriptor and a positive size.");
+	}
+	for (;;) {
+		Value result;
+		int done = read_fd(vm, fd, max, &result);
+		if (done == 1) return result;
+		if (done == -1) break;
+		if (can_park(vm)) {
+			if (!event_loop_read(vm, &vm->events, vm->fiber, fd, max)) break;
+			return park(vm);
+		}
+		if (!wait_fd(fd, false)) break;
+	}
+	return native_error(vm, "Cannot read descriptor %d: %s", fd, strerror(errno));
+}
+
+// writeFd(fd, text) writes all of text and returns the bytes written.
+static Value write_fd_native(VM* vm, int arg_count, Value* args) {
+	int fd;
+	if (arg_count != 2 || !to_integer(args[0], &fd) || !IS_TEXT(args[1])) {
+		return native_error(vm, "writeFd() expects a descriptor and a string.");
+	}
+	ObjString* text = flatten_at(vm, 0);
+	int written = 0;
+	for (;;) {
+		int done = write_fd(fd, text, &written);
+		if (done == 1) return NUMBER_VALUE(written);
+		if (done == -1) break;
+		if (can_park(vm)) {
+			if (!event_loop_write(vm, &vm->events, vm->fiber, fd, text, written)) break;
+			return park(vm);
+		}
+		if (!wait_fd(fd, true)) break;
+	}
+	return native_error(vm, "Cannot write descriptor %d: %s", fd, strerror(errno));
+}
+
+// closeFd(fd). A fiber waiting on it sees the end of the stream.
+static Value close_fd_native(VM* vm, int arg_count, Value* args) {
+	int fd;
+	if (arg_count != 1 || !to_integer(args[0], &fd)) {
+		return native_error(vm, "closeFd() expects a descriptor.");
+	}
+	event_loop_forget(vm, &vm->events, fd);
+	if (close(fd) == -1) return native_error(vm, "Cannot close descriptor %d: %s", fd, strerror(errno));
+	return NIL_VALUE();
+}
+
+void init_vm(VM* vm) {
+	init_vm_shared(vm, NULL, 0);
+}
+
+void init_vm_shared(VM* vm, SharedCode** shared, int count) {
+	vm->frames = NULL;
+	vm->frames_count = 0;
+	vm->stack = NULL;
+	vm->stack_top = NULL;
+	vm->open_upvalues = NULL;
+	vm->fiber = NULL;
+	vm->main_fiber = NULL;
+	vm->next_fiber = NULL;
+	vm->nested_runs = 0;
+	init_event_loop(&vm->events);
+	vm->limits = (Limits){0};
+	vm->budget = INT32_MAX;
+	vm->budget_chunk = INT32_MAX;
+	vm->ticks_used = 0;
+	vm->deadline = 0;
+	vm->heap_exceeded = false;
+	vm->jit_threshold = JIT_DEFAULT_THRESHOLD;
+	configure_traces(vm, TRACE_DEFAULT_THRESHOLD);
+	vm->objects = NULL;
+	init_intern_set(&vm->strings);
+	vm->shared = NULL;
+	vm->shared_count = 0;
+	vm->shared_capacity = 0;
+	init_table(&vm->globals);
+	init_table(&vm->list_methods);
+	init_table(&vm->map_methods);
+	init_table(&vm->float_array_methods);
+	init_table(&vm->line_reader_methods);
+	init_table(&vm->channel_methods);
+	init_table(&vm->isolate_methods);
+	init_table(&vm->fiber_methods);
+	vm->has_native_error = false;
+	init_output(&vm->output, stdout, OUTPUT_DEFAULT_SIZE);
+	vm->errors = stderr;
+	init_valuearray(&vm->host_values);
+
+	vm->gray_capacity = 0;
+	vm->gray_count = 0;
+	vm->gray_stack = NULL;
+
+	init_gc_config(&vm->gc_config);
+	init_gc_stats(&vm->gc_stats);
+	vm->bytes_allocated = 0;
+	vm->next_gc = vm->gc_config.initial_heap;
+	vm->collecting = false;
+
+	vm->compaction_pending = false;
+	vm->regions = NULL;
+	vm->region_dead_bytes = 0;
+	vm->fragmentation = 0;
+
+	vm->permanent = NULL;
+	vm->permanent_count = 0;
+	vm->permanent_regions = NULL;
+	vm->remembered = NULL;
+	vm->remembered_count = vm->remembered_capacity = 0;
+
+	vm->init_string = NULL;
+	vm->main_fiber = new_fiber(vm, NULL);
+	load_fiber(vm, vm->main_fiber);
+	for (int i = 0; i < count; i++) {
+		attach_shared(vm, shared[i]);
+	}
+	vm->init_string = copy_string(vm, "init", 4);
+
+	define_native(vm, &vm->globals, "clock", clock_native);
+	define_native(vm, &vm->globals, "clockNs", clock_ns_native);
+	define_native(vm, &vm->globals, "cycles", cycles_native);
+	define_native(vm, &vm->globals, "bench", bench_native);
+	define_native(vm, &vm->globals, "heapFragmentation", heap_fragmentation_native);
+	define_native(vm, &vm->globals, "compactHeap", compact_heap_native);
+	define_native(vm, &vm->globals, "gcCollect", gc_collect_native);
+	define_native(vm, &vm->globals, "gcStats", gc_stats_native);
+	define_native(vm, &vm->globals, "tableStats", table_stats_native);
+	define_native(vm, &vm->globals, "Float64Array", float_array_native);
+	define_native(vm, &vm->globals, "LineReader", line_reader_native);
+	define_native(vm, &vm->globals, "spawn", spawn_native);
+	define_native(vm, &vm->globals, "Channel", channel_native);
+	define_native(vm, &vm->globals, "Fiber", fiber_native);
+	define_native(vm, &vm->globals, "yield", yield_native);
+	define_native(vm, &vm->globals, "schedule", schedule_native);
+	define_native(vm, &vm->globals, "runEvents", run_events_native);
+	define_native(vm, &vm->globals, "sleep", sleep_native);
+	define_native(vm, &vm->globals, "pipe", pipe_native);
+	define_native(vm, &vm->globals, "socketPair", socket_pair_native);
+	define_native(vm, &vm->globals, "readFd", read_fd_native);
+	define_native(vm, &vm->globals, "writeFd", write_fd_native);
+	define_native(vm, &vm->globals, "closeFd", close_fd_native);
+
+	define_native(vm, &vm->list_methods, "push", list_push_native);
+	define_native(vm, &vm->list_methods, "pop", list_pop_native);
+	define_native(vm, &vm->list_methods, "length", list_length_native);
+	define_native(vm, &vm->list_methods, "slice", list_slice_native);
+
+	define_native(vm, &vm->map_methods, "size", map_size_native);
+	define_native(vm, &vm->map_methods, "has", map_has_native);
+	define_native(vm, &vm->map_methods, "get", map_get_native);
+	define_native(vm, &vm->map_methods, "remove", map_remove_native);
+	define_native(vm, &vm->map_methods, "keys", map_keys_native);
+	define_native(vm, &vm->map_methods, "values", map_values_native);
+	define_native(vm, &vm->map_methods, "putAll", map_put_all_native);
+	define_native(vm, &vm->map_methods, "clear", map_clear_native);
+
+	define_native(vm, &vm->float_array_methods, "length", float_array_length_native);
+	define_native(vm, &vm->float_array_methods, "sum", float_array_sum_native);
+	define_native(vm, &vm->float_array_methods, "dot", float_array_dot_native);
+	define_native(vm, &vm->float_array_methods, "scale", float_array_scale_native);
+	define_native(vm, &vm->float_array_methods, "add", float_array_add_native);
+	define_native(vm, &vm->float_array_methods, "min", float_array_min_native);
+	define_native(vm, &vm->float_array_methods, "max", float_array_max_native);
+	define_native(vm, &vm->float_array_methods, "prefixSum", float_array_prefix_sum_native);
+	define_native(vm, &vm->float_array_methods, "sort", float_array_sort_native);
+	define_native(vm, &vm->float_array_methods, "toList", float_array_to_list_native);
+
+	define_native(vm, &vm->line_reader_methods, "next", line_reader_next_native);
+	define_native(vm, &vm->line_reader_methods, "close", line_reader_close_native);
+
+	define_native(vm, &vm->channel_methods, "send", channel_send_native);
+	define_native(vm, &vm->channel_methods, "receive", channel_receive_native);
+	define_native(vm, &vm->channel_methods, "close", channel_close_native);
+
+	define_native(vm, &vm->isolate_methods, "join", isolate_join_native);
+
+	define_native(vm, &vm->fiber_methods, "resume", fiber_resume_native);
+	define_native(vm, &vm->fiber_methods, "done", fiber_done_native);
+}
+
+void configure_gc(VM* vm, GcConfig* config) {
+	vm->gc_config = *config;
+	vm->next_gc = config->initial_heap;
+}
+
+// Size 0 writes every print straight to stdout.
+void configure_output(VM* vm, size_t size) {
+	free_output(&vm->output);
+	init_output(&vm->output, stdout, size);
+}
+
+void configure_limits(VM* vm, Limits* limits) {
+	vm->limits = *limits;
+}
+
+void configure_jit(VM* vm, uint32_t threshold) {
+	vm->jit_threshold = threshold;
+}
+
+void configure_traces(VM* vm, uint16_t threshold) {
+	vm->trace_threshold = threshold;
+	for (int i = 0; i < HOT_LOOP_COUNTERS; i++) vm->hot_loops[i] = threshold;
+}
+
+void free_vm(VM* vm) {
+	free_table(vm, &vm->globals);
+	free_table(vm, &vm->list_methods);
+	free_table(vm, &vm->map_methods);
+	free_table(vm, &vm->float_array_methods);
+	free_table(vm, &vm->line_reader_methods);
+	free_table(vm, &vm->channel_methods);
+	free_table(vm, &vm->isolate_methods);
+	free_table(vm, &vm->fiber_methods);
+	free_valuearray(vm, &vm->host_values);
+	free_event_loop(vm, &vm->events);
+	free_intern_set(vm, &vm->strings);
+	vm->init_string = NULL;
+	free_objects(vm);
+	free_permanent(vm);
+	free_regions(vm);
+	for (int i = 0; i < vm->shared_count; i++) {
+		release_shared(vm->shared[i]);
+	}
+	free(vm->shared);
+	free(vm->gray_stack);
+	free_gc_stats(&vm->gc_stats);
+	free_output(&vm->output);
+}
+
+static void refill_budget(VM* vm) {
+	int64_t chunk = INT32_MAX;
+	if (vm->limits.time_ms > 0) chunk = LIMIT_CHECK_TICKS;
+	if (vm->limits.ticks > 0 && vm->limits.ticks - vm->ticks_used < (uint64_t)chunk) {
+		chunk = vm->limits.ticks - vm->ticks_used;
+	}
+	if (vm->compaction_pending || vm->heap_exceeded) chunk = 0;
+	vm->budget_chunk = (int32_t)chunk;
+	vm->budget = (int32_t)chunk;
+}
+
+static void start_limits(VM* vm) {
+	vm->ticks_used = 0;
+	vm->heap_exceeded = false;
+	vm->deadline = vm->limits.time_ms > 0 ? monotonic_ns() + vm->limits.time_ms * 1000000 : 0;
+	refill_budget(vm);
+}
+
+// Slow path of the budget count down. Reports an exhausted limit as a
+// runtime error, which leaves the VM ready for the next run.
+static bool check_limits(VM* vm, bool safe_point) {
+	interrupt_run(vm); // Counts the ticks of the chunk
+	if (safe_point && vm->compaction_pending) {
+		compact_heap(vm); // Only the VM holds object pointers.
+	}
+	if (vm->heap_exceeded) {
+		collect_garbage(vm);
+		if (vm->bytes_allocated > vm->limits.heap) {
+			runtime_error(vm, "Heap limit of %zu bytes exceeded.", vm->limits.heap);
+			return false;
+		}
+		vm->heap_exceeded = false;
+	}
+	if (vm->limits.ticks > 0 && vm->ticks_used > vm->limits.ticks) {
+		runtime_error(vm, "Budget of %llu ticks exhausted.", (unsigned long long)vm->limits.ticks);
+		return false;
+	}
+	if (vm->limits.time_ms > 0 && monotonic_ns() >= vm->deadline) {
+		runtime_error(vm, "Time limit of %llu ms exceeded.", (unsigned long long)vm->limits.time_ms);
+		return false;
+	}
+	refill_budget(vm);
+	return true;
+}
+
+static InterpretResult run_script(VM* vm, ObjFunction* func) {
+	start_limits(vm);
+	stack_push(vm, OBJ_VALUE(func));
+	ObjClosure* closure = new_closure(vm, func);
+	CallFrame* frame = &vm->frames[vm->frames_count];
 	frame->closure = closure;
 	frame->pc = func->chunk.code;
-	frame->slots = vm.stack;
-	stack_pop();
-	stack_push(OBJ_VALUE(closure));
-	call_value(OBJ_VALUE(closure), 0);
-	return run();
+	frame->slots = vm->stack;
+	stack_pop(vm);
+	stack_push(vm, OBJ_VALUE(closure));
+	// A limit that is still exhausted fails before the first frame.
+	if (!call_value(vm, OBJ_VALUE(closure), 0)) {
+		stack_reset(vm);
+		return INTERPRET_RUNTIME_ERROR;
+	}
+	InterpretResult result = run(vm, vm->stack, 0);
+	if (result == INTERPRET_OK) stack_pop(vm);
+	return result;
+}
+
+InterpretResult interpret(VM* vm, const char* source, size_t length) {
+	ObjFunction* func = compile(vm, source, length);
+	if(func == NULL) {
+		return INTERPRET_COMPILE_ERROR;
+	}
+	return run_script(vm, func);
+}
+
+// The code must be attached to the VM.
+InterpretResult interpret_shared(VM* vm, SharedCode* code) {
+	return run_script(vm, code->script);
 }
 
-static InterpretResult run() {
-	CallFrame* frame = &vm.frames[vm.frames_count - 1];
+// Calls the value below the arguments on the stack and runs it to the
+// end. The result replaces the callee and the arguments.
+InterpretResult interpret_call(VM* vm, int arg_count) {
+	int depth = vm->frames_count;
+	if (depth == 0) start_limits(vm);
+	InterpretResult result = INTERPRET_RUNTIME_ERROR;
+	vm->nested_runs++; // Counted before the call, natives can't yield either
+	if (call_value(vm, stack_peek(vm, arg_count), arg_count)) {
+		// Natives return right away
+		result = vm->frames_count == depth ? INTERPRET_OK : run(vm, vm->stack, depth);
+	}
+	vm->nested_runs--;
+	return result;
+}
+
+// Runs until the fiber whose stack is exit_stack is back to exit_depth
+// frames, by returning or by a fiber switching back to it. Natives that
+// call into Lox nest a run() above their caller's frames.
+static InterpretResult run(VM* vm, Value* exit_stack, int exit_depth) {
+	CallFrame* frame = &vm->frames[vm->frames_count - 1];
 
 #define READ_BYTE() (*frame->pc++)
 #define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
 #define READ_STRING() AS_STRING(READ_CONSTANT())
 #define READ_SHORT() (frame->pc += 2, (uint16_t)((frame->pc[-2] << 8) | frame->pc[-1]))
+// After anything that can switch fibers.
+#define RETURN_IF_EXITED() \
+	if (vm->frames_count == exit_depth && vm->stack == exit_stack) return INTERPRET_OK
 #define BINARY_OP(value_type, op) \
 	do {\
-		if(!IS_NUMBER(stack_peek(0)) || !IS_NUMBER(stack_peek(1))) { \
-			runtime_error("Operand must be a number"); \
+		if(!IS_NUMBER(stack_peek(vm, 0)) || !IS_NUMBER(stack_peek(vm, 1))) { \
+			runtime_error(vm, "Operand must be a number"); \
 			return INTERPRET_RUNTIME_ERROR; \
 		} \
-		double b = AS_NUMBER(stack_pop()); \
-		double a = AS_NUMBER(stack_pop()); \
-		stack_push(value_type(a op b)); \
+		double b = AS_NUMBER(stack_pop(vm)); \
+		double a = AS_NUMBER(stack_pop(vm)); \
+		stack_push(vm, value_type(a op b)); \
 	} while(false)
+#ifdef CLOX_JIT
+// Compiled code runs the frame up to its next call or return.
+#define RUN_COMPILED() \
+	if (jit_ready(frame->closure->function) && !jit_run(vm, frame)) return INTERPRET_RUNTIME_ERROR
+#else
+#define RUN_COMPILED()
+#endif
 
+	RUN_COMPILED();
 	for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
 		printf("         ");
-		for (Value* val_ptr = vm.stack; val_ptr < vm.stack_top; val_ptr++) {
+		for (Value* val_ptr = vm->stack; val_ptr < vm->stack_top; val_ptr++) {
 			printf("[ ");
 			print_value(*val_ptr);
 			printf(" ]");
@@ -109,55 +1255,55 @@ static InterpretResult run() {
 		uint8_t instruction;
 		switch (instruction = READ_BYTE()) {
 		case OP_RETURN: {
-			Value result = stack_pop();
-			close_upvalues(frame->slots);
-	        vm.frames_count--;
-	        if (vm.frames_count == 0) {
-				stack_pop();
-				return INTERPRET_OK;
+			Value result = stack_pop(vm);
+			close_upvalues(vm, frame->slots);
+	        vm->frames_count--;
+	        if (vm->frames_count == 0 && vm->fiber != vm->main_fiber) {
+				finish_fiber(vm, result);
+				RETURN_IF_EXITED();
+				frame = &vm->frames[vm->frames_count - 1];
+				RUN_COMPILED();
+				break;
 	        }
-	        vm.stack_top = frame->slots;
-	        stack_push(result);
-	        frame = &vm.frames[vm.frames_count - 1];
+	        vm->stack_top = frame->slots;
+	        stack_push(vm, result);
+	        RETURN_IF_EXITED();
+	        frame = &vm->frames[vm->frames_count - 1];
+	        RUN_COMPILED();
 	        break;
 		};
-		case OP_POP: stack_pop(); break;
+		case OP_POP: stack_pop(vm); break;
 		case OP_CONSTANT: {
 			Value constant = READ_CONSTANT();
-			stack_push(constant);
+			stack_push(vm, constant);
 			break;
 		}
-		case OP_NIL: stack_push(NIL_VALUE()); break;
-		case OP_TRUE: stack_push(BOOL_VALUE(true)); break;
-		case OP_FALSE: stack_push(BOOL_VALUE(false)); break;
+		case OP_NIL: stack_push(vm, NIL_VALUE()); break;
+		case OP_TRUE: stack_push(vm, BOOL_VALUE(true)); break;
+		case OP_FALSE: stack_push(vm, BOOL_VALUE(false)); break;
 		case OP_NOT:
-			stack_push(BOOL_VALUE(is_falsy(stack_pop())));
+			stack_push(vm, BOOL_VALUE(is_falsy(stack_pop(vm))));
 			break;
 		case OP_LESS: BINARY_OP(BOOL_VALUE, <); break;
 		case OP_GREATER: BINARY_OP(BOOL_VALUE, >); break;
-		case OP_EQUAL: {
-			Value right = stack_pop();
-			Value left = stack_pop();
-			stack_push(BOOL_VALUE(values_equal(left, right)));
-			break;
-		}
+		case OP_EQUAL: compare_equal(vm); break;
 		case OP_NEGATE: {
-			if(!IS_NUMBER(stack_peek(0))) {
-				runtime_error("Operand must be a number");
+			if(!IS_NUMBER(stack_peek(vm, 0))) {
+				runtime_error(vm, "Operand must be a number");
 				return INTERPRET_RUNTIME_ERROR;
 			}
-			stack_push( NUMBER_VALUE( - AS_NUMBER( stack_pop() ) ) );
+			stack_push(vm,  NUMBER_VALUE( - AS_NUMBER( stack_pop(vm) ) ) );
 			break;
 		}
 		case OP_ADD: {
-			if(IS_NUMBER(stack_peek(0)) && IS_NUMBER(stack_peek(1))) {
-				double b = AS_NUMBER(stack_pop());
-				double a = AS_NUMBER(stack_pop());
-				stack_push(NUMBER_VALUE(a + b));
-			} else if(IS_STRING(stack_peek(0)) && IS_STRING(stack_peek(1))) {
-				concatenate_str();
+			if(IS_NUMBER(stack_peek(vm, 0)) && IS_NUMBER(stack_peek(vm, 1))) {
+				double b = AS_NUMBER(stack_pop(vm));
+				double a = AS_NUMBER(stack_pop(vm));
+				stack_push(vm, NUMBER_VALUE(a + b));
+			} else if(IS_TEXT(stack_peek(vm, 0)) && IS_TEXT(stack_peek(vm, 1))) {
+				concatenate_str(vm);
 			} else {
-				runtime_error("Operand must be two numbers or two strings");
+				runtime_error(vm, "Operand must be two numbers or two strings");
 				return INTERPRET_RUNTIME_ERROR;
 			}
 			break;
@@ -166,58 +1312,36 @@ static InterpretResult run() {
 		case OP_MULTIPLY: BINARY_OP(NUMBER_VALUE, *); break;
 		case OP_DIVIDE: BINARY_OP(NUMBER_VALUE, /); break;
 		case OP_MODULE: {
-			if(!IS_NUMBER(stack_peek(0)) || !IS_NUMBER(stack_peek(1))) {
-				runtime_error("Operand must be a number");
+			if(!IS_NUMBER(stack_peek(vm, 0)) || !IS_NUMBER(stack_peek(vm, 1))) {
+				runtime_error(vm, "Operand must be a number");
 				return INTERPRET_RUNTIME_ERROR;
 			}
-			double b = AS_NUMBER(stack_pop());
-			double a = AS_NUMBER(stack_pop());
-			stack_push(NUMBER_VALUE(fmod(a, b)));
-			break;
-		}
-		case OP_PRINT: {
-			print_value(stack_pop());
-			printf("\n");
-			break;
-		}
-		case OP_DEFINE_GLOBAL: {
-			ObjString* name = READ_STRING();
-			table_set(&vm.globals, name, stack_peek(0));
-			stack_pop(); // Ensure garbage collector can access the value if is triggered here.
+			double b = AS_NUMBER(stack_pop(vm));
+			double a = AS_NUMBER(stack_pop(vm));
+			stack_push(vm, NUMBER_VALUE(fmod(a, b)));
 			break;
 		}
-		case OP_GET_GLOBAL: {
-			ObjString* name = READ_STRING();
-			Value value;
-			if(!table_get(&vm.globals, name, &value)) {
-				runtime_error("Undefined global: %s", name->chars);
-				return INTERPRET_RUNTIME_ERROR;
-			}
-			stack_push(value);
+		case OP_PRINT: print_top(vm); break;
+		case OP_DEFINE_GLOBAL: define_global(vm, READ_STRING()); break;
+		case OP_GET_GLOBAL:
+			if(!get_global(vm, READ_STRING())) return INTERPRET_RUNTIME_ERROR;
 			break;
-		}
-		case OP_SET_GLOBAL: {
-			ObjString* name = READ_STRING();
-			if(table_set(&vm.globals, name, stack_peek(0))) {
-				table_delete(&vm.globals, name);
-				runtime_error("Undefined global: %s", name->chars);
-				return INTERPRET_RUNTIME_ERROR;
-			}
+		case OP_SET_GLOBAL:
+			if(!set_global(vm, READ_STRING())) return INTERPRET_RUNTIME_ERROR;
 			break;
-		}
 		case OP_GET_LOCAL: {
 			uint8_t slot = READ_BYTE();
-			stack_push(frame->slots[slot]);
+			stack_push(vm, frame->slots[slot]);
 			break;
 		}
 		case OP_SET_LOCAL: {
 			uint8_t slot = READ_BYTE();
-			frame->slots[slot] = stack_peek(0);
+			frame->slots[slot] = stack_peek(vm, 0);
 			break;
 		}
 		case OP_JUMP_IF_FALSE: {
 			uint16_t offset = READ_SHORT();
-			if(is_falsy(stack_peek(0))) {
+			if(is_falsy(stack_peek(vm, 0))) {
 				frame->pc += offset;
 			}
 			break;
@@ -229,129 +1353,113 @@ static InterpretResult run() {
 		}
 		case OP_LOOP: {
 			uint16_t offset = READ_SHORT();
+			// Safe point for compaction, see check_limits().
+			if (--vm->budget < 0 && !check_limits(vm, true)) {
+				return INTERPRET_RUNTIME_ERROR;
+			}
 			frame->pc -= offset;
+#ifdef CLOX_JIT
+			if (vm->trace_threshold > 0 && --*hot_loop_counter(vm, frame->pc) == 0) {
+				trace_loop(vm, frame);
+			}
+#endif
 			break;
 		}
 		case OP_CALL: {
 			uint8_t args = READ_BYTE();
-			if(!call_value(stack_peek(args), args)) {
+			if(!call_value(vm, stack_peek(vm, args), args)) {
 				return INTERPRET_RUNTIME_ERROR;
 			}
-			frame = &vm.frames[vm.frames_count - 1];
-			break;
-		}
-		case OP_CLOSURE: {
-			ObjFunction* func = AS_FUNCTION(READ_CONSTANT());
-			ObjClosure* closure = new_closure(func);
-			stack_push(OBJ_VALUE(closure));
-			for(int i = 0; i < closure->upvalue_count; i++) {
-				uint8_t is_local = READ_BYTE();
-				uint8_t index = READ_BYTE();
-				if(is_local) {
-					closure->upvalues[i] = capture_upvalue(frame->slots + index);
-				} else {
-					closure->upvalues[i] = frame->closure->upvalues[index];
-				}
-			}
+			RETURN_IF_EXITED();
+			frame = &vm->frames[vm->frames_count - 1];
+			RUN_COMPILED();
 			break;
 		}
+		case OP_CLOSURE: make_closure(vm, frame); break;
 		case OP_GET_UPVALUE: {
 			uint8_t index = READ_BYTE();
-			stack_push(*frame->closure->upvalues[index]->location);
+			stack_push(vm, *frame->closure->upvalues[index]->location);
 			break;
 		}
 		case OP_SET_UPVALUE: {
 			uint8_t index = READ_BYTE();
-			*frame->closure->upvalues[index]->location = stack_peek(0);
+			*frame->closure->upvalues[index]->location = stack_peek(vm, 0);
 			break;
 		}
 		case OP_CLOSE_UPVALUE: {
-			close_upvalues(vm.stack_top - 1);
-			stack_pop();
+			close_upvalues(vm, vm->stack_top - 1);
+			stack_pop(vm);
 			break;
 		}
 		case OP_CLASS: {
-			stack_push(OBJ_VALUE(new_class(READ_STRING())));
+			stack_push(vm, OBJ_VALUE(new_class(vm, READ_STRING())));
 			break;
 		}
-		case OP_GET_PROPERTY: {
-			if (!IS_INSTANCE(stack_peek(0))) {
-				runtime_error("Only instances have properties.");
-				return INTERPRET_RUNTIME_ERROR;
-			}
-
-			ObjInstance* instance = AS_INSTANCE(stack_peek(0));
-			ObjString* name = READ_STRING();
-
-			Value value;
-			if (table_get(&instance->fields, name, &value)) {
-				stack_pop(); // Instance.
-				stack_push(value);
-				break;
-			}
-
-			if(!bind_method(instance->klass, name)) {
-				return INTERPRET_RUNTIME_ERROR;
-			}
+		case OP_GET_PROPERTY:
+			if (!get_property(vm, READ_STRING())) return INTERPRET_RUNTIME_ERROR;
 			break;
-		}
-		case OP_SET_PROPERTY: {
-			if (!IS_INSTANCE(stack_peek(1))) {
-				runtime_error("Only instances have fields.");
-				return INTERPRET_RUNTIME_ERROR;
-			}
-			ObjInstance* instance = AS_INSTANCE(stack_peek(1));
-			table_set(&instance->fields, READ_STRING(), stack_peek(0));
-
-			Value value = stack_pop();
-			stack_pop();
-			stack_push(value);
+		case OP_SET_PROPERTY:
+			if (!set_property(vm, READ_STRING())) return INTERPRET_RUNTIME_ERROR;
 			break;
-		}
 		case OP_METHOD: {
-			define_method(READ_STRING());
+			define_method(vm, READ_STRING());
 			break;
 		}
 		case OP_INVOKE: {
 			ObjString* method = READ_STRING();
 			int arg_count = READ_BYTE();
-			if (!invoke(method, arg_count)) {
+			if (!invoke(vm, method, arg_count)) {
 				return INTERPRET_RUNTIME_ERROR;
 			}
-			frame = &vm.frames[vm.frames_count - 1];
+			RETURN_IF_EXITED();
+			frame = &vm->frames[vm->frames_count - 1];
+			RUN_COMPILED();
 			break;
 		}
 		case OP_INHERIT: {
-		    Value superclass = stack_peek(1);
+		    Value superclass = stack_peek(vm, 1);
 			if(!IS_CLASS(superclass)) {
-				runtime_error("Superclass must be a class.");
+				runtime_error(vm, "Superclass must be a class.");
 				return INTERPRET_RUNTIME_ERROR;
 			}
-		    ObjClass* subclass = AS_CLASS(stack_peek(0));
-		    table_add_all(&AS_CLASS(superclass)->methods, &subclass->methods);
-		    stack_pop(); // Subclass
+		    ObjClass* subclass = AS_CLASS(stack_peek(vm, 0));
+		    table_add_all(vm, &AS_CLASS(superclass)->methods, &subclass->methods);
+		    stack_pop(vm); // Subclass
 		    break;
 		}
 		case OP_GET_SUPER: {
 			ObjString* name = READ_STRING();
-			ObjClass* superclass = AS_CLASS(stack_pop());
-			if(!bind_method(superclass, name)) {
+			ObjClass* superclass = AS_CLASS(stack_pop(vm));
+			if(!bind_method(vm, superclass, name)) {
 				return INTERPRET_RUNTIME_ERROR;
 			}
 			break;
 		}
+		case OP_BUILD_LIST: build_list(vm, READ_BYTE()); break;
+		case OP_BUILD_MAP:
+			if (!build_map(vm, READ_BYTE())) return INTERPRET_RUNTIME_ERROR;
+			break;
+		case OP_GET_INDEX:
+			if (!get_index(vm)) return INTERPRET_RUNTIME_ERROR;
+			break;
+		case OP_SET_INDEX:
+			if (!set_index(vm)) return INTERPRET_RUNTIME_ERROR;
+			break;
 		case OP_SUPER_INVOKE: {
 			ObjString* method = READ_STRING();
 			int arg_count = READ_BYTE();
-			ObjClass* superclass = AS_CLASS(stack_pop());
-			if(!invoke_from_class(superclass, method, arg_count)) {
+			ObjClass* superclass = AS_CLASS(stack_pop(vm));
+			if(!invoke_from_class(vm, superclass, method, arg_count)) {
 				return INTERPRET_RUNTIME_ERROR;
 			}
-			frame = &vm.frames[vm.frames_count - 1];
+			frame = &vm->frames[vm->frames_count - 1];
+			RUN_COMPILED();
 			break;
 		}
 		}
 	}
+#undef RUN_COMPILED
+#undef RETURN_IF_EXITED
 #undef BINARY_OP
 #undef READ_SHORT
 #undef READ_BYTE
@@ -360,140 +1468,530 @@ static InterpretResult run() {
 #undef BINARY_OP
 }
 
-static void stack_reset() {
-	vm.stack_top = vm.stack;
-	vm.frames_count = 0;
+#ifdef CLOX_JIT
+static ObjString* read_name(CallFrame* frame) {
+	return AS_STRING(frame->closure->function->chunk.constants.values[*frame->pc++]);
+}
+
+// Compiled code does the arithmetic on numbers itself and only gets here
+// for other operands. Runs the instruction at the frame's pc and leaves
+// the pc past it, so errors report the right line.
+bool jit_slow_op(VM* vm) {
+	CallFrame* frame = &vm->frames[vm->frames_count - 1];
+	switch (*frame->pc++) {
+	case OP_ADD:
+		if (IS_TEXT(stack_peek(vm, 0)) && IS_TEXT(stack_peek(vm, 1))) {
+			concatenate_str(vm);
+			return true;
+		}
+		runtime_error(vm, "Operand must be two numbers or two strings");
+		return false;
+	case OP_SUBSTRACT:
+	case OP_MULTIPLY:
+	case OP_DIVIDE:
+	case OP_MODULE:
+	case OP_LESS:
+	case OP_GREATER:
+	case OP_NEGATE:
+		runtime_error(vm, "Operand must be a number");
+		return false;
+	case OP_EQUAL: compare_equal(vm); return true;
+	case OP_PRINT: print_top(vm); return true;
+	case OP_DEFINE_GLOBAL: define_global(vm, read_name(frame)); return true;
+	case OP_GET_GLOBAL: return get_global(vm, read_name(frame));
+	case OP_SET_GLOBAL: return set_global(vm, read_name(frame));
+	case OP_CLOSURE: make_closure(vm, frame); return true;
+	case OP_CLOSE_UPVALUE:
+		close_upvalues(vm, vm->stack_top - 1);
+		stack_pop(vm);
+		return true;
+	case OP_GET_PROPERTY: return get_property(vm, read_name(frame));
+	case OP_SET_PROPERTY: return set_property(vm, read_name(frame));
+	case OP_BUILD_LIST: build_list(vm, *frame->pc++); return true;
+	case OP_BUILD_MAP: return build_map(vm, *frame->pc++);
+	case OP_GET_INDEX: return get_index(vm);
+	case OP_SET_INDEX: return set_index(vm);
+	default:
+		runtime_error(vm, "Instruction %d has no slow path.", frame->pc[-1]);
+		return false;
+	}
+}
+
+// OP_LOOP ran out of budget.
+bool jit_loop_check(VM* vm) {
+	return check_limits(vm, true);
+}
+#endif
+
+// After a runtime error. The fiber that failed and every fiber waiting on
+// it are done; their upvalues are closed before their stacks go away.
+static void stack_reset(VM* vm) {
+	save_fiber(vm);
+	vm->next_fiber = NULL;
+	ObjFiber* fiber = vm->fiber;
+	while (fiber != vm->main_fiber) {
+		for (ObjUpvalue* upvalue = fiber->open_upvalues; upvalue != NULL; upvalue = upvalue->next) {
+			upvalue->closed = *upvalue->location;
+			upvalue->location = &upvalue->closed;
+		}
+		ObjFiber* caller = fiber->caller;
+		fiber->state = FIBER_DONE;
+		fiber->caller = NULL;
+		free_fiber_stack(vm, fiber);
+		fiber = caller;
+	}
+	vm->main_fiber->state = FIBER_RUNNING;
+	load_fiber(vm, vm->main_fiber);
+	// Or the next run's locals would reuse them.
+	close_upvalues(vm, vm->stack);
+	vm->stack_top = vm->stack;
+	vm->frames_count = 0;
+}
+
+static void save_fiber(VM* vm) {
+	ObjFiber* fiber = vm->fiber;
+	fiber->frames_count = vm->frames_count;
+	fiber->stack_top = vm->stack_top;
+	fiber->open_upvalues = vm->open_upvalues;
 }
 
-void stack_push(Value value) {
-	*vm.stack_top = value;
-	vm.stack_top++;
+static void load_fiber(VM* vm, ObjFiber* fiber) {
+	vm->fiber = fiber;
+	vm->frames = fiber->frames;
+	vm->frames_count = fiber->frames_count;
+	vm->stack = fiber->stack;
+	vm->stack_top = fiber->stack_top;
+	vm->open_upvalues = fiber->open_upvalues;
 }
 
-Value stack_pop() {
-	vm.stack_top--;
-	return *vm.stack_top;
+void stack_push(VM* vm, Value value) {
+	*vm->stack_top = value;
+	vm->stack_top++;
 }
 
-static Value stack_peek(int distance) {
-	return vm.stack_top[-1 - distance];
+Value stack_pop(VM* vm) {
+	vm->stack_top--;
+	return *vm->stack_top;
 }
 
-static void runtime_error(const char* format, ...) {
+static Value stack_peek(VM* vm, int distance) {
+	return vm->stack_top[-1 - distance];
+}
+
+static void runtime_error(VM* vm, const char* format, ...) {
+	output_flush(&vm->output); // Earlier prints come before the error
 	va_list args;
 	va_start(args, format);
-	vfprintf(stderr, format, args);
+	vfprintf(vm->errors, format, args);
 	va_end(args);
-	fputs("\n", stderr);
+	fputs("\n", vm->errors);
 
-	for (int i = vm.frames_count - 1; i >= 0; i--) {
-	    CallFrame* frame = &vm.frames[i];
+	for (int i = vm->frames_count - 1; i >= 0; i--) {
+	    CallFrame* frame = &vm->frames[i];
 	    ObjFunction* func = frame->closure->function;
 	    // -1 because the IP is sitting on the next instruction to be
 	    // executed.
 	    size_t instruction = frame->pc - func->chunk.code - 1;
-	    fprintf(stderr, "[line %d] in ",
+	    fprintf(vm->errors, "[line %d] in ",
 	            func->chunk.lines[instruction]);
 	    if (func->name == NULL) {
-	    	fprintf(stderr, "script\n");
+	    	fprintf(vm->errors, "script\n");
 	    } else {
-	    	fprintf(stderr, "%s()\n", func->name->chars);
+	    	fprintf(vm->errors, "%s()\n", func->name->chars);
 	    }
 	}
 
-	stack_reset();
+	stack_reset(vm);
 }
 
-static void concatenate_str() {
-	ObjString* b = AS_STRING(stack_peek(0));
-	ObjString* a = AS_STRING(stack_peek(1));
+static void concatenate_str(VM* vm) {
+	int length = text_length(stack_peek(vm, 0)) + text_length(stack_peek(vm, 1));
+	Value result;
+	if(length < CONCAT_BUFFER_SIZE) {
+		// Ropes are never this short, so both operands are strings.
+		// Short results are often interned already. Build them on the C
+		// stack so only new strings reach the allocator.
+		ObjString* b = AS_STRING(stack_peek(vm, 0));
+		ObjString* a = AS_STRING(stack_peek(vm, 1));
+		char buffer[CONCAT_BUFFER_SIZE];
+		memcpy(buffer, a->chars, a->length);
+		memcpy(buffer + a->length, b->chars, b->length);
+		result = OBJ_VALUE(copy_string(vm, buffer, length));
+	} else {
+		// Long texts are joined lazily: building a string in a loop is
+		// linear instead of copying the whole prefix on every step.
+		Obj* b = AS_OBJ(stack_peek(vm, 0));
+		Obj* a = AS_OBJ(stack_peek(vm, 1));
+		if(IS_ROPE(stack_peek(vm, 0)) && AS_ROPE(stack_peek(vm, 0))->flat != NULL) {
+			b = (Obj*)AS_ROPE(stack_peek(vm, 0))->flat;
+		}
+		if(IS_ROPE(stack_peek(vm, 1)) && AS_ROPE(stack_peek(vm, 1))->flat != NULL) {
+			a = (Obj*)AS_ROPE(stack_peek(vm, 1))->flat;
+		}
+		result = OBJ_VALUE(new_rope(vm, a, b));
+	}
+	stack_pop(vm);
+	stack_pop(vm);
+	stack_push(vm, result);
+}
 
-	int length = b->length + a->length;
-	char* chars = ALLOCATE(char, length + 1);
-	memcpy(chars, a->chars, a->length);
-	memcpy(chars + a->length, b->chars, b->length);
-	chars[length] = '\0';
+// Replaces a rope on the stack by its flat string.
+static ObjString* flatten_at(VM* vm, int distance) {
+	Value* slot = &vm->stack_top[-1 - distance];
+	if(IS_ROPE(*slot)) {
+		*slot = OBJ_VALUE(flatten_rope(vm, AS_ROPE(*slot)));
+	}
+	return AS_STRING(*slot);
+}
+
+// Instructions too long for the switch in run(). Compiled code runs them
+// through jit_slow_op().
+
+static void compare_equal(VM* vm) {
+	// Strings are interned and compared by identity, so ropes must be
+	// flattened. Texts of different length never match.
+	if((IS_ROPE(stack_peek(vm, 0)) || IS_ROPE(stack_peek(vm, 1))) &&
+		IS_TEXT(stack_peek(vm, 0)) && IS_TEXT(stack_peek(vm, 1)) &&
+		text_length(stack_peek(vm, 0)) == text_length(stack_peek(vm, 1))) {
+		flatten_at(vm, 0);
+		flatten_at(vm, 1);
+	}
+	Value right = stack_pop(vm);
+	Value left = stack_pop(vm);
+	stack_push(vm, BOOL_VALUE(values_equal(left, right)));
+}
+
+static void print_top(VM* vm) {
+	if(IS_ROPE(stack_peek(vm, 0))) flatten_at(vm, 0);
+	write_value(&vm->output, stack_pop(vm));
+	output_newline(&vm->output);
+#ifdef DEBUG_TRACE_EXECUTION
+	output_flush(&vm->output); // Keep prints in order with the trace
+#endif
+}
+
+static void define_global(VM* vm, ObjString* name) {
+	table_set(vm, &vm->globals, name, stack_peek(vm, 0));
+	stack_pop(vm); // Ensure garbage collector can access the value if is triggered here.
+}
+
+static bool get_global(VM* vm, ObjString* name) {
+	Value value;
+	if(!table_get(&vm->globals, name, &value)) {
+		runtime_error(vm, "Undefined global: %s", name->chars);
+		return false;
+	}
+	stack_push(vm, value);
+	return true;
+}
+
+static bool set_global(VM* vm, ObjString* name) {
+	if(table_set(vm, &vm->globals, name, stack_peek(vm, 0))) {
+		table_delete(vm, &vm->globals, name);
+		runtime_error(vm, "Undefined global: %s", name->chars);
+		return false;
+	}
+	return true;
+}
+
+// Reads the operands of OP_CLOSURE at the frame's pc.
+static void make_closure(VM* vm, CallFrame* frame) {
+	ObjFunction* func = AS_FUNCTION(frame->closure->function->chunk.constants.values[*frame->pc++]);
+	ObjClosure* closure = new_closure(vm, func);
+	stack_push(vm, OBJ_VALUE(closure));
+	for(int i = 0; i < closure->upvalue_count; i++) {
+		uint8_t is_local = *frame->pc++;
+		uint8_t index = *frame->pc++;
+		if(is_local) {
+			closure->upvalues[i] = capture_upvalue(vm, frame->slots + index);
+		} else {
+			closure->upvalues[i] = frame->closure->upvalues[index];
+		}
+	}
+}
+
+static bool get_property(VM* vm, ObjString* name) {
+	if (!IS_INSTANCE(stack_peek(vm, 0))) {
+		runtime_error(vm, "Only instances have properties.");
+		return false;
+	}
+
+	ObjInstance* instance = AS_INSTANCE(stack_peek(vm, 0));
+	Value value;
+	if (table_get(&instance->fields, name, &value)) {
+		stack_pop(vm); // Instance.
+		stack_push(vm, value);
+		return true;
+	}
+	return bind_method(vm, instance->klass, name);
+}
+
+static bool set_property(VM* vm, ObjString* name) {
+	if (!IS_INSTANCE(stack_peek(vm, 1))) {
+		runtime_error(vm, "Only instances have fields.");
+		return false;
+	}
+	ObjInstance* instance = AS_INSTANCE(stack_peek(vm, 1));
+	table_set(vm, &instance->fields, name, stack_peek(vm, 0));
 
-	ObjString* result = take_string(chars, length);
-	stack_pop();
-	stack_pop();
-	stack_push(OBJ_VALUE(result));
+	Value value = stack_pop(vm);
+	stack_pop(vm);
+	stack_push(vm, value);
+	return true;
+}
+
+static void build_list(VM* vm, int count) {
+	ObjList* list = new_list(vm);
+	stack_push(vm, OBJ_VALUE(list)); // Reachable while the array is allocated
+	if (count > 0) {
+		list->items.values = GROW_ARRAY(vm, NULL, Value, 0, count);
+		list->items.capacity = count;
+		memcpy(list->items.values, vm->stack_top - 1 - count, sizeof(Value) * count);
+		list->items.size = count;
+	}
+	vm->stack_top -= count + 1;
+	stack_push(vm, OBJ_VALUE(list));
+}
+
+static bool build_map(VM* vm, int count) {
+	ObjMap* map = new_map(vm);
+	stack_push(vm, OBJ_VALUE(map)); // Reachable while entries are added
+	Value* entries = vm->stack_top - 1 - count * 2;
+	for (int i = 0; i < count * 2; i += 2) {
+		if (!valid_key(vm, &entries[i])) {
+			runtime_error(vm, "Map key cannot be nil or NaN.");
+			return false;
+		}
+		map_set(vm, map, entries[i], entries[i + 1]);
+	}
+	vm->stack_top -= count * 2 + 1;
+	stack_push(vm, OBJ_VALUE(map));
+	return true;
 }
 
-static bool call_value(Value callee, int arg_count) {
+static bool get_index(VM* vm) {
+	if (IS_MAP(stack_peek(vm, 1))) {
+		if (!valid_key(vm, &vm->stack_top[-1])) {
+			runtime_error(vm, "Map key cannot be nil or NaN.");
+			return false;
+		}
+		Value value;
+		if (!map_get(vm, AS_MAP(stack_peek(vm, 1)), stack_peek(vm, 0), &value)) {
+			value = NIL_VALUE(); // Missing keys read as nil
+		}
+		vm->stack_top -= 2;
+		stack_push(vm, value);
+		return true;
+	}
+	if (IS_FLOAT_ARRAY(stack_peek(vm, 1))) {
+		ObjFloatArray* array = AS_FLOAT_ARRAY(stack_peek(vm, 1));
+		int index;
+		const char* error = array_index(stack_peek(vm, 0), array->length, &index);
+		if (error != NULL) {
+			runtime_error(vm, error);
+			return false;
+		}
+		vm->stack_top -= 2;
+		stack_push(vm, NUMBER_VALUE(array->data[index]));
+		return true;
+	}
+	if (!IS_LIST(stack_peek(vm, 1))) {
+		runtime_error(vm, "Only lists, maps and Float64Arrays can be indexed.");
+		return false;
+	}
+	ObjList* list = AS_LIST(stack_peek(vm, 1));
+	int index;
+	const char* error = array_index(stack_peek(vm, 0), list->items.size, &index);
+	if (error != NULL) {
+		runtime_error(vm, error);
+		return false;
+	}
+	vm->stack_top -= 2;
+	stack_push(vm, list->items.values[index]);
+	return true;
+}
+
+static bool set_index(VM* vm) {
+	if (IS_MAP(stack_peek(vm, 2))) {
+		if (!valid_key(vm, &vm->stack_top[-2])) {
+			runtime_error(vm, "Map key cannot be nil or NaN.");
+			return false;
+		}
+		map_set(vm, AS_MAP(stack_peek(vm, 2)), stack_peek(vm, 1), stack_peek(vm, 0));
+		Value value = stack_pop(vm);
+		vm->stack_top -= 2;
+		stack_push(vm, value);
+		return true;
+	}
+	if (IS_FLOAT_ARRAY(stack_peek(vm, 2))) {
+		ObjFloatArray* array = AS_FLOAT_ARRAY(stack_peek(vm, 2));
+		int index;
+		const char* error = array_index(stack_peek(vm, 1), array->length, &index);
+		if (error != NULL) {
+			runtime_error(vm, error);
+			return false;
+		}
+		if (!IS_NUMBER(stack_peek(vm, 0))) {
+			runtime_error(vm, "Float64Array elements must be numbers.");
+			return false;
+		}
+		array->data[index] = AS_NUMBER(stack_peek(vm, 0));
+		Value value = stack_pop(vm);
+		vm->stack_top -= 2;
+		stack_push(vm, value);
+		return true;
+	}
+	if (!IS_LIST(stack_peek(vm, 2))) {
+		runtime_error(vm, "Only lists, maps and Float64Arrays can be indexed.");
+		return false;
+	}
+	ObjList* list = AS_LIST(stack_peek(vm, 2));
+	int index;
+	const char* error = array_index(stack_peek(vm, 1), list->items.size, &index);
+	if (error != NULL) {
+		runtime_error(vm, error);
+		return false;
+	}
+	Value value = stack_pop(vm);
+	list->items.values[index] = value;
+	vm->stack_top -= 2;
+	stack_push(vm, value);
+	return true;
+}
+
+static bool call_value(VM* vm, Value callee, int arg_count) {
 	switch(OBJ_TYPE(callee)) {
 	case OBJ_CLASS: {
 		ObjClass* klass = AS_CLASS(callee);
-		vm.stack_top[-arg_count - 1] = OBJ_VALUE(new_instance(klass));
+		vm->stack_top[-arg_count - 1] = OBJ_VALUE(new_instance(vm, klass));
 		Value initializer;
-		if (table_get(&klass->methods, vm.init_string, &initializer)) {
-			return call(AS_CLOSURE(initializer), arg_count);
+		if (table_get(&klass->methods, vm->init_string, &initializer)) {
+			return call(vm, AS_CLOSURE(initializer), arg_count);
 		} else if (arg_count != 0) {
-			runtime_error("Expected 0 arguments but got %d.", arg_count);
+			runtime_error(vm, "Expected 0 arguments but got %d.", arg_count);
 			return false;
         }
 		return true;
 	}
-	case OBJ_CLOSURE: return call(AS_CLOSURE(callee), arg_count);
-	case OBJ_NATIVE: {
-		NativeFn native = AS_NATIVE(callee);
-		Value result = native(arg_count, vm.stack_top - arg_count);
-		vm.stack_top -= arg_count + 1;
-		stack_push(result);
-		return true;
-	}
+	case OBJ_CLOSURE: return call(vm, AS_CLOSURE(callee), arg_count);
+	case OBJ_NATIVE: return call_native(vm, AS_NATIVE(callee), arg_count);
 	case OBJ_BOUND_METHOD: {
 		ObjBoundMethod* bound = AS_BOUND_METHOD(callee);
-		vm.stack_top[-arg_count - 1] = bound->receiver;
-		return call(bound->method, arg_count);
+		vm->stack_top[-arg_count - 1] = bound->receiver;
+		return call(vm, bound->method, arg_count);
 	}
 	default:
 		break;
 	}
-	runtime_error("Can only call functions and classes");
+	runtime_error(vm, "Can only call functions and classes");
 	return false;
 }
 
-static bool call(ObjClosure* closure, int arg_count) {
+static bool call(VM* vm, ObjClosure* closure, int arg_count) {
 	if (arg_count != closure->function->arity) {
-	    runtime_error("Expected %d arguments but got %d.",
+	    runtime_error(vm, "Expected %d arguments but got %d.",
 	        closure->function->arity, arg_count);
 	    return false;
   	}
-  	if(vm.frames_count == FRAMES_MAX) {
-  		runtime_error("Stack Overflow");
+  	if(vm->frames_count == FRAMES_MAX) {
+  		runtime_error(vm, "Stack Overflow");
   		return false;
   	}
-	CallFrame* frame = &vm.frames[vm.frames_count++];
+  	if (--vm->budget < 0 && !check_limits(vm, false)) {
+  		return false;
+  	}
+#ifdef CLOX_JIT
+	if (vm->jit_threshold > 0) jit_count_call(closure->function, vm->jit_threshold);
+#endif
+	CallFrame* frame = &vm->frames[vm->frames_count++];
 	frame->closure = closure;
 	frame->pc = closure->function->chunk.code;
 
-	frame->slots = vm.stack_top - arg_count - 1;
+	frame->slots = vm->stack_top - arg_count - 1;
 	return true;
 }
 
-static void free_objects() {
-	Obj* current = vm.objects;
+static void free_objects(VM* vm) {
+	Obj* current = vm->objects;
 	while(current != NULL) {
 		Obj* next = current->next;
-		free_object(current);
+		free_object(vm, current);
 		current = next;
 	}
 }
 
-static void define_native(const char* name, NativeFn native) {
+static bool call_native(VM* vm, NativeFn native, int arg_count) {
+	Value result = native(vm, arg_count, vm->stack_top - arg_count);
+	if (vm->has_native_error) {
+		vm->has_native_error = false;
+		// An empty message was already reported by a nested run().
+		if (vm->native_error[0] != '\0') runtime_error(vm, "%s", vm->native_error);
+		return false;
+	}
+	vm->stack_top -= arg_count + 1;
+	if (vm->next_fiber != NULL) return switch_fiber(vm, result);
+	stack_push(vm, result);
+	return true;
+}
+
+// Natives call this to fail with a runtime error once they return.
+Value native_error(VM* vm, const char* format, ...) {
+	va_list args;
+	va_start(args, format);
+	vsnprintf(vm->native_error, NATIVE_ERROR_MAX, format, args);
+	va_end(args);
+	vm->has_native_error = true;
+	return NIL_VALUE();
+}
+
+// interpret_call() for natives. On false the error has been reported and
+// the stack reset; the native must return native_failed().
+static bool call_from_native(VM* vm, int arg_count) {
+	return interpret_call(vm, arg_count) == INTERPRET_OK;
+}
+
+static Value native_failed(VM* vm) {
+	vm->native_error[0] = '\0';
+	vm->has_native_error = true;
+	return NIL_VALUE();
+}
+
+static bool to_integer(Value value, int* result) {
+	if (!IS_NUMBER(value)) return false;
+	double number = AS_NUMBER(value);
+	if (number < INT_MIN || number > INT_MAX || number != (int)number) return false;
+	*result = (int)number;
+	return true;
+}
+
+// Returns NULL when index is an integer in [0, length), otherwise the error.
+static const char* array_index(Value index, int length, int* result) {
+	if (!to_integer(index, result)) return "Index must be an integer.";
+	if (*result < 0 || *result >= length) return "Index out of range.";
+	return NULL;
+}
+
+// Keys are compared by identity, so ropes become interned strings first.
+// The key must live in a stack slot. Nil is not a valid key.
+static bool valid_key(VM* vm, Value* key) {
+	if (IS_ROPE(*key)) *key = OBJ_VALUE(flatten_rope(vm, AS_ROPE(*key)));
+	// NaN is not equal to itself, so it could never be found again.
+	return !IS_NIL(*key) && !(IS_NUMBER(*key) && isnan(AS_NUMBER(*key)));
+}
+
+static void define_native(VM* vm, Table* table, const char* name, NativeFn native) {
 	// Here we stack first and pop to let gc know that we are working
 	// with ObjString* and ObjNative*. Soooo it won't delete these pointers.
-	stack_push(OBJ_VALUE(copy_string(name, (int)strlen(name))));
-	stack_push(OBJ_VALUE(new_native(native)));
-	table_set(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
-	stack_pop();
-	stack_pop();
+	stack_push(vm, OBJ_VALUE(copy_string(vm, name, (int)strlen(name))));
+	stack_push(vm, OBJ_VALUE(new_native(vm, native)));
+	table_set(vm, table, AS_STRING(stack_peek(vm, 1)), stack_peek(vm, 0));
+	stack_pop(vm);
+	stack_pop(vm);
 }
 
-static ObjUpvalue* capture_upvalue(Value* value) {
+static ObjUpvalue* capture_upvalue(VM* vm, Value* value) {
 	ObjUpvalue* prev_upvalue = NULL;
-	ObjUpvalue* upvalue = vm.open_upvalues;
+	ObjUpvalue* upvalue = vm->open_upvalues;
 
 	while(upvalue != NULL && upvalue->location > value) {
 		prev_upvalue = upvalue;
@@ -502,11 +2000,12 @@ static ObjUpvalue* capture_upvalue(Value* value) {
 
 	if(upvalue != NULL && upvalue->location == value) return upvalue;
 
-	ObjUpvalue* created = new_upvalue(value);
+	ObjUpvalue* created = new_upvalue(vm, value);
+	created->closed = OBJ_VALUE(vm->fiber); // Keeps the stack alive
 
 	created->next = upvalue;
 	if(prev_upvalue == NULL) {
-		vm.open_upvalues = created;
+		vm->open_upvalues = created;
 	} else {
 		prev_upvalue->next = created;
 	}
@@ -514,39 +2013,60 @@ static ObjUpvalue* capture_upvalue(Value* value) {
 	return created;
 }
 
-static void close_upvalues(Value* last) {
-	while(vm.open_upvalues != NULL && vm.open_upvalues->location >= last) {
-		ObjUpvalue* upvalue = vm.open_upvalues;
+static void close_upvalues(VM* vm, Value* last) {
+	while(vm->open_upvalues != NULL && vm->open_upvalues->location >= last) {
+		ObjUpvalue* upvalue = vm->open_upvalues;
 		upvalue->closed = *upvalue->location;
 		upvalue->location = &upvalue->closed;
-		vm.open_upvalues = upvalue->next;
+		vm->open_upvalues = upvalue->next;
 	}
 }
 
-static void define_method(ObjString* name) {
-	Value method = stack_peek(0);
-	ObjClass* klass = AS_CLASS(stack_peek(1));
-	table_set(&klass->methods, name, method);
-	stack_pop();
+static void define_method(VM* vm, ObjString* name) {
+	Value method = stack_peek(vm, 0);
+	ObjClass* klass = AS_CLASS(stack_peek(vm, 1));
+	table_set(vm, &klass->methods, name, method);
+	stack_pop(vm);
 }
 
-static bool bind_method(ObjClass* klass, ObjString* name) {
+static bool bind_method(VM* vm, ObjClass* klass, ObjString* name) {
 	Value method;
 	if(!table_get(&klass->methods, name, &method)) {
-		runtime_error("Undefined property '%s'.", name->chars);
+		runtime_error(vm, "Undefined property '%s'.", name->chars);
 		return false;
 	}
 
-	ObjBoundMethod* bound = new_bound_method(stack_peek(0), AS_CLOSURE(method));
-	stack_pop();
-	stack_push(OBJ_VALUE(bound));
+	ObjBoundMethod* bound = new_bound_method(vm, stack_peek(vm, 0), AS_CLOSURE(method));
+	stack_pop(vm);
+	stack_push(vm, OBJ_VALUE(bound));
 	return true;
 }
 
-static bool invoke(ObjString* name, int arg_count) {
-	Value receiver = stack_peek(arg_count);
+static bool invoke(VM* vm, ObjString* name, int arg_count) {
+	Value receiver = stack_peek(vm, arg_count);
+	if (IS_LIST(receiver)) {
+		return invoke_native(vm, &vm->list_methods, name, arg_count);
+	}
+	if (IS_MAP(receiver)) {
+		return invoke_native(vm, &vm->map_methods, name, arg_count);
+	}
+	if (IS_FLOAT_ARRAY(receiver)) {
+		return invoke_native(vm, &vm->float_array_methods, name, arg_count);
+	}
+	if (IS_LINE_READER(receiver)) {
+		return invoke_native(vm, &vm->line_reader_methods, name, arg_count);
+	}
+	if (IS_CHANNEL(receiver)) {
+		return invoke_native(vm, &vm->channel_methods, name, arg_count);
+	}
+	if (IS_ISOLATE(receiver)) {
+		return invoke_native(vm, &vm->isolate_methods, name, arg_count);
+	}
+	if (IS_FIBER(receiver)) {
+		return invoke_native(vm, &vm->fiber_methods, name, arg_count);
+	}
 	if (!IS_INSTANCE(receiver)) {
-		runtime_error("Only instances have methods.");
+		runtime_error(vm, "Only instances have methods.");
 		return false;
 	}
 
@@ -554,17 +2074,26 @@ static bool invoke(ObjString* name, int arg_count) {
 
 	Value value;
 	if (table_get(&instance->fields, name, &value)) {
-		vm.stack_top[-arg_count - 1] = value;
-		return call_value(value, arg_count);
+		vm->stack_top[-arg_count - 1] = value;
+		return call_value(vm, value, arg_count);
 	}
-	return invoke_from_class(instance->klass, name, arg_count);
+	return invoke_from_class(vm, instance->klass, name, arg_count);
 }
 
-static bool invoke_from_class(ObjClass* klass, ObjString* name, int arg_count) {
+static bool invoke_from_class(VM* vm, ObjClass* klass, ObjString* name, int arg_count) {
 	Value method;
 	if (!table_get(&klass->methods, name, &method)) {
-		runtime_error("Undefined property '%s'.", name->chars);
+		runtime_error(vm, "Undefined property '%s'.", name->chars);
+		return false;
+	}
+	return call(vm, AS_CLOSURE(method), arg_count);
+}
+
+static bool invoke_native(VM* vm, Table* methods, ObjString* name, int arg_count) {
+	Value method;
+	if (!table_get(methods, name, &method)) {
+		runtime_error(vm, "Undefined method '%s'.", name->chars);
 		return false;
 	}
-	return call(AS_CLOSURE(method), arg_count);
+	return call_native(vm, AS_NATIVE(method), arg_count);
 }
@@ -4,32 +4,96 @@
 #include "chunk.h"
 #include "values.h"
 #include "table.h"
+#include "intern.h"
 #include "object.h"
+#include "memory.h"
+#include "gc_stats.h"
+#include "output.h"
+#include "event_loop.h"
 
 #define FRAMES_MAX 64
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+#define NATIVE_ERROR_MAX 256
+#define HOT_LOOP_COUNTERS 64
 
+// Limits for each run started from outside the VM: interpret() or
+// interpret_call() with no frames on the stack. Zero means no limit.
 typedef struct {
-	ObjClosure* closure;
-	uint8_t* pc;
-	Value* slots;
-} CallFrame;
+	uint64_t ticks; // Loop iterations plus calls
+	uint64_t time_ms;
+	size_t heap; // Bytes allocated
+} Limits;
 
-typedef struct {
-	CallFrame frames[FRAMES_MAX];
+struct sVM {
+	// Registers of the running fiber, saved into it on a switch.
+	CallFrame* frames;
 	int frames_count;
-
-	Value stack[STACK_MAX];
+	Value* stack;
 	Value* stack_top;
+	ObjUpvalue* open_upvalues;
+
+	ObjFiber* fiber; // Running fiber
+	ObjFiber* main_fiber; // Runs the script, never finishes
+	ObjFiber* next_fiber; // Set by resume() and yield() to switch on return
+	int nested_runs; // Lox calls made from natives still running
+	EventLoop events; // Drives fibers waiting on timers and descriptors
+
+	// OP_LOOP and calls count 'budget' down and check the limits once it
+	// runs out. interrupt_run() zeroes it to get there sooner.
+	Limits limits;
+	int32_t budget;
+	int32_t budget_chunk; // Budget at the last refill
+	uint64_t ticks_used;
+	uint64_t deadline; // monotonic_ns()
+	bool heap_exceeded; // Set by reallocate(), checked with the budget
+	uint32_t jit_threshold; // Calls before a function is compiled, 0 for never
+	uint16_t trace_threshold; // Iterations before a loop is traced, 0 for never
+	uint16_t hot_loops[HOT_LOOP_COUNTERS]; // Counted down by OP_LOOP, see trace.h
 
 	Obj* objects;
-	ObjUpvalue* open_upvalues;
 
 	size_t bytes_allocated; // Things to know when to trigger GC.
 	size_t next_gc;
 
-	Table strings; // Interning
+	GcConfig gc_config;
+	GcStats gc_stats;
+	bool collecting; // Lets the collector allocate without starting another collection.
+
+	// Compacting collector
+	bool compaction_pending; // Compact on the next safe point (OP_LOOP).
+	Region* regions;
+	size_t region_dead_bytes; // Bytes of dead objects stranded inside regions.
+	double fragmentation; // Computed after each collection. From 0 to 1.
+
+	// Permanent generation, see tenure_heap()
+	Obj** permanent;
+	int permanent_count;
+	Region* permanent_regions;
+	Obj** remembered; // Permanent objects that pointed into the heap at the last collection
+	int remembered_count;
+	int remembered_capacity;
+	bool heap_referenced; // Set by mark_object(), see mark_roots()
+
+	InternSet strings; // Interning
+	struct sSharedCode** shared; // Frozen code this VM runs, see shared.h
+	int shared_count;
+	int shared_capacity;
 	Table globals; // Global variables
+	Table list_methods; // Natives called on lists
+	Table map_methods; // Natives called on maps
+	Table float_array_methods; // Natives called on Float64Arrays
+	Table line_reader_methods; // Natives called on LineReaders
+	Table channel_methods; // Natives called on Channels
+	Table isolate_methods; // Natives called on isolates
+	Table fiber_methods; // Natives called on fibers
+
+	Output output; // Buffered stdout for 'print'
+	FILE* errors; // Compile and runtime errors, stderr unless an embedder captures them
+	ValueArray host_values; // Kept alive for the embedding API, see clox.h
+
+	// Set by natives through native_error(), reported once they return.
+	bool has_native_error;
+	char native_error[NATIVE_ERROR_MAX];
 
 	// GC gray nodes
 	int gray_capacity;
@@ -37,7 +101,7 @@ typedef struct {
 	Obj** gray_stack;
 
 	ObjString* init_string;
-} VM;
+};
 
 typedef enum {
 	INTERPRET_OK,
@@ -45,12 +109,28 @@ typedef enum {
 	INTERPRET_RUNTIME_ERROR,
 } InterpretResult;
 
-void init_vm();
-void free_vm();
-void stack_push(Value value);
-Value stack_pop();
-InterpretResult interpret(const char* source);
+void init_vm(VM* vm);
+// Attaches the regions before anything is interned, so none of them
+// conflicts with the VM's own strings.
+void init_vm_shared(VM* vm, struct sSharedCode** shared, int count);
+void configure_gc(VM* vm, GcConfig* config);
+void configure_output(VM* vm, size_t size);
+void configure_limits(VM* vm, Limits* limits);
+void configure_jit(VM* vm, uint32_t threshold);
+void configure_traces(VM* vm, uint16_t threshold);
+void free_vm(VM* vm);
+void stack_push(VM* vm, Value value);
+Value stack_pop(VM* vm);
+InterpretResult interpret(VM* vm, const char* source, size_t length);
+InterpretResult interpret_shared(VM* vm, struct sSharedCode* code);
+InterpretResult interpret_call(VM* vm, int arg_count);
+Value native_error(VM* vm, const char* format, ...);
 
-extern VM vm;
+// Makes the next OP_LOOP or call check the limits and pending compaction.
+static inline void interrupt_run(VM* vm) {
+	vm->ticks_used += vm->budget_chunk - vm->budget;
+	vm->budget_chunk = 0;
+	vm->budget = 0;
+}
 
 #endif
\ No newline at end of file
@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "x64.h"
+
+#ifdef CLOX_JIT
+
+void x64_byte(CodeBuffer* code, uint8_t byte) {
+	if (code->size == code->capacity) {
+		code->capacity = code->capacity < 256 ? 256 : code->capacity * 2;
+		code->bytes = realloc(code->bytes, code->capacity);
+		if (code->bytes == NULL) {
+			fprintf(stderr, "Not enough memory to compile\n");
+			exit(1);
+		}
+	}
+	code->bytes[code->size++] = byte;
+}
+
+void x64_int32(CodeBuffer* code, int32_t value) {
+	uint32_t bits = (uint32_t)value;
+	for (int i = 0; i < 4; i++) x64_byte(code, bits >> (i * 8));
+}
+
+void x64_int64(CodeBuffer* code, uint64_t value) {
+	for (int i = 0; i < 8; i++) x64_byte(code, value >> (i * 8));
+}
+
+void x64_patch_rel32(CodeBuffer* code, int at, int target) {
+	int32_t rel = target - (at + 4);
+	memcpy(code->bytes + at, &rel, sizeof(rel));
+}
+
+static void prefix_and_opcode(CodeBuffer* code, uint8_t prefix, bool wide, uint16_t opcode, int reg, int rm) {
+	if (prefix != 0) x64_byte(code, prefix);
+	uint8_t rex = 0x40 | (wide ? 8 : 0) | (reg & 8 ? 4 : 0) | (rm >= 0 && rm & 8 ? 1 : 0);
+	if (rex != 0x40) x64_byte(code, rex);
+	if (opcode > 0xff) x64_byte(code, opcode >> 8);
+	x64_byte(code, opcode & 0xff);
+}
+
+int x64_mem(CodeBuffer* code, uint8_t prefix, bool wide, uint16_t opcode, int reg, int base, int32_t disp) {
+	prefix_and_opcode(code, prefix, wide, opcode, reg, base);
+	if (base == RIP) {
+		x64_byte(code, ((reg & 7) << 3) | 5);
+		x64_int32(code, 0);
+		return code->size - 4;
+	}
+	int mod = disp == 0 && (base & 7) != RBP ? 0 : disp >= -128 && disp <= 127 ? 1 : 2;
+	x64_byte(code, (mod << 6) | ((reg & 7) << 3) | (base & 7));
+	if ((base & 7) == RSP) x64_byte(code, 0x24); // SIB without index
+	if (mod == 1) x64_byte(code, (uint8_t)disp);
+	if (mod == 2) x64_int32(code, disp);
+	return -1;
+}
+
+void x64_reg(CodeBuffer* code, uint8_t prefix, bool wide, uint16_t opcode, int reg, int rm) {
+	prefix_and_opcode(code, prefix, wide, opcode, reg, rm);
+	x64_byte(code, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+void x64_load(CodeBuffer* code, int reg, int base, int32_t disp) {
+	x64_mem(code, 0, true, 0x8b, reg, base, disp);
+}
+
+void x64_store(CodeBuffer* code, int base, int32_t disp, int reg) {
+	x64_mem(code, 0, true, 0x89, reg, base, disp);
+}
+
+void x64_lea(CodeBuffer* code, int reg, int base, int32_t disp) {
+	x64_mem(code, 0, true, 0x8d, reg, base, disp);
+}
+
+void x64_mov_imm64(CodeBuffer* code, int reg, uint64_t value) {
+	x64_byte(code, 0x48 | (reg & 8 ? 1 : 0));
+	x64_byte(code, 0xb8 + (reg & 7));
+	x64_int64(code, value);
+}
+
+void x64_call(CodeBuffer* code, void* function) {
+	x64_mov_imm64(code, RAX, (uint64_t)(uintptr_t)function);
+	x64_byte(code, 0xff); // call rax
+	x64_byte(code, 0xd0);
+}
+
+void x64_setcc(CodeBuffer* code, int condition) {
+	x64_byte(code, 0x0f);
+	x64_byte(code, 0x90 | condition);
+	x64_byte(code, 0xc0);
+}
+
+int x64_jump_if(CodeBuffer* code, int condition) {
+	x64_byte(code, 0x0f);
+	x64_byte(code, 0x80 | condition);
+	x64_int32(code, 0);
+	return code->size - 4;
+}
+
+int x64_jump(CodeBuffer* code) {
+	x64_byte(code, 0xe9);
+	x64_int32(code, 0);
+	return code->size - 4;
+}
+
+void x64_jump_to(CodeBuffer* code, int target) {
+	x64_patch_rel32(code, x64_jump(code), target);
+}
+
+void* x64_install(CodeBuffer* code) {
+	size_t size = code->size;
+	void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED) return NULL;
+	memcpy(memory, code->bytes, size);
+	if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+		munmap(memory, size);
+		return NULL;
+	}
+	return memory;
+}
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef clox_x64_h
+#define clox_x64_h
+
+#include "common.h"
+
+#ifdef CLOX_JIT
+
+// Just enough of an x86-64 assembler for the compilers in jit.c and
+// trace.c. Registers are numbered as the instruction set encodes them,
+// general purpose and SSE alike.
+enum {
+	RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+	R8 = 8, R9 = 9, R10 = 10, R11 = 11, R12 = 12, R13 = 13, R14 = 14, R15 = 15,
+};
+enum { XMM0 = 0, XMM1 = 1, XMM14 = 14, XMM15 = 15 };
+#define RIP (-1) // Base for x64_mem(): a rel32 from the end of the instruction
+
+enum {
+	CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_A = 0x7,
+	CC_S = 0x8, CC_P = 0xa, CC_NP = 0xb, CC_L = 0xc, CC_GE = 0xd, CC_LE = 0xe, CC_G = 0xf,
+};
+
+typedef struct {
+	uint8_t* bytes;
+	int size;
+	int capacity;
+} CodeBuffer;
+
+void x64_byte(CodeBuffer* code, uint8_t byte);
+void x64_int32(CodeBuffer* code, int32_t value);
+void x64_int64(CodeBuffer* code, uint64_t value);
+// Points the rel32 at 'at' to the code offset 'target'.
+void x64_patch_rel32(CodeBuffer* code, int at, int target);
+
+// [prefix] [REX] opcode ModRM [SIB] [disp] for 'reg' and [base + disp].
+// Two byte opcodes are 0x0fXX. With RIP as the base, returns where the
+// rel32 goes; it must end the instruction.
+int x64_mem(CodeBuffer* code, uint8_t prefix, bool wide, uint16_t opcode, int reg, int base, int32_t disp);
+// The same with 'rm' a register.
+void x64_reg(CodeBuffer* code, uint8_t prefix, bool wide, uint16_t opcode, int reg, int rm);
+
+void x64_load(CodeBuffer* code, int reg, int base, int32_t disp);
+void x64_store(CodeBuffer* code, int base, int32_t disp, int reg);
+void x64_lea(CodeBuffer* code, int reg, int base, int32_t disp);
+void x64_mov_imm64(CodeBuffer* code, int reg, uint64_t value);
+// mov rax, function; call rax. The stack must be 16 byte aligned.
+void x64_call(CodeBuffer* code, void* function);
+// setcc al
+void x64_setcc(CodeBuffer* code, int condition);
+
+// Return where the rel32 goes.
+int x64_jump_if(CodeBuffer* code, int condition);
+int x64_jump(CodeBuffer* code);
+void x64_jump_to(CodeBuffer* code, int target);
+
+// Copies the code into memory of its own and makes it executable. NULL
+// when the system refuses; free with munmap().
+void* x64_install(CodeBuffer* code);
+
+#endif
+
+#endif